@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+#include <new>
+#include <random>
+#include <vector>
+#include "../src/OnDiskStructure.h"
+#include "../libraries/schifra/schifra_galois_field.hpp"
+#include "../libraries/schifra/schifra_sequential_root_generator_polynomial_creator.hpp"
+#include "../libraries/schifra/schifra_reed_solomon_encoder.hpp"
+#include "../libraries/schifra/schifra_reed_solomon_decoder.hpp"
+#include "../src/ecc.cpp"
+#include "../src/superblock.cpp"
+#include "../src/parity.cpp"
+
+/*
+* Reed Solomon benchmark: the cost of building schifra's field against the
+* compile time tables, per symbol multiply cost in an encoder and a syndrome
+* loop, encode throughput of schifra's per stripe encoder (the sequential
+* layout) against the lane kernels, heap allocations and throughput of
+* schifra's decoder against rsDecoder.cpp, and how many codewords survive
+* bursts of unreadable sectors at each interleave depth.
+*
+* Compile: g++ -std=c++11 -O2 ecc-bench.cpp -o ecc-bench.out
+* Run: ./ecc-bench.out [image MB] [fec length] [bursts] [burst bytes]
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Every heap allocation of the program is counted
+static uint64_t allocations = 0;
+
+void* operator new(std::size_t size) {
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+// not inlined, so GCC does not see free() called on memory from the new above
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+	free(p);
+}
+
+static const schifra::galois::field& bench_field() {
+	static const schifra::galois::field field(FIELD_DESCRIPTOR,
+	                                          schifra::galois::primitive_polynomial_size06,
+	                                          schifra::galois::primitive_polynomial06);
+	return field;
+}
+
+static double seconds_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+template <std::size_t fec_length>
+static void encode_schifra(const std::vector<unsigned char>& image, unsigned char* fec) {
+	const std::size_t data_length = CODE_LENGTH - fec_length;
+	schifra::galois::field_polynomial generator(bench_field());
+	schifra::make_sequential_root_generator_polynomial(bench_field(), GEN_POLY_INDEX, fec_length, generator);
+	const schifra::reed_solomon::encoder<CODE_LENGTH, fec_length> encoder(bench_field(), generator);
+	schifra::reed_solomon::block<CODE_LENGTH, fec_length> block;
+	uint64_t stripes = parity_stripe_count(image.size(), fec_length);
+	for (uint64_t s = 0; s < stripes; s++) {
+		block.clear();
+		for (std::size_t i = 0; i < data_length && s * data_length + i < image.size(); i++) {
+			block.data[i] = image[s * data_length + i];
+		}
+		encoder.encode(block);
+		for (std::size_t i = 0; i < fec_length; i++) {
+			fec[s * fec_length + i] = (unsigned char) block.fec(i);
+		}
+	}
+}
+
+static void encode_schifra(const std::vector<unsigned char>& image, std::size_t fec_length, unsigned char* fec) {
+	switch (fec_length) {
+		case 8:  encode_schifra<8>(image, fec); break;
+		case 16: encode_schifra<16>(image, fec); break;
+		case 32: encode_schifra<32>(image, fec); break;
+		case 64: encode_schifra<64>(image, fec); break;
+	}
+}
+
+// Encode the whole image a batch of groups at a time, like addParity
+static void encode_lanes(const std::vector<unsigned char>& image, const parity_geometry& geo, unsigned char* fec) {
+	uint64_t groups = parity_group_count(geo);
+	uint64_t batch = parity_batch_groups(geo);
+	uint64_t batch_bytes = batch * geo.depth * geo.data_length;
+	std::vector<unsigned char> data(batch_bytes);
+	for (uint64_t first = 0; first < groups; first += batch) {
+		uint64_t count = groups - first < batch ? groups - first : batch;
+		uint64_t off = first * geo.depth * geo.data_length;
+		uint64_t len = image.size() - off < batch_bytes ? image.size() - off : batch_bytes;
+		memcpy(&data[0], &image[off], len);
+		memset(&data[len], 0, batch_bytes - len);
+		parity_encode(geo, first, count, &data[0], fec + first * geo.depth * geo.fec_length);
+	}
+}
+
+struct schifra_mul {
+	const schifra::galois::field& field;
+	unsigned char operator()(unsigned char a, unsigned char b) const { return field.mul(a, b); }
+};
+
+struct table_mul {
+	unsigned char operator()(unsigned char a, unsigned char b) const { return gf_mul(a, b); }
+};
+
+/*
+* Run the generator division and the syndrome evaluation of rsKernels.cpp one
+* symbol at a time through mul, returning nanoseconds per multiplication
+*/
+template <typename Mul>
+static double multiply_cost(const Mul& mul, const std::vector<unsigned char>& image, std::size_t fec_length,
+                            bool syndromes, unsigned* sink) {
+	const std::size_t data_length = CODE_LENGTH - fec_length;
+	unsigned char coefficient[RS_MAX_FEC];
+	unsigned char reg[RS_MAX_FEC] = {0};
+	for (std::size_t k = 0; k < fec_length; k++) {
+		coefficient[k] = syndromes ? gf_alpha(GEN_POLY_INDEX + k) : gf_alpha(k * 7 + 1);
+	}
+	uint64_t stripes = image.size() / data_length;
+	bench_clock::time_point start = bench_clock::now();
+	for (uint64_t s = 0; s < stripes; s++) {
+		const unsigned char* data = &image[s * data_length];
+		for (std::size_t i = 0; i < data_length; i++) {
+			if (syndromes) {
+				for (std::size_t r = 0; r < fec_length; r++) {
+					reg[r] = mul(coefficient[r], reg[r]) ^ data[i];
+				}
+			} else {
+				unsigned char fb = data[i] ^ reg[fec_length - 1];
+				for (std::size_t k = fec_length - 1; k > 0; k--) {
+					reg[k] = reg[k - 1] ^ mul(coefficient[k], fb);
+				}
+				reg[0] = mul(coefficient[0], fb);
+			}
+		}
+	}
+	double secs = seconds_since(start);
+	for (std::size_t k = 0; k < fec_length; k++) {
+		*sink += reg[k];
+	}
+	return secs * 1e9 / (stripes * data_length * fec_length);
+}
+
+/*
+* Decode the first stripes of the image against their sequential parity with
+* errors symbol errors in each codeword, through schifra's decoder or
+* rs_decode_lane, and report allocations per codeword and throughput
+*/
+template <std::size_t fec_length>
+static void bench_decode(const std::vector<unsigned char>& image, const std::vector<unsigned char>& fec,
+                         std::size_t errors, bool use_schifra) {
+	const std::size_t data_length = CODE_LENGTH - fec_length;
+	uint64_t stripes = std::min<uint64_t>(image.size() / data_length, 65536);
+	std::vector<unsigned char> codewords(stripes * CODE_LENGTH);
+	std::mt19937 rng(3);
+	for (uint64_t s = 0; s < stripes; s++) {
+		unsigned char* codeword = &codewords[s * CODE_LENGTH];
+		memcpy(codeword, &image[s * data_length], data_length);
+		memcpy(codeword + data_length, &fec[s * fec_length], fec_length);
+		for (std::size_t e = 0; e < errors; e++) {
+			codeword[rng() % CODE_LENGTH] ^= 1 + rng() % 255;
+		}
+	}
+
+	const schifra::reed_solomon::decoder<CODE_LENGTH, fec_length> decoder(bench_field(), GEN_POLY_INDEX);
+	const rs_tables* tables = ecc_tables(fec_length);
+	schifra::reed_solomon::block<CODE_LENGTH, fec_length> block;
+	std::vector<unsigned char> work(codewords.size());
+	uint64_t corrected = 0;
+	uint64_t failed = 0;
+	uint64_t allocated = 0;
+	double secs = 0;
+	// Best of three runs, the decoders correct in place so each starts from a copy
+	for (int run = 0; run < 3; run++) {
+		work = codewords;
+		corrected = 0;
+		failed = 0;
+		allocated = allocations;
+		bench_clock::time_point start = bench_clock::now();
+		for (uint64_t s = 0; s < stripes; s++) {
+			unsigned char* codeword = &work[s * CODE_LENGTH];
+			if (use_schifra) {
+				for (std::size_t i = 0; i < CODE_LENGTH; i++) {
+					block[i] = codeword[i];
+				}
+				if (decoder.decode(block)) {
+					corrected += block.errors_corrected;
+				} else {
+					failed++;
+				}
+			} else if (!rs_decode_lane(tables, rs_workspace_local(), codeword, data_length, codeword + data_length, 1,
+			                           NULL, 0, &corrected)) {
+				failed++;
+			}
+		}
+		double elapsed = seconds_since(start);
+		secs = run == 0 || elapsed < secs ? elapsed : secs;
+		allocated = allocations - allocated;
+	}
+	printf("  %-9s %2zu errors/codeword %8.2f allocations/codeword %8.3f MB/s (%llu corrected, %llu failed)\n",
+	       use_schifra ? "schifra" : "rsDecoder", errors, (double) allocated / stripes,
+	       stripes * data_length / secs / 1e6, (unsigned long long) corrected, (unsigned long long) failed);
+}
+
+static void bench_decode(const std::vector<unsigned char>& image, const std::vector<unsigned char>& fec,
+                         std::size_t fec_length, std::size_t errors, bool use_schifra) {
+	switch (fec_length) {
+		case 8:  bench_decode<8>(image, fec, errors, use_schifra); break;
+		case 16: bench_decode<16>(image, fec, errors, use_schifra); break;
+		case 32: bench_decode<32>(image, fec, errors, use_schifra); break;
+		case 64: bench_decode<64>(image, fec, errors, use_schifra); break;
+	}
+}
+
+static void report_encode(const char* name, const std::vector<unsigned char>& image, double secs) {
+	printf("  %-28s %8.3f GB/s\n", name, image.size() / secs / 1e9);
+}
+
+/*
+* Write the image and its parity, make bursts unreadable by zeroing them (a
+* failed sector read is zero filled too, but without the erasure hint), then
+* repair and count the codewords left wrong
+*/
+static void bench_recovery(const std::vector<unsigned char>& image, std::size_t fec_length, uint64_t depth,
+                           int bursts, uint64_t burst_bytes, unsigned seed) {
+	parity_geometry geo = parity_geometry_of(image.size(), fec_length, depth);
+	std::vector<unsigned char> fec(parity_length(image.size(), fec_length));
+	encode_lanes(image, geo, &fec[0]);
+
+	std::vector<unsigned char> damaged_image(image);
+	std::mt19937_64 rng(seed);
+	byte_ranges damaged;
+	for (int b = 0; b < bursts; b++) {
+		uint64_t off = rng() % (image.size() - burst_bytes) / 4096 * 4096;
+		memset(&damaged_image[off], 0, burst_bytes);
+		damaged.push_back(std::make_pair(off, burst_bytes));
+	}
+
+	char in_name[] = "/tmp/ecc-bench-in.XXXXXX";
+	char out_name[] = "/tmp/ecc-bench-out.XXXXXX";
+	int in_fd = mkstemp(in_name);
+	int out_fd = mkstemp(out_name);
+	close(out_fd);
+	FILE* in = fdopen(in_fd, "w+b");
+	fwrite(&damaged_image[0], 1, damaged_image.size(), in);
+	fwrite(&fec[0], 1, fec.size(), in);
+	fflush(in);
+
+	uint64_t corrected = 0;
+	bench_clock::time_point start = bench_clock::now();
+	int64_t failed = parity_repair(in, geo, &damaged, out_name, &corrected);
+	double secs = seconds_since(start);
+
+	std::vector<unsigned char> repaired(image.size());
+	FILE* out = fopen(out_name, "rb");
+	size_t got = fread(&repaired[0], 1, repaired.size(), out);
+	fclose(out);
+	fclose(in);
+	unlink(in_name);
+	unlink(out_name);
+
+	uint64_t wrong = 0;
+	for (uint64_t s = 0; s < parity_stripe_count(image.size(), fec_length); s++) {
+		uint64_t g = s / geo.depth;
+		uint64_t lanes = parity_group_lanes(geo, g);
+		uint64_t j = s % geo.depth;
+		for (std::size_t i = 0; i < geo.data_length; i++) {
+			uint64_t p = g * geo.depth * geo.data_length + i * lanes + j;
+			if (p < image.size() && (p >= got || repaired[p] != image[p])) {
+				wrong++;
+				break;
+			}
+		}
+	}
+	printf("  depth %-5llu corrected %10llu symbols, %8lld unrecoverable, %6llu stripes wrong, repair %6.3f s\n",
+	       (unsigned long long) depth, (unsigned long long) corrected, (long long) failed,
+	       (unsigned long long) wrong, secs);
+}
+
+int main(int argc, char** argv) {
+	uint64_t megabytes = argc > 1 ? strtoull(argv[1], NULL, 10) : 64;
+	std::size_t fec_length = argc > 2 ? strtoul(argv[2], NULL, 10) : FEC_LENGTH;
+	int bursts = argc > 3 ? atoi(argv[3]) : 16;
+	uint64_t burst_bytes = argc > 4 ? strtoull(argv[4], NULL, 10) : 4 * 4096;
+	if (!ecc_fec_supported(fec_length) || megabytes == 0 || burst_bytes >= megabytes << 20) {
+		fprintf(stderr, "Usage: %s [image MB] [fec length: 8, 16, 32 or 64] [bursts] [burst bytes]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<unsigned char> image(megabytes << 20);
+	std::mt19937 rng(1);
+	for (size_t i = 0; i < image.size(); i++) {
+		image[i] = (unsigned char) rng();
+	}
+	std::vector<unsigned char> fec(parity_length(image.size(), fec_length));
+	std::vector<unsigned char> reference(fec.size());
+
+	printf("Galois field\n");
+	bench_clock::time_point start = bench_clock::now();
+	const schifra::galois::field* field = new schifra::galois::field(FIELD_DESCRIPTOR,
+	                                                                  schifra::galois::primitive_polynomial_size06,
+	                                                                  schifra::galois::primitive_polynomial06);
+	printf("  %-28s %8.3f ms\n", "schifra field construction", seconds_since(start) * 1e3);
+	printf("  %-28s %8.3f ms (%zu bytes of tables)\n", "compile time tables", 0.0, sizeof(gf_exp) + sizeof(gf_log));
+	rs_tables* tables = new rs_tables;
+	start = bench_clock::now();
+	rs_tables_init(tables, fec_length, GEN_POLY_INDEX);
+	printf("  %-28s %8.3f ms\n", "lane kernel tables", seconds_since(start) * 1e3);
+	delete tables;
+	unsigned sink = 0;
+	for (int syndromes = 0; syndromes <= 1; syndromes++) {
+		const char* loop = syndromes ? "syndromes" : "encoder";
+		printf("  %-9s schifra field.mul %10.3f ns/multiply\n", loop,
+		       multiply_cost(schifra_mul{*field}, image, fec_length, syndromes, &sink));
+		printf("  %-9s log/antilog gf_mul %9.3f ns/multiply\n", loop,
+		       multiply_cost(table_mul(), image, fec_length, syndromes, &sink));
+	}
+	delete field;
+
+	printf("Encode, %llu MB, fec length %zu (checksum %u)\n", (unsigned long long) megabytes, fec_length, sink);
+	start = bench_clock::now();
+	encode_schifra(image, fec_length, &reference[0]);
+	report_encode("schifra, sequential", image, seconds_since(start));
+
+	const uint64_t depths[] = {1, 16, 4096};
+	for (int simd = 0; simd <= 1; simd++) {
+		rs_simd = simd;
+		for (uint64_t depth : depths) {
+			char name[64];
+			snprintf(name, sizeof(name), "%s lanes, depth %llu", simd ? "ssse3" : "scalar", (unsigned long long) depth);
+			start = bench_clock::now();
+			encode_lanes(image, parity_geometry_of(image.size(), fec_length, depth), &fec[0]);
+			report_encode(name, image, seconds_since(start));
+			if (depth == 1 && memcmp(&fec[0], &reference[0], fec.size()) != 0) {
+				printf("  parity differs from schifra's encoder\n");
+				return 1;
+			}
+		}
+	}
+	rs_simd = true;
+
+	printf("Decode, sequential codewords\n");
+	const std::size_t error_counts[] = {0, fec_length / 8, fec_length / 2};
+	for (std::size_t errors : error_counts) {
+		bench_decode(image, reference, fec_length, errors, true);
+		bench_decode(image, reference, fec_length, errors, false);
+	}
+
+	printf("Recovery, %d bursts of %llu bytes\n", bursts, (unsigned long long) burst_bytes);
+	const uint64_t recovery_depths[] = {1, 16, 256, 4096};
+	for (uint64_t depth : recovery_depths) {
+		bench_recovery(image, fec_length, depth, bursts, burst_bytes, 7);
+	}
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../src/keyedHash.cpp"
+
+/*
+* HMAC-SHA256 benchmark: hashes an image in hash blocks with one
+* HMAC(EVP_sha256(), ...) call per block, as hashAndAppend and checkHash did,
+* against hmac_sha256_many (sha256Lanes.cpp) with and without the multi-buffer
+* lanes, and checks that every digest matches. Block lengths that are not a
+* multiple of 64 bytes and keys longer than a block are checked too.
+*
+* Then times every master --hash algorithm through keyed_hash_many
+* (keyedHash.cpp), BLAKE3 with and without its AVX2 chunk lanes, and checks
+* each against a known digest. Given a file instead of a size, the benchmark
+* hashes that file, e.g. an image mastered from a test tree.
+*
+* Compile: g++ -std=c++11 -O2 hash-bench.cpp -o hash-bench.out -lcrypto
+* Run: ./hash-bench.out [image MB | image file] [hash block KB]
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Digests of count blocks of length bytes each, one OpenSSL call per block
+static void hmac_per_block(const char* key, const unsigned char* image, size_t count, uint64_t length,
+                           unsigned char* out) {
+	for (size_t i = 0; i < count; i++) {
+		unsigned char* digest = HMAC(EVP_sha256(), key, strlen(key), image + i * length, length, NULL, NULL);
+		memcpy(out + i * SHA256_DIGEST, digest, SHA256_DIGEST);
+	}
+}
+
+static void hmac_many(const char* key, const unsigned char* image, size_t count, uint64_t length, unsigned char* out) {
+	std::vector<const unsigned char*> blocks(count);
+	for (size_t i = 0; i < count; i++) {
+		blocks[i] = image + i * length;
+	}
+	hmac_sha256_many(key, strlen(key), &blocks[0], count, length, out);
+}
+
+#ifdef SHA256_LANES_X86
+struct bench_kernel {
+	const char* name;
+	sha256_lanes_fn compress;
+	int lanes;
+	bool supported;
+};
+
+static const bench_kernel kernels[] = {
+	{"AVX2 lanes, 8 blocks at a time", sha256_compress8, 8, __builtin_cpu_supports("avx2") != 0},
+	{"AVX-512 lanes, 16 at a time", sha256_compress16, 16,
+	 __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")},
+};
+
+// Digests through one kernel whatever the host prefers, returns the blocks hashed
+static size_t hmac_forced(const bench_kernel& kernel, const char* key, const unsigned char* image, size_t count,
+                          uint64_t length, unsigned char* out) {
+	uint32_t inner[8], outer[8];
+	hmac_sha256_pads(key, strlen(key), inner, outer);
+	size_t i = 0;
+	for (; i + kernel.lanes <= count; i += kernel.lanes) {
+		const unsigned char* blocks[SHA256_MAX_LANES];
+		for (int j = 0; j < kernel.lanes; j++) {
+			blocks[j] = image + (i + j) * length;
+		}
+		hmac_sha256_lanes(kernel.compress, kernel.lanes, inner, outer, blocks, length, out + i * SHA256_DIGEST);
+	}
+	return i;
+}
+#endif
+
+// Every path against OpenSSL for awkward lengths and keys, returns the mismatches
+static int check_lengths(const std::vector<unsigned char>& image) {
+	static const char* keys[] = {"wofs", "a key that is longer than the sixty four byte block of sha256 itself, hashed first"};
+	static const uint64_t lengths[] = {0, 1, 31, 55, 56, 63, 64, 65, 119, 120, 127, 128, 1000, 4096, 65599};
+	int mismatches = 0;
+	for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+		for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+			size_t count = 2 * SHA256_MAX_LANES + 3;
+			if (lengths[l] * count > image.size()) {
+				continue;
+			}
+			std::vector<unsigned char> expected(count * SHA256_DIGEST);
+			std::vector<unsigned char> got(count * SHA256_DIGEST);
+			hmac_per_block(keys[k], &image[0], count, lengths[l], &expected[0]);
+			hmac_many(keys[k], &image[0], count, lengths[l], &got[0]);
+			mismatches += expected != got;
+#ifdef SHA256_LANES_X86
+			for (size_t n = 0; n < sizeof(kernels) / sizeof(kernels[0]); n++) {
+				if (kernels[n].supported) {
+					std::fill(got.begin(), got.end(), 0);
+					size_t hashed = hmac_forced(kernels[n], keys[k], &image[0], count, lengths[l], &got[0]);
+					mismatches += memcmp(&expected[0], &got[0], hashed * SHA256_DIGEST) != 0;
+				}
+			}
+#endif
+		}
+	}
+	return mismatches;
+}
+
+// Digest of "abc" under the key "wofs" for each hash_algorithm, from Python's hmac, hashlib and blake3
+static const char* const known_digests[HASH_ALGORITHM_COUNT] = {
+	"5b043871393847d6a63b87d62e83ed8a56f784c982b6bebbffb7120691999f6e",
+	"33cc3aae076d5f0d1c30304eac58f1758d236cecc88d908c063e196a9aed30fa",
+	"479b1fd611429a9da2213ddd60523fd1d5bf7d476a7454f3e988c1409216d2a5",
+};
+
+static bool matches_known_digest(uint64_t algorithm) {
+	const unsigned char* message = (const unsigned char*) "abc";
+	unsigned char digest[KEYED_HASH_SIZE];
+	keyed_hash_many(algorithm, "wofs", 4, &message, 1, 3, digest);
+	char hex[2 * KEYED_HASH_SIZE + 1];
+	for (int i = 0; i < KEYED_HASH_SIZE; i++) {
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	}
+	return strcmp(hex, known_digests[algorithm]) == 0;
+}
+
+// Times keyed_hash_many over the image as the master does, returns false on a wrong digest
+static bool bench_algorithm(uint64_t algorithm, const char* label, const char* key,
+                            const std::vector<unsigned char>& image, uint64_t block_size,
+                            std::vector<unsigned char>* digests) {
+	size_t count = image.size() / block_size;
+	std::vector<const unsigned char*> blocks(count);
+	for (size_t i = 0; i < count; i++) {
+		blocks[i] = &image[i * block_size];
+	}
+	bench_clock::time_point start = bench_clock::now();
+	keyed_hash_many(algorithm, key, strlen(key), &blocks[0], count, block_size, &(*digests)[0]);
+	double seconds = seconds_since(start);
+	bool known = matches_known_digest(algorithm);
+	printf("  %-30s %8.1f MB/s%s\n", label, count * block_size / seconds / 1e6, known ? "" : " WRONG DIGEST");
+	return known;
+}
+
+int main(int argc, char** argv) {
+	char* end = NULL;
+	uint64_t megabytes = argc > 1 ? strtoull(argv[1], &end, 10) : 256;
+	const char* image_file = argc > 1 && *end != '\0' ? argv[1] : NULL;
+	uint64_t block_size = (argc > 2 ? strtoull(argv[2], NULL, 10) : 1024) << 10;
+	std::vector<unsigned char> image;
+	if (image_file != NULL) {
+		FILE* fp = fopen(image_file, "rb");
+		if (fp == NULL) {
+			fprintf(stderr, "Cannot open %s\n", image_file);
+			return 1;
+		}
+		fseek(fp, 0, SEEK_END);
+		image.resize(ftell(fp));
+		fseek(fp, 0, SEEK_SET);
+		size_t got = fread(&image[0], 1, image.size(), fp);
+		fclose(fp);
+		image.resize(got);
+		megabytes = image.size() >> 20;
+	} else {
+		image.resize(megabytes << 20);
+		std::mt19937 rng(1);
+		for (size_t i = 0; i < image.size(); i++) {
+			image[i] = (unsigned char) rng();
+		}
+	}
+	if (image.empty() || block_size == 0 || block_size > image.size()) {
+		fprintf(stderr, "Usage: %s [image MB | image file] [hash block KB]\n", argv[0]);
+		return 1;
+	}
+	const char* key = "wofs-bench";
+	size_t count = image.size() / block_size;
+	std::vector<unsigned char> reference(count * SHA256_DIGEST);
+	std::vector<unsigned char> digests(count * SHA256_DIGEST);
+
+	printf("HMAC-SHA256, %llu MB%s%s in %llu KB blocks, AVX2 %s, SHA extensions %s\n",
+	       (unsigned long long) megabytes, image_file ? " of " : "", image_file ? image_file : "",
+	       (unsigned long long) (block_size >> 10),
+#ifdef SHA256_LANES_X86
+	       __builtin_cpu_supports("avx2") ? "yes" : "no", sha256_have_sha_extensions() ? "yes" : "no"
+#else
+	       "no", "no"
+#endif
+	       );
+	printf("  dispatched to %d lanes\n", sha256_lane_count());
+	bench_clock::time_point start = bench_clock::now();
+	hmac_per_block(key, &image[0], count, block_size, &reference[0]);
+	double seconds = seconds_since(start);
+	printf("  %-30s %8.1f MB/s\n", "HMAC() per block", image.size() / seconds / 1e6);
+
+	sha256_lanes_simd = false;
+	start = bench_clock::now();
+	hmac_many(key, &image[0], count, block_size, &digests[0]);
+	seconds = seconds_since(start);
+	printf("  %-30s %8.1f MB/s%s\n", "hmac_sha256_many, OpenSSL", image.size() / seconds / 1e6,
+	       digests == reference ? "" : " MISMATCH");
+
+#ifdef SHA256_LANES_X86
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (!kernels[k].supported) {
+			continue;
+		}
+		std::fill(digests.begin(), digests.end(), 0);
+		start = bench_clock::now();
+		size_t hashed = hmac_forced(kernels[k], key, &image[0], count, block_size, &digests[0]);
+		seconds = seconds_since(start);
+		printf("  %-30s %8.1f MB/s%s\n", kernels[k].name, hashed * block_size / seconds / 1e6,
+		       memcmp(&digests[0], &reference[0], hashed * SHA256_DIGEST) == 0 ? "" : " MISMATCH");
+	}
+#endif
+	sha256_lanes_simd = true;
+	start = bench_clock::now();
+	hmac_many(key, &image[0], count, block_size, &digests[0]);
+	seconds = seconds_since(start);
+	printf("  %-30s %8.1f MB/s%s\n", "hmac_sha256_many, dispatched", image.size() / seconds / 1e6,
+	       digests == reference ? "" : " MISMATCH");
+
+	int mismatches = check_lengths(image);
+	printf("Digests of other lengths and keys: %d mismatches\n", mismatches);
+	mismatches += digests != reference;
+
+	printf("Keyed hash algorithms (master --hash)\n");
+	bool known = true;
+	for (uint64_t algorithm = 0; algorithm < HASH_ALGORITHM_COUNT; algorithm++) {
+		if (algorithm == HASH_BLAKE3) {
+			std::vector<unsigned char> lanes(digests.size());
+			blake3_simd = false;
+			known &= bench_algorithm(algorithm, "blake3, scalar", key, image, block_size, &digests);
+			blake3_simd = true;
+			known &= bench_algorithm(algorithm, "blake3, dispatched", key, image, block_size, &lanes);
+			mismatches += lanes != digests;
+		} else {
+			known &= bench_algorithm(algorithm, hash_algorithm_name(algorithm), key, image, block_size, &digests);
+		}
+	}
+	return mismatches != 0 || !known;
+}
@@ -0,0 +1,80 @@
+import os
+import time
+import random
+import argparse
+import subprocess
+
+#============================== Helper Functions ==============================#
+
+def drop_caches(args):
+    if (args.cold):
+        subprocess.run(['sh', args.clear_cache], stdout=subprocess.DEVNULL)
+
+def report(name, samples):
+    samples.sort()
+    count = len(samples)
+    mean = sum(samples) / count
+    p50 = samples[count // 2]
+    p99 = samples[min(count - 1, (count * 99) // 100)]
+    print("%-6s n=%-7d mean=%8.1f us  p50=%8.1f us  p99=%8.1f us" %
+          (name, count, mean * 1e6, p50 * 1e6, p99 * 1e6))
+
+def list_paths(original, mount):
+    # Take the path list from the original tree so listing does not warm the mount
+    mount_paths = []
+    dir_paths = []
+    for root, dirs, files in os.walk(original):
+        rel = os.path.relpath(root, original)
+        mount_root = mount if rel == '.' else os.path.join(mount, rel)
+        dir_paths.append(mount_root)
+        for f in files:
+            mount_paths.append(os.path.join(mount_root, f))
+    return mount_paths, dir_paths
+
+#================================= Benchmarks =================================#
+
+def bench_stat(paths, args):
+    samples = []
+    for path in random.sample(paths, min(args.samples, len(paths))):
+        drop_caches(args)
+        start = time.perf_counter()
+        os.stat(path)
+        samples.append(time.perf_counter() - start)
+    report("stat", samples)
+
+def bench_ls(dirs, args):
+    # ls -l: list the directory and stat every entry
+    samples = []
+    for path in random.sample(dirs, min(args.samples, len(dirs))):
+        drop_caches(args)
+        start = time.perf_counter()
+        for name in os.listdir(path):
+            os.lstat(os.path.join(path, name))
+        samples.append(time.perf_counter() - start)
+    report("ls -l", samples)
+
+def bench_find(args):
+    drop_caches(args)
+    start = time.perf_counter()
+    subprocess.run(['find', args.mount], stdout=subprocess.DEVNULL)
+    report("find", [time.perf_counter() - start])
+
+#==================================== Main ====================================#
+
+def main():
+    parser = argparse.ArgumentParser(description='Metadata latency of a mounted WOFS image')
+    parser.add_argument('-m', '--mount', help='mounted image root, e.g. mountPoint/tensorflow', required=True)
+    parser.add_argument('-o', '--original', help='original directory the image was mastered from', required=True)
+    parser.add_argument('-n', '--samples', type=int, help='number of random paths/directories')
+    parser.add_argument('-c', '--cold', action='store_true', help='drop the page cache before every sample (needs sudo)')
+    parser.add_argument('--clear-cache', help='cache clearing script', default=os.path.join(os.path.dirname(__file__), 'benchmark-data', 'clear-cache.sh'))
+    parser.set_defaults(samples=200)
+    args = parser.parse_args()
+
+    paths, dirs = list_paths(args.original, args.mount)
+    bench_stat(paths, args)
+    bench_ls(dirs, args)
+    bench_find(args)
+
+if __name__ == '__main__':
+    main()
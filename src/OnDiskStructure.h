@@ -3,7 +3,8 @@
 
 #include <cstdint>
 
-enum file_type : uint32_t {DIRECTORY = 0, PLAIN_FILE = 1, SYM_LINK = 2};
+enum file_type : uint32_t {DIRECTORY = 0, PLAIN_FILE = 1, SYM_LINK = 2, COMPRESSED_FILE = 3, CHUNKED_FILE = 4,
+                           BASE_FILE = 5};
 
 // structure for metadata on disk
 struct metadata_parse {
@@ -32,6 +33,111 @@ struct tree_node {
 };
 typedef struct tree_node node;
 
+// true for every header type whose payload is read back as file contents
+static inline bool is_file(uint32_t type) {
+    return type == PLAIN_FILE || type == COMPRESSED_FILE || type == CHUNKED_FILE || type == BASE_FILE;
+}
+
+/*
+* Superblock stored at offset 0 of every image. It locates the sections of the
+* image and records the parameters the image was mastered with, so readers do
+* not need to scan the image or rely on compile time constants.
+* Serialized field by field in big endian order (see superblock.cpp).
+*/
+#define WOFS_MAGIC          0x574F4653  // "WOFS"
+#define WOFS_VERSION        1
+#define SUPERBLOCK_SIZE     512         // bytes reserved at offset 0, remainder zero filled
+#define MAX_SECTIONS        16
+#define BASE_ID_SIZE        32          // SHA-256 identifying the base image of a delta
+
+// Feature flags: a reader must refuse an image with a flag it does not know
+enum feature_flag : uint64_t {
+    FEATURE_COMPRESSION = 1ULL << 0,    // image may contain COMPRESSED_FILE payloads
+    FEATURE_COMPACT_METADATA = 1ULL << 1, // inode table and name heap instead of m_hdr headers
+    FEATURE_SORTED_DIRS = 1ULL << 2,    // children of every directory are sorted by name (strcmp order)
+    FEATURE_MERKLE_HASHES = 1ULL << 3,  // hashes section holds a Merkle tree over the hash blocks (merkle.cpp)
+    FEATURE_CHUNK_STORE = 1ULL << 4,    // image may contain CHUNKED_FILE payloads, read from a chunk store (chunkStore.cpp)
+    FEATURE_BASE_IMAGE = 1ULL << 5,     // delta image, BASE_FILE payloads are read from the base image (baseImage.cpp)
+    FEATURE_STRIPED = 1ULL << 6,        // image striped over shard files, each with its own hashes (shards.cpp)
+    FEATURE_SPLIT_DATA = 1ULL << 7,     // data section in a file of its own, with its own hashes (splitImage.cpp)
+};
+#define SUPPORTED_FEATURES (FEATURE_COMPRESSION | FEATURE_COMPACT_METADATA | FEATURE_SORTED_DIRS \
+                            | FEATURE_MERKLE_HASHES | FEATURE_CHUNK_STORE | FEATURE_BASE_IMAGE \
+                            | FEATURE_STRIPED | FEATURE_SPLIT_DATA)
+
+// Index of each section in superblock::sections
+enum section_id : uint32_t {
+    SECTION_METADATA = 0,               // headers and child offset lists, root header first
+                                        // (inode table when FEATURE_COMPACT_METADATA is set)
+    SECTION_DATA = 1,                   // file payloads
+    SECTION_HASHES = 2,                 // one keyed hash per hash block of everything before it
+                                        // (keyed Merkle tree when FEATURE_MERKLE_HASHES is set,
+                                        // empty when FEATURE_STRIPED is, each shard holds its own,
+                                        // and of the image file without the data section when
+                                        // FEATURE_SPLIT_DATA is)
+    SECTION_NAMES = 3,                  // name heap of the compact metadata format
+    SECTION_PATH_INDEX = 4,             // optional perfect hash from full path to header (pathIndex.cpp)
+    SECTION_PARITY = 5,                 // optional Reed Solomon parity of everything before it (parity.cpp)
+    SECTION_CRC = 6,                    // optional CRC32C of every crc_block_size bytes before it (crc32c.cpp)
+    SECTION_SEARCH = 7,                 // optional trigram index over full paths (searchIndex.cpp)
+};
+
+// Keyed hash of each hash block in the hashes section (keyedHash.cpp)
+enum hash_algorithm : uint64_t {
+    HASH_HMAC_SHA256 = 0,               // HMAC-SHA256, also what images without the field hold
+    HASH_BLAKE2B = 1,                   // keyed BLAKE2b with a 32 byte digest
+    HASH_BLAKE3 = 2,                    // BLAKE3 keyed with a key derived from the passphrase
+    HASH_ALGORITHM_COUNT = 3,
+};
+
+struct section_entry {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t features;
+    // ECC geometry the image is encoded with, kept near the start of the block
+    // so it can be read before the image is decoded
+    uint32_t field_descriptor;
+    uint32_t code_length;
+    uint32_t fec_length;
+    uint32_t gen_poly_index;
+    uint64_t hash_block_size;
+    uint64_t entry_count;               // number of files and directories
+    section_entry sections[MAX_SECTIONS];
+    // Fields below were added after the section table, images without them read as zero
+    uint64_t data_alignment;            // payloads of at least align_threshold bytes start on
+    uint64_t align_threshold;           // a multiple of data_alignment, 0 if not aligned
+    uint64_t parity_interleave;         // codewords interleaved per group of the parity section, 0 or 1 if sequential
+    uint64_t hash_algorithm;            // keyed hash of the flat hashes section, a hash_algorithm value
+    uint64_t crc_block_size;            // bytes per CRC32C of the CRC section, 0 without one
+    unsigned char base_id[BASE_ID_SIZE]; // base image of a delta (FEATURE_BASE_IMAGE), see baseImage.cpp
+    uint64_t shard_count;               // shard files of a striped image (FEATURE_STRIPED), 0 if not striped
+    uint64_t stripe_unit;               // bytes per stripe unit dealt to each shard in turn
+    unsigned char data_id[BASE_ID_SIZE]; // data file of a split image (FEATURE_SPLIT_DATA), see splitImage.cpp
+};
+typedef struct superblock s_blk;
+
 #define M_HDR_SIZE (sizeof(m_hdr::name) + sizeof(m_hdr::type) + sizeof(m_hdr::length) + sizeof(m_hdr::time) + sizeof(m_hdr::offset))
 
+/*
+* Compact metadata format (FEATURE_COMPACT_METADATA)
+* The metadata section is a table of fixed size inode records in breadth first
+* order, so the children of a directory are consecutive records. Inode 0 is the
+* root. Names live in the name heap as a one byte length followed by the name.
+*/
+struct inode_record {
+    enum file_type type;
+    uint32_t name_offset;   // offset of the name in the name heap
+    uint64_t length;        // same meaning as m_hdr::length
+    uint64_t time;
+    uint64_t offset;        // file: payload offset, directory: index of the first child
+};
+typedef struct inode_record inode;
+
+#define INODE_SIZE (sizeof(inode::type) + sizeof(inode::name_offset) + sizeof(inode::length) + sizeof(inode::time) + sizeof(inode::offset))
+
 #endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "OnDiskStructure.h"
+
+/*
+* Delta images (master --base)
+*
+* A delta image is mastered against a base image and only stores the files
+* that are new or changed since it. A file whose path, length and modification
+* time match a file of the base gets a BASE_FILE header whose payload is a
+* reference to the payload of that file in the base (integers big endian):
+*
+*   uint64  payload offset in the base image
+*   uint32  header type in the base image
+*
+* The superblock of the delta holds the id of its base, the SHA-256 of the
+* base's hashes section. Those hashes are keyed and cover everything in the
+* base, so a base with that id which verifies under the key is the image the
+* delta was mastered against. Bases are full images readable in place: the
+* .necc image, one mastered with --ecc-layout=separate or a decoded .rec copy.
+*/
+
+#define BASE_REFERENCE_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+
+// SHA-256 of the hashes section of an image. Returns 0 on success.
+static inline int base_image_id(FILE* fp, const s_blk* sb, unsigned char* id) {
+	const section_entry& hashes = sb -> sections[SECTION_HASHES];
+	if (hashes.length == 0) {
+		return -1;
+	}
+	std::vector<unsigned char> buffer(hashes.length);
+	fseek(fp, hashes.offset, SEEK_SET);
+	if (fread(&buffer[0], 1, buffer.size(), fp) != buffer.size()) {
+		return -1;
+	}
+	EVP_Digest(&buffer[0], buffer.size(), id, NULL, EVP_sha256(), NULL);
+	return 0;
+}
+
+/*
+* True if the image can serve as a base: a full image whose payloads are at
+* the offsets its headers give, which an interleaved ECC file or a split image
+* is not
+*/
+static inline bool base_image_usable(FILE* fp, const s_blk* sb) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || (sb -> features & (FEATURE_BASE_IMAGE | FEATURE_SPLIT_DATA))) {
+		return false;
+	}
+	uint64_t size = st.st_size;
+	const section_entry& hashes = sb -> sections[SECTION_HASHES];
+	const section_entry& parity = sb -> sections[SECTION_PARITY];
+	return size == hashes.offset + hashes.length || (parity.length > 0 && size == parity.offset + parity.length);
+}
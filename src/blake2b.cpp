@@ -0,0 +1,120 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+* Keyed BLAKE2b (RFC 7693) with a 32 byte digest, for keyedHash.cpp. Keys
+* are up to BLAKE2B_KEY_LEN bytes and are padded to a block of their own in
+* front of the message.
+*/
+
+#define BLAKE2B_BLOCK_LEN 128
+#define BLAKE2B_KEY_LEN 64
+#define BLAKE2B_OUT_LEN 32
+
+static const uint64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+	{11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+	{7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+	{9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+	{2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+	{12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+	{13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+	{6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+static inline uint64_t blake2b_rotr(uint64_t x, unsigned n) {
+	return (x >> n) | (x << (64 - n));
+}
+
+static inline uint64_t blake2b_load_le(const unsigned char* p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return le64toh(x);
+}
+
+static inline void blake2b_g(uint64_t* v, int a, int b, int c, int d, uint64_t x, uint64_t y) {
+	v[a] = v[a] + v[b] + x;
+	v[d] = blake2b_rotr(v[d] ^ v[a], 32);
+	v[c] = v[c] + v[d];
+	v[b] = blake2b_rotr(v[b] ^ v[c], 24);
+	v[a] = v[a] + v[b] + y;
+	v[d] = blake2b_rotr(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];
+	v[b] = blake2b_rotr(v[b] ^ v[c], 63);
+}
+
+// Compress a block into h, counted bytes of input so far including it
+static inline void blake2b_compress(uint64_t* h, const unsigned char* block, uint64_t counted, bool last) {
+	uint64_t m[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = blake2b_load_le(block + 8 * i);
+	}
+	uint64_t v[16];
+	for (int i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = blake2b_iv[i];
+	}
+	v[12] ^= counted;
+	if (last) {
+		v[14] = ~v[14];
+	}
+	#pragma GCC unroll 12
+	for (int r = 0; r < 12; r++) {
+		const unsigned char* s = blake2b_sigma[r];
+		blake2b_g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+		blake2b_g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+		blake2b_g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+		blake2b_g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+		blake2b_g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+		blake2b_g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		blake2b_g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+		blake2b_g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+	for (int i = 0; i < 8; i++) {
+		h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+// BLAKE2B_OUT_LEN byte digest of input under a key of at most BLAKE2B_KEY_LEN bytes
+static inline void blake2b_keyed(const unsigned char* key, size_t key_length, const unsigned char* input,
+                                 uint64_t length, unsigned char* out) {
+	uint64_t h[8];
+	memcpy(h, blake2b_iv, sizeof(h));
+	h[0] ^= 0x01010000ULL ^ (uint64_t) key_length << 8 ^ BLAKE2B_OUT_LEN;
+
+	unsigned char block[BLAKE2B_BLOCK_LEN];
+	uint64_t counted = 0;
+	if (key_length > 0) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, key, key_length);
+		counted = BLAKE2B_BLOCK_LEN;
+		blake2b_compress(h, block, counted, length == 0);
+	}
+	// Every block but the last goes through as is, the last is zero padded and flagged
+	uint64_t offset = 0;
+	while (length - offset > BLAKE2B_BLOCK_LEN) {
+		counted += BLAKE2B_BLOCK_LEN;
+		blake2b_compress(h, input + offset, counted, false);
+		offset += BLAKE2B_BLOCK_LEN;
+	}
+	if (length > 0 || key_length == 0) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, input + offset, length - offset);
+		counted += length - offset;
+		blake2b_compress(h, block, counted, true);
+	}
+	for (int i = 0; i < BLAKE2B_OUT_LEN; i++) {
+		out[i] = (unsigned char) (h[i / 8] >> 8 * (i % 8));
+	}
+}
@@ -0,0 +1,363 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLAKE3_X86 1
+#endif
+
+/*
+* BLAKE3 (https://github.com/BLAKE3-team/BLAKE3-specs) with 32 byte output,
+* in its keyed hash and key derivation modes (keyedHash.cpp).
+*
+* The input is split into 1024 byte chunks, each hashed on its own into a
+* chaining value; chaining values are then paired up level by level into a
+* binary tree, the last value of an odd level moving up unchanged, and the
+* root compression carries the ROOT flag. The chunks of an input and the
+* parents of a level are independent, so both are hashed BLAKE3_LANES at a
+* time with AVX2: word i of every lane's state sits in one register, and
+* message blocks are loaded with an 8x8 transpose of 32 bit words. What is
+* left over, and hosts without AVX2, go through the scalar compression.
+*/
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_KEY_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_LANES 8
+
+enum blake3_flag : uint32_t {
+	BLAKE3_CHUNK_START = 1 << 0,
+	BLAKE3_CHUNK_END = 1 << 1,
+	BLAKE3_PARENT = 1 << 2,
+	BLAKE3_ROOT = 1 << 3,
+	BLAKE3_KEYED_HASH = 1 << 4,
+	BLAKE3_DERIVE_KEY_CONTEXT = 1 << 5,
+	BLAKE3_DERIVE_KEY_MATERIAL = 1 << 6,
+};
+
+static bool blake3_simd = true;                 // cleared to benchmark the scalar path
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*
+* Message words are permuted between rounds, word i of the next round being
+* word {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8}[i] of this one.
+* Spelled out so that, with the rounds unrolled, every word stays in a
+* register instead of being looked up through a schedule table.
+*/
+template <typename word>
+static inline void blake3_permute(word* m) {
+	word t[16] = {m[2], m[6], m[3], m[10], m[7], m[0], m[4], m[13], m[1], m[11], m[12], m[5], m[9], m[14], m[15], m[8]};
+	for (int i = 0; i < 16; i++) {
+		m[i] = t[i];
+	}
+}
+
+static inline uint32_t blake3_rotr(uint32_t x, unsigned n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t blake3_load_le(const unsigned char* p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return le32toh(x);
+}
+
+static inline void blake3_store_le(uint32_t x, unsigned char* p) {
+	x = htole32(x);
+	memcpy(p, &x, sizeof(x));
+}
+
+static inline void blake3_g(uint32_t* v, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+	v[a] = v[a] + v[b] + x;
+	v[d] = blake3_rotr(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];
+	v[b] = blake3_rotr(v[b] ^ v[c], 12);
+	v[a] = v[a] + v[b] + y;
+	v[d] = blake3_rotr(v[d] ^ v[a], 8);
+	v[c] = v[c] + v[d];
+	v[b] = blake3_rotr(v[b] ^ v[c], 7);
+}
+
+// Compress one block into the next chaining value cv (which may alias chain)
+static inline void blake3_compress(const uint32_t* chain, const unsigned char* block, uint32_t block_len,
+                                   uint64_t counter, uint32_t flags, uint32_t* cv) {
+	uint32_t m[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = blake3_load_le(block + 4 * i);
+	}
+	uint32_t v[16] = {
+		chain[0], chain[1], chain[2], chain[3], chain[4], chain[5], chain[6], chain[7],
+		blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+		(uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags
+	};
+	#pragma GCC unroll 7
+	for (int r = 0; r < 7; r++) {
+		blake3_g(v, 0, 4, 8, 12, m[0], m[1]);
+		blake3_g(v, 1, 5, 9, 13, m[2], m[3]);
+		blake3_g(v, 2, 6, 10, 14, m[4], m[5]);
+		blake3_g(v, 3, 7, 11, 15, m[6], m[7]);
+		blake3_g(v, 0, 5, 10, 15, m[8], m[9]);
+		blake3_g(v, 1, 6, 11, 12, m[10], m[11]);
+		blake3_g(v, 2, 7, 8, 13, m[12], m[13]);
+		blake3_g(v, 3, 4, 9, 14, m[14], m[15]);
+		blake3_permute(m);
+	}
+	for (int i = 0; i < 8; i++) {
+		cv[i] = v[i] ^ v[i + 8];
+	}
+}
+
+static inline void blake3_store_cv(const uint32_t* cv, unsigned char* out) {
+	for (int i = 0; i < 8; i++) {
+		blake3_store_le(cv[i], out + 4 * i);
+	}
+}
+
+/*
+* Chaining value of chunk counter, length bytes at most BLAKE3_CHUNK_LEN, stored
+* in out. With root set it is the hash of an input that is this one chunk.
+*/
+static inline void blake3_chunk(const uint32_t* key, uint32_t flags, const unsigned char* chunk, uint64_t length,
+                                uint64_t counter, bool root, unsigned char* out) {
+	uint32_t cv[8];
+	memcpy(cv, key, sizeof(cv));
+	uint64_t blocks = length == 0 ? 1 : (length + BLAKE3_BLOCK_LEN - 1) / BLAKE3_BLOCK_LEN;
+	for (uint64_t b = 0; b < blocks; b++) {
+		uint64_t offset = b * BLAKE3_BLOCK_LEN;
+		uint32_t block_len = length - offset < BLAKE3_BLOCK_LEN ? length - offset : BLAKE3_BLOCK_LEN;
+		unsigned char padded[BLAKE3_BLOCK_LEN];
+		const unsigned char* block = chunk + offset;
+		if (block_len < BLAKE3_BLOCK_LEN) {
+			memset(padded, 0, sizeof(padded));
+			memcpy(padded, block, block_len);
+			block = padded;
+		}
+		uint32_t block_flags = flags;
+		if (b == 0) {
+			block_flags |= BLAKE3_CHUNK_START;
+		}
+		if (b == blocks - 1) {
+			block_flags |= BLAKE3_CHUNK_END | (root ? BLAKE3_ROOT : 0);
+		}
+		blake3_compress(cv, block, block_len, counter, block_flags, cv);
+	}
+	blake3_store_cv(cv, out);
+}
+
+// Parent of the two chaining values at children, stored in out (which may alias children)
+static inline void blake3_parent(const uint32_t* key, uint32_t flags, const unsigned char* children,
+                                 unsigned char* out) {
+	uint32_t cv[8];
+	blake3_compress(key, children, BLAKE3_BLOCK_LEN, 0, flags | BLAKE3_PARENT, cv);
+	blake3_store_cv(cv, out);
+}
+
+#ifdef BLAKE3_X86
+__attribute__((target("avx2")))
+static inline __m256i blake3_rotr8(__m256i x, int n) {
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static inline void blake3_g8(__m256i* v, int a, int b, int c, int d, __m256i x, __m256i y) {
+	const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+	                                       2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+	                                      1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);
+	v[c] = _mm256_add_epi32(v[c], v[d]);
+	v[b] = blake3_rotr8(_mm256_xor_si256(v[b], v[c]), 12);
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8);
+	v[c] = _mm256_add_epi32(v[c], v[d]);
+	v[b] = blake3_rotr8(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+// Transpose of the 8x8 matrix of 32 bit words in r, row j of the input becoming column j of out
+__attribute__((target("avx2")))
+static inline void blake3_transpose8(const __m256i* r, __m256i* out) {
+	__m256i t[8];
+	for (int i = 0; i < 4; i++) {
+		t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+	__m256i u[8];
+	for (int i = 0; i < 2; i++) {
+		u[4 * i] = _mm256_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+		u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+	}
+	for (int k = 0; k < 4; k++) {
+		out[k] = _mm256_permute2x128_si256(u[k], u[4 + k], 0x20);
+		out[4 + k] = _mm256_permute2x128_si256(u[k], u[4 + k], 0x31);
+	}
+}
+
+// Words 0..15 of the 64 byte block at offset of each lane's input, one register per word
+__attribute__((target("avx2")))
+static inline void blake3_load8(const unsigned char* const* inputs, uint64_t offset, __m256i* m) {
+	for (int half = 0; half < 2; half++) {
+		__m256i r[8];
+		for (int j = 0; j < 8; j++) {
+			r[j] = _mm256_loadu_si256((const __m256i*) (inputs[j] + offset + 32 * half));
+		}
+		blake3_transpose8(r, m + 8 * half);
+	}
+}
+
+/*
+* Chaining values of BLAKE3_LANES inputs of blocks full blocks each, stored 32
+* bytes per input at out. Lane j is numbered counter + j when chunks are
+* hashed (counters set) and 0 for parents; start_flags and end_flags are
+* added on the first and last block.
+*/
+__attribute__((target("avx2")))
+static void blake3_hash8(const uint32_t* key, uint32_t flags, const unsigned char* const* inputs, int blocks,
+                         uint64_t counter, bool counters, uint32_t start_flags, uint32_t end_flags,
+                         unsigned char* out) {
+	__m256i cv[8];
+	for (int i = 0; i < 8; i++) {
+		cv[i] = _mm256_set1_epi32(key[i]);
+	}
+	uint32_t lo[BLAKE3_LANES], hi[BLAKE3_LANES];
+	for (int j = 0; j < BLAKE3_LANES; j++) {
+		uint64_t c = counters ? counter + j : 0;
+		lo[j] = (uint32_t) c;
+		hi[j] = (uint32_t) (c >> 32);
+	}
+	__m256i counter_lo = _mm256_loadu_si256((const __m256i*) lo);
+	__m256i counter_hi = _mm256_loadu_si256((const __m256i*) hi);
+	for (int b = 0; b < blocks; b++) {
+		__m256i m[16];
+		blake3_load8(inputs, b * BLAKE3_BLOCK_LEN, m);
+		uint32_t block_flags = flags | (b == 0 ? start_flags : 0) | (b == blocks - 1 ? end_flags : 0);
+		__m256i v[16] = {
+			cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+			_mm256_set1_epi32(blake3_iv[0]), _mm256_set1_epi32(blake3_iv[1]),
+			_mm256_set1_epi32(blake3_iv[2]), _mm256_set1_epi32(blake3_iv[3]),
+			counter_lo, counter_hi, _mm256_set1_epi32(BLAKE3_BLOCK_LEN), _mm256_set1_epi32(block_flags)
+		};
+		#pragma GCC unroll 7
+		for (int r = 0; r < 7; r++) {
+			blake3_g8(v, 0, 4, 8, 12, m[0], m[1]);
+			blake3_g8(v, 1, 5, 9, 13, m[2], m[3]);
+			blake3_g8(v, 2, 6, 10, 14, m[4], m[5]);
+			blake3_g8(v, 3, 7, 11, 15, m[6], m[7]);
+			blake3_g8(v, 0, 5, 10, 15, m[8], m[9]);
+			blake3_g8(v, 1, 6, 11, 12, m[10], m[11]);
+			blake3_g8(v, 2, 7, 8, 13, m[12], m[13]);
+			blake3_g8(v, 3, 4, 9, 14, m[14], m[15]);
+			blake3_permute(m);
+		}
+		for (int i = 0; i < 8; i++) {
+			cv[i] = _mm256_xor_si256(v[i], v[i + 8]);
+		}
+	}
+	// Transposing back gives every lane's chaining value in order, little endian on x86
+	__m256i lanes[BLAKE3_LANES];
+	blake3_transpose8(cv, lanes);
+	for (int j = 0; j < BLAKE3_LANES; j++) {
+		_mm256_storeu_si256((__m256i*) (out + BLAKE3_OUT_LEN * j), lanes[j]);
+	}
+}
+
+static inline bool blake3_have_avx2() {
+	static const bool have = __builtin_cpu_supports("avx2");
+	return blake3_simd && have;
+}
+#else
+static inline bool blake3_have_avx2() {
+	return false;
+}
+#endif
+
+/*
+* Hash length bytes of input into out, starting every chunk and parent from
+* key (the IV, a key, or a context key) with flags set on every compression
+*/
+static inline void blake3_hash(const uint32_t* key, uint32_t flags, const unsigned char* input, uint64_t length,
+                               unsigned char* out) {
+	uint64_t chunks = length == 0 ? 1 : (length + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+	if (chunks == 1) {
+		blake3_chunk(key, flags, input, length, 0, true, out);
+		return;
+	}
+	std::vector<unsigned char> cvs(BLAKE3_OUT_LEN * chunks);
+	uint64_t c = 0;
+#ifdef BLAKE3_X86
+	if (blake3_have_avx2()) {
+		for (; c + BLAKE3_LANES <= length / BLAKE3_CHUNK_LEN; c += BLAKE3_LANES) {
+			const unsigned char* inputs[BLAKE3_LANES];
+			for (int j = 0; j < BLAKE3_LANES; j++) {
+				inputs[j] = input + (c + j) * BLAKE3_CHUNK_LEN;
+			}
+			blake3_hash8(key, flags, inputs, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, c, true,
+			             BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, &cvs[BLAKE3_OUT_LEN * c]);
+		}
+	}
+#endif
+	for (; c < chunks; c++) {
+		uint64_t offset = c * BLAKE3_CHUNK_LEN;
+		uint64_t chunk_len = length - offset < BLAKE3_CHUNK_LEN ? length - offset : BLAKE3_CHUNK_LEN;
+		blake3_chunk(key, flags, input + offset, chunk_len, c, false, &cvs[BLAKE3_OUT_LEN * c]);
+	}
+
+	// Pair chaining values up a level at a time, in place, until the root's two children are left.
+	// Parent i reads values 2i and 2i + 1, so a batch is read before anything it overwrites.
+	uint64_t count = chunks;
+	while (count > 2) {
+		uint64_t parents = count / 2;
+		uint64_t i = 0;
+#ifdef BLAKE3_X86
+		if (blake3_have_avx2()) {
+			for (; i + BLAKE3_LANES <= parents; i += BLAKE3_LANES) {
+				const unsigned char* inputs[BLAKE3_LANES];
+				for (int j = 0; j < BLAKE3_LANES; j++) {
+					inputs[j] = &cvs[BLAKE3_OUT_LEN * 2 * (i + j)];
+				}
+				blake3_hash8(key, flags | BLAKE3_PARENT, inputs, 1, 0, false, 0, 0, &cvs[BLAKE3_OUT_LEN * i]);
+			}
+		}
+#endif
+		for (; i < parents; i++) {
+			blake3_parent(key, flags, &cvs[BLAKE3_OUT_LEN * 2 * i], &cvs[BLAKE3_OUT_LEN * i]);
+		}
+		if (count % 2) {
+			memmove(&cvs[BLAKE3_OUT_LEN * parents], &cvs[BLAKE3_OUT_LEN * (count - 1)], BLAKE3_OUT_LEN);
+		}
+		count = parents + count % 2;
+	}
+	blake3_parent(key, flags | BLAKE3_ROOT, &cvs[0], out);
+}
+
+static inline void blake3_key_words(const unsigned char* key, uint32_t* words) {
+	for (int i = 0; i < 8; i++) {
+		words[i] = blake3_load_le(key + 4 * i);
+	}
+}
+
+// Keyed hash of input under a BLAKE3_KEY_LEN byte key
+static inline void blake3_keyed(const unsigned char* key, const unsigned char* input, uint64_t length,
+                                unsigned char* out) {
+	uint32_t words[8];
+	blake3_key_words(key, words);
+	blake3_hash(words, BLAKE3_KEYED_HASH, input, length, out);
+}
+
+// BLAKE3_KEY_LEN byte key derived from material under a context string
+static inline void blake3_derive_key(const char* context, const unsigned char* material, uint64_t length,
+                                     unsigned char* out) {
+	unsigned char context_key[BLAKE3_KEY_LEN];
+	uint32_t words[8];
+	blake3_hash(blake3_iv, BLAKE3_DERIVE_KEY_CONTEXT, (const unsigned char*) context, strlen(context), context_key);
+	blake3_key_words(context_key, words);
+	blake3_hash(words, BLAKE3_DERIVE_KEY_MATERIAL, material, length, out);
+}
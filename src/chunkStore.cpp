@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+/*
+* Content defined chunk store (master --chunk-store)
+*
+* Payloads are cut into chunks where a rolling hash of the last bytes hits a
+* pattern (FastCDC), so an edit only changes the chunks around it and the rest
+* cut the same way they did in the last version. Each chunk is stored once in
+* a directory shared by every image, as a read only file named by the SHA-256
+* of its contents:
+*
+*   <store>/<first 2 hex digits>/<other 62 hex digits>
+*
+* A CHUNKED_FILE header points at its chunk list in the data section
+* (integers big endian):
+*
+*   uint64  chunk count
+*   chunk count entries of
+*     uint64  end of the chunk in the file (its start is the end of the last)
+*     byte    SHA-256 of the chunk [32]
+*
+* The keyed hash of the image covers the list, and a chunk read from the store
+* is only used if it hashes to the entry, so the store need not be trusted.
+*/
+
+#define CHUNK_ID_SIZE 32
+#define CHUNK_ENTRY_SIZE (sizeof(uint64_t) + CHUNK_ID_SIZE)
+#define CHUNK_LIST_PREFIX_SIZE sizeof(uint64_t)
+#define CDC_MIN_AVERAGE 1024
+#define CDC_MAX_AVERAGE (1024 * 1024)
+#define CDC_MAX_CHUNK (8 * CDC_MAX_AVERAGE)    // longest chunk any image can list
+
+/*
+* Chunk sizes for an average of 2^bits bytes: cuts are not looked for in the
+* first quarter of the average, and forced at 8 times it. The pattern before
+* the average has two more bits than after it (normalized chunking), which
+* keeps most chunks near the average.
+*/
+struct cdc_params {
+	uint64_t min;
+	uint64_t average;
+	uint64_t max;
+	uint64_t mask_small;        // before the average, harder to hit
+	uint64_t mask_large;        // after it, easier
+};
+
+static inline bool cdc_average_supported(uint64_t average) {
+	return average >= CDC_MIN_AVERAGE && average <= CDC_MAX_AVERAGE && (average & (average - 1)) == 0;
+}
+
+static inline cdc_params cdc_params_of(uint64_t average) {
+	int bits = __builtin_ctzll(average);
+	cdc_params p;
+	p.min = average / 4;
+	p.average = average;
+	p.max = average * 8;
+	// the top bits of the hash depend on the most bytes
+	p.mask_small = ~0ULL << (64 - (bits + 2));
+	p.mask_large = ~0ULL << (64 - (bits - 2));
+	return p;
+}
+
+// Random value per byte value, fixed so every master cuts the same data the same way
+struct cdc_gear_table {
+	uint64_t gear[256];
+
+	cdc_gear_table() {
+		uint64_t state = 0x574F4653;    // splitmix64 from "WOFS"
+		for (int i = 0; i < 256; i++) {
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			gear[i] = z ^ (z >> 31);
+		}
+	}
+};
+
+static inline const uint64_t* cdc_gear() {
+	static const cdc_gear_table table;
+	return table.gear;
+}
+
+/*
+* Length of the chunk starting at data, of which length bytes are available.
+* The caller passes at least p.max bytes unless they are the end of the file.
+*/
+static inline uint64_t cdc_cut(const unsigned char* data, uint64_t length, const cdc_params& p) {
+	const uint64_t* gear = cdc_gear();
+	uint64_t n = length < p.max ? length : p.max;
+	if (n <= p.min) {
+		return n;
+	}
+	uint64_t barrier = p.average < n ? p.average : n;
+	uint64_t hash = 0;
+	uint64_t i = p.min;
+	for (; i < barrier; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & p.mask_small) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < n; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & p.mask_large) == 0) {
+			return i + 1;
+		}
+	}
+	return n;
+}
+
+static inline void chunk_id(const void* data, uint64_t length, unsigned char* id) {
+	EVP_Digest(data, length, id, NULL, EVP_sha256(), NULL);
+}
+
+// File of the chunk id in the store
+static inline std::string chunk_path(const std::string& store, const unsigned char* id) {
+	static const char digits[] = "0123456789abcdef";
+	std::string path = store + "/";
+	for (int i = 0; i < CHUNK_ID_SIZE; i++) {
+		path += digits[id[i] >> 4];
+		path += digits[id[i] & 0xF];
+		if (i == 0) {
+			path += '/';
+		}
+	}
+	return path;
+}
+
+/*
+* Add a chunk to the store unless it is there already. The chunk is written
+* to a temporary file and linked into place, so a reader or another master
+* never sees part of it and an existing chunk is never written again.
+* Returns 1 if the chunk was added, 0 if it was there, -1 on error.
+*/
+static inline int chunk_store_put(const std::string& store, const unsigned char* id, const void* data, uint64_t length) {
+	std::string path = chunk_path(store, id);
+	if (access(path.c_str(), F_OK) == 0) {
+		return 0;
+	}
+	std::string dir = path.substr(0, store.size() + 3);
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		return -1;
+	}
+	std::string temp = dir + "/.tmp." + std::to_string(getpid());
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	if (fd < 0) {
+		return -1;
+	}
+	bool written = write(fd, data, length) == (ssize_t) length;
+	written = close(fd) == 0 && written;
+	int res = -1;
+	if (written && link(temp.c_str(), path.c_str()) == 0) {
+		res = 1;
+	} else if (written && errno == EEXIST) {
+		res = 0;
+	}
+	unlink(temp.c_str());
+	return res;
+}
+
+/*
+* Read the chunk id of length bytes from the store into out and check it
+* hashes to id. Returns 0 on success.
+*/
+static inline int chunk_store_get(const std::string& store, const unsigned char* id, void* out, uint64_t length) {
+	int fd = open(chunk_path(store, id).c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	uint64_t done = 0;
+	while (done < length) {
+		ssize_t got = pread(fd, (char*) out + done, length - done, done);
+		if (got <= 0) {
+			break;
+		}
+		done += got;
+	}
+	close(fd);
+	unsigned char check[CHUNK_ID_SIZE];
+	if (done != length) {
+		return -1;
+	}
+	chunk_id(out, length, check);
+	return memcmp(check, id, CHUNK_ID_SIZE) == 0 ? 0 : -1;
+}
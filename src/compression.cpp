@@ -0,0 +1,65 @@
+#include <cstring>
+#include <zlib.h>
+
+/*
+* Compressed file payloads
+*
+* A COMPRESSED_FILE header points at a payload made of independent chunks so a
+* read only has to inflate the chunks overlapping the requested range.
+* Layout (integers big endian, offsets relative to the start of the payload):
+*
+*   uint32  chunk size (uncompressed bytes per chunk, last chunk may be short)
+*   uint32  chunk count
+*   uint64  chunk offsets [chunk count + 1]
+*   chunk data
+*
+* A chunk whose stored length equals its uncompressed length is stored raw,
+* the master only keeps the zlib stream when it is strictly smaller.
+*/
+
+#define COMPRESSED_PREFIX_SIZE (2 * sizeof(uint32_t))
+
+static inline uint64_t compressed_index_size(uint32_t chunk_count) {
+	return COMPRESSED_PREFIX_SIZE + (uint64_t) (chunk_count + 1) * sizeof(uint64_t);
+}
+
+static inline uint32_t compressed_chunk_count(uint64_t length, uint32_t chunk_size) {
+	return (uint32_t) ((length + chunk_size - 1) / chunk_size);
+}
+
+// Uncompressed length of chunk `index` of a file of `length` bytes
+static inline uint32_t compressed_chunk_length(uint64_t length, uint32_t chunk_size, uint32_t index) {
+	uint64_t start = (uint64_t) index * chunk_size;
+	uint64_t remaining = length - start;
+	return remaining < chunk_size ? (uint32_t) remaining : chunk_size;
+}
+
+/*
+* Compress `len` bytes of `in` into `out` (at least compressBound(len) bytes).
+* Returns the compressed length, or 0 if compressing does not shrink the chunk.
+*/
+static inline uint32_t compress_chunk(const char* in, uint32_t len, char* out, int level) {
+	uLongf out_len = compressBound(len);
+	int res = compress2((Bytef*) out, &out_len, (const Bytef*) in, len, level);
+	if (res != Z_OK || out_len >= len) {
+		return 0;
+	}
+	return (uint32_t) out_len;
+}
+
+/*
+* Expand a stored chunk into `out` which must hold `raw_len` bytes.
+* Returns 0 on success.
+*/
+static inline int decompress_chunk(const char* in, uint32_t stored_len, char* out, uint32_t raw_len) {
+	if (stored_len == raw_len) {
+		memcpy(out, in, raw_len);
+		return 0;
+	}
+	uLongf out_len = raw_len;
+	int res = uncompress((Bytef*) out, &out_len, (const Bytef*) in, stored_len);
+	if (res != Z_OK || out_len != raw_len) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,2 @@
+unsigned long DEF_CDC_AVERAGE = 8192;       // Average bytes per content defined chunk of --chunk-store
+unsigned long DEF_STORE_CACHE_CHUNKS = 1024; // Verified chunk store chunks kept by the mounter
@@ -0,0 +1,2 @@
+unsigned long DEF_COMPRESSION_CHUNK_SIZE = 65536; // Uncompressed bytes per independently compressed chunk
+unsigned long DEF_CHUNK_CACHE_SLOTS = 256;        // Decompressed chunks kept by the mounter
@@ -1,5 +1,4 @@
 const std::size_t FIELD_DESCRIPTOR    =   8;
 const std::size_t GEN_POLY_INDEX      = 120;
-const std::size_t ROOT_COUNT 		  =  32;
 const std::size_t CODE_LENGTH         = 255;
-const std::size_t FEC_LENGTH          =  32;
\ No newline at end of file
+const std::size_t FEC_LENGTH          =  32;    // default parity symbols per codeword, see ecc_fec_supported
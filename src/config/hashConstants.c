@@ -1 +1,3 @@
-unsigned long DEF_HASH_BLOCK_SIZE = 1048576; // Block size used for hashing
\ No newline at end of file
+unsigned long DEF_HASH_BLOCK_SIZE = 1048576; // Block size used for hashing
+unsigned long DEF_MERKLE_CACHE_NODES = 65536; // Verified Merkle tree nodes kept by --lazy-verify
+unsigned long DEF_CRC_BLOCK_SIZE = 4096; // Bytes per CRC32C of the --crc table
@@ -0,0 +1,3 @@
+unsigned long DEF_SCRUB_RATE = 4;            // MB/s the scrubber may read
+unsigned long DEF_SCRUB_IDLE = 200;         // ms without foreground reads before the scrubber runs
+unsigned long DEF_SCRUB_INTERVAL = 86400;   // s between the starts of two scrub passes
@@ -0,0 +1 @@
+unsigned long DEF_STRIPE_UNIT = 65536;      // Bytes per stripe unit of a --shards image
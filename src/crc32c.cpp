@@ -0,0 +1,152 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+/*
+* CRC32C (Castagnoli, reflected polynomial 0x82F63B78) of the CRC table
+* section, a quick check of every block the mounter returns.
+*
+* With SSE4.2 the crc32 instruction takes 8 bytes at a time, but each one
+* waits for the last, so the buffer is cut into three stripes whose CRCs run
+* side by side. The stripe CRCs are joined by shifting the first two past the
+* bytes after them: multiplying by x^(8 * bytes) modulo the polynomial, one
+* carry-less multiply (PCLMULQDQ) reduced by another crc32. Hosts without
+* them use a table a byte at a time. Both give the same CRC.
+*/
+
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_STRIPE_WORDS 32          // 8 byte words per stripe of the main loop
+
+static bool crc32c_simd = true;         // cleared to benchmark the table
+
+// a * b modulo the polynomial, both reflected (x^0 is the top bit)
+static inline uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+	uint32_t product = 0;
+	for (uint32_t m = 1U << 31; m != 0; m >>= 1) {
+		if (a & m) {
+			product ^= b;
+		}
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return product;
+}
+
+// x^n modulo the polynomial, reflected
+static inline uint32_t crc32c_x_pow(uint64_t n) {
+	uint32_t result = 1U << 31;
+	uint32_t square = 1U << 30;          // x^(2^k) for the bit of n being looked at
+	for (; n != 0; n >>= 1) {
+		if (n & 1) {
+			result = crc32c_multiply(result, square);
+		}
+		square = crc32c_multiply(square, square);
+	}
+	return result;
+}
+
+struct crc32c_tables {
+	uint32_t bytes[256];
+	// x^(8 * 8s - 33) and x^(16 * 8s - 33) for stripes of s words: the crc32 reducing
+	// a carry-less product multiplies it by x^33
+	uint64_t shift[CRC32C_STRIPE_WORDS + 1][2];
+
+	crc32c_tables() {
+		for (uint32_t b = 0; b < 256; b++) {
+			uint32_t crc = b;
+			for (int k = 0; k < 8; k++) {
+				crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+			}
+			bytes[b] = crc;
+		}
+		for (uint64_t s = 1; s <= CRC32C_STRIPE_WORDS; s++) {
+			shift[s][0] = crc32c_x_pow(64 * s - 33);
+			shift[s][1] = crc32c_x_pow(128 * s - 33);
+		}
+	}
+};
+
+static inline const crc32c_tables& crc32c_constants() {
+	static const crc32c_tables tables;
+	return tables;
+}
+
+// Raw CRC register, without the inversions, a byte at a time
+static inline uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t length) {
+	const uint32_t* bytes = crc32c_constants().bytes;
+	for (size_t i = 0; i < length; i++) {
+		crc = bytes[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t crc32c_stripes(uint64_t crc, const unsigned char* p, uint64_t words, const uint64_t* shift) {
+	uint64_t crc1 = 0, crc2 = 0;
+	const unsigned char* p1 = p + 8 * words;
+	const unsigned char* p2 = p1 + 8 * words;
+	for (uint64_t i = 0; i < words; i++) {
+		uint64_t w0, w1, w2;
+		memcpy(&w0, p + 8 * i, 8);
+		memcpy(&w1, p1 + 8 * i, 8);
+		memcpy(&w2, p2 + 8 * i, 8);
+		crc = _mm_crc32_u64(crc, w0);
+		crc1 = _mm_crc32_u64(crc1, w1);
+		crc2 = _mm_crc32_u64(crc2, w2);
+	}
+	// crc shifts past two stripes and crc1 past one
+	__m128i shifted = _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi64_si128(crc), _mm_cvtsi64_si128(shift[1]), 0),
+	                                _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc1), _mm_cvtsi64_si128(shift[0]), 0));
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(shifted)) ^ crc2;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hardware(uint32_t crc32, const unsigned char* p, size_t length) {
+	const crc32c_tables& tables = crc32c_constants();
+	uint64_t crc = crc32;
+	while (length >= 24 * CRC32C_STRIPE_WORDS) {
+		crc = crc32c_stripes(crc, p, CRC32C_STRIPE_WORDS, tables.shift[CRC32C_STRIPE_WORDS]);
+		p += 24 * CRC32C_STRIPE_WORDS;
+		length -= 24 * CRC32C_STRIPE_WORDS;
+	}
+	// what is left is cut into three shorter stripes once
+	uint64_t words = length / 24;
+	if (words > 0) {
+		crc = crc32c_stripes(crc, p, words, tables.shift[words]);
+		p += 24 * words;
+		length -= 24 * words;
+	}
+	for (; length >= 8; p += 8, length -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		crc = _mm_crc32_u64(crc, w);
+	}
+	for (; length > 0; p++, length--) {
+		crc = _mm_crc32_u8((uint32_t) crc, *p);
+	}
+	return (uint32_t) crc;
+}
+
+static inline bool crc32c_have_hardware() {
+	static const bool have = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+	return crc32c_simd && have;
+}
+#endif
+
+/*
+* CRC32C of length bytes continuing from crc, the CRC of what came before
+* them (0 to start). crc32c(0, "123456789", 9) is 0xE3069283.
+*/
+static inline uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+	const unsigned char* p = (const unsigned char*) data;
+#ifdef CRC32C_X86
+	if (crc32c_have_hardware()) {
+		return ~crc32c_hardware(~crc, p, length);
+	}
+#endif
+	return ~crc32c_table(~crc, p, length);
+}
@@ -2,35 +2,51 @@
 #include <string>
 #include <iostream>
 #include <fstream>
-#include "../libraries/schifra/schifra_reed_solomon_block.hpp"
-#include "../libraries/schifra/schifra_fileio.hpp"
-#include "../libraries/schifra/schifra_galois_field.hpp"
-#include "../libraries/schifra/schifra_sequential_root_generator_polynomial_creator.hpp"
-#include "../libraries/schifra/schifra_reed_solomon_decoder.hpp"
-#include "fileDecoder.cpp"
 #include "config/decodeConstants.c"
+#include "fileDecoder.cpp"
 
-int decode(std::string inFile, std::string outFile)
-{
-   const std::size_t field_descriptor    = FIELD_DESCRIPTOR;
-   const std::size_t gen_poly_index      = GEN_POLY_INDEX;
-   const std::size_t code_length         = CODE_LENGTH;
-   const std::size_t fec_length          =   FEC_LENGTH;
-   const std::string input_file_name     = inFile;
-   const std::string output_file_name    = outFile;
+/*
+* The Reed Solomon geometry is chosen per image when it is mastered and
+* recorded in the superblock. Encoding and decoding run on GF(2^8) tables
+* built at compile time (gfTables.cpp) and, per parity length, the generator
+* and root tables of rsKernels.cpp, built the first time that length is used.
+*/
+static inline bool ecc_fec_supported(std::size_t fec_length) {
+   return fec_length == 8 || fec_length == 16 || fec_length == 32 || fec_length == 64;
+}
 
-   typedef schifra::reed_solomon::decoder<code_length,fec_length> decoder_t;
-   typedef schifra::reed_solomon::file_decoder<code_length,fec_length> file_decoder_t;
+template <std::size_t fec_length>
+static inline const rs_tables* ecc_tables_for() {
+   struct builder {
+      static rs_tables* build() {
+         rs_tables* t = new rs_tables;
+         rs_tables_init(t, fec_length, GEN_POLY_INDEX);
+         return t;
+      }
+   };
+   static const rs_tables* tables = builder::build();
+   return tables;
+}
 
-   const schifra::galois::field field(field_descriptor,
-                                      schifra::galois::primitive_polynomial_size06,
-                                      schifra::galois::primitive_polynomial06);
+// Encoder, syndrome and decoder tables for a supported parity length, NULL otherwise
+static inline const rs_tables* ecc_tables(std::size_t fec_length) {
+   switch (fec_length) {
+      case 8:  return ecc_tables_for<8>();
+      case 16: return ecc_tables_for<16>();
+      case 32: return ecc_tables_for<32>();
+      case 64: return ecc_tables_for<64>();
+   }
+   return NULL;
+}
 
-   const decoder_t rs_decoder(field,gen_poly_index);
+int decode(std::string inFile, std::string outFile, std::size_t fec_length = FEC_LENGTH)
+{
+   const rs_tables* tables = ecc_tables(fec_length);
+   if (tables == NULL) {
+      std::cout << "Unsupported Reed Solomon parity length " << fec_length << std::endl;
+      return 5;
+   }
 
-   file_decoder_t* fd = new file_decoder_t();
-   int decode_success = fd -> decode_file(rs_decoder, input_file_name, output_file_name);
-   //std::cout << rs_decoder.errors_corrected << std::endl;
-   free(fd);
-   return decode_success;
+   file_decoder fd(tables);
+   return fd.decode_file(inFile, outFile);
 }
@@ -1,7 +1,8 @@
 /*
 (**************************************************************************)
 (* Based on the file_decoder in the Schifra library                       *)
-(* The Schifra file was edited to return a status on decode               *)
+(* The Schifra file was edited to return a status on decode, and to use   *)
+(* the allocation free decoder of rsDecoder.cpp on batches of codewords   *)
 (*                                                                        *)
 (* Release Version 0.0.1                                                  *)
 (* http://www.schifra.com                                                 *)
@@ -11,184 +12,157 @@
 */
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include <stdio.h>
 #include <string.h>
-#include "../libraries/schifra/schifra_reed_solomon_block.hpp"
-#include "../libraries/schifra/schifra_reed_solomon_decoder.hpp"
 #include "../libraries/schifra/schifra_fileio.hpp"
+#include "rsDecoder.cpp"
 
-namespace schifra
+#define FILE_DECODER_BATCH 4096         // codewords read and written at a time
+
+class file_decoder
 {
-   namespace reed_solomon
-   {
 
-      template <std::size_t code_length, std::size_t fec_length, std::size_t data_length = code_length - fec_length>
-      class file_decoder
+   enum return_type : int {SUCCESS = 0, ZERO_SIZE = 1, ERR_OPEN = 2, ERR_CREATE = 3, ERR_DECODE = 4};
+
+public:
+
+   uint64_t errors_corrected;
+
+   file_decoder(const rs_tables* tables)
+   : errors_corrected(0),
+     tables_(tables),
+     workspace_(rs_workspace_local()),
+     current_block_index_(0)
+   {}
+
+/*
+// Public exposed API for decoding file
+// Decode the entire file: return return_type based on status of decode
+*/
+public:
+   inline int decode_file(const std::string& input_file_name,
+                          const std::string& output_file_name) {
+      const char* input_display = strrchr(input_file_name.c_str(), '/');
+      const char* output_display = strrchr(output_file_name.c_str(), '/');
+      std::cout << "Decoding " << input_display << " ..." <<std::endl;
+
+      std::size_t remaining_bytes = schifra::fileio::file_size(input_file_name);
+      if (remaining_bytes == 0)
       {
+         std::cout << "Error: input file has ZERO size." << std::endl;
+         return ZERO_SIZE;
+      }
 
-      enum return_type : int {SUCCESS = 0, ZERO_SIZE = 1, ERR_OPEN = 2, ERR_CREATE = 3, ERR_DECODE = 4};
-
-      public:
-
-         typedef decoder<code_length,fec_length> decoder_type;
-         typedef typename decoder_type::block_type block_type;
-         int errors_corrected;
-         int errors_detected;
-
-      /*
-      // Public exposed API for decoding file
-      // Decode the entire file: return return_type based on status of decode
-      */
-      public:
-         inline int decode_file(const decoder_type& decoder,
-                                    const std::string& input_file_name,
-                                    const std::string& output_file_name) {
-            const char* input_display = strrchr(input_file_name.c_str(), '/');
-            const char* output_display = strrchr(output_file_name.c_str(), '/');
-            std::cout << "Decoding " << input_display << " ..." <<std::endl;
-
-            std::size_t remaining_bytes = schifra::fileio::file_size(input_file_name);
-             if (remaining_bytes == 0)
-            {
-               std::cout << "Error: input file has ZERO size." << std::endl;
-               return ZERO_SIZE;
-            }
-
-            std::ifstream in_stream(input_file_name.c_str(),std::ios::binary);
-            if (!in_stream)
-            {
-               std::cout << "Error: input file could not be opened." << std::endl;
-               return ERR_OPEN;
-            }
-
-            std::ofstream out_stream(output_file_name.c_str(),std::ios::binary);
-            if (!out_stream)
-            {
-               std::cout << "Error: output file could not be created." << std::endl;
-               return ERR_CREATE;
-            }
-
-            current_block_index_ = 0;
-
-            while (remaining_bytes >= code_length)
-            {
-               int process_success = process_complete_block(decoder,in_stream,out_stream);
-               if (process_success) {
-                  print_report(input_display, output_display, 0);
-                  return ERR_DECODE;
-               }
-               remaining_bytes -= code_length;
-               current_block_index_++;
-            }
-
-            if (remaining_bytes > 0)
-            {
-               int process_success = process_partial_block(decoder,in_stream,out_stream,remaining_bytes);
-               if (process_success) {
-                  print_report(input_display, output_display, 0);
-                  return ERR_DECODE;
-               }
-            }
-
-            in_stream.close();
-            out_stream.close();
-
-            print_report(input_display, output_display, 1);
-            return SUCCESS;   
+      std::ifstream in_stream(input_file_name.c_str(),std::ios::binary);
+      if (!in_stream)
+      {
+         std::cout << "Error: input file could not be opened." << std::endl;
+         return ERR_OPEN;
       }
 
-      private: 
-         inline void print_report(const char* input_display, const char* output_display, int recoverable) 
-         {
-            std::cout << std::endl << "DECODE REPORT " << std::endl;
-            std::cout << "Decoded " << input_display << " into " << output_display << std::endl; 
-            std::cout << "Errors detected: " << errors_detected << std::endl;
-            std::cout << "Errors corrected: " << errors_corrected << std::endl;
-            if (recoverable) {
-               std::cout << "\033[0;32m" << "Recoverable: " << recoverable << std::endl << "\033[0m"<< std::endl;
-            } else {
-               std::cout << "\033[0;31m" << "Recoverable: " << recoverable << std::endl << "\033[0m"<< std::endl;
-            }
+      std::ofstream out_stream(output_file_name.c_str(),std::ios::binary);
+      if (!out_stream)
+      {
+         std::cout << "Error: output file could not be created." << std::endl;
+         return ERR_CREATE;
+      }
+
+      const std::size_t code_length = tables_ -> fec_length + data_length();
+      std::vector<char> buffer(FILE_DECODER_BATCH * code_length);
+      current_block_index_ = 0;
+      errors_corrected = 0;
+
+      while (remaining_bytes > 0)
+      {
+         std::size_t read_amount = std::min(remaining_bytes, buffer.size());
+         in_stream.read(&buffer[0],static_cast<std::streamsize>(read_amount));
+         int process_success = process_batch(&buffer[0], read_amount, out_stream);
+         if (process_success) {
+            print_report(input_display, output_display, 0);
+            return ERR_DECODE;
          }
+         remaining_bytes -= read_amount;
+      }
+
+      in_stream.close();
+      out_stream.close();
+
+      print_report(input_display, output_display, 1);
+      return SUCCESS;
+   }
 
+private:
+   inline void print_report(const char* input_display, const char* output_display, int recoverable)
+   {
+      std::cout << std::endl << "DECODE REPORT " << std::endl;
+      std::cout << "Decoded " << input_display << " into " << output_display << std::endl;
+      std::cout << "Errors corrected: " << errors_corrected << std::endl;
+      if (recoverable) {
+         std::cout << "\033[0;32m" << "Recoverable: " << recoverable << std::endl << "\033[0m"<< std::endl;
+      } else {
+         std::cout << "\033[0;31m" << "Recoverable: " << recoverable << std::endl << "\033[0m"<< std::endl;
+      }
+   }
 
-      private:
+   inline std::size_t data_length() const
+   {
+      return RS_CODE_LENGTH - tables_ -> fec_length;
+   }
+
+private:
+
+   /*
+   // Decode the codewords in buffer in place and write their data. Only the
+   // last codeword of the file may be partial: its data is shorter, the
+   // parity is whole.
+   */
+   inline int process_batch(char* buffer,
+                            const std::size_t& read_amount,
+                            std::ofstream& out_stream)
+   {
+      const std::size_t fec_length = tables_ -> fec_length;
+      const std::size_t code_length = fec_length + data_length();
+      unsigned char* symbols = reinterpret_cast<unsigned char*>(buffer);
+      std::size_t written = 0;
 
-         inline int process_complete_block(const decoder_type& decoder,
-                                            std::ifstream& in_stream,
-                                            std::ofstream& out_stream)
+      for (std::size_t offset = 0; offset < read_amount; offset += code_length)
+      {
+         std::size_t length = std::min(code_length, read_amount - offset);
+         if (length <= fec_length)
+         {
+            std::cout << "Error during decoding of block " << current_block_index_ << "!" << std::endl;
+            return ERR_DECODE;
+         }
+
+         std::size_t data_amount = length - fec_length;
+         unsigned char* data = symbols + offset;
+         if (length < code_length)
          {
-            in_stream.read(&buffer_[0],static_cast<std::streamsize>(code_length));
-            copy<char,code_length,fec_length>(buffer_,code_length,block_);
-
-            int res = decoder.decode(block_);
-            errors_detected = errors_detected + block_.errors_detected;
-            errors_corrected = errors_corrected + block_.errors_corrected;
-            
-            if (!res)
-            {
-               std::cout << "Error during decoding of block " << current_block_index_ << "!" << std::endl;
-               return ERR_DECODE;
-            }
-
-            for (std::size_t i = 0; i < data_length; ++i)
-            {
-               buffer_[i] = static_cast<char>(block_[i]);
-            }
-
-            out_stream.write(&buffer_[0],static_cast<std::streamsize>(data_length));
-            return SUCCESS;
+            memset(partial_, 0, sizeof(partial_));
+            memcpy(partial_, data, data_amount);
+            memcpy(partial_ + data_length(), data + data_amount, fec_length);
+            data = partial_;
          }
 
-         inline int process_partial_block(const decoder_type& decoder,
-                                           std::ifstream& in_stream,
-                                           std::ofstream& out_stream,
-                                           const std::size_t& read_amount)
+         if (!rs_decode_lane(tables_, workspace_, data, data_length(), data + data_length(), 1,
+                             NULL, 0, &errors_corrected))
          {
-            if (read_amount <= fec_length)
-            {
-               std::cout << "Error during decoding of block " << current_block_index_ << "!" << std::endl;
-               return ERR_DECODE;
-            }
-
-            in_stream.read(&buffer_[0],static_cast<std::streamsize>(read_amount));
-
-            for (std::size_t i = 0; i < (read_amount - fec_length); ++i)
-            {
-               block_.data[i] = static_cast<typename block_type::symbol_type>(buffer_[i]);
-            }
-
-            if ((read_amount - fec_length) < data_length)
-            {
-               for (std::size_t i = (read_amount - fec_length); i < data_length; ++i)
-               {
-                  block_.data[i] = 0;
-               }
-            }
-
-            for (std::size_t i = 0; i < fec_length; ++i)
-            {
-               block_.fec(i) = static_cast<typename block_type::symbol_type>(buffer_[(read_amount - fec_length) + i]);
-            }
-
-            if (!decoder.decode(block_))
-            {
-               std::cout << "Error during decoding of block " << current_block_index_ << "!" << std::endl;
-               return ERR_DECODE;
-            }
-
-            for (std::size_t i = 0; i < (read_amount - fec_length); ++i)
-            {
-               buffer_[i] = static_cast<char>(block_.data[i]);
-            }
-
-            out_stream.write(&buffer_[0],static_cast<std::streamsize>(read_amount - fec_length));
-            return SUCCESS;
+            std::cout << "Error during decoding of block " << current_block_index_ << "!" << std::endl;
+            return ERR_DECODE;
          }
 
-         block_type block_;
-         std::size_t current_block_index_;
-         char buffer_[code_length];
-      };
-   } // namespace reed_solomon
-} // namespace schifra
+         memmove(buffer + written, data, data_amount);
+         written += data_amount;
+         current_block_index_++;
+      }
+
+      out_stream.write(buffer,static_cast<std::streamsize>(written));
+      return SUCCESS;
+   }
+
+   const rs_tables* tables_;
+   rs_workspace* workspace_;
+   std::size_t current_block_index_;
+   unsigned char partial_[RS_CODE_LENGTH];
+};
@@ -0,0 +1,69 @@
+#include <stddef.h>
+
+/*
+* GF(2^8) tables for the field the images are encoded with: field descriptor 8
+* and schifra's primitive_polynomial06, x^8 + x^7 + x^2 + x + 1. They are
+* generated at compile time, so nothing is built or allocated at startup,
+* unlike schifra::galois::field which fills four 256 x 256 tables of ints.
+*
+* gf_exp holds alpha^i twice over (512 bytes) so gf_exp[log a + log b] needs
+* no reduction modulo 255, and gf_log holds the discrete logarithms (256
+* bytes). Both fit in a few L1 cache lines.
+*/
+
+#define GF_POLYNOMIAL 0x187             // primitive_polynomial06, bit k the coefficient of x^k
+
+// alpha times a
+constexpr unsigned char gf_times_alpha(unsigned a) {
+	return (unsigned char) (a & 0x80 ? (a << 1) ^ GF_POLYNOMIAL : a << 1);
+}
+
+// alpha^n for n < 255
+constexpr unsigned char gf_alpha_power(unsigned n) {
+	return n == 0 ? 1 : gf_times_alpha(gf_alpha_power(n - 1));
+}
+
+// The n in [from, 255) with alpha^n == a given power == alpha^from, 0 if there is none (a == 0)
+constexpr unsigned char gf_log_search(unsigned a, unsigned from, unsigned power) {
+	return from == 255 ? 0 : power == a ? from : gf_log_search(a, from + 1, gf_times_alpha(power));
+}
+
+// Index packs to expand the generators into arrays (std::index_sequence is C++14)
+template <size_t... I> struct gf_indexes {};
+template <size_t N, size_t... I> struct gf_make_indexes : gf_make_indexes<N - 1, N - 1, I...> {};
+template <size_t... I> struct gf_make_indexes<0, I...> { typedef gf_indexes<I...> type; };
+
+template <typename Indexes> struct gf_exp_builder;
+template <size_t... I> struct gf_exp_builder<gf_indexes<I...> > {
+	static constexpr unsigned char table[sizeof...(I)] = {gf_alpha_power(I % 255)...};
+};
+template <size_t... I> constexpr unsigned char gf_exp_builder<gf_indexes<I...> >::table[sizeof...(I)];
+
+template <typename Indexes> struct gf_log_builder;
+template <size_t... I> struct gf_log_builder<gf_indexes<I...> > {
+	static constexpr unsigned char table[sizeof...(I)] = {gf_log_search(I, 0, 1)...};
+};
+template <size_t... I> constexpr unsigned char gf_log_builder<gf_indexes<I...> >::table[sizeof...(I)];
+
+typedef gf_exp_builder<gf_make_indexes<512>::type> gf_exp_table;
+typedef gf_log_builder<gf_make_indexes<256>::type> gf_log_table;
+
+static constexpr const unsigned char (&gf_exp)[512] = gf_exp_table::table;
+static constexpr const unsigned char (&gf_log)[256] = gf_log_table::table;
+
+static_assert(gf_exp[8] == 0x87 && gf_exp[255] == 1 && gf_exp[256] == 2, "GF(2^8) antilog table");
+static_assert(gf_log[1] == 0 && gf_log[2] == 1 && gf_log[0x87] == 8, "GF(2^8) log table");
+
+static inline unsigned char gf_mul(unsigned char a, unsigned char b) {
+	return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+// a / b, b non zero
+static inline unsigned char gf_div(unsigned char a, unsigned char b) {
+	return a == 0 ? 0 : gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+// alpha^n for any n
+static inline unsigned char gf_alpha(size_t n) {
+	return gf_exp[n % 255];
+}
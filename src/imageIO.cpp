@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+* Payload reads of the mounted image. pread keeps concurrent FUSE requests from
+* racing on a shared file position. With --direct reads bypass the page cache
+* through an O_DIRECT descriptor; the range is widened to DIRECT_IO_ALIGNMENT
+* and bounced through an aligned buffer, so images mastered with --align=4096
+* need exactly one aligned read per request.
+*/
+
+#define DIRECT_IO_ALIGNMENT 4096
+
+static int image_fd = -1;
+static int image_direct_fd = -1;
+
+// A striped image is read from its shards instead (shards.cpp)
+static shard_set* image_shards = NULL;
+
+// The payloads of a split image are read from its data file (splitImage.cpp)
+static split_files* image_split = NULL;
+
+// Mirrored replicas of the image, replica 0 being the image itself (replicas.cpp)
+static replica_set* image_replicas = NULL;
+
+// Blocks the scrubber repaired into a sidecar file are read from it instead (scrub.cpp)
+static int image_overlay_fd = -1;
+static uint64_t image_overlay_block_size = 0;
+static volatile unsigned char* image_overlay_map = NULL;   // non zero for blocks in the sidecar
+static uint64_t image_overlay_blocks = 0;
+
+static int image_open(const char* file_name, int direct) {
+	image_fd = open(file_name, O_RDONLY);
+	if (image_fd < 0) {
+		return -1;
+	}
+	if (direct) {
+		image_direct_fd = open(file_name, O_RDONLY | O_DIRECT);
+		if (image_direct_fd < 0) {
+			printf("O_DIRECT is not supported for %s, using buffered reads\n", file_name);
+		}
+	}
+	return 0;
+}
+
+static void image_close() {
+	close(image_fd);
+	if (image_direct_fd >= 0) {
+		close(image_direct_fd);
+	}
+	image_fd = -1;
+	image_direct_fd = -1;
+}
+
+// pread until len bytes are read or the end of the file. Returns bytes read or -errno.
+static ssize_t pread_full(int fd, void* buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t got = pread(fd, (char*) buf + done, len - done, offset + done);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (got == 0) {
+			break;
+		}
+		done += got;
+	}
+	return done;
+}
+
+static ssize_t image_read_base(void* buf, size_t len, uint64_t offset) {
+	if (image_shards != NULL) {
+		return shard_read(image_shards, buf, len, offset);
+	}
+	if (image_split != NULL) {
+		return split_read(image_split, buf, len, offset);
+	}
+	if (image_direct_fd < 0) {
+		return pread_full(image_fd, buf, len, offset);
+	}
+
+	uint64_t start = offset & ~((uint64_t) DIRECT_IO_ALIGNMENT - 1);
+	uint64_t end = (offset + len + DIRECT_IO_ALIGNMENT - 1) & ~((uint64_t) DIRECT_IO_ALIGNMENT - 1);
+	void* bounce;
+	if (posix_memalign(&bounce, DIRECT_IO_ALIGNMENT, end - start) != 0) {
+		return -ENOMEM;
+	}
+	// one aligned read, a short read only happens at the end of the image
+	ssize_t got;
+	do {
+		got = pread(image_direct_fd, bounce, end - start, start);
+	} while (got < 0 && errno == EINTR);
+	if (got < 0) {
+		got = -errno;
+	} else {
+		uint64_t skip = offset - start;
+		got = (uint64_t) got > skip ? got - skip : 0;
+		if ((size_t) got > len) {
+			got = len;
+		}
+		memcpy(buf, (char*) bounce + skip, got);
+	}
+	free(bounce);
+	return got;
+}
+
+static inline int image_overlaid(uint64_t block) {
+	return block < image_overlay_blocks && image_overlay_map[block];
+}
+
+/*
+* Read through the overlay of repaired blocks, one run of blocks from the same
+* file at a time
+*/
+static ssize_t image_read(void* buf, size_t len, uint64_t offset) {
+	if (image_overlay_fd < 0) {
+		return image_read_base(buf, len, offset);
+	}
+	size_t done = 0;
+	while (done < len) {
+		uint64_t at = offset + done;
+		int overlaid = image_overlaid(at / image_overlay_block_size);
+		uint64_t end = (at / image_overlay_block_size + 1) * image_overlay_block_size;
+		while (end < offset + len && image_overlaid(end / image_overlay_block_size) == overlaid) {
+			end += image_overlay_block_size;
+		}
+		size_t part = end - at < len - done ? end - at : len - done;
+		ssize_t got = overlaid ? pread_full(image_overlay_fd, (char*) buf + done, part, at)
+		                       : image_read_base((char*) buf + done, part, at);
+		if (got < 0) {
+			return done > 0 ? (ssize_t) done : got;
+		}
+		done += got;
+		if ((size_t) got < part) {
+			break;
+		}
+	}
+	return done;
+}
+
+/*
+* Read from one replica of the image. Repaired blocks and O_DIRECT only apply
+* to the image itself, other replicas are read with plain pread.
+*/
+static ssize_t image_read_replica(int replica, void* buf, size_t len, uint64_t offset) {
+	if (image_replicas == NULL) {
+		return image_read(buf, len, offset);
+	}
+	uint64_t started = replica_begin(image_replicas, replica);
+	ssize_t got = replica == 0 ? image_read(buf, len, offset)
+	                           : pread_full(image_replicas -> replicas[replica].fd, buf, len, offset);
+	replica_end(image_replicas, replica, started);
+	return got;
+}
+
+/*
+* A read only stdio stream over the reads of an image that is not one plain
+* file, for the code that reads metadata through a FILE*. The read callback
+* returns the bytes read, fewer only at the end, or a negative errno.
+*/
+typedef ssize_t (*image_stream_read_fn)(void* source, void* buf, size_t len, uint64_t offset);
+
+struct image_stream {
+	image_stream_read_fn read;
+	void* source;
+	uint64_t size;
+	uint64_t position;
+};
+
+static ssize_t image_stream_read(void* cookie, char* buf, size_t size) {
+	image_stream* stream = (image_stream*) cookie;
+	ssize_t got = stream -> read(stream -> source, buf, size, stream -> position);
+	if (got > 0) {
+		stream -> position += got;
+	}
+	return got < 0 ? -1 : got;
+}
+
+static int image_stream_seek(void* cookie, off64_t* offset, int whence) {
+	image_stream* stream = (image_stream*) cookie;
+	int64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (int64_t) stream -> position : (int64_t) stream -> size;
+	if (base + *offset < 0) {
+		return -1;
+	}
+	stream -> position = base + *offset;
+	*offset = stream -> position;
+	return 0;
+}
+
+static int image_stream_close(void* cookie) {
+	delete (image_stream*) cookie;
+	return 0;
+}
+
+static inline FILE* image_fopen(image_stream_read_fn read, void* source, uint64_t size) {
+	image_stream* stream = new image_stream;
+	stream -> read = read;
+	stream -> source = source;
+	stream -> size = size;
+	stream -> position = 0;
+	cookie_io_functions_t io = {image_stream_read, NULL, image_stream_seek, image_stream_close};
+	return fopencookie(stream, "r", io);
+}
+
+// The logical image of a striped image (shards.cpp)
+static inline FILE* shard_fopen(shard_set* set) {
+	return image_fopen([](void* source, void* buf, size_t len, uint64_t offset) {
+		return shard_read((shard_set*) source, buf, len, offset);
+	}, set, set -> geo.logical_size);
+}
+
+// The whole image of a split image, its data section read from the data file (splitImage.cpp)
+static inline FILE* split_fopen(split_files* files) {
+	return image_fopen([](void* source, void* buf, size_t len, uint64_t offset) {
+		return split_read((const split_files*) source, buf, len, offset);
+	}, files, files -> geo.image_size);
+}
@@ -0,0 +1,64 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "OnDiskStructure.h"
+#include "sha256Lanes.cpp"
+#include "blake2b.cpp"
+#include "blake3.cpp"
+
+/*
+* Keyed hash of the hash blocks, selected with master --hash and recorded in
+* superblock::hash_algorithm. Every algorithm produces a KEYED_HASH_SIZE byte
+* digest, so the layout of the hashes section does not depend on it.
+*
+* BLAKE2b takes the passphrase as its key, or the unkeyed BLAKE2b digest of it
+* when it is longer than BLAKE2B_KEY_LEN bytes. BLAKE3 is keyed with a key
+* derived from the passphrase under KEYED_HASH_BLAKE3_CONTEXT.
+*/
+
+#define KEYED_HASH_SIZE 32
+#define KEYED_HASH_BLAKE3_CONTEXT "WriteOnceFileSystem hash blocks v1"
+
+static const char* const hash_algorithm_names[HASH_ALGORITHM_COUNT] = {"hmac-sha256", "blake2b", "blake3"};
+
+static inline const char* hash_algorithm_name(uint64_t algorithm) {
+	return algorithm < HASH_ALGORITHM_COUNT ? hash_algorithm_names[algorithm] : "unknown";
+}
+
+// Algorithm called name, or HASH_ALGORITHM_COUNT if there is none
+static inline uint64_t hash_algorithm_named(const char* name) {
+	uint64_t algorithm = 0;
+	while (algorithm < HASH_ALGORITHM_COUNT && strcmp(name, hash_algorithm_names[algorithm]) != 0) {
+		algorithm++;
+	}
+	return algorithm;
+}
+
+/*
+* Keyed hash under key of count messages of length bytes each, the digest of
+* message i stored at out + KEYED_HASH_SIZE * i
+*/
+static inline void keyed_hash_many(uint64_t algorithm, const char* key, size_t key_length,
+                                   const unsigned char* const* messages, size_t count, uint64_t length,
+                                   unsigned char* out) {
+	if (algorithm == HASH_BLAKE2B) {
+		unsigned char short_key[BLAKE2B_OUT_LEN];
+		const unsigned char* k = (const unsigned char*) key;
+		if (key_length > BLAKE2B_KEY_LEN) {
+			blake2b_keyed(NULL, 0, k, key_length, short_key);
+			k = short_key;
+			key_length = sizeof(short_key);
+		}
+		for (size_t i = 0; i < count; i++) {
+			blake2b_keyed(k, key_length, messages[i], length, out + i * KEYED_HASH_SIZE);
+		}
+	} else if (algorithm == HASH_BLAKE3) {
+		unsigned char derived[BLAKE3_KEY_LEN];
+		blake3_derive_key(KEYED_HASH_BLAKE3_CONTEXT, (const unsigned char*) key, key_length, derived);
+		for (size_t i = 0; i < count; i++) {
+			blake3_keyed(derived, messages[i], length, out + i * KEYED_HASH_SIZE);
+		}
+	} else {
+		hmac_sha256_many(key, key_length, messages, count, length, out);
+	}
+}
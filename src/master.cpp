@@ -9,20 +9,34 @@
 #include <algorithm>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <endian.h>
 #include <stack>
 #include <queue>
+#include <map>
 #include <openssl/hmac.h>
 #include <cstddef>
 #include "../libraries/cxxopts.hpp"
 #include "OnDiskStructure.h"
-#include "../libraries/schifra/schifra_galois_field.hpp"
-#include "../libraries/schifra/schifra_sequential_root_generator_polynomial_creator.hpp"
-#include "../libraries/schifra/schifra_reed_solomon_encoder.hpp"
-#include "../libraries/schifra/schifra_reed_solomon_file_encoder.hpp"
-#include "config/decodeConstants.c"
+#include "ecc.cpp"
 #include "config/hashConstants.c"
+#include "config/compressionConstants.c"
+#include "config/chunkStoreConstants.c"
+#include "config/shardConstants.c"
 #include "requestKey.cpp"
+#include "compression.cpp"
+#include "superblock.cpp"
+#include "pathIndex.cpp"
+#include "searchIndex.cpp"
+#include "parity.cpp"
+#include "merkle.cpp"
+#include "keyedHash.cpp"
+#include "crc32c.cpp"
+#include "chunkStore.cpp"
+#include "metadata.cpp"
+#include "baseImage.cpp"
+#include "shards.cpp"
+#include "splitImage.cpp"
 
 
 int run(std::string, std::string, std::string);
@@ -32,9 +46,22 @@ static int s_builder(const char *, const struct stat *, int, struct FTW *);
 
 //Major structural methods defining each stage of the process, in order of thier usage
 int imageDFS(const std::string& out_filename, node* root);
-uint64_t writeDFS(node* node, FILE* output);
+uint64_t writeDFS(node* node, FILE* output, const std::string& parent = "");
+uint64_t writeCompact(node* root, FILE* output, s_blk* sb);
+void writeGrouped(node* dir, FILE* output, uint64_t dirOffset, const std::string& path);
+void writeHeader(node* node, FILE* output, uint64_t headerOffset, enum file_type type, uint64_t offset);
+void sortChildren(node* node);
+uint64_t writeFile(node* node, FILE* output, enum file_type* type);
+uint64_t writeCompressed(node* node, FILE* output, uint64_t payload_off);
+uint64_t writeChunked(node* node, FILE* output, uint64_t payload_off);
+int loadBase(const std::string& base_name);
 int hashAndAppend(const char*, const char*);
-int addReedSolomon(std::string ifs, std::string ofs);
+int writeShards(const std::string& image_name, const std::string& wofs_filename, const char* key);
+int writeSplit(const std::string& image_name, const std::string& wofs_filename, const char* key);
+int merkleAndAppend(const char*, const char*);
+int writeCrcTable(const char*);
+int addReedSolomon(std::string ifs, std::string ofs, std::size_t fec_length);
+int addParity(const std::string& ifn, const std::string& ofn, std::size_t fec_length, uint64_t interleave);
 
 // Helper Methods
 std::string parse_name(const std::string& path_name);
@@ -51,6 +78,32 @@ static uint64_t file_off;
 //Arbitrary constant required by the transversal software
 const int MAX_METADATA = 2000;
 static unsigned long HASH_BLOCK_SIZE = DEF_HASH_BLOCK_SIZE;
+static unsigned long COMPRESSION_CHUNK_SIZE = DEF_COMPRESSION_CHUNK_SIZE;
+static uint64_t raw_data_bytes = 0;     // file bytes read from the source tree
+static uint64_t stored_data_bytes = 0;  // file bytes written to the data section
+static unsigned long ALIGNMENT = 0;     // payload alignment, 0 packs payloads back to back
+static unsigned long ALIGN_THRESHOLD = 0;
+static uint64_t padding_bytes = 0;      // bytes spent aligning payloads
+static std::string CHUNK_STORE;         // chunk store directory, empty to keep payloads in the image
+static cdc_params CDC = cdc_params_of(DEF_CDC_AVERAGE);
+static uint64_t chunked_bytes = 0;      // file bytes put in the chunk store
+static uint64_t chunk_count = 0;        // chunks they were cut into
+static uint64_t new_chunks = 0;         // chunks the store did not hold yet
+static uint64_t new_chunk_bytes = 0;
+
+// Delta images: files of the base image by path below the root, see baseImage.cpp
+struct base_file {
+  uint32_t type;
+  uint64_t length;
+  uint64_t time;
+  uint64_t offset;
+};
+static std::string BASE_IMAGE;          // base image of a delta, empty for a full image
+static std::string SOURCE_ROOT;         // directory being mastered, stripped from paths to match the base
+static std::map<std::string, base_file> base_files;
+static unsigned char base_id[BASE_ID_SIZE];
+static uint64_t base_file_count = 0;    // files referenced in the base instead of written
+static uint64_t base_bytes = 0;
 
 //global variables for transversal
 int metadataPointer = 0;
@@ -58,6 +111,26 @@ int header_count = 0;
 int subitems_count = 0;
 std::stack<node> directories;
 int ECC = 1;
+static unsigned long FEC = FEC_LENGTH;  // Reed Solomon parity symbols per 255 byte codeword
+int SEPARATE_PARITY = 0;  // ECC layout: parity in a region after the image instead of interleaved
+static unsigned long INTERLEAVE = 1;    // codewords interleaved per group of the parity region
+int COMPRESS = 0;
+int COMPACT = 0;
+int SORTED = 0;
+int PATH_INDEX = 0;
+int SEARCH_INDEX = 0;   // trigram index over full paths for substring and glob searches
+int MERKLE = 0;     // Merkle tree instead of one HMAC per hash block
+uint64_t HASH_ALGORITHM = HASH_HMAC_SHA256;   // keyed hash of the flat hash list (keyedHash.cpp)
+static unsigned long CRC_BLOCK_SIZE = 0;    // bytes per CRC32C of the CRC table, 0 without one
+int GROUPED = 0;    // header layout: children of a directory stored next to each other
+static unsigned long SHARDS = 0;        // shard files of a striped image, 0 for one image file
+static unsigned long STRIPE_UNIT = DEF_STRIPE_UNIT;
+static std::string SHARD_DIRS;          // colon separated directories the shards are dealt to
+static int SPLIT = 0;                   // payloads in a data file next to the image
+
+// full path and header location of every entry, collected for the path and search indexes
+std::vector<std::string> index_paths;
+std::vector<uint64_t> index_locations;
 
 int main(int argc, char **argv){
 
@@ -68,6 +141,29 @@ int main(int argc, char **argv){
     ("o,output", "Name of output filename", cxxopts::value<std::string>())
     ("p,path", "relative path to directory to master", cxxopts::value<std::string>())
     ("n,necc", "No ECC codes")
+    ("c,compress", "Compress file payloads in independent chunks")
+    ("chunk-size", "Uncompressed bytes per compressed chunk", cxxopts::value<unsigned long>())
+    ("compact", "Write an inode table and name heap instead of fixed size headers")
+    ("sorted", "Sort the children of every directory by name")
+    ("path-index", "Add a perfect hash index from full paths to headers")
+    ("search-index", "Add a trigram index over full paths for substring and glob searches")
+    ("merkle", "Store a keyed Merkle tree over the hash blocks instead of one HMAC per block")
+    ("hash", "Keyed hash of the hash blocks: hmac-sha256 (default), blake2b or blake3", cxxopts::value<std::string>())
+    ("chunk-store", "Put file payloads in this shared content defined chunk store", cxxopts::value<std::string>())
+    ("cdc-average", "Average bytes per chunk of the chunk store (power of two, default 8192)", cxxopts::value<unsigned long>())
+    ("base", "Master a delta image storing only files that differ from this base image", cxxopts::value<std::string>())
+    ("shards", "Stripe the image over this many files, each with its own hashes and ECC", cxxopts::value<unsigned long>())
+    ("stripe-unit", "Bytes per stripe unit of --shards (power of two, default 65536)", cxxopts::value<unsigned long>())
+    ("shard-dirs", "Colon separated directories to put the shards in, in turn", cxxopts::value<std::string>())
+    ("split", "Write the file payloads to a data file of their own")
+    ("crc", "Add a CRC32C table the mounter checks every read against")
+    ("crc-block", "Bytes per CRC32C of the table (power of two, default 4096)", cxxopts::value<unsigned long>())
+    ("fec", "Reed Solomon parity bytes per 255 byte codeword: 8, 16, 32 or 64", cxxopts::value<unsigned long>())
+    ("interleave", "Codewords interleaved per group of the parity region (power of two up to 4096)", cxxopts::value<unsigned long>())
+    ("ecc-layout", "ECC layout: interleaved (default) or separate", cxxopts::value<std::string>())
+    ("layout", "Header layout: dfs (default) or grouped", cxxopts::value<std::string>())
+    ("align", "Start file payloads on a multiple of this many bytes", cxxopts::value<unsigned long>())
+    ("align-threshold", "Only align payloads of at least this many bytes", cxxopts::value<unsigned long>())
     ("h,help", "Show help")
     ;
     options.parse(argc, argv);
@@ -95,6 +191,143 @@ int main(int argc, char **argv){
       ECC =0;
     }
 
+    COMPRESS = options.count("compress") == 1;
+    COMPACT = options.count("compact") == 1;
+    SORTED = options.count("sorted") == 1;
+    PATH_INDEX = options.count("path-index") == 1;
+    SEARCH_INDEX = options.count("search-index") == 1;
+    MERKLE = options.count("merkle") == 1;
+    if (options.count("hash")==1) {
+      HASH_ALGORITHM = hash_algorithm_named(options["hash"].as<std::string>().c_str());
+      if (HASH_ALGORITHM == HASH_ALGORITHM_COUNT) {
+        std::cout << "Hash must be hmac-sha256, blake2b or blake3" << std::endl;
+        return 0;
+      }
+      if (MERKLE && HASH_ALGORITHM != HASH_HMAC_SHA256) {
+        std::cout << "The Merkle tree is built with SHA-256, --hash only applies without --merkle" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("chunk-store")==1) {
+      CHUNK_STORE = options["chunk-store"].as<std::string>();
+      struct stat store_st;
+      if (mkdir(CHUNK_STORE.c_str(), 0755) != 0 && (stat(CHUNK_STORE.c_str(), &store_st) != 0 || !S_ISDIR(store_st.st_mode))) {
+        std::cout << "Unable to use " << CHUNK_STORE << " as a chunk store" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("cdc-average")==1) {
+      unsigned long average = options["cdc-average"].as<unsigned long>();
+      if (CHUNK_STORE.empty() || !cdc_average_supported(average)) {
+        std::cout << "Chunk average needs --chunk-store and a power of two from " << CDC_MIN_AVERAGE
+                  << " to " << CDC_MAX_AVERAGE << std::endl;
+        return 0;
+      }
+      CDC = cdc_params_of(average);
+    }
+    if (options.count("base")==1) {
+      BASE_IMAGE = options["base"].as<std::string>();
+      if (loadBase(BASE_IMAGE) != 0) {
+        return 0;
+      }
+    }
+    if (options.count("crc")==1) {
+      CRC_BLOCK_SIZE = DEF_CRC_BLOCK_SIZE;
+    }
+    if (options.count("crc-block")==1) {
+      CRC_BLOCK_SIZE = options["crc-block"].as<unsigned long>();
+      if (options.count("crc")!=1 || CRC_BLOCK_SIZE < 512 || (CRC_BLOCK_SIZE & (CRC_BLOCK_SIZE - 1)) != 0) {
+        std::cout << "CRC block size needs --crc and a power of two of at least 512" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("fec")==1) {
+      FEC = options["fec"].as<unsigned long>();
+      if (!ecc_fec_supported(FEC)) {
+        std::cout << "Parity length must be 8, 16, 32 or 64" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("ecc-layout")==1) {
+      std::string layout = options["ecc-layout"].as<std::string>();
+      if (layout != "interleaved" && layout != "separate") {
+        std::cout << "ECC layout must be interleaved or separate" << std::endl;
+        return 0;
+      }
+      SEPARATE_PARITY = layout == "separate";
+    }
+    if (options.count("interleave")==1) {
+      INTERLEAVE = options["interleave"].as<unsigned long>();
+      if (!SEPARATE_PARITY || !parity_interleave_supported(INTERLEAVE)) {
+        std::cout << "Interleave needs --ecc-layout=separate and a power of two up to 4096" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("layout")==1) {
+      std::string layout = options["layout"].as<std::string>();
+      if (layout != "dfs" && layout != "grouped") {
+        std::cout << "Layout must be dfs or grouped" << std::endl;
+        return 0;
+      }
+      GROUPED = layout == "grouped";
+    }
+    if (options.count("align")==1) {
+      ALIGNMENT = options["align"].as<unsigned long>();
+      if (ALIGNMENT == 0 || (ALIGNMENT & (ALIGNMENT - 1)) != 0) {
+        std::cout << "Alignment must be a power of two" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("align-threshold")==1) {
+      ALIGN_THRESHOLD = options["align-threshold"].as<unsigned long>();
+      if (ALIGNMENT == 0) {
+        std::cout << "Align threshold needs --align" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("shards")==1) {
+      SHARDS = options["shards"].as<unsigned long>();
+      if (!shard_count_supported(SHARDS)) {
+        std::cout << "Shards must be from 2 to " << SHARD_MAX_COUNT << std::endl;
+        return 0;
+      }
+      if (MERKLE || CRC_BLOCK_SIZE || SEPARATE_PARITY) {
+        std::cout << "Shards carry their own hashes and interleaved ECC, not with --merkle, --crc or --ecc-layout=separate"
+                  << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("stripe-unit")==1) {
+      STRIPE_UNIT = options["stripe-unit"].as<unsigned long>();
+      if (!SHARDS || !shard_unit_supported(STRIPE_UNIT)) {
+        std::cout << "Stripe unit needs --shards and a power of two from " << SHARD_MIN_UNIT << " to " << SHARD_MAX_UNIT
+                  << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("shard-dirs")==1) {
+      SHARD_DIRS = options["shard-dirs"].as<std::string>();
+      if (!SHARDS) {
+        std::cout << "Shard directories need --shards" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("split")==1) {
+      SPLIT = 1;
+      if (SHARDS || MERKLE || CRC_BLOCK_SIZE || SEPARATE_PARITY) {
+        std::cout << "The image and data files carry their own hashes and interleaved ECC, not with --shards, --merkle,"
+                  << " --crc or --ecc-layout=separate" << std::endl;
+        return 0;
+      }
+    }
+    if (options.count("chunk-size")==1) {
+      COMPRESSION_CHUNK_SIZE = options["chunk-size"].as<unsigned long>();
+      if (!COMPRESS || COMPRESSION_CHUNK_SIZE == 0 || COMPRESSION_CHUNK_SIZE > UINT32_MAX) {
+        std::cout << "Chunk size needs --compress and a size between 1 and " << UINT32_MAX << std::endl;
+        return 0;
+      }
+    }
+
     int min_key_length = 4;
     const char* key =  get_key_from_user();
     while (strlen(key) < min_key_length) {
@@ -129,6 +362,50 @@ void display_help(const char* progname){
          "\n"
          "    --necc               Turns ECC off (optional flag)"
          "\n"
+         "    --compress           Compress file payloads (optional flag)"
+         "\n"
+         "    --chunk-size=<n>     Bytes per compressed chunk (default 65536)"
+         "\n"
+         "    --compact            Compact metadata format (optional flag)"
+         "\n"
+         "    --sorted             Sort directory entries by name (optional flag)"
+         "\n"
+         "    --path-index         Add a full path index (optional flag)"
+         "\n"
+         "    --merkle             Merkle tree integrity, blocks verify on their own (optional flag)"
+         "\n"
+         "    --hash=<s>           Keyed hash of each block, hmac-sha256 (default), blake2b or blake3"
+         "\n"
+         "    --chunk-store=<s>    Put file payloads in a shared chunk store directory"
+         "\n"
+         "    --cdc-average=<n>    Average bytes per chunk of the store (default 8192)"
+         "\n"
+         "    --base=<s>           Master a delta against this base image"
+         "\n"
+         "    --shards=<n>         Stripe the image over n files (optional)"
+         "\n"
+         "    --stripe-unit=<n>    Bytes per stripe unit of the shards (default 65536)"
+         "\n"
+         "    --shard-dirs=<s>     Colon separated directories for the shards"
+         "\n"
+         "    --split              Write file payloads to <out>.data, apart from the metadata"
+         "\n"
+         "    --crc                Add a CRC32C table checked on every read (optional flag)"
+         "\n"
+         "    --crc-block=<n>      Bytes per CRC32C of the table (default 4096)"
+         "\n"
+         "    --fec=<n>            Reed Solomon parity bytes per codeword (default 32)"
+         "\n"
+         "    --ecc-layout=<s>     ECC layout, interleaved or separate"
+         "\n"
+         "    --interleave=<n>     Codewords interleaved per parity group (separate layout)"
+         "\n"
+         "    --layout=<s>         Header layout, dfs or grouped"
+         "\n"
+         "    --align=<n>          Align file payloads to n bytes, e.g. 4096"
+         "\n"
+         "    --align-threshold=<n> Only align payloads of at least n bytes"
+         "\n"
          "    --help               Show help"
          "\n");
 }
@@ -160,6 +437,7 @@ int run(std::string root_directory, std::string wofs_filename, std::string key){
   // max number of directories that can be used
 
   // flags to specialize usage, we aren't using any right now
+  SOURCE_ROOT = root_directory;
   int result =  nftw(root_directory.c_str(), s_builder, MAX_METADATA, 0);
 
   //iterate to real root
@@ -174,15 +452,51 @@ int run(std::string root_directory, std::string wofs_filename, std::string key){
   << '\"' << pre_filename << '\"'
   << std::endl;
   node* r = &root;
+  if (SORTED) {
+    sortChildren(r);
+  }
   int imageStatus = imageDFS(pre_filename, r);
-  std::cout << "Appending Sha256 Hash using Key" << "\n";
-  int hashStatus = hashAndAppend(pre_filename.c_str(), key.c_str());
+  if (COMPRESS && raw_data_bytes > 0) {
+    printf("Compressed %llu bytes of file data to %llu bytes (ratio %.2f)\n",
+           (unsigned long long) raw_data_bytes, (unsigned long long) stored_data_bytes,
+           (double) raw_data_bytes / stored_data_bytes);
+  }
+  if (!CHUNK_STORE.empty() && chunked_bytes > 0) {
+    printf("Cut %llu bytes of file data into %llu chunks, %llu new (%llu bytes added to %s)\n",
+           (unsigned long long) chunked_bytes, (unsigned long long) chunk_count,
+           (unsigned long long) new_chunks, (unsigned long long) new_chunk_bytes, CHUNK_STORE.c_str());
+  }
+  if (!BASE_IMAGE.empty()) {
+    printf("Referenced %llu unchanged files (%llu bytes) in the base image, wrote %llu bytes of file data\n",
+           (unsigned long long) base_file_count, (unsigned long long) base_bytes,
+           (unsigned long long) (raw_data_bytes - base_bytes));
+  }
+  if (ALIGNMENT) {
+    struct stat image_st;
+    stat(pre_filename.c_str(), &image_st);
+    printf("Aligning payloads to %lu bytes added %llu bytes of padding (%.2f%% of the image)\n",
+           ALIGNMENT, (unsigned long long) padding_bytes, 100.0 * padding_bytes / image_st.st_size);
+  }
+  if (CRC_BLOCK_SIZE) {
+    std::cout << "Writing CRC32C table of " << CRC_BLOCK_SIZE << " byte blocks" << std::endl;
+    writeCrcTable(pre_filename.c_str());
+  }
+  if (SHARDS) {
+    return writeShards(pre_filename, wofs_filename, key.c_str());
+  }
+  if (SPLIT) {
+    return writeSplit(pre_filename, wofs_filename, key.c_str());
+  }
+  std::cout << "Appending " << (MERKLE ? "Merkle tree" : hash_algorithm_name(HASH_ALGORITHM)) << " hashes using Key" << "\n";
+  int hashStatus = MERKLE ? merkleAndAppend(pre_filename.c_str(), key.c_str())
+                         : hashAndAppend(pre_filename.c_str(), key.c_str());
   if (ECC) {
     std::cout << "Applying error correcting codes to "
      << '\"' << pre_filename << '\"'
      << " to create "
      << '\"' << wofs_filename << '\"' << std::endl;
-    int reedSolomonStatus = addReedSolomon(pre_filename,wofs_filename);
+    int reedSolomonStatus = SEPARATE_PARITY ? addParity(pre_filename, wofs_filename, FEC, INTERLEAVE)
+                                            : addReedSolomon(pre_filename, wofs_filename, FEC);
   }
   return 0;
 }
@@ -361,15 +675,115 @@ std::string space_pad(const std::string& s) {
 }
 
 int imageDFS(const std::string& out_filename, node* root) {
-  header_off = 0;
-  file_off = find_header_size();
-
   FILE *output;
   output = fopen(out_filename.c_str(), "wb");
 
-  writeDFS(root, output);
-  fclose(output);
+  s_blk sb;
+  memset(&sb, 0, sizeof(sb));
+  uint64_t data_start;
+  if (COMPACT) {
+    data_start = writeCompact(root, output, &sb);
+  } else {
+    data_start = SUPERBLOCK_SIZE + find_header_size();
+    header_off = SUPERBLOCK_SIZE;
+    file_off = data_start;
+    if (GROUPED) {
+      header_off += M_HDR_SIZE;
+      writeGrouped(root, output, SUPERBLOCK_SIZE, std::string("/") + root->data->name);
+    } else {
+      writeDFS(root, output);
+    }
+    sb.sections[SECTION_METADATA].offset = SUPERBLOCK_SIZE;
+    sb.sections[SECTION_METADATA].length = data_start - SUPERBLOCK_SIZE;
+  }
+  uint64_t data_end = file_off;
+
+  if (PATH_INDEX) {
+    std::vector<unsigned char> index = build_path_index(index_paths, index_locations);
+    if (index.empty()) {
+      std::cout << "Unable to build the path index, continuing without it" << std::endl;
+    } else {
+      fseek(output, file_off, SEEK_SET);
+      fwrite(&index[0], 1, index.size(), output);
+      sb.sections[SECTION_PATH_INDEX].offset = file_off;
+      sb.sections[SECTION_PATH_INDEX].length = index.size();
+      file_off += index.size();
+    }
+  }
+
+  if (SEARCH_INDEX) {
+    std::vector<unsigned char> search = build_search_index(index_paths);
+    fseek(output, file_off, SEEK_SET);
+    fwrite(&search[0], 1, search.size(), output);
+    sb.sections[SECTION_SEARCH].offset = file_off;
+    sb.sections[SECTION_SEARCH].length = search.size();
+    file_off += search.size();
+  }
 
+  // Room for the CRC table, filled in by writeCrcTable once the superblock is final
+  if (CRC_BLOCK_SIZE) {
+    uint64_t crc_count = (file_off + CRC_BLOCK_SIZE - 1) / CRC_BLOCK_SIZE;
+    sb.sections[SECTION_CRC].offset = file_off;
+    sb.sections[SECTION_CRC].length = crc_count * sizeof(uint32_t);
+    sb.crc_block_size = CRC_BLOCK_SIZE;
+    file_off += crc_count * sizeof(uint32_t);
+  }
+
+  // Hashes cover the whole image in front of them, see hashAndAppend and merkleAndAppend
+  uint64_t image_size = file_off;
+  uint64_t hash_block_size = HASH_BLOCK_SIZE > image_size ? image_size : HASH_BLOCK_SIZE;
+  uint64_t hash_count = (image_size + hash_block_size - 1) / hash_block_size;
+  uint64_t hashes_length = MERKLE ? merkle_section_length(hash_count) : hash_count * 32;
+  if (SPLIT) {
+    // the image file without the data section is hashed on its own, see writeSplit
+    uint64_t split_size = image_size - (data_end - data_start);
+    hash_block_size = HASH_BLOCK_SIZE > split_size ? split_size : HASH_BLOCK_SIZE;
+    hash_count = hash_block_size > 0 ? (split_size + hash_block_size - 1) / hash_block_size : 0;
+    hashes_length = hash_count * 32;
+    image_size = split_size;
+    sb.features |= FEATURE_SPLIT_DATA;
+  }
+  if (SHARDS) {
+    hashes_length = 0;  // each shard is hashed on its own, see writeShards
+    sb.features |= FEATURE_STRIPED;
+    sb.shard_count = SHARDS;
+    sb.stripe_unit = STRIPE_UNIT;
+  }
+
+  sb.magic = WOFS_MAGIC;
+  sb.version = WOFS_VERSION;
+  sb.features |= COMPRESS ? FEATURE_COMPRESSION : 0;
+  sb.features |= SORTED ? FEATURE_SORTED_DIRS : 0;
+  sb.features |= MERKLE ? FEATURE_MERKLE_HASHES : 0;
+  sb.features |= CHUNK_STORE.empty() ? 0 : FEATURE_CHUNK_STORE;
+  sb.features |= BASE_IMAGE.empty() ? 0 : FEATURE_BASE_IMAGE;
+  memcpy(sb.base_id, base_id, BASE_ID_SIZE);
+  sb.field_descriptor = FIELD_DESCRIPTOR;
+  sb.code_length = CODE_LENGTH;
+  sb.fec_length = FEC;
+  sb.gen_poly_index = GEN_POLY_INDEX;
+  sb.hash_block_size = HASH_BLOCK_SIZE;
+  sb.entry_count = header_count;
+  sb.data_alignment = ALIGNMENT;
+  sb.align_threshold = ALIGNMENT ? ALIGN_THRESHOLD : 0;
+  sb.hash_algorithm = HASH_ALGORITHM;
+  sb.sections[SECTION_DATA].offset = data_start;
+  sb.sections[SECTION_DATA].length = data_end - data_start;
+  sb.sections[SECTION_HASHES].offset = image_size;
+  sb.sections[SECTION_HASHES].length = hashes_length;
+  if (ECC && SEPARATE_PARITY) {
+    uint64_t protected_size = image_size + hashes_length;
+    sb.sections[SECTION_PARITY].offset = protected_size;
+    sb.sections[SECTION_PARITY].length = parity_length(protected_size, FEC);
+    sb.parity_interleave = INTERLEAVE;
+  }
+  write_superblock(output, &sb);
+
+  // a file that did not compress is rewritten in place and can leave a stale tail
+  fflush(output);
+  ftruncate(fileno(output), file_off);
+  fclose(output);
+  return 0;
 }
 
 int hashAndAppend(const char* file_name, const char* key){
@@ -384,81 +798,397 @@ int hashAndAppend(const char* file_name, const char* key){
   if (HASH_BLOCK_SIZE > file_size) {
     HASH_BLOCK_SIZE = file_size;
   }
-  int block_size = HASH_BLOCK_SIZE;
-  long remaining = file_size;
-  uint32_t number_hashes = 0;
-  // malloc a buffer for the data- may be large
-  int hash_size = 32;
+  uint64_t block_size = HASH_BLOCK_SIZE;
+  uint64_t hash_count = (file_size + block_size - 1) / block_size;
+  int hash_size = KEYED_HASH_SIZE;
+
+  // Blocks are hashed a batch at a time, HMAC-SHA256 side by side (keyedHash.cpp)
+  std::vector<unsigned char> buffer(block_size * SHA256_MAX_LANES);
+  std::vector<unsigned char> digests(hash_size * SHA256_MAX_LANES);
+  for (uint64_t first = 0; first < hash_count; first += SHA256_MAX_LANES) {
+    uint64_t count = hash_count - first < SHA256_MAX_LANES ? hash_count - first : SHA256_MAX_LANES;
+    uint64_t offset = first * block_size;
+    uint64_t length = file_size - offset < count * block_size ? file_size - offset : count * block_size;
+    fseek(fp, offset, SEEK_SET);
+    fread(&buffer[0], sizeof(char), length, fp);
+
+    const unsigned char* blocks[SHA256_MAX_LANES];
+    for (uint64_t i = 0; i < count; i++) {
+      blocks[i] = &buffer[i * block_size];
+    }
+    // only the last block of the image can be short
+    uint64_t full = length / block_size;
+    keyed_hash_many(HASH_ALGORITHM, key, strlen(key), blocks, full, block_size, &digests[0]);
+    if (full < count) {
+      keyed_hash_many(HASH_ALGORITHM, key, strlen(key), blocks + full, 1, length % block_size,
+                      &digests[full * hash_size]);
+    }
 
-  while (remaining > 0) {
-    number_hashes = number_hashes + 1;
-    int data_location = (number_hashes-1) * HASH_BLOCK_SIZE;
-    fseek(fp, data_location, SEEK_SET);
+    // Append the Hashes to the file
+    fwrite(&digests[0], sizeof(char), count * hash_size, fp);
+  }
 
-    unsigned char buffer[block_size];
-    int bytes_read = fread(buffer, sizeof(char), block_size, fp);
+  // The hash section is located through the superblock
+  fclose (fp);
 
-    // make the hash Hash
-    unsigned char* digest;
-    digest = HMAC(EVP_sha256(), key, strlen(key), buffer, block_size, NULL, NULL);
+  return 0;
+}
 
-    // Append the Hash to the file
-    fwrite (digest, sizeof(char), hash_size, fp);
+/*
+* Collect the files of the base image of a delta by their path below its root,
+* and its id. The base is checked against its hashes when the delta is mounted.
+*/
+static void collectBaseFiles(FILE* fp, const s_blk* sb, const m_hdr* dir, const std::string& path) {
+  m_hdr* children;
+  int64_t count = meta_list(fp, sb, dir, &children);
+  for (int64_t i = 0; i < count; i++) {
+    std::string child_path = path + "/" + children[i].name;
+    if (children[i].type == DIRECTORY) {
+      collectBaseFiles(fp, sb, &children[i], child_path);
+    } else if (is_file(children[i].type)) {
+      base_file file = {children[i].type, children[i].length, children[i].time, children[i].offset};
+      base_files[child_path] = file;
+    }
+  }
+  free(children);
+}
 
-    remaining = remaining - block_size;
-    if (block_size > remaining) {
-      block_size = remaining;
+int loadBase(const std::string& base_name) {
+  FILE* fp = fopen(base_name.c_str(), "rb");
+  s_blk sb;
+  int status = fp == NULL ? SB_SHORT : read_superblock(fp, &sb);
+  if (status != SB_OK || !base_image_usable(fp, &sb) || base_image_id(fp, &sb, base_id) != 0) {
+    std::cout << "Unable to use " << base_name << " as a base image, it must be a full image readable in place"
+              << " (the .necc image, --ecc-layout=separate or a .rec)" << std::endl;
+    if (fp != NULL) {
+      fclose(fp);
     }
+    return 1;
   }
+  m_hdr* root = meta_root(fp, &sb);
+  collectBaseFiles(fp, &sb, root, "");
+  free(root);
+  fclose(fp);
+  std::cout << "Base image " << base_name << " holds " << base_files.size() << " files" << std::endl;
+  return 0;
+}
 
-  // Write the number of hashes generated and close the file
-  write32(number_hashes, fp);
-  fclose (fp);
+/*
+* Deal the stripe units of the image round robin to the shard files (see
+* shards.cpp), then append the hashes of each shard and apply ECC to it
+*/
+int writeShards(const std::string& image_name, const std::string& wofs_filename, const char* key) {
+  struct stat st;
+  stat(image_name.c_str(), &st);
+  shard_geometry geo = {(uint64_t) st.st_size, STRIPE_UNIT, SHARDS};
+  if (geo.logical_size <= (geo.count - 1) * geo.unit) {
+    std::cout << "Error - The image is too small for " << SHARDS << " shards of " << STRIPE_UNIT << " byte units" << std::endl;
+    remove(image_name.c_str());
+    return 1;
+  }
 
+  FILE* in = fopen(image_name.c_str(), "rb");
+  std::vector<FILE*> shards(geo.count);
+  std::vector<std::string> names(geo.count);
+  for (uint64_t k = 0; k < geo.count; k++) {
+    names[k] = shard_name(wofs_filename + ".0.necc", k, SHARD_DIRS);
+    shards[k] = fopen(names[k].c_str(), "wb");
+    if (shards[k] == NULL) {
+      std::cout << "Error - Unable to open " << names[k] << std::endl;
+      for (uint64_t j = 0; j < k; j++) {
+        fclose(shards[j]);
+        remove(names[j].c_str());
+      }
+      if (in != NULL) {
+        fclose(in);
+      }
+      remove(image_name.c_str());
+      return 1;
+    }
+  }
+  std::cout << "Striping the image over " << geo.count << " shards of " << STRIPE_UNIT << " byte units" << std::endl;
+  std::vector<char> unit(geo.unit);
+  size_t bytes;
+  for (uint64_t u = 0; in != NULL && (bytes = fread(&unit[0], 1, unit.size(), in)) > 0; u++) {
+    fwrite(&unit[0], 1, bytes, shards[u % geo.count]);
+  }
+  for (uint64_t k = 0; k < geo.count; k++) {
+    fclose(shards[k]);
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  remove(image_name.c_str());
+
+  // hashAndAppend shortens the hash block to a shard smaller than it, per shard
+  unsigned long block_size = HASH_BLOCK_SIZE;
+  for (uint64_t k = 0; k < geo.count; k++) {
+    std::cout << "Appending " << hash_algorithm_name(HASH_ALGORITHM) << " hashes of " << names[k] << std::endl;
+    HASH_BLOCK_SIZE = block_size;
+    hashAndAppend(names[k].c_str(), key);
+    if (ECC) {
+      std::string ecc_name = shard_name(wofs_filename + ".0", k, SHARD_DIRS);
+      std::cout << "Applying error correcting codes to " << '\"' << ecc_name << '\"' << std::endl;
+      addReedSolomon(names[k], ecc_name, FEC);
+    }
+  }
   return 0;
 }
 
-int addReedSolomon(std::string ifn, std::string ofn){
-  //Code taken from Schifra example
-   const std::size_t field_descriptor    = FIELD_DESCRIPTOR;
-   const std::size_t gen_poly_index      = GEN_POLY_INDEX;
-   const std::size_t gen_poly_root_count = ROOT_COUNT;
-   const std::size_t code_length         = CODE_LENGTH;
-   const std::size_t fec_length          =   FEC_LENGTH;
-   const std::string input_file_name     = ifn;
-   const std::string output_file_name    = ofn;
-
-   typedef schifra::reed_solomon::encoder<code_length,fec_length> encoder_t;
-   typedef schifra::reed_solomon::file_encoder<code_length,fec_length> file_encoder_t;
-
-   const schifra::galois::field field(field_descriptor,
-                                      schifra::galois::primitive_polynomial_size06,
-                                      schifra::galois::primitive_polynomial06);
-
-   schifra::galois::field_polynomial generator_polynomial(field);
-
-   if (
-        !schifra::make_sequential_root_generator_polynomial(field,
-                                                            gen_poly_index,
-                                                            gen_poly_root_count,
-                                                            generator_polynomial)
-      )
-   {
-      std::cout << "Error - Failed to create sequential root generator!" << std::endl;
-      return 1;
-   }
+/*
+* Move the data section of the image to its data file (see splitImage.cpp),
+* append the hashes of the data file and record its id in the superblock,
+* then hash the rest of the image and apply ECC to both files
+*/
+int writeSplit(const std::string& image_name, const std::string& wofs_filename, const char* key) {
+  FILE* in = fopen(image_name.c_str(), "rb");
+  s_blk sb;
+  if (in == NULL || read_superblock(in, &sb) != SB_OK) {
+    std::cout << "Error - Unable to read back " << image_name << std::endl;
+    if (in != NULL) {
+      fclose(in);
+    }
+    return 1;
+  }
+  const section_entry data = sb.sections[SECTION_DATA];
+  if (data.length == 0) {
+    std::cout << "Error - There is no file data to split from the image" << std::endl;
+    fclose(in);
+    remove(image_name.c_str());
+    return 1;
+  }
+  std::string data_name = split_data_name(image_name);
+  std::string rest_name = image_name + ".rest";
+  FILE* data_out = fopen(data_name.c_str(), "wb");
+  FILE* rest_out = fopen(rest_name.c_str(), "wb");
+  if (data_out == NULL || rest_out == NULL) {
+    std::cout << "Error - Unable to open " << (data_out == NULL ? data_name : rest_name) << std::endl;
+    if (data_out != NULL) {
+      fclose(data_out);
+      remove(data_name.c_str());
+    }
+    if (rest_out != NULL) {
+      fclose(rest_out);
+      remove(rest_name.c_str());
+    }
+    fclose(in);
+    remove(image_name.c_str());
+    return 1;
+  }
+  std::cout << "Writing " << data.length << " bytes of file data to " << '\"' << data_name << '\"' << std::endl;
+  std::vector<char> buffer(1 << 20);
+  uint64_t at = 0;
+  size_t bytes;
+  fseek(in, 0, SEEK_SET);
+  while ((bytes = fread(&buffer[0], 1, buffer.size(), in)) > 0) {
+    for (size_t i = 0; i < bytes;) {
+      uint64_t end = at < data.offset ? data.offset : at < data.offset + data.length ? data.offset + data.length : UINT64_MAX;
+      size_t part = end - at < bytes - i ? end - at : bytes - i;
+      fwrite(&buffer[i], 1, part, at >= data.offset && at < data.offset + data.length ? data_out : rest_out);
+      at += part;
+      i += part;
+    }
+  }
+  fclose(in);
+  fclose(data_out);
+  fclose(rest_out);
+  rename(rest_name.c_str(), image_name.c_str());
+
+  // hashAndAppend shortens the hash block to a file smaller than it, per file
+  unsigned long block_size = HASH_BLOCK_SIZE;
+  std::cout << "Appending " << hash_algorithm_name(HASH_ALGORITHM) << " hashes of " << data_name << std::endl;
+  hashAndAppend(data_name.c_str(), key);
+  HASH_BLOCK_SIZE = block_size;
+
+  s_blk data_sb = sb;
+  uint64_t data_block = sb.hash_block_size < data.length ? sb.hash_block_size : data.length;
+  data_sb.sections[SECTION_HASHES].offset = data.length;
+  data_sb.sections[SECTION_HASHES].length = (data.length + data_block - 1) / data_block * KEYED_HASH_SIZE;
+  FILE* fp = fopen(data_name.c_str(), "rb");
+  int identified = fp != NULL && base_image_id(fp, &data_sb, sb.data_id) == 0;
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  fp = fopen(image_name.c_str(), "r+b");
+  if (!identified || fp == NULL || write_superblock(fp, &sb) != SB_OK) {
+    std::cout << "Error - Unable to link " << image_name << " to its data file" << std::endl;
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    remove(data_name.c_str());
+    remove(image_name.c_str());
+    return 1;
+  }
+  fclose(fp);
 
-   const encoder_t rs_encoder(field,generator_polynomial);
+  std::cout << "Appending " << hash_algorithm_name(HASH_ALGORITHM) << " hashes using Key" << std::endl;
+  hashAndAppend(image_name.c_str(), key);
+  if (ECC) {
+    std::cout << "Applying error correcting codes to " << '\"' << image_name << '\"' << " and "
+              << '\"' << data_name << '\"' << std::endl;
+    addReedSolomon(image_name, wofs_filename, FEC);
+    addReedSolomon(data_name, split_data_name(wofs_filename), FEC);
+  }
+  return 0;
+}
 
-   file_encoder_t(rs_encoder, input_file_name, output_file_name);
+/*
+* Fill in the CRC section reserved by imageDFS: the CRC32C of every
+* CRC_BLOCK_SIZE bytes in front of it, big endian
+*/
+int writeCrcTable(const char* file_name){
+
+  FILE* fp = fopen(file_name, "r+b");
+  s_blk sb;
+  if (fp == NULL || read_superblock(fp, &sb) != SB_OK) {
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    return 1;
+  }
+  uint64_t covered = sb.sections[SECTION_CRC].offset;
+  uint64_t count = sb.sections[SECTION_CRC].length / sizeof(uint32_t);
+  std::vector<unsigned char> block(sb.crc_block_size);
+  std::vector<uint32_t> table(count);
+  fseek(fp, 0, SEEK_SET);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t length = covered - i * sb.crc_block_size < sb.crc_block_size ? covered - i * sb.crc_block_size
+                                                                           : sb.crc_block_size;
+    fread(&block[0], sizeof(char), length, fp);
+    table[i] = htobe32(crc32c(0, &block[0], length));
+  }
+  fseek(fp, covered, SEEK_SET);
+  fwrite(&table[0], sizeof(uint32_t), count, fp);
+  fclose(fp);
+  return 0;
+}
 
-   return 0;
+/*
+* Append the Merkle tree of the image (merkle.cpp) in place of the flat hash
+* list, the keyed root first
+*/
+int merkleAndAppend(const char* file_name, const char* key){
+  FILE* fp = fopen(file_name, "r+b");
+  if (fp == NULL) {
+    std::cout << "Error - Unable to open " << file_name << std::endl;
+    return 1;
+  }
+  struct stat st;
+  fstat(fileno(fp), &st);
+  uint64_t image_size = st.st_size;
+  uint64_t block_size = HASH_BLOCK_SIZE > image_size ? image_size : HASH_BLOCK_SIZE;
 
+  int status = merkle_write(fp, image_size, block_size, key);
+  if (status != 0) {
+    std::cout << "Error - Unable to write the Merkle tree of " << file_name << std::endl;
+  }
+  fclose(fp);
+  return status;
 }
 
-uint64_t writeDFS(node* node, FILE* output) {
+/*
+* Write the image to ofn with the parity of every stripe after it, the layout
+* of schifra's file encoder that decode() (ecc.cpp) reads back. Batches of
+* stripes are transposed so the lane kernels (rsKernels.cpp) encode them side
+* by side, and the GF(2^8) tables are compile time constants (gfTables.cpp),
+* so no schifra field is built to master an image.
+*/
+int addReedSolomon(std::string ifn, std::string ofn, std::size_t fec_length){
+  const rs_tables* tables = ecc_tables(fec_length);
+  const std::size_t data_length = CODE_LENGTH - fec_length;
+  if (tables == NULL) {
+    std::cout << "Error - Unsupported Reed Solomon parity length " << fec_length << std::endl;
+    return 1;
+  }
+
+  FILE* in = fopen(ifn.c_str(), "rb");
+  FILE* out = fopen(ofn.c_str(), "wb");
+  if (in == NULL || out == NULL) {
+    std::cout << "Error - Unable to open " << (in == NULL ? ifn : ofn) << std::endl;
+    return 1;
+  }
+  std::vector<unsigned char> data(PARITY_BATCH_STRIPES * data_length);
+  std::vector<unsigned char> lanes(PARITY_BATCH_STRIPES * data_length);
+  std::vector<unsigned char> fec(PARITY_BATCH_STRIPES * fec_length);
+  std::vector<unsigned char> codewords(PARITY_BATCH_STRIPES * CODE_LENGTH);
+
+  size_t read;
+  while ((read = fread(&data[0], 1, data.size(), in)) > 0) {
+    uint64_t stripes = (read + data_length - 1) / data_length;
+    std::fill(data.begin() + read, data.begin() + stripes * data_length, 0);
+    for (uint64_t j = 0; j < stripes; j++) {
+      for (std::size_t i = 0; i < data_length; i++) {
+        lanes[i * stripes + j] = data[j * data_length + i];
+      }
+    }
+    rs_encode_lanes(tables, &lanes[0], data_length, stripes, stripes, &fec[0]);
+
+    // The last stripe of the image is written without its zero padding
+    unsigned char* p = &codewords[0];
+    for (uint64_t j = 0; j < stripes; j++) {
+      std::size_t length = std::min<uint64_t>(data_length, read - j * data_length);
+      memcpy(p, &data[j * data_length], length);
+      p += length;
+      for (std::size_t i = 0; i < fec_length; i++) {
+        *p++ = fec[i * stripes + j];
+      }
+    }
+    fwrite(&codewords[0], 1, p - &codewords[0], out);
+  }
+
+  fclose(in);
+  fclose(out);
+  return 0;
+}
+
+/*
+* Copy the image to ofn and store the parity of each of its stripes in a
+* region after it (see parity.cpp), leaving the image itself readable in place
+*/
+int addParity(const std::string& ifn, const std::string& ofn, std::size_t fec_length, uint64_t interleave) {
+  struct stat st;
+  stat(ifn.c_str(), &st);
+  parity_geometry geo = parity_geometry_of(st.st_size, fec_length, interleave);
+  uint64_t groups = parity_group_count(geo);
+  uint64_t batch = parity_batch_groups(geo);
+
+  FILE* in = fopen(ifn.c_str(), "rb");
+  FILE* out = fopen(ofn.c_str(), "wb");
+  if (in == NULL || out == NULL) {
+    std::cout << "Error - Unable to open " << (in == NULL ? ifn : ofn) << std::endl;
+    return 1;
+  }
+  std::vector<unsigned char> data(batch * geo.depth * geo.data_length);
+  std::vector<unsigned char> fec(batch * geo.depth * geo.fec_length);
+
+  for (uint64_t first = 0; first < groups; first += batch) {
+    uint64_t count = std::min<uint64_t>(groups - first, batch);
+    uint64_t stripes = (count - 1) * geo.depth + parity_group_lanes(geo, first + count - 1);
+    uint64_t data_off = first * geo.depth * geo.data_length;
+    uint64_t data_len = std::min<uint64_t>(geo.image_size - data_off, stripes * geo.data_length);
+    std::fill(data.begin(), data.end(), 0);
+    fread(&data[0], 1, data_len, in);
+    parity_encode(geo, first, count, &data[0], &fec[0]);
+
+    fseek(out, data_off, SEEK_SET);
+    fwrite(&data[0], 1, data_len, out);
+    fseek(out, geo.image_size + first * geo.depth * geo.fec_length, SEEK_SET);
+    fwrite(&fec[0], geo.fec_length, stripes, out);
+  }
+
+  fclose(in);
+  fclose(out);
+  return 0;
+}
+
+uint64_t writeDFS(node* node, FILE* output, const std::string& parent) {
 
   uint64_t currentOffset = header_off;
+  std::string path = parent + "/" + node->data->name;
+  if (PATH_INDEX || SEARCH_INDEX) {
+    index_paths.push_back(path);
+    index_locations.push_back(currentOffset);
+  }
 
   fseek(output, currentOffset, SEEK_SET);
 
@@ -470,34 +1200,16 @@ uint64_t writeDFS(node* node, FILE* output) {
 
   // write Node is a file
   if (is_reg) {
+    enum file_type type;
+    uint64_t payloadOffset = writeFile(node, output, &type);
+
     // write the header info
+    fseek(output, currentOffset + sizeof(m_hdr::name), SEEK_SET);
     write64(node->data->length, output);
     write64(node->data->time, output);
-    write64(file_off, output);
-    write32(node->data->type, output);
-    fseek(output, file_off, SEEK_SET);
-    uint64_t fileSize = node->data->length;
-    int blockSize = 1024;
-    int remaining = fileSize;
-    if (blockSize > fileSize) {
-      blockSize = fileSize;
-    }
-    FILE* open_file = fopen((node->data->p), "r");
-    // check on success
-    char* file_buffer[blockSize];
-    while (remaining > 0) {
-      size_t bytes;
-      while (0 < (bytes = fread(file_buffer, 1, sizeof(file_buffer), open_file))){
-          fwrite(file_buffer, 1, bytes, output);
-      }
-      remaining = remaining - blockSize;
-      if (blockSize > remaining) {
-        blockSize = remaining;
-      }
-    }
-    file_off += fileSize;
+    write64(payloadOffset, output);
+    write32(type, output);
     header_off += M_HDR_SIZE;
-    fclose(open_file);
   } else if (is_dir) {
 
     write64(node->data->length, output);
@@ -511,7 +1223,7 @@ uint64_t writeDFS(node* node, FILE* output) {
 
     for (int i = 0; i<numChildren; i++) {
             tree_node child = (node -> children)[i];
-            uint64_t childOffset = writeDFS(&child, output);
+            uint64_t childOffset = writeDFS(&child, output, path);
             uint64_t desiredSeekLoc = endOffset + i * sizeof(uint64_t);
 
             fseek(output, desiredSeekLoc, SEEK_SET);
@@ -522,6 +1234,338 @@ uint64_t writeDFS(node* node, FILE* output) {
     return currentOffset;
 }
 
+/*
+* Write the payload of a file at the current data offset: a reference to the
+* base image if it is unchanged since it, its chunk list if it goes to the
+* chunk store, or the file compressed if enabled and worthwhile. Returns the
+* payload offset and the header type.
+*/
+uint64_t writeFile(node* node, FILE* output, enum file_type* type) {
+  uint64_t fileSize = node->data->length;
+  if (!BASE_IMAGE.empty() && fileSize > BASE_REFERENCE_SIZE) {
+    std::string path = std::string(node->data->p).substr(SOURCE_ROOT.size());
+    path.erase(0, path.find_first_not_of('/'));
+    std::map<std::string, base_file>::const_iterator in_base = base_files.find("/" + path);
+    if (in_base != base_files.end() && in_base->second.length == fileSize && in_base->second.time == node->data->time) {
+      uint64_t payloadOffset = file_off;
+      fseek(output, file_off, SEEK_SET);
+      write64(in_base->second.offset, output);
+      write32(in_base->second.type, output);
+      file_off += BASE_REFERENCE_SIZE;
+      raw_data_bytes += fileSize;
+      stored_data_bytes += BASE_REFERENCE_SIZE;
+      base_file_count++;
+      base_bytes += fileSize;
+      *type = BASE_FILE;
+      return payloadOffset;
+    }
+  }
+  if (ALIGNMENT && fileSize > 0 && fileSize >= ALIGN_THRESHOLD) {
+    uint64_t aligned = (file_off + ALIGNMENT - 1) & ~((uint64_t) ALIGNMENT - 1);
+    padding_bytes += aligned - file_off;
+    file_off = aligned;
+  }
+  uint64_t payloadOffset = file_off;
+  uint64_t storedSize = 0;
+  *type = node->data->type;
+  if (!CHUNK_STORE.empty() && fileSize >= CDC.min) {
+    storedSize = writeChunked(node, output, file_off);
+    *type = storedSize ? CHUNKED_FILE : *type;
+  }
+  if (COMPRESS && fileSize > 0 && storedSize == 0) {
+    storedSize = writeCompressed(node, output, file_off);
+    *type = storedSize ? COMPRESSED_FILE : *type;
+  }
+  raw_data_bytes += fileSize;
+  if (storedSize) {
+    stored_data_bytes += storedSize;
+    file_off += storedSize;
+    return payloadOffset;
+  }
+  stored_data_bytes += fileSize;
+
+  fseek(output, file_off, SEEK_SET);
+  int blockSize = 1024;
+  int remaining = fileSize;
+  if (blockSize > fileSize) {
+    blockSize = fileSize;
+  }
+  FILE* open_file = fopen((node->data->p), "r");
+  // check on success
+  char* file_buffer[blockSize];
+  while (remaining > 0) {
+    size_t bytes;
+    while (0 < (bytes = fread(file_buffer, 1, sizeof(file_buffer), open_file))){
+        fwrite(file_buffer, 1, bytes, output);
+    }
+    remaining = remaining - blockSize;
+    if (blockSize > remaining) {
+      blockSize = remaining;
+    }
+  }
+  file_off += fileSize;
+  fclose(open_file);
+  return payloadOffset;
+}
+
+
+/*
+* Write the payload of a file as independently compressed chunks at payload_off
+* (see compression.cpp for the layout). Returns the payload size, or 0 if the
+* file does not shrink, in which case the caller stores it raw at the same offset.
+*/
+uint64_t writeCompressed(node* node, FILE* output, uint64_t payload_off) {
+  uint64_t length = node->data->length;
+  uint32_t chunk_size = COMPRESSION_CHUNK_SIZE;
+  uint32_t chunk_count = compressed_chunk_count(length, chunk_size);
+
+  FILE* open_file = fopen(node->data->p, "r");
+  if (open_file == NULL) {
+    return 0;
+  }
+
+  std::vector<uint64_t> offsets(chunk_count + 1);
+  std::vector<char> in(chunk_size);
+  std::vector<char> out(compressBound(chunk_size));
+
+  uint64_t stored = compressed_index_size(chunk_count);
+  fseek(output, payload_off + stored, SEEK_SET);
+  for (uint32_t i = 0; i < chunk_count; i++) {
+    uint32_t raw_len = compressed_chunk_length(length, chunk_size, i);
+    size_t bytes = fread(&in[0], 1, raw_len, open_file);
+    if (bytes < raw_len) { // file shrank since it was stat'ed
+      memset(&in[bytes], 0, raw_len - bytes);
+    }
+
+    offsets[i] = stored;
+    uint32_t compressed_len = compress_chunk(&in[0], raw_len, &out[0], Z_DEFAULT_COMPRESSION);
+    if (compressed_len) {
+      fwrite(&out[0], 1, compressed_len, output);
+      stored += compressed_len;
+    } else {
+      fwrite(&in[0], 1, raw_len, output);
+      stored += raw_len;
+    }
+  }
+  offsets[chunk_count] = stored;
+  fclose(open_file);
+
+  if (stored >= length) {
+    return 0;
+  }
+
+  fseek(output, payload_off, SEEK_SET);
+  write32(chunk_size, output);
+  write32(chunk_count, output);
+  for (uint32_t i = 0; i <= chunk_count; i++) {
+    write64(offsets[i], output);
+  }
+  return stored;
+}
+
+/*
+* Cut a file into content defined chunks, add the ones the chunk store does
+* not hold and write its chunk list at payload_off (see chunkStore.cpp for the
+* layout). Returns the size of the list, or 0 if the file could not be read as
+* it was stat'ed, in which case the caller stores it in the image.
+*/
+uint64_t writeChunked(node* node, FILE* output, uint64_t payload_off) {
+  uint64_t length = node->data->length;
+  FILE* open_file = fopen(node->data->p, "r");
+  if (open_file == NULL) {
+    return 0;
+  }
+
+  // The window holds at least the longest chunk ahead of the next cut, unless the file ends first
+  std::vector<unsigned char> window(2 * CDC.max);
+  std::vector<unsigned char> list;
+  uint64_t have = 0, at = 0, done = 0, added = 0, added_bytes = 0;
+  bool eof = false, failed = false;
+  while (!failed) {
+    if (!eof && have - at < CDC.max) {
+      memmove(&window[0], &window[at], have - at);
+      have -= at;
+      at = 0;
+      size_t bytes = fread(&window[have], 1, window.size() - have, open_file);
+      have += bytes;
+      eof = bytes == 0;
+      continue;
+    }
+    if (at == have) {
+      break;
+    }
+    uint64_t cut = cdc_cut(&window[at], have - at, CDC);
+    unsigned char id[CHUNK_ID_SIZE];
+    chunk_id(&window[at], cut, id);
+    int res = chunk_store_put(CHUNK_STORE, id, &window[at], cut);
+    failed = res < 0;
+    added += res == 1;
+    added_bytes += res == 1 ? cut : 0;
+
+    done += cut;
+    uint64_t end = htobe64(done);
+    list.insert(list.end(), (unsigned char*) &end, (unsigned char*) &end + sizeof(end));
+    list.insert(list.end(), id, id + CHUNK_ID_SIZE);
+    at += cut;
+  }
+  fclose(open_file);
+  if (failed || done != length) {
+    std::cout << "Unable to put " << node->data->p << " in the chunk store, storing it in the image" << std::endl;
+    return 0;
+  }
+  chunked_bytes += length;
+  chunk_count += list.size() / CHUNK_ENTRY_SIZE;
+  new_chunks += added;
+  new_chunk_bytes += added_bytes;
+
+  fseek(output, payload_off, SEEK_SET);
+  write64(list.size() / CHUNK_ENTRY_SIZE, output);
+  fwrite(&list[0], 1, list.size(), output);
+  return CHUNK_LIST_PREFIX_SIZE + list.size();
+}
+
+/*
+* Write the compact metadata format: an inode table in breadth first order
+* followed by the name heap and the file data. Records the metadata sections
+* in sb and returns the offset where the data section starts.
+*/
+uint64_t writeCompact(node* root, FILE* output, s_blk* sb) {
+
+  // Breadth first order keeps the children of every directory contiguous
+  std::vector<node*> order(1, root);
+  std::vector<uint64_t> first_child;
+  std::vector<std::string> paths(1, std::string("/") + root->data->name);
+  for (size_t i = 0; i < order.size(); i++) {
+    node* n = order[i];
+    first_child.push_back(order.size());
+    if (n->fill == 0) {
+      for (uint64_t c = 0; c < n->data->length; c++) {
+        order.push_back(&n->children[c]);
+        paths.push_back(paths[i] + "/" + n->children[c].data->name);
+      }
+    }
+  }
+  if (PATH_INDEX || SEARCH_INDEX) {
+    for (size_t i = 0; i < order.size(); i++) {
+      index_paths.push_back(paths[i]);
+      index_locations.push_back(i);
+    }
+  }
+
+  std::vector<char> names;
+  std::vector<uint32_t> name_offsets(order.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    size_t len = strnlen(order[i]->data->name, 255);
+    name_offsets[i] = names.size();
+    names.push_back((char) len);
+    names.insert(names.end(), order[i]->data->name, order[i]->data->name + len);
+  }
+
+  uint64_t table_off = SUPERBLOCK_SIZE;
+  uint64_t names_off = table_off + order.size() * INODE_SIZE;
+  uint64_t data_start = names_off + names.size();
+  file_off = data_start;
+
+  for (size_t i = 0; i < order.size(); i++) {
+    node* n = order[i];
+    enum file_type type = DIRECTORY;
+    uint64_t offset = first_child[i];
+    if (n->fill != 0) {
+      offset = writeFile(n, output, &type);
+    }
+
+    fseek(output, table_off + i * INODE_SIZE, SEEK_SET);
+    write32(type, output);
+    write32(name_offsets[i], output);
+    write64(n->data->length, output);
+    write64(n->data->time, output);
+    write64(offset, output);
+  }
+
+  fseek(output, names_off, SEEK_SET);
+  fwrite(&names[0], 1, names.size(), output);
+
+  sb->features |= FEATURE_COMPACT_METADATA;
+  sb->sections[SECTION_METADATA].offset = table_off;
+  sb->sections[SECTION_METADATA].length = names_off - table_off;
+  sb->sections[SECTION_NAMES].offset = names_off;
+  sb->sections[SECTION_NAMES].length = names.size();
+  return data_start;
+}
+
+// Write a complete header for node at headerOffset
+void writeHeader(node* node, FILE* output, uint64_t headerOffset, enum file_type type, uint64_t offset) {
+  fseek(output, headerOffset, SEEK_SET);
+  std::string padded_name = space_pad(node->data->name);
+  fwrite(padded_name.c_str(), sizeof(char), 256, output);
+  write64(node->data->length, output);
+  write64(node->data->time, output);
+  write64(offset, output);
+  write32(type, output);
+}
+
+/*
+* Grouped header layout: a directory's child offset list is followed by the
+* headers of all its children back to back, and the contents of its
+* subdirectories come after that. Listing a directory is then one sequential
+* read. dirOffset is where the header of dir goes, which its parent reserved.
+*/
+void writeGrouped(node* dir, FILE* output, uint64_t dirOffset, const std::string& path) {
+  uint64_t numChildren = dir->data->length;
+  uint64_t listOffset = header_off;
+  uint64_t firstChild = listOffset + numChildren * sizeof(uint64_t);
+  header_off = firstChild + numChildren * M_HDR_SIZE;
+
+  writeHeader(dir, output, dirOffset, DIRECTORY, listOffset);
+  if (PATH_INDEX || SEARCH_INDEX) {
+    index_paths.push_back(path);
+    index_locations.push_back(dirOffset);
+  }
+
+  fseek(output, listOffset, SEEK_SET);
+  for (uint64_t i = 0; i < numChildren; i++) {
+    write64(firstChild + i * M_HDR_SIZE, output);
+  }
+
+  for (uint64_t i = 0; i < numChildren; i++) {
+    node* child = &dir->children[i];
+    uint64_t childOffset = firstChild + i * M_HDR_SIZE;
+    std::string childPath = path + "/" + child->data->name;
+    if (child->fill == 0) {
+      continue;
+    }
+    enum file_type type;
+    uint64_t payloadOffset = writeFile(child, output, &type);
+    writeHeader(child, output, childOffset, type, payloadOffset);
+    if (PATH_INDEX || SEARCH_INDEX) {
+      index_paths.push_back(childPath);
+      index_locations.push_back(childOffset);
+    }
+  }
+
+  for (uint64_t i = 0; i < numChildren; i++) {
+    node* child = &dir->children[i];
+    if (child->fill == 0) {
+      writeGrouped(child, output, firstChild + i * M_HDR_SIZE, path + "/" + child->data->name);
+    }
+  }
+}
+
+static bool nameLess(const tree_node& a, const tree_node& b) {
+  return strcmp(a.data->name, b.data->name) < 0;
+}
+
+// Sort the children of every directory by name so readers can binary search them
+void sortChildren(node* node) {
+  if (node->fill != 0) {
+    return;
+  }
+  std::sort(node->children, node->children + node->data->length, nameLess);
+  for (uint64_t i = 0; i < node->data->length; i++) {
+    sortChildren(&node->children[i]);
+  }
+}
+
 uint64_t find_header_size(){
   uint64_t h_size = header_count * M_HDR_SIZE + subitems_count * sizeof(uint64_t);
   return h_size;
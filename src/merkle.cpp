@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/*
+* Merkle tree integrity (FEATURE_MERKLE_HASHES)
+*
+* Instead of one HMAC per hash block the hashes section holds a binary hash
+* tree over the blocks. A leaf is the SHA-256 of 0x00 followed by its block,
+* an inner node the SHA-256 of 0x01 followed by its two children, so a leaf
+* cannot pass for a node. Each level pairs nodes 2i and 2i + 1, and the last
+* node of a level with an odd count moves up unchanged. The section holds the
+* keyed root, the HMAC-SHA256 of the root under the image key, followed by
+* the levels from the leaves up to the root:
+*
+*   keyed root | leaf 0 .. leaf n-1 | level 1 | ... | root
+*
+* Only the keyed root involves the key. A block is verified by hashing it and
+* its path up to the root, reading the siblings along the path from the
+* section; nodes already verified are kept in a bounded cache where later
+* paths stop early, so the memory a reader needs does not grow with the image.
+* Disjoint ranges of blocks hash to disjoint subtrees and can be verified in
+* parallel.
+*/
+
+#define MERKLE_HASH_SIZE 32
+#define MERKLE_MAX_LEVELS 64
+#define MERKLE_CHUNK_LEVEL 6            // leaves per unit of parallel verification, as a power of two
+#define MERKLE_MAX_THREADS 16
+
+struct merkle_tree {
+	uint64_t offset;                    // of the hashes section, where the keyed root is
+	uint64_t leaves;
+	unsigned levels;
+	uint64_t level_offset[MERKLE_MAX_LEVELS];   // file offset of the first node of each level
+	uint64_t level_count[MERKLE_MAX_LEVELS];
+};
+
+static inline void merkle_geometry(uint64_t section_offset, uint64_t leaves, merkle_tree* t) {
+	t -> offset = section_offset;
+	t -> leaves = leaves;
+	t -> levels = 0;
+	uint64_t at = section_offset + MERKLE_HASH_SIZE;
+	uint64_t count = leaves;
+	for (;;) {
+		t -> level_offset[t -> levels] = at;
+		t -> level_count[t -> levels] = count;
+		t -> levels++;
+		at += count * MERKLE_HASH_SIZE;
+		if (count <= 1) {
+			break;
+		}
+		count = (count + 1) / 2;
+	}
+}
+
+// Bytes of the hashes section of an image with the given number of hash blocks
+static inline uint64_t merkle_section_length(uint64_t leaves) {
+	merkle_tree t;
+	merkle_geometry(0, leaves, &t);
+	return t.level_offset[t.levels - 1] + MERKLE_HASH_SIZE;
+}
+
+static inline void merkle_leaf(const void* block, uint64_t length, unsigned char* out) {
+	static const unsigned char prefix = 0x00;
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, &prefix, 1);
+	EVP_DigestUpdate(ctx, block, length);
+	EVP_DigestFinal_ex(ctx, out, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+// out may alias either child
+static inline void merkle_parent(const unsigned char* left, const unsigned char* right, unsigned char* out) {
+	unsigned char both[1 + 2 * MERKLE_HASH_SIZE];
+	both[0] = 0x01;
+	memcpy(both + 1, left, MERKLE_HASH_SIZE);
+	memcpy(both + 1 + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+	EVP_Digest(both, sizeof(both), out, NULL, EVP_sha256(), NULL);
+}
+
+static inline void merkle_keyed_root(const char* key, const unsigned char* root, unsigned char* out) {
+	unsigned int length = 0;
+	HMAC(EVP_sha256(), key, strlen(key), root, MERKLE_HASH_SIZE, out, &length);
+}
+
+static inline bool merkle_pread(int fd, void* buf, uint64_t length, uint64_t offset) {
+	uint64_t done = 0;
+	while (done < length) {
+		ssize_t got = pread(fd, (char*) buf + done, length - done, offset + done);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		done += got;
+	}
+	return true;
+}
+
+/*
+* Root of a run of nodes fed in order, in O(levels) memory. A node waiting at
+* a level is paired with the next one to arrive there; nodes still waiting at
+* the end are the last of odd levels and move up.
+*/
+struct merkle_builder {
+	unsigned char pending[MERKLE_MAX_LEVELS][MERKLE_HASH_SIZE];
+	bool waiting[MERKLE_MAX_LEVELS];
+};
+
+static inline void merkle_builder_init(merkle_builder* b) {
+	memset(b -> waiting, 0, sizeof(b -> waiting));
+}
+
+static inline void merkle_builder_push(merkle_builder* b, unsigned level, const unsigned char* node) {
+	unsigned char carry[MERKLE_HASH_SIZE];
+	memcpy(carry, node, MERKLE_HASH_SIZE);
+	while (b -> waiting[level]) {
+		merkle_parent(b -> pending[level], carry, carry);
+		b -> waiting[level] = false;
+		level++;
+	}
+	memcpy(b -> pending[level], carry, MERKLE_HASH_SIZE);
+	b -> waiting[level] = true;
+}
+
+static inline void merkle_builder_root(const merkle_builder* b, unsigned char* root) {
+	bool have = false;
+	for (unsigned level = 0; level < MERKLE_MAX_LEVELS; level++) {
+		if (!b -> waiting[level]) {
+			continue;
+		}
+		if (have) {
+			merkle_parent(b -> pending[level], root, root);
+		} else {
+			memcpy(root, b -> pending[level], MERKLE_HASH_SIZE);
+			have = true;
+		}
+	}
+}
+
+/*
+* Append the hashes section of the image in fp: hash every block of
+* block_size bytes of its first image_size bytes, then build each level from
+* the one below it as written to the file, so memory does not grow with the
+* image. Returns 0 on success.
+*/
+static inline int merkle_write(FILE* fp, uint64_t image_size, uint64_t block_size, const char* key) {
+	int fd = fileno(fp);
+	uint64_t leaves = (image_size + block_size - 1) / block_size;
+	merkle_tree t;
+	merkle_geometry(image_size, leaves, &t);
+
+	const uint64_t batch = 4096;        // nodes read and written at a time
+	std::vector<unsigned char> block(block_size);
+	std::vector<unsigned char> nodes(batch * MERKLE_HASH_SIZE);
+	std::vector<unsigned char> parents(batch / 2 * MERKLE_HASH_SIZE);
+	for (uint64_t i = 0; i < leaves; i += batch) {
+		uint64_t count = leaves - i < batch ? leaves - i : batch;
+		for (uint64_t j = 0; j < count; j++) {
+			uint64_t offset = (i + j) * block_size;
+			uint64_t length = image_size - offset < block_size ? image_size - offset : block_size;
+			if (!merkle_pread(fd, &block[0], length, offset)) {
+				return -1;
+			}
+			merkle_leaf(&block[0], length, &nodes[j * MERKLE_HASH_SIZE]);
+		}
+		if (pwrite(fd, &nodes[0], count * MERKLE_HASH_SIZE, t.level_offset[0] + i * MERKLE_HASH_SIZE)
+		    != (ssize_t) (count * MERKLE_HASH_SIZE)) {
+			return -1;
+		}
+	}
+
+	for (unsigned level = 1; level < t.levels; level++) {
+		uint64_t below = t.level_count[level - 1];
+		for (uint64_t i = 0; i < below; i += batch) {
+			uint64_t count = below - i < batch ? below - i : batch;
+			if (!merkle_pread(fd, &nodes[0], count * MERKLE_HASH_SIZE, t.level_offset[level - 1] + i * MERKLE_HASH_SIZE)) {
+				return -1;
+			}
+			uint64_t made = 0;
+			for (uint64_t j = 0; j < count; j += 2, made++) {
+				unsigned char* parent = &parents[made * MERKLE_HASH_SIZE];
+				if (j + 1 < count) {
+					merkle_parent(&nodes[j * MERKLE_HASH_SIZE], &nodes[(j + 1) * MERKLE_HASH_SIZE], parent);
+				} else {
+					memcpy(parent, &nodes[j * MERKLE_HASH_SIZE], MERKLE_HASH_SIZE);
+				}
+			}
+			if (pwrite(fd, &parents[0], made * MERKLE_HASH_SIZE, t.level_offset[level] + i / 2 * MERKLE_HASH_SIZE)
+			    != (ssize_t) (made * MERKLE_HASH_SIZE)) {
+				return -1;
+			}
+		}
+	}
+
+	unsigned char root[MERKLE_HASH_SIZE];
+	unsigned char keyed[MERKLE_HASH_SIZE];
+	if (!merkle_pread(fd, root, MERKLE_HASH_SIZE, t.level_offset[t.levels - 1])) {
+		return -1;
+	}
+	merkle_keyed_root(key, root, keyed);
+	return pwrite(fd, keyed, MERKLE_HASH_SIZE, t.offset) == MERKLE_HASH_SIZE ? 0 : -1;
+}
+
+/*
+* Verifies blocks one path at a time against the stored tree. The root is
+* checked against the keyed root once, when it is opened.
+*/
+struct merkle_cache_slot {
+	uint64_t id;                        // (level << 56 | index) + 1, 0 if empty
+	unsigned char hash[MERKLE_HASH_SIZE];
+};
+
+struct merkle_verifier {
+	merkle_tree tree;
+	int fd;
+	unsigned char root[MERKLE_HASH_SIZE];
+	std::vector<merkle_cache_slot> cache;       // verified nodes, direct mapped
+	pthread_mutex_t lock;
+	uint64_t node_reads;                // nodes read from the section
+};
+
+static inline uint64_t merkle_node_id(unsigned level, uint64_t index) {
+	return ((uint64_t) level << 56 | index) + 1;
+}
+
+static inline bool merkle_cache_get(merkle_verifier* v, unsigned level, uint64_t index, unsigned char* hash) {
+	uint64_t id = merkle_node_id(level, index);
+	merkle_cache_slot& slot = v -> cache[id * 0x9E3779B97F4A7C15ULL % v -> cache.size()];
+	pthread_mutex_lock(&v -> lock);
+	bool hit = slot.id == id;
+	if (hit) {
+		memcpy(hash, slot.hash, MERKLE_HASH_SIZE);
+	}
+	pthread_mutex_unlock(&v -> lock);
+	return hit;
+}
+
+static inline void merkle_cache_put(merkle_verifier* v, unsigned level, uint64_t index, const unsigned char* hash) {
+	uint64_t id = merkle_node_id(level, index);
+	merkle_cache_slot& slot = v -> cache[id * 0x9E3779B97F4A7C15ULL % v -> cache.size()];
+	pthread_mutex_lock(&v -> lock);
+	slot.id = id;
+	memcpy(slot.hash, hash, MERKLE_HASH_SIZE);
+	pthread_mutex_unlock(&v -> lock);
+}
+
+/*
+* Open the tree of the hashes section at section_offset of the file open at
+* fd, keeping up to cache_nodes verified nodes. Returns 0 if the stored root
+* matches the keyed root, 1 if it does not and -1 if the section cannot be read.
+*/
+static inline int merkle_open(merkle_verifier* v, int fd, uint64_t section_offset, uint64_t leaves,
+                              const char* key, uint64_t cache_nodes) {
+	merkle_geometry(section_offset, leaves, &v -> tree);
+	v -> fd = fd;
+	v -> cache.assign(cache_nodes > 0 ? cache_nodes : 1, merkle_cache_slot());
+	v -> node_reads = 0;
+	pthread_mutex_init(&v -> lock, NULL);
+	unsigned char keyed[MERKLE_HASH_SIZE];
+	unsigned char expected[MERKLE_HASH_SIZE];
+	if (!merkle_pread(fd, keyed, MERKLE_HASH_SIZE, section_offset)
+	    || !merkle_pread(fd, v -> root, MERKLE_HASH_SIZE, v -> tree.level_offset[v -> tree.levels - 1])) {
+		return -1;
+	}
+	merkle_keyed_root(key, v -> root, expected);
+	return memcmp(keyed, expected, MERKLE_HASH_SIZE) == 0 ? 0 : 1;
+}
+
+/*
+* True if leaf, the hash of block index, lies on a path to the verified root.
+* The path stops at the first node already verified; the nodes and siblings
+* on a path that verifies are cached.
+*/
+static inline bool merkle_verify_leaf(merkle_verifier* v, uint64_t index, const unsigned char* leaf) {
+	const merkle_tree& t = v -> tree;
+	if (index >= t.leaves) {
+		return false;
+	}
+	struct path_node {
+		unsigned level;
+		uint64_t index;
+		unsigned char hash[MERKLE_HASH_SIZE];
+	} path[2 * MERKLE_MAX_LEVELS];
+	unsigned length = 0;
+	unsigned char node[MERKLE_HASH_SIZE];
+	unsigned char known[MERKLE_HASH_SIZE];
+	memcpy(node, leaf, MERKLE_HASH_SIZE);
+
+	bool verified = false;
+	for (unsigned level = 0; ; level++) {
+		if (merkle_cache_get(v, level, index, known)) {
+			verified = memcmp(known, node, MERKLE_HASH_SIZE) == 0;
+			break;
+		}
+		if (level == t.levels - 1) {
+			verified = memcmp(v -> root, node, MERKLE_HASH_SIZE) == 0;
+			break;
+		}
+		path[length].level = level;
+		path[length].index = index;
+		memcpy(path[length++].hash, node, MERKLE_HASH_SIZE);
+
+		uint64_t sibling = index ^ 1;
+		if (sibling < t.level_count[level]) {
+			unsigned char* other = path[length].hash;
+			if (!merkle_cache_get(v, level, sibling, other)) {
+				if (!merkle_pread(v -> fd, other, MERKLE_HASH_SIZE, t.level_offset[level] + sibling * MERKLE_HASH_SIZE)) {
+					break;
+				}
+				__sync_fetch_and_add(&v -> node_reads, 1);
+			}
+			path[length].level = level;
+			path[length++].index = sibling;
+			if (index & 1) {
+				merkle_parent(other, node, node);
+			} else {
+				merkle_parent(node, other, node);
+			}
+		}
+		index >>= 1;
+	}
+
+	if (verified) {
+		for (unsigned i = 0; i < length; i++) {
+			merkle_cache_put(v, path[i].level, path[i].index, path[i].hash);
+		}
+	}
+	return verified;
+}
+
+/*
+* Check every block of the first image_size bytes of file_name against the
+* tree of its hashes section at image_size. Chunks of 2^MERKLE_CHUNK_LEVEL
+* blocks are subtrees, hashed by worker threads; their roots are folded into
+* the root, which must match the keyed root. Blocks whose leaf differs from
+* the stored one are added to failed_blocks if given. Returns 1 if the image
+* verifies, 0 if it does not and -1 if it cannot be read.
+*/
+struct merkle_check_job {
+	const char* file_name;
+	uint64_t image_size;
+	uint64_t block_size;
+	merkle_tree tree;
+	uint64_t chunks;
+	uint64_t next;                      // next chunk to hash, taken atomically
+	std::vector<unsigned char> roots;   // root of each chunk's subtree
+	std::vector<std::vector<uint64_t> > failed;     // blocks of each chunk whose leaf differs
+	int error;
+};
+
+static void* merkle_check_worker(void* arg) {
+	merkle_check_job* job = (merkle_check_job*) arg;
+	const uint64_t chunk_leaves = 1ULL << MERKLE_CHUNK_LEVEL;
+	int fd = open(job -> file_name, O_RDONLY);
+	if (fd < 0) {
+		job -> error = 1;
+		return NULL;
+	}
+	std::vector<unsigned char> block(job -> block_size);
+	unsigned char stored[chunk_leaves * MERKLE_HASH_SIZE];
+	unsigned char leaf[MERKLE_HASH_SIZE];
+	for (;;) {
+		uint64_t c = __sync_fetch_and_add(&job -> next, 1);
+		if (c >= job -> chunks) {
+			break;
+		}
+		uint64_t first = c * chunk_leaves;
+		uint64_t count = job -> tree.leaves - first < chunk_leaves ? job -> tree.leaves - first : chunk_leaves;
+		if (!merkle_pread(fd, stored, count * MERKLE_HASH_SIZE, job -> tree.level_offset[0] + first * MERKLE_HASH_SIZE)) {
+			job -> error = 1;
+			break;
+		}
+		merkle_builder builder;
+		merkle_builder_init(&builder);
+		for (uint64_t j = 0; j < count; j++) {
+			uint64_t offset = (first + j) * job -> block_size;
+			uint64_t length = job -> image_size - offset < job -> block_size ? job -> image_size - offset : job -> block_size;
+			if (!merkle_pread(fd, &block[0], length, offset)) {
+				job -> error = 1;
+				break;
+			}
+			merkle_leaf(&block[0], length, leaf);
+			if (memcmp(leaf, stored + j * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE) != 0) {
+				job -> failed[c].push_back(first + j);
+			}
+			merkle_builder_push(&builder, 0, leaf);
+		}
+		merkle_builder_root(&builder, &job -> roots[c * MERKLE_HASH_SIZE]);
+	}
+	close(fd);
+	return NULL;
+}
+
+static inline int merkle_check_file(const char* file_name, uint64_t image_size, uint64_t block_size,
+                                    const char* key, std::vector<uint64_t>* failed_blocks) {
+	merkle_check_job job;
+	job.file_name = file_name;
+	job.image_size = image_size;
+	job.block_size = block_size;
+	merkle_geometry(image_size, (image_size + block_size - 1) / block_size, &job.tree);
+	job.chunks = (job.tree.leaves + (1ULL << MERKLE_CHUNK_LEVEL) - 1) >> MERKLE_CHUNK_LEVEL;
+	job.next = 0;
+	job.roots.resize(job.chunks * MERKLE_HASH_SIZE);
+	job.failed.resize(job.chunks);
+	job.error = 0;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t threads = cpus > 1 ? (uint64_t) cpus : 1;
+	threads = threads < MERKLE_MAX_THREADS ? threads : MERKLE_MAX_THREADS;
+	threads = threads < job.chunks ? threads : job.chunks;
+	std::vector<pthread_t> workers(threads);
+	uint64_t started = 0;
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, merkle_check_worker, &job) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		merkle_check_worker(&job);
+	}
+	for (uint64_t i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	int fd = open(file_name, O_RDONLY);
+	unsigned char keyed[MERKLE_HASH_SIZE];
+	if (job.error || fd < 0 || !merkle_pread(fd, keyed, MERKLE_HASH_SIZE, job.tree.offset)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+
+	// A chunk's subtree root is the node of its chunk at MERKLE_CHUNK_LEVEL, or below that for
+	// an image of fewer leaves
+	merkle_builder builder;
+	merkle_builder_init(&builder);
+	for (uint64_t c = 0; c < job.chunks; c++) {
+		merkle_builder_push(&builder, MERKLE_CHUNK_LEVEL, &job.roots[c * MERKLE_HASH_SIZE]);
+		if (failed_blocks != NULL) {
+			failed_blocks -> insert(failed_blocks -> end(), job.failed[c].begin(), job.failed[c].end());
+		}
+	}
+	unsigned char root[MERKLE_HASH_SIZE];
+	unsigned char expected[MERKLE_HASH_SIZE];
+	merkle_builder_root(&builder, root);
+	merkle_keyed_root(key, root, expected);
+	return memcmp(keyed, expected, MERKLE_HASH_SIZE) == 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <vector>
+#include "OnDiskStructure.h"
+#include "readFunctions.cpp"
+
+/*
+* Metadata access shared by the mounter and tree programs. Hides whether the
+* image uses m_hdr headers with child offset lists or the compact inode table
+* and name heap. Headers returned are malloc'd and owned by the caller.
+*
+* For compact images m_hdr::offset of a directory holds the index of its first
+* child inode rather than the offset of a child offset list.
+*/
+
+static m_hdr* readInode(FILE* fp, const s_blk* sb, uint64_t index);
+
+static m_hdr* readInode(FILE* fp, const s_blk* sb, uint64_t index) {
+	if (index >= sb -> entry_count) {
+		return NULL;
+	}
+	uint64_t record = sb -> sections[SECTION_METADATA].offset + index * INODE_SIZE;
+	m_hdr* header = (m_hdr*) malloc(sizeof(m_hdr));
+	header -> type = (file_type) read32(fp, record);
+	uint32_t name_offset = read32_pure(fp);
+	header -> length = read64_pure(fp);
+	header -> time = read64_pure(fp);
+	header -> offset = read64_pure(fp);
+
+	const section_entry& names = sb -> sections[SECTION_NAMES];
+	unsigned char name_length = 0;
+	header -> name[0] = '\0';
+	if (name_offset < names.length) {
+		fseek(fp, names.offset + name_offset, SEEK_SET);
+		fread(&name_length, 1, 1, fp);
+		if (name_offset + 1 + name_length > names.length) {
+			name_length = 0;
+		}
+		fread(header -> name, 1, name_length, fp);
+	}
+	header -> name[name_length] = '\0';
+	return header;
+}
+
+/*
+* Return the header of the root directory
+*/
+static m_hdr* meta_root(FILE* fp, const s_blk* sb) {
+	if (sb -> features & FEATURE_COMPACT_METADATA) {
+		return readInode(fp, sb, 0);
+	}
+	return readHeader(fp, sb -> sections[SECTION_METADATA].offset);
+}
+
+/*
+* Return the header at a location taken from an index: a header offset, or an
+* inode index for compact images. NULL if it is outside the metadata section.
+*/
+static m_hdr* meta_at(FILE* fp, const s_blk* sb, uint64_t location) {
+	if (sb -> features & FEATURE_COMPACT_METADATA) {
+		return readInode(fp, sb, location);
+	}
+	const section_entry& meta = sb -> sections[SECTION_METADATA];
+	if (location < meta.offset || location + M_HDR_SIZE > meta.offset + meta.length) {
+		return NULL;
+	}
+	return readHeader(fp, location);
+}
+
+/*
+* Return the header of child i of directory dir, NULL if it points outside
+* the metadata section
+*/
+static m_hdr* meta_child(FILE* fp, const s_blk* sb, const m_hdr* dir, uint64_t i) {
+	if (i >= dir -> length) {
+		return NULL;
+	}
+	if (sb -> features & FEATURE_COMPACT_METADATA) {
+		return readInode(fp, sb, dir -> offset + i);
+	}
+
+	const section_entry& meta = sb -> sections[SECTION_METADATA];
+	uint64_t child_offset = read64(fp, dir -> offset + i * sizeof(uint64_t));
+	if (child_offset < meta.offset || child_offset + M_HDR_SIZE > meta.offset + meta.length) {
+		return NULL;
+	}
+	return readHeader(fp, child_offset);
+}
+
+/*
+* Return the child of dir called name, NULL if there is none. Sorted images
+* are binary searched, O(log n) header reads instead of one per child.
+*/
+static m_hdr* meta_lookup(FILE* fp, const s_blk* sb, const m_hdr* dir, const char* name) {
+	if (sb -> features & FEATURE_SORTED_DIRS) {
+		uint64_t lo = 0;
+		uint64_t hi = dir -> length;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			m_hdr* child = meta_child(fp, sb, dir, mid);
+			if (child == NULL) {
+				return NULL;
+			}
+			int cmp = strcmp(name, child -> name);
+			if (cmp == 0) {
+				return child;
+			}
+			free(child);
+			if (cmp < 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		return NULL;
+	}
+
+	for (uint64_t i = 0; i < dir -> length; i++) {
+		m_hdr* child = meta_child(fp, sb, dir, i);
+		if (child == NULL) {
+			return NULL;
+		}
+		if (strcmp(name, child -> name) == 0) {
+			return child;
+		}
+		free(child);
+	}
+	return NULL;
+}
+
+static void parseHeader(const unsigned char* buf, m_hdr* header) {
+	memcpy(header -> name, buf, sizeof(header -> name));
+	header -> name[sizeof(header -> name) - 1] = '\0';
+	const unsigned char* p = buf + sizeof(header -> name);
+	uint64_t v64;
+	uint32_t v32;
+	memcpy(&v64, p, 8); header -> length = be64toh(v64); p += 8;
+	memcpy(&v64, p, 8); header -> time = be64toh(v64); p += 8;
+	memcpy(&v64, p, 8); header -> offset = be64toh(v64); p += 8;
+	memcpy(&v32, p, 4); header -> type = (file_type) be32toh(v32);
+}
+
+static uint32_t parseInode(const unsigned char* buf, m_hdr* header) {
+	uint64_t v64;
+	uint32_t v32;
+	uint32_t name_offset;
+	memcpy(&v32, buf, 4); header -> type = (file_type) be32toh(v32);
+	memcpy(&v32, buf + 4, 4); name_offset = be32toh(v32);
+	memcpy(&v64, buf + 8, 8); header -> length = be64toh(v64);
+	memcpy(&v64, buf + 16, 8); header -> time = be64toh(v64);
+	memcpy(&v64, buf + 24, 8); header -> offset = be64toh(v64);
+	return name_offset;
+}
+
+/*
+* Read every child of dir into a malloc'd array, returns the number of children
+* or -1 on a malformed image. Children stored next to each other (compact
+* images, or headers mastered with --layout=grouped) are fetched with a single
+* read instead of one seek per child.
+*/
+static int64_t meta_list(FILE* fp, const s_blk* sb, const m_hdr* dir, m_hdr** children) {
+	uint64_t count = dir -> length;
+	*children = NULL;
+	if (count == 0) {
+		return 0;
+	}
+	if (count > sb -> entry_count) {
+		return -1;
+	}
+	m_hdr* out = (m_hdr*) malloc(count * sizeof(m_hdr));
+	unsigned char* buf = NULL;
+
+	if (sb -> features & FEATURE_COMPACT_METADATA) {
+		if (dir -> offset + count > sb -> entry_count) {
+			free(out);
+			return -1;
+		}
+		buf = (unsigned char*) malloc(count * INODE_SIZE);
+		fseek(fp, sb -> sections[SECTION_METADATA].offset + dir -> offset * INODE_SIZE, SEEK_SET);
+		fread(buf, INODE_SIZE, count, fp);
+		std::vector<uint32_t> name_offsets(count);
+		uint64_t lo = UINT64_MAX, hi = 0;
+		for (uint64_t i = 0; i < count; i++) {
+			name_offsets[i] = parseInode(buf + i * INODE_SIZE, &out[i]);
+			lo = name_offsets[i] < lo ? name_offsets[i] : lo;
+			hi = name_offsets[i] > hi ? name_offsets[i] : hi;
+		}
+		free(buf);
+
+		// Siblings' names are adjacent in the heap, fetch them in one read too
+		const section_entry& names = sb -> sections[SECTION_NAMES];
+		uint64_t end = hi + 256 < names.length ? hi + 256 : names.length;
+		if (lo >= end) {
+			free(out);
+			return -1;
+		}
+		buf = (unsigned char*) calloc(end - lo, 1);
+		fseek(fp, names.offset + lo, SEEK_SET);
+		fread(buf, 1, end - lo, fp);
+		for (uint64_t i = 0; i < count; i++) {
+			const unsigned char* name = buf + (name_offsets[i] - lo);
+			unsigned char length = name_offsets[i] + 1 + name[0] <= end ? name[0] : 0;
+			memcpy(out[i].name, name + 1, length);
+			out[i].name[length] = '\0';
+		}
+		free(buf);
+		*children = out;
+		return count;
+	}
+
+	const section_entry& meta = sb -> sections[SECTION_METADATA];
+	std::vector<uint64_t> offsets(count);
+	fseek(fp, dir -> offset, SEEK_SET);
+	fread(&offsets[0], sizeof(uint64_t), count, fp);
+	bool contiguous = true;
+	for (uint64_t i = 0; i < count; i++) {
+		offsets[i] = be64toh(offsets[i]);
+		if (offsets[i] < meta.offset || offsets[i] + M_HDR_SIZE > meta.offset + meta.length) {
+			free(out);
+			return -1;
+		}
+		contiguous = contiguous && offsets[i] == offsets[0] + i * M_HDR_SIZE;
+	}
+
+	if (contiguous) {
+		buf = (unsigned char*) malloc(count * M_HDR_SIZE);
+		fseek(fp, offsets[0], SEEK_SET);
+		fread(buf, M_HDR_SIZE, count, fp);
+		for (uint64_t i = 0; i < count; i++) {
+			parseHeader(buf + i * M_HDR_SIZE, &out[i]);
+		}
+		free(buf);
+	} else {
+		for (uint64_t i = 0; i < count; i++) {
+			m_hdr* child = readHeader(fp, offsets[i]);
+			out[i] = *child;
+			free(child);
+		}
+	}
+	*children = out;
+	return count;
+}
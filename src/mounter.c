@@ -4,7 +4,7 @@
 
 #include "OnDiskStructure.h"
 #include "ecc.cpp"
-#include "readFunctions.cpp"
+#include "metadata.cpp"
 #include <fuse.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,31 +16,220 @@
 #include <endian.h>
 #include <openssl/hmac.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "config/hashConstants.c"
+#include "config/compressionConstants.c"
+#include "config/scrubConstants.c"
+#include "config/chunkStoreConstants.c"
 #include "requestKey.cpp"
+#include "compression.cpp"
+#include "superblock.cpp"
+#include "pathIndex.cpp"
+#include "searchIndex.cpp"
+#include "parity.cpp"
+#include "merkle.cpp"
+#include "keyedHash.cpp"
+#include "crc32c.cpp"
+#include "chunkStore.cpp"
+#include "baseImage.cpp"
+#include "shards.cpp"
+#include "replicas.cpp"
+#include "splitImage.cpp"
+#include "imageIO.cpp"
+#include "scrub.cpp"
 
 //========================== Function Declarations ===========================//
 
 static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
 static m_hdr* find(const char* path);
+static int is_scrub_status(const char* path);
+static int read_compressed(const m_hdr* file_header, int in_base, char* buf, size_t size, off_t offset);
+static int read_chunked(const m_hdr* file_header, int in_base, char* buf, size_t size, off_t offset);
+static ssize_t verified_read(void* buf, size_t len, uint64_t offset);
+static ssize_t verified_read_from(int replica, void* buf, size_t len, uint64_t offset, int repair);
+static ssize_t payload_read(int in_base, void* buf, size_t len, uint64_t offset);
+static int open_base(const char* base_name, const char* key);
+static int open_shards(const char* first, const std::string& served_first, const std::string& dirs, int ecc,
+                       const char* key);
+static int open_split(const std::string& served, const std::string& data_name, int ecc, const char* key);
+static void open_replicas(const char* image_name, const std::string& names, int ecc, int lazy, const char* key);
+static int open_lazy_verify(const char* key, unsigned long cache_nodes, std::vector<uint64_t>* failed_blocks);
+static int load_crc_table(const char* key, unsigned long cache_nodes);
 void exit_program();
-int checkHash(const char* file_name, const char* key);
+int checkHash(const char* file_name, const char* key, std::vector<uint64_t>* failed_blocks = NULL);
+static int check_image_hash(FILE* image, const s_blk* image_sb, const char* file_name, const char* key,
+                            std::vector<uint64_t>* failed_blocks);
+static void open_image(const std::string& file_name, int direct, const s_blk* known);
+static int has_separate_parity(const char* file_name, s_blk* probed);
+static std::size_t interleaved_fec_length(const char* file_name);
 
 //========================== Global Variables ===============================//
 
 static unsigned long HASH_BLOCK_SIZE = DEF_HASH_BLOCK_SIZE;
 unsigned long image_file_size; 		// Stored to see if offset is safe or not
 FILE* fp;
+s_blk sb;							// Superblock of the mounted image
+static path_index pindex;			// Full path index, if the image has one
+static int use_path_index = 0;
 size_t prev_offset = 0;
 
+// Query files of the search index, if the image has one: /.wofs-search/<pattern> lists the matches
+#define SEARCH_DIR_PATH "/.wofs-search"
+static search_index sindex;
+static int use_search_index = 0;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::string search_last_pattern;		// getattr, open and read of one query share its answer
+static std::string search_last_answer;
+
+// Merkle images mounted with --lazy-verify check each hash block on its first read
+static int lazy_verify = 0;
+static merkle_verifier merkle;
+static volatile unsigned char* verified_blocks[REPLICA_MAX_COUNT];   // per replica, bitmap of blocks that verified
+static volatile unsigned char* bad_blocks[REPLICA_MAX_COUNT];        // and of blocks that did not, not read again
+
+// CRC32C of every crc_block_size bytes of the image, checked on every payload read (crc32c.cpp)
+static std::vector<uint32_t> crc_table;
+static uint64_t crc_block_size = 0;		// 0 if reads are not checked
+static uint64_t crc_covered = 0;		// bytes of the image the table covers
+static std::string hash_key;			// to check a hash block whose CRC does not match
+
+// Base image of a delta, verified in full when it is opened (baseImage.cpp)
+static FILE* base_fp = NULL;
+static s_blk base_sb;
+static int base_fd = -1;
+#define BASE_CACHE_KEY (1ULL << 63)		// set in the chunk cache key of payloads of the base
+
+// Shards of a striped image, read through image_read and, for the metadata, fp (shards.cpp)
+static shard_set shards;
+
+// Image and data files of a split image, read through image_read and fp (splitImage.cpp)
+static split_files split;
+
+// Replicas payloads are read from, checked like the image (replicas.cpp)
+static replica_set replicas;
+
+// Direct mapped cache of decompressed chunks, keyed by payload offset and chunk index
+struct chunk_cache_slot {
+	uint64_t payload;
+	uint32_t index;
+	uint32_t length;
+	char* data;
+};
+static struct chunk_cache_slot* chunk_cache;
+static unsigned long chunk_cache_slots;
+static pthread_mutex_t chunk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Chunk store the CHUNKED_FILE payloads are read from, and a direct mapped cache of
+// chunks that verified, keyed by their hash so files sharing a chunk share the slot
+static std::string chunk_store;
+struct store_cache_slot {
+	unsigned char id[CHUNK_ID_SIZE];
+	uint32_t length;
+	char* data;
+};
+static struct store_cache_slot* store_cache;
+static unsigned long store_cache_slots;
+static pthread_mutex_t store_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Read statistics reported when the file system is unmounted
+static uint64_t stat_bytes_read = 0;
+static uint64_t stat_read_nsec = 0;
+static uint64_t stat_chunk_hits = 0;
+static uint64_t stat_chunk_misses = 0;
+static uint64_t stat_store_hits = 0;
+static uint64_t stat_store_misses = 0;
+static uint64_t stat_crc_blocks = 0;
+static uint64_t stat_crc_mismatches = 0;
+
 static void *mount_init(struct fuse_conn_info *conn,
 			struct fuse_config *cfg)
 {
 	(void) conn;
 	cfg->kernel_cache = 1;
+	// Started here rather than in main, threads do not survive the daemon's fork
+	if (scrub_cfg.rate > 0) {
+		scrub_start();
+	}
+	if (image_shards != NULL) {
+		shard_set_start(image_shards);
+	}
 	return NULL;
 }
 
+static void mount_destroy(void* private_data)
+{
+	(void) private_data;
+	scrub_stop();
+	double seconds = stat_read_nsec / 1e9;
+	printf("Read %llu bytes in %.3f s", (unsigned long long) stat_bytes_read, seconds);
+	if (seconds > 0) {
+		printf(" (%.2f MB/s)", stat_bytes_read / seconds / 1e6);
+	}
+	printf("\n");
+	if (stat_chunk_hits + stat_chunk_misses > 0) {
+		printf("Compressed chunk cache: %llu hits, %llu misses\n",
+			(unsigned long long) stat_chunk_hits, (unsigned long long) stat_chunk_misses);
+	}
+	if (stat_store_hits + stat_store_misses > 0) {
+		printf("Chunk store cache: %llu hits, %llu misses\n",
+			(unsigned long long) stat_store_hits, (unsigned long long) stat_store_misses);
+	}
+	if (crc_block_size > 0) {
+		printf("CRC32C checked %llu blocks, %llu mismatches\n",
+			(unsigned long long) stat_crc_blocks, (unsigned long long) stat_crc_mismatches);
+	}
+	for (int r = 0; image_replicas != NULL && r < image_replicas -> count; r++) {
+		const replica& rep = image_replicas -> replicas[r];
+		printf("Replica %s: %llu reads, %llu failed, %.3f ms average latency\n", rep.name.c_str(),
+			(unsigned long long) rep.reads, (unsigned long long) rep.failures, rep.latency_nsec / 1e6);
+	}
+}
+
+// The scrubber's status file, served at the root while it runs but not listed
+static int is_scrub_status(const char* path) {
+	return scrub_enabled && strcmp(path, SCRUB_STATUS_PATH) == 0;
+}
+
+// The directory of search query files, served at the root but not listed
+static int is_search_dir(const char* path) {
+	return use_search_index && strcmp(path, SEARCH_DIR_PATH) == 0;
+}
+
+// Pattern of a query file in it, or NULL for any other path
+static const char* search_query_of(const char* path) {
+	size_t len = strlen(SEARCH_DIR_PATH);
+	if (!use_search_index || strncmp(path, SEARCH_DIR_PATH "/", len + 1) != 0 || path[len + 1] == '\0') {
+		return NULL;
+	}
+	return path + len + 1;
+}
+
+/*
+* Matching paths of the query, one per line, as they are seen under the mount
+* point. The last answer is kept, since a query is looked up, opened and read
+* in turn. Returns 0 or -EIO.
+*/
+static int search_answer(const char* pattern, std::string* answer) {
+	pthread_mutex_lock(&search_lock);
+	int res = 0;
+	if (search_last_pattern != pattern || search_last_answer.empty()) {
+		std::vector<std::string> matches;
+		if (search_query(fp, &sindex, pattern, false, &matches) < 0) {
+			res = -EIO;
+		} else {
+			search_last_pattern = pattern;
+			search_last_answer.clear();
+			for (size_t i = 0; i < matches.size(); i++) {
+				search_last_answer += matches[i] + "\n";
+			}
+		}
+	}
+	*answer = search_last_answer;
+	pthread_mutex_unlock(&search_lock);
+	return res;
+}
+
 /*
 * Return the metadata at the given path
 */
@@ -49,16 +238,32 @@ static m_hdr* find(const char* path) {
 		return NULL;
 	}
 
+	// The path index resolves the whole path with one slot and one header read
+	if (use_path_index) {
+		uint64_t location = path_index_lookup(fp, &pindex, path);
+		if (location == PATH_INDEX_EMPTY) {
+			return NULL;
+		}
+		m_hdr* header = meta_at(fp, &sb, location);
+		const char* last = strrchr(path, '/');
+		if (header != NULL && strcmp(header -> name, last + 1) != 0) {
+			free(header);
+			header = NULL;
+		}
+		return header;
+	}
+
 	//printf("Calling find on %s. \n", path);
 	char* pathCopy = (char*) malloc(strlen(path) + 1);
 	strcpy(pathCopy, path);
 	char* token = strtok(pathCopy, "/");
-	m_hdr* root = readHeader(fp, 0);
-	m_hdr* current = root;
+	m_hdr* current = meta_root(fp, &sb);
 
 	//printf("token found\n");
 	while (token != NULL) {
 		if (strcmp(current -> name, token) !=0) {
+			free(current);
+			free(pathCopy);
 			return NULL;
 		}
 		token = strtok(NULL, "/");
@@ -67,33 +272,20 @@ static m_hdr* find(const char* path) {
 			break;
 		}
 
-		if (current -> type == 1) {
+		if (is_file(current -> type)) {
+			free(pathCopy);
 			return current;
 		}
 
-		uint64_t initOffset = current -> offset;
-		int childFound = 0;
-		for (unsigned int i =0; i< current -> length; i++) {
-			uint64_t nextOffset = initOffset + i*sizeof(uint64_t);
-			uint64_t next_header_block = read64(fp, nextOffset);
-			if (next_header_block > image_file_size) {
-				printf("Attempting to traverse to a location out of range. \n");
-				printf("Please verify the correctness of the image \n");
-				//exit_program();
-			}
-			m_hdr* child = readHeader(fp, next_header_block);
-
-			if (strcmp(child -> name, token) == 0) {
-				current = child;
-				childFound = 1;
-				break;
-			}
-		}
-
-		if (!childFound) {
+		m_hdr* child = meta_lookup(fp, &sb, current, token);
+		free(current);
+		if (child == NULL) {
+			free(pathCopy);
 			return NULL;
 		}
+		current = child;
 	}
+	free(pathCopy);
 	return current;
 }
 
@@ -113,6 +305,28 @@ static int mount_getattr(const char *path, struct stat *stbuf,
 		return res;
 	}
 
+	if (is_scrub_status(path)) {			// Generated, so the size is only a hint
+		stbuf -> st_mode = S_IFREG | 0444;
+		stbuf -> st_nlink = 1;
+		stbuf -> st_size = scrub_status().size();
+		return res;
+	}
+
+	if (is_search_dir(path)) {
+		stbuf -> st_mode = S_IFDIR | 0444;
+		stbuf -> st_nlink = 2;
+		return res;
+	}
+	const char* pattern = search_query_of(path);
+	if (pattern != NULL) {
+		std::string answer;
+		res = search_answer(pattern, &answer);
+		stbuf -> st_mode = S_IFREG | 0444;
+		stbuf -> st_nlink = 1;
+		stbuf -> st_size = answer.size();
+		return res;
+	}
+
 	m_hdr* head = find(path);
 	if (head == NULL) {
 		return -ENOENT;
@@ -121,7 +335,7 @@ static int mount_getattr(const char *path, struct stat *stbuf,
 		stbuf -> st_mode = S_IFDIR | 0444;	// Read only access
 		stbuf -> st_nlink = head -> length; // for a directory length signifies # subchildren
 
-	} else if (head -> type == 1) { 		// File 
+	} else if (is_file(head -> type)) { 	// File 
 		stbuf->st_mode = S_IFREG | 0444;	// Read only access
 		stbuf->st_size = head -> length;
 		double file_size = head->length;
@@ -134,6 +348,7 @@ static int mount_getattr(const char *path, struct stat *stbuf,
 	}
 	stbuf->st_mtime = head -> time;
 
+	free(head);
 	return res;
 }
 
@@ -147,11 +362,16 @@ static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	m_hdr* dir_header;
 	if (strcmp(path, "/") == 0) {
-		dir_header = readHeader(fp, 0);
+		dir_header = meta_root(fp, &sb);
 		// Address of struct stat = NULL, next offset = 0 (not used)
 		filler(buf, ".", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 		filler(buf, "..", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 		filler(buf, dir_header -> name, NULL, 0, static_cast<fuse_fill_dir_flags>(0));
+		free(dir_header);
+		return 0;
+	} else if (is_search_dir(path)) {	// Query files are made up on lookup, none to list
+		filler(buf, ".", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
+		filler(buf, "..", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 		return 0;
 	} else {
 		dir_header = find(path);
@@ -162,6 +382,7 @@ static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	}
 
 	if (dir_header -> type != 0) {		// Not a directory
+		free(dir_header);
 		return -ENOENT; 
 	}
 
@@ -170,19 +391,35 @@ static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	filler(buf, "..", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 
 	// Fill the buffer with all subdirectories
-	uint64_t initOffset = dir_header -> offset;
-	for (unsigned int i =0; i< dir_header -> length; i++) {
-		uint64_t nextOffset = initOffset + i*sizeof(uint64_t);
-		uint64_t next_header_block = read64(fp, nextOffset);
-		m_hdr* child = readHeader(fp, next_header_block);
-		filler(buf, child->name, NULL, 0, static_cast<fuse_fill_dir_flags>(0));
+	m_hdr* children;
+	int64_t count = meta_list(fp, &sb, dir_header, &children);
+	free(dir_header);
+	if (count < 0) {
+		return -EIO;
+	}
+	for (int64_t i = 0; i < count; i++) {
+		filler(buf, children[i].name, NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 	}
+	free(children);
 
 	return 0; // no more files
 }
 
 static int mount_open(const char *path, struct fuse_file_info *fi)
 {
+	if (is_scrub_status(path)) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;					// Regenerated on every read, never cached
+		return 0;
+	}
+	if (search_query_of(path) != NULL) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		fi->direct_io = 1;
+		return 0;
+	}
+
 	m_hdr* file_header = find(path);
 
 
@@ -190,7 +427,9 @@ static int mount_open(const char *path, struct fuse_file_info *fi)
 		return -ENOENT;
 	}
 
-	if (file_header -> type != 1) {		// Not a file
+	int file_type = file_header -> type;
+	free(file_header);
+	if (!is_file(file_type)) {			// Not a file
 		return -ENOENT;
 	}
 
@@ -204,99 +443,1037 @@ static int mount_open(const char *path, struct fuse_file_info *fi)
 static int mount_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	size_t len;
 	(void) fi;
-	
+
+	if (is_scrub_status(path)) {
+		std::string status = scrub_status();
+		if ((uint64_t) offset >= status.size()) {
+			return 0;
+		}
+		size = status.size() - offset < size ? status.size() - offset : size;
+		memcpy(buf, status.data() + offset, size);
+		return size;
+	}
+	const char* pattern = search_query_of(path);
+	if (pattern != NULL) {
+		std::string answer;
+		int res = search_answer(pattern, &answer);
+		if (res != 0) {
+			return res;
+		}
+		if ((uint64_t) offset >= answer.size()) {
+			return 0;
+		}
+		size = answer.size() - offset < size ? answer.size() - offset : size;
+		memcpy(buf, answer.data() + offset, size);
+		return size;
+	}
+	scrub_note_foreground();
+
 	m_hdr* file_header = find(path);
 
 	if (file_header == NULL) {				// File not found
 		return -ENOENT;
 	}
 
-	if (file_header -> type != 1) {			// Not a file
+	if (!is_file(file_header -> type)) {		// Not a file
+		free(file_header);
 		return -ENOENT;
 	}
 
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// A file unchanged since the base image of a delta is read from its payload in the base
+	int in_base = file_header -> type == BASE_FILE;
+	if (in_base) {
+		unsigned char reference[BASE_REFERENCE_SIZE];
+		uint64_t base_offset;
+		uint32_t base_type;
+		if (verified_read(reference, BASE_REFERENCE_SIZE, file_header -> offset) != (ssize_t) BASE_REFERENCE_SIZE) {
+			free(file_header);
+			return -EIO;
+		}
+		memcpy(&base_offset, reference, sizeof(base_offset));
+		memcpy(&base_type, reference + sizeof(base_offset), sizeof(base_type));
+		file_header -> offset = be64toh(base_offset);
+		file_header -> type = (file_type) be32toh(base_type);
+		if (!is_file(file_header -> type) || file_header -> type == BASE_FILE) {
+			free(file_header);
+			return -EIO;
+		}
+	}
+
+	if (file_header -> type == COMPRESSED_FILE || file_header -> type == CHUNKED_FILE) {
+		int res = file_header -> type == COMPRESSED_FILE ? read_compressed(file_header, in_base, buf, size, offset)
+		                                                 : read_chunked(file_header, in_base, buf, size, offset);
+		free(file_header);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (res > 0) {
+			__sync_fetch_and_add(&stat_bytes_read, (uint64_t) res);
+		}
+		__sync_fetch_and_add(&stat_read_nsec, (uint64_t) ((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)));
+		return res;
+	}
+
 
 	size_t length = file_header -> length;
 	uint64_t data_block_offset = file_header -> offset;
-	fseek(fp, data_block_offset, SEEK_SET);
-	char* data_buffer = (char*) malloc(length);
-	fread((void*)data_buffer, 1, length, fp);
-	len = length;
-
-	if ((unsigned uint64_t) offset < len) {
-		if (offset + size > len)
-			size = len - offset;
-		memcpy(buf, data_buffer + offset, size);
+	free(file_header);
+
+	// Read only the requested range of the payload
+	if ((uint64_t) offset < length) {
+		if (offset + size > length)
+			size = length - offset;
+		ssize_t got = payload_read(in_base, buf, size, data_block_offset + offset);
+		if (got < 0) {
+			return got;
+		}
+		size = got;
 	} else
 		size = 0;
 
-	free(data_buffer);
 	prev_offset = offset;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	__sync_fetch_and_add(&stat_bytes_read, (uint64_t) size);
+	__sync_fetch_and_add(&stat_read_nsec, (uint64_t) ((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)));
 	return size;
 }
 
-int checkHash(const char* file_name, const char* key) {
+/*
+* Copy a decompressed chunk out of the cache. Returns 1 on a hit.
+*/
+static int chunk_cache_get(uint64_t payload, uint32_t index, char* out, uint32_t length) {
+	if (chunk_cache_slots == 0) {
+		return 0;
+	}
+	int hit = 0;
+	struct chunk_cache_slot* slot = &chunk_cache[(payload * 31 + index) % chunk_cache_slots];
+	pthread_mutex_lock(&chunk_cache_lock);
+	if (slot -> data != NULL && slot -> payload == payload && slot -> index == index && slot -> length == length) {
+		memcpy(out, slot -> data, length);
+		hit = 1;
+		stat_chunk_hits++;
+	} else {
+		stat_chunk_misses++;
+	}
+	pthread_mutex_unlock(&chunk_cache_lock);
+	return hit;
+}
+
+static void chunk_cache_put(uint64_t payload, uint32_t index, const char* data, uint32_t length) {
+	if (chunk_cache_slots == 0) {
+		return;
+	}
+	struct chunk_cache_slot* slot = &chunk_cache[(payload * 31 + index) % chunk_cache_slots];
+	pthread_mutex_lock(&chunk_cache_lock);
+	if (slot -> data == NULL || slot -> length < length) {
+		slot -> data = (char*) realloc(slot -> data, length);
+	}
+	memcpy(slot -> data, data, length);
+	slot -> payload = payload;
+	slot -> index = index;
+	slot -> length = length;
+	pthread_mutex_unlock(&chunk_cache_lock);
+}
+
+/*
+* Read from a COMPRESSED_FILE, inflating only the chunks that overlap
+* [offset, offset + size).
+*/
+static int read_compressed(const m_hdr* file_header, int in_base, char* buf, size_t size, off_t offset) {
+	uint64_t length = file_header -> length;
+	uint64_t payload = file_header -> offset;
+	uint64_t cache_key = in_base ? payload | BASE_CACHE_KEY : payload;
+	if ((uint64_t) offset >= length || size == 0) {
+		return 0;
+	}
+	if (offset + size > length) {
+		size = length - offset;
+	}
+
+	uint32_t prefix[2];
+	if (payload_read(in_base, prefix, sizeof(prefix), payload) != sizeof(prefix)) {
+		return -EIO;
+	}
+	uint32_t chunk_size = be32toh(prefix[0]);
+	uint32_t chunk_count = be32toh(prefix[1]);
+	if (chunk_size == 0 || chunk_count != compressed_chunk_count(length, chunk_size)) {
+		return -EIO;
+	}
+
+	uint32_t first = offset / chunk_size;
+	uint32_t last = (offset + size - 1) / chunk_size;
+
+	// Offsets of chunks first..last plus the end of the last chunk
+	uint32_t span = last - first + 2;
+	uint64_t* offsets = (uint64_t*) malloc(span * sizeof(uint64_t));
+	uint64_t index_offset = payload + COMPRESSED_PREFIX_SIZE + (uint64_t) first * sizeof(uint64_t);
+	if (payload_read(in_base, offsets, span * sizeof(uint64_t), index_offset) != (ssize_t) (span * sizeof(uint64_t))) {
+		free(offsets);
+		return -EIO;
+	}
+	for (uint32_t i = 0; i < span; i++) {
+		offsets[i] = be64toh(offsets[i]);
+	}
+
+	char* chunk = (char*) malloc(chunk_size);
+	char* stored = (char*) malloc(chunk_size);
+	size_t copied = 0;
+	int res = 0;
+	for (uint32_t i = first; i <= last; i++) {
+		uint32_t raw_len = compressed_chunk_length(length, chunk_size, i);
+		if (!chunk_cache_get(cache_key, i, chunk, raw_len)) {
+			uint64_t stored_len = offsets[i - first + 1] - offsets[i - first];
+			if (stored_len > raw_len) {
+				res = -EIO;
+				break;
+			}
+			if (payload_read(in_base, stored, stored_len, payload + offsets[i - first]) != (ssize_t) stored_len) {
+				res = -EIO;
+				break;
+			}
+			if (decompress_chunk(stored, stored_len, chunk, raw_len)) {
+				res = -EIO;
+				break;
+			}
+			chunk_cache_put(cache_key, i, chunk, raw_len);
+		}
+
+		uint64_t chunk_start = (uint64_t) i * chunk_size;
+		uint64_t from = (uint64_t) offset > chunk_start ? offset - chunk_start : 0;
+		uint64_t to = offset + size < chunk_start + raw_len ? offset + size - chunk_start : raw_len;
+		memcpy(buf + copied, chunk + from, to - from);
+		copied += to - from;
+	}
+
+	free(offsets);
+	free(chunk);
+	free(stored);
+	return res ? res : (int) copied;
+}
+
+/*
+* Copy a chunk store chunk out of the cache. Returns 1 on a hit.
+*/
+static int store_cache_get(const unsigned char* id, char* out, uint32_t length) {
+	if (store_cache_slots == 0) {
+		return 0;
+	}
+	uint64_t key;
+	memcpy(&key, id, sizeof(key));
+	int hit = 0;
+	struct store_cache_slot* slot = &store_cache[key % store_cache_slots];
+	pthread_mutex_lock(&store_cache_lock);
+	if (slot -> data != NULL && slot -> length == length && memcmp(slot -> id, id, CHUNK_ID_SIZE) == 0) {
+		memcpy(out, slot -> data, length);
+		hit = 1;
+		stat_store_hits++;
+	} else {
+		stat_store_misses++;
+	}
+	pthread_mutex_unlock(&store_cache_lock);
+	return hit;
+}
+
+static void store_cache_put(const unsigned char* id, const char* data, uint32_t length) {
+	if (store_cache_slots == 0) {
+		return;
+	}
+	uint64_t key;
+	memcpy(&key, id, sizeof(key));
+	struct store_cache_slot* slot = &store_cache[key % store_cache_slots];
+	pthread_mutex_lock(&store_cache_lock);
+	if (slot -> data == NULL || slot -> length < length) {
+		slot -> data = (char*) realloc(slot -> data, length);
+	}
+	memcpy(slot -> data, data, length);
+	memcpy(slot -> id, id, CHUNK_ID_SIZE);
+	slot -> length = length;
+	pthread_mutex_unlock(&store_cache_lock);
+}
+
+// End of chunk `index` of a chunk list at payload, 0 if it cannot be read
+static uint64_t chunk_end(int in_base, uint64_t payload, uint64_t index) {
+	uint64_t end;
+	if (payload_read(in_base, &end, sizeof(end), payload + CHUNK_LIST_PREFIX_SIZE + index * CHUNK_ENTRY_SIZE) != sizeof(end)) {
+		return 0;
+	}
+	return be64toh(end);
+}
+
+/*
+* Read from a CHUNKED_FILE: find the first chunk overlapping offset by a
+* binary search of the chunk list, then read the chunks up to offset + size
+* from the cache or the chunk store, each checked against its hash.
+*/
+static int read_chunked(const m_hdr* file_header, int in_base, char* buf, size_t size, off_t offset) {
+	uint64_t length = file_header -> length;
+	uint64_t payload = file_header -> offset;
+	if ((uint64_t) offset >= length || size == 0) {
+		return 0;
+	}
+	if (offset + size > length) {
+		size = length - offset;
+	}
+
+	uint64_t count;
+	if (payload_read(in_base, &count, sizeof(count), payload) != sizeof(count)) {
+		return -EIO;
+	}
+	count = be64toh(count);
+	if (count == 0 || count > length) {
+		return -EIO;
+	}
+	uint64_t low = 0, high = count - 1;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		uint64_t end = chunk_end(in_base, payload, middle);
+		if (end == 0) {
+			return -EIO;
+		}
+		if (end > (uint64_t) offset) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	uint64_t start = low > 0 ? chunk_end(in_base, payload, low - 1) : 0;
+	if (low > 0 && start == 0) {
+		return -EIO;
+	}
+
+	unsigned char entry[CHUNK_ENTRY_SIZE];
+	char* chunk = NULL;
+	size_t copied = 0;
+	int res = 0;
+	for (uint64_t i = low; i < count && start < (uint64_t) offset + size; i++) {
+		if (payload_read(in_base, entry, CHUNK_ENTRY_SIZE, payload + CHUNK_LIST_PREFIX_SIZE + i * CHUNK_ENTRY_SIZE)
+		    != (ssize_t) CHUNK_ENTRY_SIZE) {
+			res = -EIO;
+			break;
+		}
+		uint64_t end;
+		memcpy(&end, entry, sizeof(end));
+		end = be64toh(end);
+		const unsigned char* id = entry + sizeof(end);
+		if (end <= start || end - start > CDC_MAX_CHUNK || end > length) {
+			res = -EIO;
+			break;
+		}
+		uint32_t chunk_len = end - start;
+		chunk = (char*) realloc(chunk, chunk_len);
+		if (!store_cache_get(id, chunk, chunk_len)) {
+			if (chunk_store_get(chunk_store, id, chunk, chunk_len) != 0) {
+				printf("Chunk %llu of a file is missing from the chunk store or damaged\n", (unsigned long long) i);
+				res = -EIO;
+				break;
+			}
+			store_cache_put(id, chunk, chunk_len);
+		}
+
+		uint64_t from = (uint64_t) offset > start ? offset - start : 0;
+		uint64_t to = offset + size < end ? offset + size - start : chunk_len;
+		memcpy(buf + copied, chunk + from, to - from);
+		copied += to - from;
+		start = end;
+	}
+
+	free(chunk);
+	return res ? res : (int) copied;
+}
+
+/*
+* Check a hash block as it reads now from a replica against the Merkle tree,
+* or its stored hash. Returns 0 if it verifies.
+*/
+static int check_hash_block(int replica, uint64_t block) {
+	uint64_t image_size = sb.sections[SECTION_HASHES].offset;
+	uint64_t offset = block * HASH_BLOCK_SIZE;
+	uint64_t length = image_size - offset < HASH_BLOCK_SIZE ? image_size - offset : HASH_BLOCK_SIZE;
+	unsigned char* buffer = (unsigned char*) malloc(length);
+	int ok = buffer != NULL && image_read_replica(replica, buffer, length, offset) == (ssize_t) length;
+	if (ok && (sb.features & FEATURE_MERKLE_HASHES)) {
+		unsigned char leaf[MERKLE_HASH_SIZE];
+		merkle_leaf(buffer, length, leaf);
+		ok = merkle_verify_leaf(&merkle, block, leaf);
+	} else if (ok) {
+		unsigned char stored[KEYED_HASH_SIZE];
+		unsigned char digest[KEYED_HASH_SIZE];
+		const unsigned char* message = buffer;
+		ok = image_read_replica(replica, stored, KEYED_HASH_SIZE, image_size + block * KEYED_HASH_SIZE)
+		     == KEYED_HASH_SIZE;
+		keyed_hash_many(sb.hash_algorithm, hash_key.c_str(), hash_key.size(), &message, 1, length, digest);
+		ok = ok && memcmp(stored, digest, KEYED_HASH_SIZE) == 0;
+	}
+	free(buffer);
+	return ok ? 0 : -EIO;
+}
+
+/*
+* Check a hash block of a replica against the Merkle tree, once. Returns 0 if
+* it verifies.
+*/
+static int verify_block(int replica, uint64_t block) {
+	volatile unsigned char* verified = verified_blocks[replica];
+	volatile unsigned char* failed = bad_blocks[replica];
+	if (verified[block / 8] & (1 << block % 8)) {
+		return 0;
+	}
+	if (failed[block / 8] & (1 << block % 8)) {
+		return -EIO;
+	}
+	if (check_hash_block(replica, block) != 0) {
+		printf("Hash block %llu failed verification\n", (unsigned long long) block);
+		__sync_fetch_and_or(&failed[block / 8], (unsigned char) (1 << block % 8));
+		return -EIO;
+	}
+	__sync_fetch_and_or(&verified[block / 8], (unsigned char) (1 << block % 8));
+	return 0;
+}
+
+/*
+* Bytes [offset, offset + len) of a replica failed their CRC: the keyed hash
+* of the hash blocks holding them decides. With repair and --scrub a block of
+* the image itself that fails is corrected from the parity, and repaired if
+* the scrubber may. Returns 0 if they all verify now, in which case the CRC
+* entry was the damaged part or the damage was repaired.
+*/
+static int crc_escalate(int replica, uint64_t offset, uint64_t len, int repair) {
+	__sync_fetch_and_add(&stat_crc_mismatches, 1);
+	uint64_t last = (offset + len - 1) / HASH_BLOCK_SIZE;
+	for (uint64_t block = offset / HASH_BLOCK_SIZE; block <= last; block++) {
+		if (check_hash_block(replica, block) == 0) {
+			continue;
+		}
+		if (repair && replica == 0 && scrub_repair_block(block) && check_hash_block(replica, block) == 0) {
+			printf("Hash block %llu failed its CRC and hash, repaired from the parity\n", (unsigned long long) block);
+			continue;
+		}
+		printf("Hash block %llu failed its CRC and hash\n", (unsigned long long) block);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+* Read checked against the CRC table, widened to whole CRC blocks. A block
+* that does not match is escalated to its hash block, and read again if that
+* verifies.
+*/
+static ssize_t crc_read(int replica, void* buf, size_t len, uint64_t offset, int repair) {
+	uint64_t start = offset / crc_block_size * crc_block_size;
+	uint64_t end = (offset + len + crc_block_size - 1) / crc_block_size * crc_block_size;
+	end = end < crc_covered ? end : crc_covered;
+	int widened = start != offset || end != offset + len;
+	unsigned char* data = widened ? (unsigned char*) malloc(end - start) : (unsigned char*) buf;
+	if (data == NULL) {
+		return -ENOMEM;
+	}
+	ssize_t res = image_read_replica(replica, data, end - start, start) == (ssize_t) (end - start) ? (ssize_t) len
+	                                                                                              : -EIO;
+	for (uint64_t at = start; res >= 0 && at < end; at += crc_block_size) {
+		uint64_t length = end - at < crc_block_size ? end - at : crc_block_size;
+		if (crc32c(0, data + (at - start), length) == crc_table[at / crc_block_size]) {
+			continue;
+		}
+		if (crc_escalate(replica, at, length, repair) != 0
+		    || image_read_replica(replica, data + (at - start), length, at) != (ssize_t) length) {
+			res = -EIO;
+		}
+	}
+	__sync_fetch_and_add(&stat_crc_blocks, (end - start + crc_block_size - 1) / crc_block_size);
+	if (widened) {
+		if (res >= 0) {
+			memcpy(buf, data + (offset - start), len);
+		}
+		free(data);
+	}
+	return res;
+}
+
+/*
+* Payload read from a replica, checking the hash blocks it overlaps first with
+* --lazy-verify, and every block it returns against the CRC table if the image
+* has one. repair allows correcting the image itself from its parity.
+*/
+static ssize_t verified_read_from(int replica, void* buf, size_t len, uint64_t offset, int repair) {
+	if (lazy_verify && len > 0) {
+		uint64_t last = (offset + len - 1) / HASH_BLOCK_SIZE;
+		for (uint64_t block = offset / HASH_BLOCK_SIZE; block <= last; block++) {
+			int res = verify_block(replica, block);
+			if (res != 0) {
+				return res;
+			}
+		}
+	}
+	if (crc_block_size > 0 && len > 0 && offset + len <= crc_covered) {
+		return crc_read(replica, buf, len, offset, repair);
+	}
+	return image_read_replica(replica, buf, len, offset);
+}
+
+/*
+* Replicas holding a hash block of the range that already failed lazy
+* verification, which are not read for it again
+*/
+static uint32_t replicas_known_bad(size_t len, uint64_t offset) {
+	uint32_t bad = 0;
+	if (!lazy_verify || len == 0) {
+		return 0;
+	}
+	uint64_t last = (offset + len - 1) / HASH_BLOCK_SIZE;
+	for (int r = 0; r < image_replicas -> count; r++) {
+		volatile unsigned char* failed = bad_blocks[r];
+		for (uint64_t block = offset / HASH_BLOCK_SIZE; failed != NULL && block <= last; block++) {
+			if (failed[block / 8] & (1 << block % 8)) {
+				bad |= 1u << r;
+				break;
+			}
+		}
+	}
+	return bad;
+}
+
+/*
+* Payload read from the replica expected to serve it first. A replica whose
+* read fails is left out and the others are tried, and only once they have
+* all failed is the image itself corrected from its parity.
+*/
+static ssize_t verified_read(void* buf, size_t len, uint64_t offset) {
+	if (image_replicas == NULL) {
+		return verified_read_from(0, buf, len, offset, 1);
+	}
+	uint32_t failed = replicas_known_bad(len, offset);
+	ssize_t res = -EIO;
+	for (int r = replica_pick(image_replicas, failed); r >= 0; r = replica_pick(image_replicas, failed)) {
+		res = verified_read_from(r, buf, len, offset, 0);
+		if (res >= 0) {
+			return res;
+		}
+		failed |= 1u << r;
+		if (__sync_fetch_and_add(&image_replicas -> replicas[r].failures, 1) == 0) {
+			printf("A read failed on replica %s, retrying it on the others\n", image_replicas -> replicas[r].name.c_str());
+		}
+	}
+	return scrub_enabled ? verified_read_from(0, buf, len, offset, 1) : res;
+}
+
+/*
+* Payload read from the mounted image, or from the base image of a delta,
+* which was verified when it was opened
+*/
+static ssize_t payload_read(int in_base, void* buf, size_t len, uint64_t offset) {
+	return in_base ? pread_full(base_fd, buf, len, offset) : verified_read(buf, len, offset);
+}
+
+/*
+* Load the CRC table for verified_read. A block failing its CRC is checked
+* against its hash, so a Merkle image mounted without --lazy-verify opens its
+* tree here too. Returns 0 on success.
+*/
+static int load_crc_table(const char* key, unsigned long cache_nodes) {
+	uint64_t covered = sb.sections[SECTION_CRC].offset;
+	uint64_t count = sb.crc_block_size > 0 ? (covered + sb.crc_block_size - 1) / sb.crc_block_size : 0;
+	if (count == 0 || sb.sections[SECTION_CRC].length != count * sizeof(uint32_t)) {
+		return -1;
+	}
+	crc_table.resize(count);
+	if (image_read(&crc_table[0], count * sizeof(uint32_t), covered) != (ssize_t) (count * sizeof(uint32_t))) {
+		return -1;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		crc_table[i] = be32toh(crc_table[i]);
+	}
+	if ((sb.features & FEATURE_MERKLE_HASHES) && !lazy_verify) {
+		uint64_t image_size = sb.sections[SECTION_HASHES].offset;
+		uint64_t leaves = (image_size + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+		if (merkle_open(&merkle, image_fd, image_size, leaves, key, cache_nodes) != 0) {
+			return -1;
+		}
+	}
+	hash_key = key;
+	crc_covered = covered;
+	crc_block_size = sb.crc_block_size;
+	return 0;
+}
+
+/*
+* Check the keyed root of a Merkle image and the hash blocks holding anything
+* but file payloads, the rest are verified when they are first read. Returns
+* 1 if they all verify, collecting the failing blocks in failed_blocks if given.
+*/
+static int open_lazy_verify(const char* key, unsigned long cache_nodes, std::vector<uint64_t>* failed_blocks) {
+	uint64_t image_size = sb.sections[SECTION_HASHES].offset;
+	if (HASH_BLOCK_SIZE > image_size) {
+		HASH_BLOCK_SIZE = image_size;
+	}
+	uint64_t leaves = (image_size + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+	if (sb.sections[SECTION_HASHES].length != merkle_section_length(leaves)
+	    || merkle_open(&merkle, image_fd, image_size, leaves, key, cache_nodes) != 0) {
+		return 0;
+	}
+	free((void*) verified_blocks[0]);
+	free((void*) bad_blocks[0]);
+	verified_blocks[0] = (volatile unsigned char*) calloc((leaves + 7) / 8, 1);
+	bad_blocks[0] = (volatile unsigned char*) calloc((leaves + 7) / 8, 1);
+	lazy_verify = 1;
+
+	// The superblock and metadata are read through fp rather than verified_read
+	uint64_t data_first = sb.sections[SECTION_DATA].offset / HASH_BLOCK_SIZE;
+	uint64_t data_last = (sb.sections[SECTION_DATA].offset + sb.sections[SECTION_DATA].length) / HASH_BLOCK_SIZE;
+	int ok = 1;
+	for (uint64_t block = 0; block < leaves; block++) {
+		int payload_only = sb.sections[SECTION_DATA].length > 0 && block > data_first && block < data_last;
+		if (!payload_only && verify_block(0, block) != 0) {
+			ok = 0;
+			if (failed_blocks == NULL) {
+				break;
+			}
+			failed_blocks -> push_back(block);
+		}
+	}
+	return ok;
+}
+
+/*
+* Verify the image against the hashes stored in it. Stops at the first
+* mismatch, unless failed_blocks is given to collect every failing hash block.
+* A Merkle tree is checked in parallel, every block.
+*/
+int checkHash(const char* file_name, const char* key, std::vector<uint64_t>* failed_blocks) {
+	uint64_t image_size = sb.sections[SECTION_HASHES].offset;
+	if (HASH_BLOCK_SIZE > image_size) {
+		HASH_BLOCK_SIZE = image_size;
+	}
+	return check_image_hash(fp, &sb, file_name, key, failed_blocks);
+}
+
+/*
+* checkHash of any image, the mounted one or the base of a delta
+*/
+static int check_image_hash(FILE* image, const s_blk* image_sb, const char* file_name, const char* key,
+                            std::vector<uint64_t>* failed_blocks) {
 	
 	struct stat st;
  	stat(file_name, &st);
-  	long file_size = st.st_size;
+  	uint64_t file_size = st.st_size;
 
-  	int hash_size = 32; //size of each hash
+  	int hash_size = KEYED_HASH_SIZE; //size of each hash
 
-  	// Determine the number of hashes that was generated during mastering
-  	uint64_t number_hash_location = file_size - sizeof(uint32_t);
-	uint32_t number_hashes = read32(fp, number_hash_location);
-	uint64_t hashes_offset = number_hash_location - hash_size * number_hashes;
+  	// The superblock locates the hashes generated during mastering
+	uint64_t hashes_offset = image_sb -> sections[SECTION_HASHES].offset;
+	uint64_t hashes_length = image_sb -> sections[SECTION_HASHES].length;
+	if (hashes_offset + hashes_length > file_size || hashes_length % hash_size != 0) {
+		return 0;
+	}
 	uint64_t image_size = hashes_offset;
-	uint64_t remaining = image_size;
 
-	if (HASH_BLOCK_SIZE > image_size) {
-		HASH_BLOCK_SIZE = image_size;
+	uint64_t block_size = image_sb -> hash_block_size > image_size ? image_size : image_sb -> hash_block_size;
+	if (block_size == 0) {
+		return 0;
+	}
+	if (image_sb -> features & FEATURE_MERKLE_HASHES) {
+		uint64_t leaves = (image_size + block_size - 1) / block_size;
+		if (hashes_length != merkle_section_length(leaves)) {
+			return 0;
+		}
+		return merkle_check_file(file_name, image_size, block_size, key, failed_blocks) == 1;
+	}
+
+	uint64_t block_count = (image_size + block_size - 1) / block_size;
+
+	// Blocks are hashed a batch at a time with the algorithm the image was mastered with (keyedHash.cpp)
+	std::vector<unsigned char> buffer(block_size * SHA256_MAX_LANES);
+	unsigned char mastered_hashes[SHA256_MAX_LANES * hash_size];
+	unsigned char digests[SHA256_MAX_LANES * hash_size];
+	for (uint64_t first = 0; first < block_count; first += SHA256_MAX_LANES) {
+		uint64_t count = block_count - first < SHA256_MAX_LANES ? block_count - first : SHA256_MAX_LANES;
+
+		// read the hashes saved in the mastered image
+		fseek(image, hashes_offset + first * hash_size, SEEK_SET);
+		fread(mastered_hashes, hash_size, count, image);
+
+		// generate the hashes based on the data in the master image
+		uint64_t offset = first * block_size;
+		uint64_t length = image_size - offset < count * block_size ? image_size - offset : count * block_size;
+		fseek(image, offset, SEEK_SET);
+		fread(&buffer[0], sizeof(char), length, image);
+		const unsigned char* blocks[SHA256_MAX_LANES];
+		for (uint64_t i = 0; i < count; i++) {
+			blocks[i] = &buffer[i * block_size];
+		}
+		// only the last block of the image can be short
+		uint64_t full = length / block_size;
+		keyed_hash_many(image_sb -> hash_algorithm, key, strlen(key), blocks, full, block_size, digests);
+		if (full < count) {
+			keyed_hash_many(image_sb -> hash_algorithm, key, strlen(key), blocks + full, 1, length % block_size,
+			                &digests[full * hash_size]);
+		}
+
+		// compare the hashes
+		for (uint64_t i = 0; i < count; i++) {
+			if (memcmp(&mastered_hashes[i * hash_size], &digests[i * hash_size], hash_size) != 0) {
+				if (failed_blocks == NULL) {
+					return 0;
+				}
+				failed_blocks -> push_back(first + i);
+			}
+		}
+	}
+  	return failed_blocks == NULL || failed_blocks -> empty();
+}
+
+/*
+* Open the base image of a delta: it must be the image the delta was mastered
+* against, and it is checked against its hashes in full now, so its payloads
+* are read without further checks. Returns 0 on success.
+*/
+static int open_base(const char* base_name, const char* key) {
+	base_fp = fopen(base_name, "r");
+	if (base_fp == NULL) {
+		printf("Unable to open the base image %s\n", base_name);
+		return -1;
+	}
+	unsigned char id[BASE_ID_SIZE];
+	int status = read_superblock(base_fp, &base_sb);
+	if (status != SB_OK) {
+		printf("Unable to read the base image: %s.\n", superblock_error(status));
+		return -1;
+	}
+	if (!base_image_usable(base_fp, &base_sb) || base_image_id(base_fp, &base_sb, id) != 0
+	    || memcmp(id, sb.base_id, BASE_ID_SIZE) != 0) {
+		printf("%s is not the base image the delta was mastered against\n", base_name);
+		return -1;
+	}
+	if (!check_image_hash(base_fp, &base_sb, base_name, key, NULL)) {
+		printf("The base image failed its hash check\n");
+		return -1;
+	}
+	base_fd = open(base_name, O_RDONLY);
+	return base_fd < 0 ? -1 : 0;
+}
+
+/*
+* Decode a replica from its ECC if needed, and check it is the mounted image
+*/
+struct replica_check {
+	std::string name;           // replica as given
+	std::string served;         // replica as read, its decoded copy with interleaved ECC
+	int decode;
+	std::size_t fec_length;
+	const unsigned char* image_id;
+	int verify;                 // check every hash block now, not only the id
+	const char* key;
+	int ok;
+	pthread_t thread;
+};
+
+static void* replica_check_main(void* arg) {
+	replica_check* check = (replica_check*) arg;
+	check -> ok = 0;
+	if (check -> decode && decode(check -> name, check -> served, check -> fec_length) != 0) {
+		return NULL;
+	}
+	FILE* image = fopen(check -> served.c_str(), "r");
+	if (image == NULL) {
+		return NULL;
+	}
+	s_blk replica_sb;
+	unsigned char id[BASE_ID_SIZE];
+	check -> ok = read_superblock(image, &replica_sb) == SB_OK
+	              && memcmp(replica_sb.sections, sb.sections, sizeof(sb.sections)) == 0
+	              && base_image_id(image, &replica_sb, id) == 0 && memcmp(id, check -> image_id, BASE_ID_SIZE) == 0
+	              && (!check -> verify || check_image_hash(image, &replica_sb, check -> served.c_str(), check -> key, NULL));
+	fclose(image);
+	return NULL;
+}
+
+/*
+* Open the replicas of the mounted image, image_name, named in names, colon
+* separated, side by side. Each is decoded from interleaved ECC unless !ecc and must have the
+* id of the image (baseImage.cpp); it is checked against its hashes now, or
+* with lazy as its blocks are read. A replica that fails is left out.
+*/
+static void open_replicas(const char* image_name, const std::string& names, int ecc, int lazy, const char* key) {
+	unsigned char image_id[BASE_ID_SIZE];
+	if (base_image_id(fp, &sb, image_id) != 0) {
+		printf("The image has no hashes to compare replicas by, reading it alone\n");
+		return;
+	}
+	std::vector<replica_check> checks;
+	size_t start = 0;
+	while (start <= names.size() && checks.size() + 1 < REPLICA_MAX_COUNT) {
+		size_t end = names.find(':', start);
+		end = end == std::string::npos ? names.size() : end;
+		replica_check check;
+		check.name = names.substr(start, end - start);
+		start = end + 1;
+		s_blk probed;
+		check.decode = ecc && !has_separate_parity(check.name.c_str(), &probed);
+		check.served = check.decode ? check.name + ".rec" : check.name;
+		check.fec_length = check.decode ? interleaved_fec_length(check.name.c_str()) : 0;
+		check.image_id = image_id;
+		check.verify = !lazy;
+		check.key = key;
+		checks.push_back(check);
+	}
+	for (size_t i = 0; i < checks.size(); i++) {
+		if (pthread_create(&checks[i].thread, NULL, replica_check_main, &checks[i]) != 0) {
+			replica_check_main(&checks[i]);
+			checks[i].thread = pthread_self();
+		}
+	}
+
+	replicas.count = 1;
+	replicas.replicas[0].fd = image_fd;
+	replicas.replicas[0].name = image_name;
+	uint64_t leaves = (sb.sections[SECTION_HASHES].offset + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+	for (size_t i = 0; i < checks.size(); i++) {
+		if (!pthread_equal(checks[i].thread, pthread_self())) {
+			pthread_join(checks[i].thread, NULL);
+		}
+		int fd = checks[i].ok ? open(checks[i].served.c_str(), O_RDONLY) : -1;
+		if (fd < 0) {
+			printf("Replica %s is not a readable copy of the image, leaving it out\n", checks[i].name.c_str());
+			continue;
+		}
+		replica& rep = replicas.replicas[replicas.count];
+		rep.fd = fd;
+		rep.name = checks[i].name;
+		if (lazy) {
+			verified_blocks[replicas.count] = (volatile unsigned char*) calloc((leaves + 7) / 8, 1);
+			bad_blocks[replicas.count] = (volatile unsigned char*) calloc((leaves + 7) / 8, 1);
+		}
+		replicas.count++;
 	}
+	if (replicas.count > 1) {
+		printf("Reading payloads from %d replicas\n", replicas.count);
+		image_replicas = &replicas;
+	}
+}
+
+/*
+* Decode a shard of a striped image from its ECC if needed and check it
+* against its own hashes
+*/
+struct shard_check {
+	std::string name;           // shard as given
+	std::string served;         // shard as read, its decoded copy with ECC
+	int decode;
+	std::size_t fec_length;
+	s_blk shard_sb;             // locates the hashes of the shard
+	const char* key;
+	int ok;
+	pthread_t thread;
+};
+
+static void* shard_check_main(void* arg) {
+	shard_check* check = (shard_check*) arg;
+	check -> ok = 0;
+	if (check -> decode && decode(check -> name, check -> served, check -> fec_length) != 0) {
+		return NULL;
+	}
+	FILE* shard = fopen(check -> served.c_str(), "r");
+	if (shard != NULL) {
+		check -> ok = check_image_hash(shard, &check -> shard_sb, check -> served.c_str(), check -> key, NULL);
+		fclose(shard);
+	}
+	return NULL;
+}
+
+/*
+* Open the shards of a striped image whose shard 0, named first, is served
+* from served_first, the others being in dirs if not empty (shard_name). They
+* are decoded from their ECC unless !ecc, and every shard is checked against
+* its hashes, side by side. Returns 1 if they all verify.
+*/
+static int open_shards(const char* first, const std::string& served_first, const std::string& dirs, int ecc,
+                       const char* key) {
+	shard_geometry geo = {sb.sections[SECTION_HASHES].offset, sb.stripe_unit, sb.shard_count};
+	if (!shard_count_supported(geo.count) || !shard_unit_supported(geo.unit) || geo.logical_size == 0) {
+		printf("The image is striped over %llu shards of %llu byte units, which is not supported\n",
+			(unsigned long long) geo.count, (unsigned long long) geo.unit);
+		exit_program();
+	}
+	if (shard_name(first, 0, dirs).empty()) {
+		printf("The image is striped, use --image=<image>.0%s to name its first shard\n", ecc ? "" : ".necc");
+		exit_program();
+	}
+
+	std::vector<shard_check> checks(geo.count);
+	std::size_t fec_length = ecc ? interleaved_fec_length(first) : 0;
+	for (uint64_t k = 0; k < geo.count; k++) {
+		shard_check& check = checks[k];
+		check.name = k == 0 ? first : shard_name(first, k, dirs);
+		check.served = k == 0 ? served_first : ecc ? check.name + ".rec" : check.name;
+		check.decode = ecc && k > 0;
+		check.fec_length = fec_length;
+		check.shard_sb = sb;
+		check.shard_sb.features = 0;
+		uint64_t length = shard_length(geo, k);
+		uint64_t block_size = sb.hash_block_size < length ? sb.hash_block_size : length;
+		check.shard_sb.sections[SECTION_HASHES].offset = length;
+		check.shard_sb.sections[SECTION_HASHES].length = block_size == 0 ? 0
+		                                                 : (length + block_size - 1) / block_size * KEYED_HASH_SIZE;
+		check.key = key;
+		if (pthread_create(&check.thread, NULL, shard_check_main, &check) != 0) {
+			shard_check_main(&check);
+			check.thread = pthread_self();
+		}
+	}
+	int ok = 1;
+	int fds[SHARD_MAX_COUNT];
+	for (uint64_t k = 0; k < geo.count; k++) {
+		if (!pthread_equal(checks[k].thread, pthread_self())) {
+			pthread_join(checks[k].thread, NULL);
+		}
+		fds[k] = open(checks[k].served.c_str(), O_RDONLY);
+		if (fds[k] < 0) {
+			printf("Unable to open shard %s\n", checks[k].served.c_str());
+			exit_program();
+		}
+		if (!checks[k].ok) {
+			printf("Shard %s failed its %s\n", checks[k].name.c_str(), checks[k].decode ? "decoding or hash check" : "hash check");
+			ok = 0;
+		}
+	}
+	printf("Reading the image from %llu shards of %llu byte units\n",
+		(unsigned long long) geo.count, (unsigned long long) geo.unit);
+
+	shard_set_open(&shards, geo, fds);
+	image_shards = &shards;
+	fclose(fp);
+	fp = shard_fopen(&shards);
+	return ok;
+}
 
-	int block_size = HASH_BLOCK_SIZE;
-	int hash_count = 0; // running tally of number of hashes checked
+/*
+* Open the data file of a split image served from served, decoding it from its
+* ECC unless !ecc. The image file and the data file are checked against their
+* hashes side by side, and the data file must have the id the superblock
+* records. Returns 1 if they verify.
+*/
+static int open_split(const std::string& served, const std::string& data_name, int ecc, const char* key) {
+	split.geo.data_offset = sb.sections[SECTION_DATA].offset;
+	split.geo.data_length = sb.sections[SECTION_DATA].length;
+	split.geo.image_size = sb.sections[SECTION_HASHES].offset + split.geo.data_length;
+	if (split.geo.data_length == 0 || split.geo.data_offset > sb.sections[SECTION_HASHES].offset) {
+		printf("The data section of the split image is malformed\n");
+		exit_program();
+	}
 
-	// malloc the buffer because it could be large
-	unsigned char* buffer = (unsigned char*) malloc(block_size * sizeof(char));
-	if (buffer == NULL) {
-		printf("Call to allocate buffer failed\n");
+	// the data file has no superblock, its hashes are located like those of a shard
+	shard_check data;
+	data.name = data_name;
+	data.decode = ecc;
+	data.served = ecc ? data_name + ".rec" : data_name;
+	data.fec_length = interleaved_fec_length(served.c_str());
+	data.shard_sb = sb;
+	data.shard_sb.features = 0;
+	uint64_t block_size = sb.hash_block_size < split.geo.data_length ? sb.hash_block_size : split.geo.data_length;
+	data.shard_sb.sections[SECTION_HASHES].offset = split.geo.data_length;
+	data.shard_sb.sections[SECTION_HASHES].length = (split.geo.data_length + block_size - 1) / block_size * KEYED_HASH_SIZE;
+	data.key = key;
+	int threaded = pthread_create(&data.thread, NULL, shard_check_main, &data) == 0;
+	if (!threaded) {
+		shard_check_main(&data);
+	}
+	int image_ok = checkHash(served.c_str(), key);
+	if (threaded) {
+		pthread_join(data.thread, NULL);
+	}
+
+	FILE* data_fp = fopen(data.served.c_str(), "r");
+	unsigned char id[BASE_ID_SIZE];
+	int linked = data_fp != NULL && base_image_id(data_fp, &data.shard_sb, id) == 0
+	             && memcmp(id, sb.data_id, BASE_ID_SIZE) == 0;
+	if (data_fp == NULL) {
+		printf("Unable to open the data file %s, use --data=<file> to name it\n", data.served.c_str());
+		exit_program();
+	}
+	fclose(data_fp);
+	if (!linked) {
+		printf("%s is not the data file of the image\n", data_name.c_str());
+	} else if (!data.ok) {
+		printf("The data file %s failed its %s\n", data_name.c_str(), ecc ? "decoding or hash check" : "hash check");
+	}
+	printf("Reading file data from %s\n", data.served.c_str());
+
+	split.image_fd = image_fd;
+	split.data_fd = open(data.served.c_str(), O_RDONLY);
+	image_split = &split;
+	fclose(fp);
+	fp = split_fopen(&split);
+	return image_ok && linked && data.ok;
+}
+
+/*
+* Open the image the mounter serves and read its superblock, unless it is
+* already known
+*/
+static void open_image(const std::string& file_name, int direct, const s_blk* known) {
+	fp = fopen(file_name.c_str(), "r");
+	if (fp == NULL) {
+		printf("Unable to open %s\n", file_name.c_str());
 		exit(0);
 	}
+	int sb_status = SB_OK;
+	if (known != NULL) {
+		sb = *known;
+	} else {
+		sb_status = read_superblock(fp, &sb);
+	}
+	if (sb_status != SB_OK) {
+		std::cout << "\033[0;31m" <<"Error" << "\033[0m" << std::endl;
+		printf("Unable to read image: %s.\n", superblock_error(sb_status));
+		exit_program();
+	}
+	HASH_BLOCK_SIZE = sb.hash_block_size;
+	// Striped and split images are read through their shards or data file, so no O_DIRECT descriptor
+	if (sb.features & (FEATURE_STRIPED | FEATURE_SPLIT_DATA)) {
+		direct = 0;
+	}
+	if (image_open(file_name.c_str(), direct) != 0) {
+		printf("Unable to open %s\n", file_name.c_str());
+		exit_program();
+	}
+}
 
-	while (remaining > 0) {
-
-		// read the hash saved in the mastered image
-	  	fseek(fp, hashes_offset, SEEK_SET);
-	  	char mastered_hash[hash_size];
-	  	fread(mastered_hash, hash_size, 1, fp);
-	  	
-	  	// generate the hash based on the data in the master image
-	  	int data_block_local = hash_count * HASH_BLOCK_SIZE;
-	  	fseek(fp, data_block_local, SEEK_SET);
-	  	fread(buffer, sizeof(char), block_size, fp);
-	  	unsigned char* digest;
-	  	digest = HMAC(EVP_sha256(), key, strlen(key), buffer, block_size, NULL, NULL);
-
-	  	// compare the two hashes
-	  	for (int i =0; i< hash_size; i++) {
-	    	if ((unsigned char) mastered_hash[i] != digest[i]) {
-	    		free(buffer);
-	      		return 0;
-	    	}
-	  	}
-
-	  	hash_count = hash_count + 1;
-	  	remaining = remaining - block_size;
-	  	if ((uint64_t) block_size > remaining) {
-	  		block_size = remaining;
-	  	}
-	  	hashes_offset = hashes_offset + hash_size;
-  	}
-  	free(buffer);
-  	return 1;
+/*
+* True if the image keeps its parity in a region after the image, so it can be
+* served without decoding it first. probed receives its superblock, corrected
+* through the parity if needed.
+*/
+static int has_separate_parity(const char* file_name, s_blk* probed) {
+	FILE* probe = fopen(file_name, "r");
+	if (probe == NULL) {
+		return 0;
+	}
+	struct stat st;
+	int separate = fstat(fileno(probe), &st) == 0 && parity_probe(probe, st.st_size, probed);
+	fclose(probe);
+	return separate;
+}
+
+/*
+* Parity length an interleaved image was encoded with. The superblock fields
+* recording it lie within the first codeword's data, ahead of any parity, so
+* they can be read before decoding; the default is assumed if they are damaged.
+*/
+static std::size_t interleaved_fec_length(const char* file_name) {
+	FILE* probe = fopen(file_name, "r");
+	if (probe == NULL) {
+		return FEC_LENGTH;
+	}
+	s_blk probe_sb;
+	int status = read_superblock(probe, &probe_sb);
+	fclose(probe);
+	if (status != SB_OK || !ecc_fec_supported(probe_sb.fec_length) || probe_sb.code_length != CODE_LENGTH) {
+		return FEC_LENGTH;
+	}
+	return probe_sb.fec_length;
 }
 
 void exit_program() {
@@ -313,6 +1490,23 @@ static struct options {
 	const char *key;
 	int show_help;
 	int no_ecc;
+	unsigned long chunk_cache;
+	const char *chunk_store;
+	const char *base;
+	const char *shard_dirs;
+	const char *replicas;
+	const char *data;
+	unsigned long store_cache;
+	int no_path_index;
+	int no_crc;
+	int direct;
+	int scrub;
+	unsigned long scrub_rate;
+	unsigned long scrub_idle;
+	unsigned long scrub_interval;
+	const char *scrub_repair;
+	int lazy_verify;
+	unsigned long merkle_cache;
 } options;
 
 #define OPTION(t, p)                           \
@@ -322,6 +1516,23 @@ static const struct fuse_opt option_spec[] = {
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	OPTION("--necc", no_ecc),
+	OPTION("--chunk-cache=%lu", chunk_cache),
+	OPTION("--chunk-store=%s", chunk_store),
+	OPTION("--base=%s", base),
+	OPTION("--shard-dirs=%s", shard_dirs),
+	OPTION("--replicas=%s", replicas),
+	OPTION("--data=%s", data),
+	OPTION("--store-cache=%lu", store_cache),
+	OPTION("--no-path-index", no_path_index),
+	OPTION("--no-crc", no_crc),
+	OPTION("--direct", direct),
+	OPTION("--scrub", scrub),
+	OPTION("--scrub-rate=%lu", scrub_rate),
+	OPTION("--scrub-idle=%lu", scrub_idle),
+	OPTION("--scrub-interval=%lu", scrub_interval),
+	OPTION("--scrub-repair=%s", scrub_repair),
+	OPTION("--lazy-verify", lazy_verify),
+	OPTION("--merkle-cache=%lu", merkle_cache),
 	FUSE_OPT_END
 };
 
@@ -333,6 +1544,40 @@ static void show_help(const char *progname)
 	       "\n"
 	       "    --key=<s>            Key to check dat validity"
 	       "\n"
+	       "    --chunk-cache=<n>    Decompressed chunks to cache (default 256)"
+	       "\n"
+	       "    --chunk-store=<s>    Chunk store the image was mastered into"
+	       "\n"
+	       "    --store-cache=<n>    Chunk store chunks to cache (default 1024)"
+	       "\n"
+	       "    --base=<s>           Base image of a delta image"
+	       "\n"
+	       "    --shard-dirs=<s>     Colon separated directories of the shards"
+	       "\n"
+	       "    --replicas=<s>       Colon separated copies of the image to read from too"
+	       "\n"
+	       "    --data=<s>           Data file of a split image (default <image>.data)"
+	       "\n"
+	       "    --no-path-index      Walk the tree instead of using the path index"
+	       "\n"
+	       "    --no-crc             Do not check reads against the CRC32C table"
+	       "\n"
+	       "    --direct             Read file data with O_DIRECT"
+	       "\n"
+	       "    --scrub              Verify and repair the image in the background"
+	       "\n"
+	       "    --scrub-rate=<n>     MB/s the scrubber may read (default 4)"
+	       "\n"
+	       "    --scrub-idle=<n>     ms without reads before it runs (default 200)"
+	       "\n"
+	       "    --scrub-interval=<n> s between scrub passes (default 86400)"
+	       "\n"
+	       "    --scrub-repair=<s>   none, sidecar or inplace (default none)"
+	       "\n"
+	       "    --lazy-verify        Verify Merkle image blocks when first read"
+	       "\n"
+	       "    --merkle-cache=<n>   Verified tree nodes to keep (default 65536)"
+	       "\n"
 	       "    --help           	 Show help"
 	       "\n");
 }
@@ -341,6 +1586,7 @@ static struct mount_opereration : fuse_operations {
 
 	mount_opereration() {
 		init       	= mount_init;
+		destroy		= mount_destroy;
 		getattr		= mount_getattr;
 		readdir		= mount_readdir;
 		open		= mount_open;
@@ -352,6 +1598,12 @@ int main(int argc, char *argv[])
 {
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	options.chunk_cache = DEF_CHUNK_CACHE_SLOTS;
+	options.store_cache = DEF_STORE_CACHE_CHUNKS;
+	options.scrub_rate = DEF_SCRUB_RATE;
+	options.scrub_idle = DEF_SCRUB_IDLE;
+	options.scrub_interval = DEF_SCRUB_INTERVAL;
+	options.merkle_cache = DEF_MERKLE_CACHE_NODES;
 
 	/* Parse options */
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
@@ -397,12 +1649,14 @@ int main(int argc, char *argv[])
     }
 
 	std::string outfile;
-	if (options.no_ecc) {
+	s_blk probed_sb;
+	int separate_parity = !options.no_ecc && has_separate_parity(file_name, &probed_sb);
+	if (options.no_ecc || separate_parity) {
 		outfile = file_name;
 	} else {
 		std::string infile = file_name;
 		outfile = infile + ".rec";
-  		int decodeResults = decode(infile, outfile);
+  		int decodeResults = decode(infile, outfile, interleaved_fec_length(file_name));
   		if (decodeResults) {
   			std::cout << "\033[0;31m" <<"Error" << "\033[0m" << std::endl;
   			printf("Unable to recover image from error correcing codes \n");
@@ -418,9 +1672,76 @@ int main(int argc, char *argv[])
   		}
 	}
 	
-  	fp = fopen(outfile.c_str(), "r");
-	int hash_correct = checkHash(outfile.c_str(), key);
+	open_image(outfile, options.direct, separate_parity ? &probed_sb : NULL);
+	int striped = (sb.features & FEATURE_STRIPED) != 0;
+	int shards_correct = striped ? open_shards(file_name, outfile, options.shard_dirs != NULL ? options.shard_dirs : "",
+	                                          !options.no_ecc, key) : 0;
+	int split_image = !striped && (sb.features & FEATURE_SPLIT_DATA);
+	std::string data_name = options.data != NULL ? options.data : split_data_name(file_name);
+	int split_correct = split_image ? open_split(outfile, data_name, !options.no_ecc, key) : 0;
+	if ((striped || split_image) && (options.direct || options.scrub)) {
+		printf("Striped and split images are read without --direct or --scrub\n");
+		options.direct = 0;
+		options.scrub = 0;
+	}
+	if (image_direct_fd >= 0 && (sb.data_alignment == 0 || sb.data_alignment % DIRECT_IO_ALIGNMENT != 0)) {
+		printf("Image payloads are not %d byte aligned, O_DIRECT reads will straddle extra blocks\n", DIRECT_IO_ALIGNMENT);
+	}
+	if (sb.sections[SECTION_PATH_INDEX].length > 0 && !options.no_path_index) {
+		use_path_index = load_path_index(fp, sb.sections[SECTION_PATH_INDEX], &pindex) == 0;
+		if (!use_path_index) {
+			printf("Ignoring malformed path index\n");
+		}
+	}
+	if (sb.sections[SECTION_SEARCH].length > 0) {
+		use_search_index = load_search_index(fp, sb.sections[SECTION_SEARCH], &sindex) == 0;
+		if (!use_search_index) {
+			printf("Ignoring malformed search index\n");
+		}
+	}
+	printf("Image holds %llu files/directories in %llu bytes of metadata and %llu bytes of data\n",
+		(unsigned long long) sb.entry_count,
+		(unsigned long long) sb.sections[SECTION_METADATA].length,
+		(unsigned long long) sb.sections[SECTION_DATA].length);
+
+	int lazy = options.lazy_verify && (sb.features & FEATURE_MERKLE_HASHES);
+	if (options.lazy_verify && !lazy) {
+		printf("--lazy-verify needs an image mastered with --merkle, verifying every block\n");
+	}
+	std::vector<uint64_t> failed_blocks;
+	int hash_correct = striped ? shards_correct
+	                   : split_image ? split_correct
+	                   : lazy ? open_lazy_verify(key, options.merkle_cache, separate_parity ? &failed_blocks : NULL)
+	                   : checkHash(outfile.c_str(), key, separate_parity ? &failed_blocks : NULL);
 	printf("\nVerifying hash... \n \n");
+
+	// The image was served in place, decode it against its parity only now that it is needed,
+	// and only the stripes of the hash blocks that failed. A damaged hash fails its block, so
+	// the hashes are decoded as well.
+	if (!hash_correct && separate_parity) {
+		std::string repaired = outfile + ".rec";
+		printf("%zu hash blocks failed, repairing them from the parity region\n", failed_blocks.size());
+		byte_ranges damaged;
+		for (size_t i = 0; i < failed_blocks.size(); i++) {
+			damaged.push_back(std::make_pair(failed_blocks[i] * HASH_BLOCK_SIZE, (uint64_t) HASH_BLOCK_SIZE));
+		}
+		damaged.push_back(std::make_pair(sb.sections[SECTION_HASHES].offset, sb.sections[SECTION_HASHES].length));
+		uint64_t corrected;
+		parity_geometry geo = parity_geometry_of(sb.sections[SECTION_PARITY].offset, sb.fec_length,
+		                                         sb.parity_interleave);
+		int64_t failed = parity_repair(fp, geo, &damaged, repaired.c_str(), &corrected);
+		if (failed < 0) {
+			printf("Unable to write %s\n", repaired.c_str());
+		} else {
+			printf("Corrected %llu symbols, %lld codewords unrecoverable\n",
+				(unsigned long long) corrected, (long long) failed);
+			fclose(fp);
+			image_close();
+			outfile = repaired;
+			open_image(outfile, options.direct, NULL);
+			hash_correct = lazy ? open_lazy_verify(key, options.merkle_cache, NULL) : checkHash(outfile.c_str(), key);
+		}
+	}
 	if (!hash_correct) {
 		std::cout << "\033[0;31m" <<"Error" << "\033[0m" << std::endl;
 		printf("Data integrity issue detected.\n");
@@ -437,9 +1758,84 @@ int main(int argc, char *argv[])
 		std::cout << "\033[0;32m" <<"Hash passed" << "\033[0m" << std::endl;
 	}
 
+	if (sb.sections[SECTION_CRC].length > 0 && !options.no_crc && load_crc_table(key, options.merkle_cache) != 0) {
+		printf("Ignoring malformed CRC table\n");
+	}
+	if (options.replicas != NULL && (striped || split_image)) {
+		printf("Striped and split images are read without --replicas\n");
+	} else if (options.replicas != NULL) {
+		open_replicas(original_path, options.replicas, !options.no_ecc, lazy, key);
+	}
+
 	struct stat st;
  	stat(outfile.c_str(), &st);
-  	image_file_size = st.st_size;
+  	image_file_size = striped ? shards.geo.logical_size : split_image ? split.geo.image_size : st.st_size;
+
+	// Resolved now, the daemon does not keep the working directory
+	if (sb.features & FEATURE_BASE_IMAGE) {
+		char* base_path = options.base != NULL ? realpath(options.base, NULL) : NULL;
+		if (base_path == NULL) {
+			printf("The image is a delta, use --base=<image> to name the image it was mastered against\n");
+			exit_program();
+		}
+		printf("Verifying base image %s\n", base_path);
+		int opened = open_base(base_path, key);
+		free(base_path);
+		if (opened != 0) {
+			exit_program();
+		}
+	}
+	uint64_t features = sb.features | (base_fd >= 0 ? base_sb.features : 0);
+
+	// Only images with compressed payloads need the chunk cache
+	chunk_cache_slots = (features & FEATURE_COMPRESSION) ? options.chunk_cache : 0;
+	chunk_cache = (struct chunk_cache_slot*) calloc(chunk_cache_slots, sizeof(struct chunk_cache_slot));
+
+	if (features & FEATURE_CHUNK_STORE) {
+		char* store_path = options.chunk_store != NULL ? realpath(options.chunk_store, NULL) : NULL;
+		struct stat store_st;
+		if (store_path == NULL || stat(store_path, &store_st) != 0 || !S_ISDIR(store_st.st_mode)) {
+			printf("The image keeps file data in a chunk store, use --chunk-store=<directory> to name it\n");
+			exit_program();
+		}
+		chunk_store = store_path;
+		free(store_path);
+		store_cache_slots = options.store_cache;
+		store_cache = (struct store_cache_slot*) calloc(store_cache_slots, sizeof(struct store_cache_slot));
+	}
+
+	// The parity is read from the file the image came from: the separated parity region, or the
+	// interleaved codewords the served .rec was decoded from
+	if (options.scrub) {
+		scrub_cfg.served = outfile;
+		scrub_cfg.parity_file = file_name;
+		scrub_cfg.parity = options.no_ecc ? SCRUB_PARITY_NONE
+		                   : separate_parity ? SCRUB_PARITY_SEPARATE : SCRUB_PARITY_INTERLEAVED;
+		scrub_cfg.geo = parity_geometry_of(sb.sections[SECTION_PARITY].offset, sb.fec_length, sb.parity_interleave);
+		scrub_cfg.fec_length = separate_parity ? sb.fec_length : interleaved_fec_length(file_name);
+		scrub_cfg.key = key;
+		scrub_cfg.image_size = sb.sections[SECTION_HASHES].offset;
+		scrub_cfg.hashes_offset = sb.sections[SECTION_HASHES].offset;
+		scrub_cfg.block_size = HASH_BLOCK_SIZE;
+		scrub_cfg.merkle = (sb.features & FEATURE_MERKLE_HASHES) != 0;
+		scrub_cfg.hash_algorithm = sb.hash_algorithm;
+		scrub_cfg.merkle_cache = options.merkle_cache;
+		scrub_cfg.rate = (options.scrub_rate > 0 ? options.scrub_rate : 1) * 1000000ULL;
+		scrub_cfg.idle_nsec = options.scrub_idle * 1000000ULL;
+		scrub_cfg.interval_sec = options.scrub_interval;
+		scrub_cfg.repair = SCRUB_REPAIR_NONE;
+		if (options.scrub_repair != NULL && strcmp(options.scrub_repair, "sidecar") == 0) {
+			scrub_cfg.repair = SCRUB_REPAIR_SIDECAR;
+		} else if (options.scrub_repair != NULL && strcmp(options.scrub_repair, "inplace") == 0) {
+			scrub_cfg.repair = SCRUB_REPAIR_IN_PLACE;
+		} else if (options.scrub_repair != NULL && strcmp(options.scrub_repair, "none") != 0) {
+			printf("Unknown scrub repair mode %s, only reporting damage\n", options.scrub_repair);
+		}
+		if (scrub_cfg.image_size == 0 || scrub_cfg.block_size == 0) {
+			printf("The image has no hashes to scrub against\n");
+			scrub_cfg.rate = 0;
+		}
+	}
   	printf("Mounting image %s \n", original_path);
 	return fuse_main(args.argc, args.argv, &mount_oper_init, NULL);
 }
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+/*
+* Separated parity region (SECTION_PARITY)
+*
+* The image is cut into stripes of CODE_LENGTH - fec_length bytes, the last one
+* zero padded, and every stripe is Reed Solomon encoded with the parity length
+* recorded in the superblock. The parity is stored after the hashes instead of
+* after each stripe like the interleaving file encoder, so the image in front
+* of it is byte identical to the .necc image. The mounter reads it in place and
+* only consults the parity when the hash check fails. Expects ecc.cpp to be
+* included.
+*
+* With an interleave depth of N, consecutive runs of N stripes form a group
+* whose codewords are interleaved: symbol i of codeword j of the group is byte
+* i * N + j of the group, and parity symbol i of codeword j is byte i * N + j of
+* the group's parity. A burst of N bytes then costs each codeword of the group
+* a single symbol. The last group holds the remaining stripes, so the parity
+* length does not depend on the depth. A depth of 1 is the sequential layout.
+*/
+
+#define PARITY_BATCH_STRIPES 4096
+#define PARITY_MAX_INTERLEAVE 4096
+
+// Byte ranges (offset, length) of the image file
+typedef std::vector<std::pair<uint64_t, uint64_t> > byte_ranges;
+
+struct parity_geometry {
+	uint64_t image_size;                // bytes protected, where the parity section starts
+	std::size_t fec_length;
+	std::size_t data_length;
+	uint64_t depth;                     // codewords interleaved per group
+};
+
+static inline uint64_t parity_stripe_count(uint64_t image_size, std::size_t fec_length) {
+	uint64_t data_length = CODE_LENGTH - fec_length;
+	return (image_size + data_length - 1) / data_length;
+}
+
+static inline uint64_t parity_length(uint64_t image_size, std::size_t fec_length) {
+	return parity_stripe_count(image_size, fec_length) * fec_length;
+}
+
+static inline bool parity_interleave_supported(uint64_t depth) {
+	return depth >= 1 && depth <= PARITY_MAX_INTERLEAVE && (depth & (depth - 1)) == 0;
+}
+
+static inline parity_geometry parity_geometry_of(uint64_t image_size, std::size_t fec_length, uint64_t interleave) {
+	parity_geometry geo;
+	geo.image_size = image_size;
+	geo.fec_length = fec_length;
+	geo.data_length = CODE_LENGTH - fec_length;
+	geo.depth = interleave > 1 ? interleave : 1;   // images without the field read 0
+	return geo;
+}
+
+static inline uint64_t parity_group_count(const parity_geometry& geo) {
+	return (parity_stripe_count(geo.image_size, geo.fec_length) + geo.depth - 1) / geo.depth;
+}
+
+// Codewords in group g, depth for all but the last group
+static inline uint64_t parity_group_lanes(const parity_geometry& geo, uint64_t g) {
+	uint64_t stripes = parity_stripe_count(geo.image_size, geo.fec_length);
+	return stripes - g * geo.depth < geo.depth ? stripes - g * geo.depth : geo.depth;
+}
+
+/*
+* True if the parity section of sb covers everything in front of it and ends
+* a file of file_size bytes
+*/
+static inline bool parity_in_place(const s_blk* sb, uint64_t file_size) {
+	const section_entry& parity = sb -> sections[SECTION_PARITY];
+	return ecc_fec_supported(sb -> fec_length) && sb -> code_length == CODE_LENGTH
+	       && (sb -> parity_interleave == 0 || parity_interleave_supported(sb -> parity_interleave))
+	       && parity.length > 0 && parity.offset + parity.length == file_size
+	       && parity.length == parity_length(parity.offset, sb -> fec_length);
+}
+
+/*
+* Read len bytes at offset. When the device reports an error the range is read
+* again sector by sector, and sectors that stay unreadable are zero filled and
+* added to unreadable so their symbols are decoded as erasures. Returns false if
+* the file ends early.
+*/
+static inline bool parity_read(FILE* in, uint64_t offset, uint64_t len, unsigned char* buf,
+                               byte_ranges* unreadable) {
+	const uint64_t sector = 512;
+	int fd = fileno(in);
+	uint64_t done = 0;
+	while (done < len) {
+		ssize_t got = pread(fd, buf + done, len - done, offset + done);
+		if (got > 0) {
+			done += got;
+			continue;
+		}
+		if (got == 0) {
+			return false;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		uint64_t step = sector - (offset + done) % sector;
+		step = step < len - done ? step : len - done;
+		got = pread(fd, buf + done, step, offset + done);
+		if (got <= 0) {
+			memset(buf + done, 0, step);
+			unreadable -> push_back(std::make_pair(offset + done, step));
+			got = step;
+		}
+		done += got;
+	}
+	return true;
+}
+
+/*
+* Add the codeword positions of the unreadable bytes in [start, start + length)
+* to the erasures of their lanes. Byte start + i * lanes + j is symbol base + i
+* of lane j.
+*/
+static inline void parity_erasures(const byte_ranges& unreadable, uint64_t start, uint64_t length,
+                                   uint64_t lanes, std::size_t base,
+                                   std::vector<std::vector<std::size_t> >& erasures) {
+	for (size_t r = 0; r < unreadable.size(); r++) {
+		uint64_t from = unreadable[r].first > start ? unreadable[r].first : start;
+		uint64_t to = unreadable[r].first + unreadable[r].second < start + length
+		              ? unreadable[r].first + unreadable[r].second : start + length;
+		for (uint64_t p = from; p < to; p++) {
+			erasures[(p - start) % lanes].push_back(base + (p - start) / lanes);
+		}
+	}
+}
+
+/*
+* Read groups [first, first + count) of the image in "in" into data and correct
+* the ones overlapping damaged (all of them if damaged is NULL) against their
+* parity. Clean codewords are recognized by their syndromes, computed across
+* lanes, and skip the decoder. damaged must be sorted by offset. Returns the
+* number of codewords that could not be corrected, or -1 if they could not be
+* read.
+*/
+static inline int64_t parity_decode(FILE* in, const parity_geometry& geo, uint64_t first, uint64_t count,
+                                    unsigned char* data, const byte_ranges* damaged, uint64_t* corrected) {
+	uint64_t group_bytes = geo.depth * geo.data_length;
+	uint64_t stripes = 0;
+	for (uint64_t g = first; g < first + count; g++) {
+		stripes += parity_group_lanes(geo, g);
+	}
+	uint64_t data_off = first * group_bytes;
+	uint64_t data_len = geo.image_size - data_off < stripes * geo.data_length
+	                    ? geo.image_size - data_off : stripes * geo.data_length;
+	uint64_t fec_off = geo.image_size + first * geo.depth * geo.fec_length;
+	std::vector<unsigned char> fec(stripes * geo.fec_length);
+	byte_ranges unreadable;
+	memset(data, 0, stripes * geo.data_length);
+	if (!parity_read(in, data_off, data_len, data, &unreadable)
+	    || !parity_read(in, fec_off, fec.size(), &fec[0], &unreadable)) {
+		return -1;
+	}
+
+	const rs_tables* tables = ecc_tables(geo.fec_length);
+	rs_workspace* workspace = rs_workspace_local();
+	std::vector<unsigned char> dirty(geo.depth);
+	std::vector<std::vector<std::size_t> > erasures(geo.depth);
+	int64_t failed = 0;
+	size_t r = 0;
+	for (uint64_t g = first; g < first + count; g++) {
+		uint64_t lanes = parity_group_lanes(geo, g);
+		uint64_t start = g * group_bytes;
+		unsigned char* group_data = data + (g - first) * group_bytes;
+		unsigned char* group_fec = &fec[(g - first) * geo.depth * geo.fec_length];
+		while (damaged != NULL && r < damaged -> size() && (*damaged)[r].first + (*damaged)[r].second <= start) {
+			r++;
+		}
+		bool wanted = damaged == NULL
+		              || (r < damaged -> size() && (*damaged)[r].first < start + lanes * geo.data_length);
+		for (uint64_t j = 0; j < lanes; j++) {
+			erasures[j].clear();
+		}
+		if (!unreadable.empty()) {
+			parity_erasures(unreadable, start, lanes * geo.data_length, lanes, 0, erasures);
+			parity_erasures(unreadable, geo.image_size + g * geo.depth * geo.fec_length,
+			                lanes * geo.fec_length, lanes, geo.data_length, erasures);
+		}
+		if (wanted) {
+			rs_check_lanes(tables, group_data, geo.data_length, group_fec, lanes, lanes, &dirty[0]);
+		} else {
+			memset(&dirty[0], 0, lanes);
+		}
+
+		// Known erasures cost one parity symbol each instead of two for an unknown error
+		for (uint64_t j = 0; j < lanes; j++) {
+			if ((dirty[j] || !erasures[j].empty()) && !rs_decode_lane(tables, workspace, group_data + j, geo.data_length, group_fec + j, lanes,
+			                                erasures[j].empty() ? NULL : &erasures[j][0], erasures[j].size(),
+			                                corrected)) {
+				failed++;
+			}
+		}
+	}
+	return failed;
+}
+
+/*
+* Encode groups [first, first + count) whose data is in data (zero padded to
+* whole stripes), writing their parity to fec
+*/
+static inline void parity_encode(const parity_geometry& geo, uint64_t first, uint64_t count,
+                                 const unsigned char* data, unsigned char* fec) {
+	const rs_tables* tables = ecc_tables(geo.fec_length);
+	for (uint64_t g = first; g < first + count; g++) {
+		uint64_t lanes = parity_group_lanes(geo, g);
+		rs_encode_lanes(tables, data + (g - first) * geo.depth * geo.data_length, geo.data_length, lanes, lanes,
+		                fec + (g - first) * geo.depth * geo.fec_length);
+	}
+}
+
+// Groups handled per read, whole groups of about PARITY_BATCH_STRIPES stripes
+static inline uint64_t parity_batch_groups(const parity_geometry& geo) {
+	return geo.depth < PARITY_BATCH_STRIPES ? PARITY_BATCH_STRIPES / geo.depth : 1;
+}
+
+/*
+* Find the superblock of an image with a separated parity region, correcting it
+* through the parity if it is damaged. For a given parity length the image
+* size follows from the file size since parity_length grows with it, so the
+* parity of the superblock can be located without trusting the superblock;
+* each supported parity length and interleave depth is tried in turn.
+*/
+static inline bool parity_probe(FILE* in, uint64_t file_size, s_blk* sb) {
+	unsigned char raw[SUPERBLOCK_SIZE];
+	fseek(in, 0, SEEK_SET);
+	if (fread(raw, 1, SUPERBLOCK_SIZE, in) == SUPERBLOCK_SIZE && decode_superblock(raw, sb) == SB_OK
+	    && parity_in_place(sb, file_size)) {
+		return true;
+	}
+
+	const std::size_t fec_lengths[] = {8, 16, 32, 64};
+	for (std::size_t fec_length : fec_lengths) {
+		uint64_t data_length = CODE_LENGTH - fec_length;
+		uint64_t guess = file_size / CODE_LENGTH * data_length;
+		uint64_t image_size = guess > CODE_LENGTH ? guess - CODE_LENGTH : 0;
+		while (image_size + parity_length(image_size, fec_length) < file_size) {
+			image_size++;
+		}
+		if (image_size < SUPERBLOCK_SIZE || image_size + parity_length(image_size, fec_length) != file_size) {
+			continue;
+		}
+
+		for (uint64_t depth = 1; depth <= PARITY_MAX_INTERLEAVE; depth *= 2) {
+			parity_geometry geo = parity_geometry_of(image_size, fec_length, depth);
+			uint64_t groups = (SUPERBLOCK_SIZE + depth * data_length - 1) / (depth * data_length);
+			groups = groups < parity_group_count(geo) ? groups : parity_group_count(geo);
+			std::vector<unsigned char> data(groups * depth * data_length);
+			uint64_t corrected = 0;
+			if (parity_decode(in, geo, 0, groups, &data[0], NULL, &corrected) == 0
+			    && decode_superblock(&data[0], sb) == SB_OK && sb -> fec_length == fec_length
+			    && (sb -> parity_interleave > 1 ? sb -> parity_interleave : 1) == depth
+			    && parity_in_place(sb, file_size) && sb -> sections[SECTION_PARITY].offset == image_size) {
+				return true;
+			}
+			if (depth * data_length >= image_size) {
+				break;                  // deeper groups hold the same single group
+			}
+		}
+	}
+	return false;
+}
+
+/*
+* Write the image in "in" to out_name, correcting the codewords of the groups
+* that overlap the damaged byte ranges (every group if damaged is NULL)
+* against their parity. Other groups are copied without decoding. Returns the
+* number of codewords that could not be corrected, or -1 if the image could not
+* be read or the output written.
+*/
+static inline int64_t parity_repair(FILE* in, const parity_geometry& geo, const byte_ranges* damaged,
+                                    const char* out_name, uint64_t* corrected) {
+	uint64_t groups = parity_group_count(geo);
+	uint64_t batch = parity_batch_groups(geo);
+	FILE* out = fopen(out_name, "wb");
+	if (out == NULL) {
+		return -1;
+	}
+	std::vector<unsigned char> data(batch * geo.depth * geo.data_length);
+	int64_t failed = 0;
+	*corrected = 0;
+	byte_ranges sorted;
+	if (damaged != NULL) {
+		sorted = *damaged;
+		std::sort(sorted.begin(), sorted.end());
+	}
+
+	for (uint64_t first = 0; first < groups; first += batch) {
+		uint64_t count = groups - first < batch ? groups - first : batch;
+		int64_t batch_failed = parity_decode(in, geo, first, count, &data[0],
+		                                     damaged != NULL ? &sorted : NULL, corrected);
+		uint64_t data_off = first * geo.depth * geo.data_length;
+		uint64_t data_len = geo.image_size - data_off < count * geo.depth * geo.data_length
+		                    ? geo.image_size - data_off : count * geo.depth * geo.data_length;
+		if (batch_failed < 0 || fwrite(&data[0], 1, data_len, out) != data_len) {
+			failed = -1;
+			break;
+		}
+		failed += batch_failed;
+	}
+
+	if (fclose(out) != 0) {
+		failed = -1;
+	}
+	return failed;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <endian.h>
+
+/*
+* Path index section (SECTION_PATH_INDEX)
+*
+* A perfect hash over the full path of every entry ("/root/dir/file", as FUSE
+* passes them), built with hash and displace (CHD): keys are split into buckets
+* and each bucket gets a displacement pair (d0, d1) that sends its keys to free
+* slots with slot = (f1 + d0 * f2 + d1) mod slot_count. A lookup hashes the path,
+* reads the bucket's displacement and lands on exactly one slot, which holds a
+* fingerprint of the path and the location of its header (header offset, or
+* inode index for compact images). Layout (big endian):
+*
+*   uint64  key count
+*   uint64  seed
+*   uint32  bucket count
+*   uint32  slot count
+*   uint32  d0, uint32 d1              [bucket count]
+*   uint64  fingerprint, uint64 location [slot count]
+*
+* Empty slots have location PATH_INDEX_EMPTY.
+*/
+
+#define PATH_INDEX_PREFIX_SIZE  (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t))
+#define PATH_INDEX_BUCKET_SIZE  (2 * sizeof(uint32_t))
+#define PATH_INDEX_SLOT_SIZE    (2 * sizeof(uint64_t))
+#define PATH_INDEX_EMPTY        UINT64_MAX
+#define PATH_INDEX_KEYS_PER_BUCKET 4
+#define PATH_INDEX_MAX_D0       1024
+
+struct path_hash {
+	uint32_t bucket;
+	uint32_t f1;
+	uint32_t f2;
+	uint64_t fingerprint;
+};
+
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline path_hash hash_path(const char* path, size_t len, uint64_t seed,
+                                  uint32_t bucket_count, uint32_t slot_count) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed; // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) path[i];
+		h *= 0x100000001b3ULL;
+	}
+	h = mix64(h);
+	uint64_t g = mix64(h ^ 0x9e3779b97f4a7c15ULL);
+
+	path_hash ph;
+	ph.bucket = (uint32_t) ((h >> 32) % bucket_count);
+	ph.f1 = (uint32_t) (h % slot_count);
+	ph.f2 = slot_count > 1 ? (uint32_t) ((g >> 32) % (slot_count - 1)) + 1 : 1;
+	ph.fingerprint = mix64(h ^ 0xc2b2ae3d27d4eb4fULL);  // independent of the slot hashes
+	return ph;
+}
+
+static inline uint32_t path_slot(const path_hash& ph, uint32_t d0, uint32_t d1, uint32_t slot_count) {
+	return (uint32_t) ((ph.f1 + (uint64_t) d0 * ph.f2 + d1) % slot_count);
+}
+
+/*
+* Build the serialized index for (path, location) pairs. Returns an empty
+* vector if no displacement could be found (practically only for huge d0).
+*/
+std::vector<unsigned char> build_path_index(const std::vector<std::string>& paths,
+                                            const std::vector<uint64_t>& locations) {
+	uint64_t key_count = paths.size();
+	uint32_t bucket_count = key_count / PATH_INDEX_KEYS_PER_BUCKET + 1;
+	uint32_t slot_count = key_count + key_count / 64 + 1; // ~98% load keeps the search short
+
+	for (uint64_t seed = 1; seed < 16; seed++) {
+		std::vector<path_hash> hashes(key_count);
+		std::vector<std::vector<uint32_t> > buckets(bucket_count);
+		for (uint64_t k = 0; k < key_count; k++) {
+			hashes[k] = hash_path(paths[k].c_str(), paths[k].size(), seed, bucket_count, slot_count);
+			buckets[hashes[k].bucket].push_back(k);
+		}
+
+		// Place the largest buckets first while most slots are still free
+		std::vector<uint32_t> order(bucket_count);
+		for (uint32_t b = 0; b < bucket_count; b++) {
+			order[b] = b;
+		}
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			return buckets[a].size() > buckets[b].size();
+		});
+
+		std::vector<uint32_t> d0s(bucket_count, 0), d1s(bucket_count, 0);
+		std::vector<int64_t> slot_key(slot_count, -1);
+		std::vector<uint32_t> taken;
+		bool failed = false;
+		for (uint32_t o = 0; o < bucket_count && !failed; o++) {
+			const std::vector<uint32_t>& keys = buckets[order[o]];
+			if (keys.empty()) {
+				break;
+			}
+			bool placed = false;
+			for (uint32_t d0 = 0; d0 < PATH_INDEX_MAX_D0 && !placed; d0++) {
+				for (uint32_t d1 = 0; d1 < slot_count && !placed; d1++) {
+					taken.clear();
+					bool ok = true;
+					for (size_t i = 0; i < keys.size() && ok; i++) {
+						uint32_t slot = path_slot(hashes[keys[i]], d0, d1, slot_count);
+						ok = slot_key[slot] < 0 && std::find(taken.begin(), taken.end(), slot) == taken.end();
+						taken.push_back(slot);
+					}
+					if (ok) {
+						for (size_t i = 0; i < keys.size(); i++) {
+							slot_key[taken[i]] = keys[i];
+						}
+						d0s[order[o]] = d0;
+						d1s[order[o]] = d1;
+						placed = true;
+					}
+				}
+			}
+			failed = !placed;
+		}
+		if (failed) {
+			continue;
+		}
+
+		std::vector<unsigned char> out(PATH_INDEX_PREFIX_SIZE + (uint64_t) bucket_count * PATH_INDEX_BUCKET_SIZE
+		                               + (uint64_t) slot_count * PATH_INDEX_SLOT_SIZE);
+		unsigned char* p = &out[0];
+		p = put64(p, key_count);
+		p = put64(p, seed);
+		p = put32(p, bucket_count);
+		p = put32(p, slot_count);
+		for (uint32_t b = 0; b < bucket_count; b++) {
+			p = put32(p, d0s[b]);
+			p = put32(p, d1s[b]);
+		}
+		for (uint32_t s = 0; s < slot_count; s++) {
+			int64_t k = slot_key[s];
+			p = put64(p, k < 0 ? 0 : hashes[k].fingerprint);
+			p = put64(p, k < 0 ? PATH_INDEX_EMPTY : locations[k]);
+		}
+		return out;
+	}
+	return std::vector<unsigned char>();
+}
+
+/*
+* Mount side view of the index. The displacements are loaded into memory when
+* the image is opened, slots are read on demand.
+*/
+struct path_index {
+	uint64_t section_offset;
+	uint64_t seed;
+	uint32_t bucket_count;
+	uint32_t slot_count;
+	uint32_t* displacements;            // d0, d1 per bucket
+};
+
+static inline int load_path_index(FILE* fp, const section_entry& section, path_index* index) {
+	memset(index, 0, sizeof(*index));
+	if (section.length < PATH_INDEX_PREFIX_SIZE) {
+		return -1;
+	}
+	unsigned char prefix[PATH_INDEX_PREFIX_SIZE];
+	fseek(fp, section.offset, SEEK_SET);
+	if (fread(prefix, 1, sizeof(prefix), fp) != sizeof(prefix)) {
+		return -1;
+	}
+	uint64_t key_count;
+	const unsigned char* p = prefix;
+	p = get64(p, &key_count);
+	p = get64(p, &index -> seed);
+	p = get32(p, &index -> bucket_count);
+	p = get32(p, &index -> slot_count);
+	uint64_t expected = PATH_INDEX_PREFIX_SIZE + (uint64_t) index -> bucket_count * PATH_INDEX_BUCKET_SIZE
+	                    + (uint64_t) index -> slot_count * PATH_INDEX_SLOT_SIZE;
+	if (index -> bucket_count == 0 || index -> slot_count == 0 || expected != section.length) {
+		return -1;
+	}
+
+	uint64_t table_size = (uint64_t) index -> bucket_count * PATH_INDEX_BUCKET_SIZE;
+	index -> displacements = (uint32_t*) malloc(table_size);
+	if (fread(index -> displacements, 1, table_size, fp) != table_size) {
+		free(index -> displacements);
+		index -> displacements = NULL;
+		return -1;
+	}
+	for (uint64_t i = 0; i < 2 * (uint64_t) index -> bucket_count; i++) {
+		index -> displacements[i] = be32toh(index -> displacements[i]);
+	}
+	index -> section_offset = section.offset;
+	return 0;
+}
+
+/*
+* Location of the header for path, or PATH_INDEX_EMPTY if the path is not in
+* the image. A path not in the image matches another entry's 64 bit
+* fingerprint with probability 2^-64; only the name stored in the header is
+* checked against it.
+*/
+static inline uint64_t path_index_lookup(FILE* fp, const path_index* index, const char* path) {
+	path_hash ph = hash_path(path, strlen(path), index -> seed, index -> bucket_count, index -> slot_count);
+	uint32_t d0 = index -> displacements[2 * ph.bucket];
+	uint32_t d1 = index -> displacements[2 * ph.bucket + 1];
+	uint32_t slot = path_slot(ph, d0, d1, index -> slot_count);
+
+	unsigned char entry[PATH_INDEX_SLOT_SIZE];
+	uint64_t table = index -> section_offset + PATH_INDEX_PREFIX_SIZE
+	                 + (uint64_t) index -> bucket_count * PATH_INDEX_BUCKET_SIZE;
+	fseek(fp, table + (uint64_t) slot * PATH_INDEX_SLOT_SIZE, SEEK_SET);
+	if (fread(entry, 1, sizeof(entry), fp) != sizeof(entry)) {
+		return PATH_INDEX_EMPTY;
+	}
+	uint64_t fingerprint;
+	uint64_t location;
+	get64(get64(entry, &fingerprint), &location);
+	if (fingerprint != ph.fingerprint) {
+		return PATH_INDEX_EMPTY;
+	}
+	return location;
+}
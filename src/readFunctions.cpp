@@ -32,11 +32,12 @@ static m_hdr* readHeader(FILE* fp, uint64_t curr_offset) {
 
 	fseek(fp, curr_offset, SEEK_SET);
 	int name_length = 255;
-	char* root_name = (char*) malloc(name_length);
+	char* root_name = (char*) malloc(name_length+1);
 	fread((void*)root_name, 1, name_length+1, fp);
 	fseek(fp, (long) curr_offset+name_length+1, SEEK_SET);
 	m_hdr* header = (m_hdr*) malloc(sizeof(m_hdr));
 	strncpy(header -> name, root_name, name_length+1);
+	free(root_name);
 	header-> length = read64_pure(fp);
 	header -> time = read64_pure(fp);
 	header -> offset = read64_pure(fp);
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+/*
+* Mirrored replicas (mounter --replicas)
+*
+* Copies of the image on other media are opened next to it once they are
+* known to be the same image: the SHA-256 of their hashes section, which the
+* key binds to everything in the image, matches, and they verify. Replica 0 is
+* the image itself. Each payload read goes to the replica expected to finish
+* it first, the one with the fewest reads in flight weighted by its recent
+* latency, so concurrent reads spread over the media and a slow one gets less
+* of them. A read that fails its hash or CRC, or its I/O, on one replica is
+* retried on the others before the parity is used.
+*/
+
+#define REPLICA_MAX_COUNT 8
+#define REPLICA_PROBE_INTERVAL 64   // every this many picks take the next replica in turn
+
+struct replica {
+	int fd;
+	std::string name;
+	volatile uint64_t inflight;
+	volatile uint64_t latency_nsec;     // moving average of the last reads, 0 until the first
+	volatile uint64_t reads;
+	volatile uint64_t failures;
+};
+
+struct replica_set {
+	int count;
+	replica replicas[REPLICA_MAX_COUNT];
+	volatile uint64_t next;             // rotates the choice among equally good replicas
+};
+
+static inline uint64_t replica_clock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+* Replica to read from next, skipping those in the exclude mask. An unused
+* replica costs nothing, so each is tried early on, and each is picked in turn
+* now and then so the latency of one that was slow once is measured again.
+* -1 if all are excluded.
+*/
+static int replica_pick(replica_set* set, uint32_t exclude) {
+	uint64_t start = __sync_fetch_and_add(&set -> next, 1);
+	int best = -1;
+	uint64_t best_cost = 0;
+	for (int i = 0; i < set -> count; i++) {
+		int r = (start + i) % set -> count;
+		if (exclude & (1u << r)) {
+			continue;
+		}
+		if (start % REPLICA_PROBE_INTERVAL == 0) {
+			return r;
+		}
+		const replica& rep = set -> replicas[r];
+		uint64_t cost = (rep.inflight + 1) * rep.latency_nsec;
+		if (best < 0 || cost < best_cost) {
+			best = r;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+// Account a read of replica r, returning its start time for replica_end
+static inline uint64_t replica_begin(replica_set* set, int r) {
+	__sync_fetch_and_add(&set -> replicas[r].inflight, 1);
+	return replica_clock();
+}
+
+static inline void replica_end(replica_set* set, int r, uint64_t started) {
+	replica& rep = set -> replicas[r];
+	uint64_t elapsed = replica_clock() - started;
+	uint64_t average = rep.latency_nsec;
+	// a racing update is lost, which only makes the average a little staler
+	rep.latency_nsec = average == 0 ? elapsed : average - average / 8 + elapsed / 8;
+	__sync_fetch_and_add(&rep.reads, 1);
+	__sync_fetch_and_sub(&rep.inflight, 1);
+}
@@ -0,0 +1,208 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "rsKernels.cpp"
+
+/*
+* Reed Solomon errors and erasures decoder working on the tables of
+* rsKernels.cpp. schifra's decoder builds field_polynomial objects and root
+* lists for every block it decodes; this one keeps all of its state in a
+* fixed capacity workspace, so decoding a codeword allocates nothing. Each
+* thread reuses its own workspace (rs_workspace_local).
+*
+* Codewords are laid out like the lane kernels: symbol i of the data at
+* data[i * stride] and symbol i of the parity at parity[i * stride], corrected
+* in place. Symbol i of the codeword is the coefficient of x^(254 - i).
+*
+* The steps are the textbook ones: syndromes at the generator roots, the
+* erasure locator, Berlekamp-Massey seeded with it for the errata locator,
+* a Chien search for its roots and Forney's formula for the error values.
+*/
+
+#define RS_CODE_LENGTH 255
+#define RS_NO_TERM 0xffff
+
+struct rs_workspace {
+	unsigned char syndrome[RS_MAX_FEC];
+	unsigned char lambda[RS_MAX_FEC + 2];       // errata locator
+	unsigned char prev[RS_MAX_FEC + 2];         // Berlekamp-Massey correction term
+	unsigned char next[RS_MAX_FEC + 2];
+	unsigned short term[RS_MAX_FEC + 2];        // Chien search terms
+	unsigned char omega[RS_MAX_FEC];            // errata evaluator
+	unsigned char location[RS_MAX_FEC];         // exponents of the errata positions
+	unsigned char value[RS_MAX_FEC];            // and their error values
+};
+
+static inline rs_workspace* rs_workspace_local() {
+	static thread_local rs_workspace workspace;
+	return &workspace;
+}
+
+/*
+* Evaluate the codeword at the generator roots into syndrome, returns non zero
+* if any of them is. Kept in a local array: stores through an unsigned char
+* pointer could alias the tables and would force them to be reloaded.
+*/
+static inline unsigned char rs_syndromes(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                                         const unsigned char* parity, std::size_t stride, unsigned char* syndrome) {
+	const std::size_t fec = t -> fec_length;
+	const unsigned char (*root_mul)[256] = t -> root_mul;
+	unsigned char syn[RS_MAX_FEC] = {0};
+	for (std::size_t i = 0; i < data_length; i++) {
+		unsigned char s = data[i * stride];
+		for (std::size_t r = 0; r < fec; r++) {
+			syn[r] = root_mul[r][syn[r]] ^ s;
+		}
+	}
+	for (std::size_t i = 0; i < fec; i++) {
+		unsigned char s = parity[i * stride];
+		for (std::size_t r = 0; r < fec; r++) {
+			syn[r] = root_mul[r][syn[r]] ^ s;
+		}
+	}
+	unsigned char any = 0;
+	for (std::size_t r = 0; r < fec; r++) {
+		syndrome[r] = syn[r];
+		any |= syn[r];
+	}
+	return any;
+}
+
+/*
+* Correct the codeword in place given the block indexes of its erasures
+* (known bad symbols, parity symbol i is index data_length + i). Returns false
+* if it has more errata than its parity can correct, leaving it unchanged;
+* otherwise adds the number of symbols corrected to corrected.
+*/
+static inline bool rs_decode_lane(const rs_tables* t, rs_workspace* w, unsigned char* data,
+                                  std::size_t data_length, unsigned char* parity, std::size_t stride,
+                                  const std::size_t* erasures, std::size_t erasure_count, uint64_t* corrected) {
+	const std::size_t fec = t -> fec_length;
+	const std::size_t n = data_length + fec;
+	if (n != RS_CODE_LENGTH || erasure_count > fec) {
+		return false;
+	}
+
+	// Syndromes by Horner's rule, the codeword is clean if they all vanish
+	if (!rs_syndromes(t, data, data_length, parity, stride, w -> syndrome)) {
+		return true;
+	}
+
+	// Erasure locator, the product of (1 + X x) over the erased positions X
+	unsigned char* lambda = w -> lambda;
+	unsigned char* prev = w -> prev;
+	unsigned char* next = w -> next;
+	memset(lambda, 0, fec + 2);
+	lambda[0] = 1;
+	for (std::size_t e = 0; e < erasure_count; e++) {
+		if (erasures[e] >= n) {
+			return false;
+		}
+		unsigned char x = gf_alpha(n - 1 - erasures[e]);
+		for (std::size_t k = e + 1; k > 0; k--) {
+			lambda[k] ^= gf_mul(x, lambda[k - 1]);
+		}
+	}
+	memcpy(prev, lambda, fec + 2);
+
+	// Berlekamp-Massey over the remaining syndromes
+	std::size_t length = erasure_count;
+	for (std::size_t r = erasure_count; r < fec; r++) {
+		unsigned char delta = 0;
+		for (std::size_t j = 0; j <= length && j <= r; j++) {
+			delta ^= gf_mul(lambda[j], w -> syndrome[r - j]);
+		}
+		memmove(prev + 1, prev, fec + 1);
+		prev[0] = 0;
+		if (delta == 0) {
+			continue;
+		}
+		for (std::size_t k = 0; k < fec + 2; k++) {
+			next[k] = lambda[k] ^ gf_mul(delta, prev[k]);
+		}
+		if (2 * length <= r + erasure_count) {
+			for (std::size_t k = 0; k < fec + 2; k++) {
+				prev[k] = gf_div(lambda[k], delta);
+			}
+			length = r + 1 + erasure_count - length;
+		}
+		memcpy(lambda, next, fec + 2);
+	}
+	if (2 * length > fec + erasure_count) {
+		return false;
+	}
+	std::size_t degree = fec + 1;
+	while (degree > 0 && lambda[degree] == 0) {
+		degree--;
+	}
+	if (degree != length) {
+		return false;
+	}
+
+	// Chien search: position p is in error if lambda(alpha^-p) == 0. term[j]
+	// holds log(lambda_j) - j * p mod 255, stepped by a subtraction per position.
+	std::size_t found = 0;
+	for (std::size_t j = 1; j <= degree; j++) {
+		w -> term[j] = lambda[j] ? gf_log[lambda[j]] : RS_NO_TERM;
+	}
+	for (std::size_t p = 0; p < n; p++) {
+		unsigned char sum = lambda[0];
+		for (std::size_t j = 1; j <= degree; j++) {
+			unsigned short term = w -> term[j];
+			if (term != RS_NO_TERM) {
+				sum ^= gf_exp[term];
+				w -> term[j] = term >= j ? term - j : term + RS_CODE_LENGTH - j;
+			}
+		}
+		if (sum == 0) {
+			if (found == degree) {
+				return false;
+			}
+			w -> location[found++] = (unsigned char) p;
+		}
+	}
+	if (found != degree) {
+		return false;
+	}
+
+	// Errata evaluator omega = syndrome * lambda mod x^fec
+	for (std::size_t k = 0; k < fec; k++) {
+		unsigned char sum = 0;
+		for (std::size_t j = 0; j <= k && j <= degree; j++) {
+			sum ^= gf_mul(lambda[j], w -> syndrome[k - j]);
+		}
+		w -> omega[k] = sum;
+	}
+
+	// Forney: the value at X is X^(1 - gen_poly_index) omega(X^-1) / lambda'(X^-1)
+	for (std::size_t e = 0; e < found; e++) {
+		std::size_t p = w -> location[e];
+		unsigned char inverse = gf_alpha(RS_CODE_LENGTH - p);
+		unsigned char numerator = 0;
+		unsigned char power = 1;
+		for (std::size_t k = 0; k < fec; k++) {
+			numerator ^= gf_mul(w -> omega[k], power);
+			power = gf_mul(power, inverse);
+		}
+		unsigned char denominator = 0;
+		unsigned char square = gf_mul(inverse, inverse);
+		power = 1;
+		for (std::size_t j = 1; j <= degree; j += 2) {
+			denominator ^= gf_mul(lambda[j], power);
+			power = gf_mul(power, square);
+		}
+		if (denominator == 0) {
+			return false;
+		}
+		std::size_t shift = (p * (RS_CODE_LENGTH - t -> gen_poly_index % RS_CODE_LENGTH + 1)) % RS_CODE_LENGTH;
+		w -> value[e] = gf_mul(gf_alpha(shift), gf_div(numerator, denominator));
+	}
+
+	for (std::size_t e = 0; e < found; e++) {
+		std::size_t i = n - 1 - w -> location[e];
+		unsigned char* symbol = i < data_length ? &data[i * stride] : &parity[(i - data_length) * stride];
+		*symbol ^= w -> value[e];
+	}
+	*corrected += found;
+	return true;
+}
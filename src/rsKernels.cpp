@@ -0,0 +1,268 @@
+#include <stddef.h>
+#include <string.h>
+#include "gfTables.cpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_KERNELS_X86 1
+#endif
+
+/*
+* Lane parallel Reed Solomon kernels for the parity region (parity.cpp).
+*
+* Codewords are processed in lanes: symbol i of lane j lives at
+* buf[i * stride + j], so with interleaved parity the same symbol of many
+* codewords is contiguous in memory and one SSSE3 register holds it for 16
+* codewords. Multiplying by a constant uses split nibble tables: since
+* multiplication is linear over GF(2), c * x = c * (x & 0x0f) ^ c * (x & 0xf0),
+* and each half is a 16 entry pshufb lookup. The clean check also has an AVX2
+* variant holding 32 codewords per register. Hosts without SSSE3 use the
+* scalar path, one 256 entry table per constant.
+*
+* The output is bit identical to schifra's encoder: symbol 0 of a block is the
+* highest degree coefficient, and the parity is the remainder of the message
+* by the monic generator polynomial.
+*/
+
+#define RS_MAX_FEC 64
+
+struct rs_tables {
+	std::size_t fec_length;
+	std::size_t gen_poly_index;                 // alpha^gen_poly_index is the first generator root
+	unsigned char gen_mul[RS_MAX_FEC][256];     // x * g_k, g_k the generator coefficients
+	unsigned char root_mul[RS_MAX_FEC][256];    // x * alpha^(gen_poly_index + r), the generator roots
+	unsigned char gen_nibble[RS_MAX_FEC][32];   // g_k times each low nibble, then each high nibble
+	unsigned char root_nibble[RS_MAX_FEC][32];
+};
+
+static bool rs_simd = true;                     // cleared to benchmark the scalar kernels
+
+/*
+* Build the tables for the generator polynomial with roots alpha^(gen_poly_index)
+* .. alpha^(gen_poly_index + fec_length - 1), schifra's sequential root generator
+*/
+static inline void rs_tables_init(rs_tables* t, std::size_t fec_length, std::size_t gen_poly_index) {
+	unsigned char generator[RS_MAX_FEC + 1] = {1};  // coefficient k of x^k, monic
+	for (std::size_t r = 0; r < fec_length; r++) {
+		unsigned char root = gf_alpha(gen_poly_index + r);
+		for (std::size_t k = r + 1; k > 0; k--) {
+			generator[k] = generator[k - 1] ^ gf_mul(root, generator[k]);
+		}
+		generator[0] = gf_mul(root, generator[0]);
+	}
+
+	t -> fec_length = fec_length;
+	t -> gen_poly_index = gen_poly_index;
+	for (std::size_t k = 0; k < fec_length; k++) {
+		unsigned char root = gf_alpha(gen_poly_index + k);
+		for (unsigned x = 0; x < 256; x++) {
+			t -> gen_mul[k][x] = gf_mul(generator[k], x);
+			t -> root_mul[k][x] = gf_mul(root, x);
+		}
+		for (unsigned n = 0; n < 16; n++) {
+			t -> gen_nibble[k][n] = t -> gen_mul[k][n];
+			t -> gen_nibble[k][16 + n] = t -> gen_mul[k][n << 4];
+			t -> root_nibble[k][n] = t -> root_mul[k][n];
+			t -> root_nibble[k][16 + n] = t -> root_mul[k][n << 4];
+		}
+	}
+}
+
+// Remainder register of the generator division for one lane
+static inline void rs_encode_lane(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                                  std::size_t stride, unsigned char* parity) {
+	std::size_t fec = t -> fec_length;
+	unsigned char reg[RS_MAX_FEC] = {0};
+	for (std::size_t i = 0; i < data_length; i++) {
+		unsigned char fb = data[i * stride] ^ reg[fec - 1];
+		for (std::size_t k = fec - 1; k > 0; k--) {
+			reg[k] = reg[k - 1] ^ t -> gen_mul[k][fb];
+		}
+		reg[0] = t -> gen_mul[0][fb];
+	}
+	for (std::size_t p = 0; p < fec; p++) {
+		parity[p * stride] = reg[fec - 1 - p];
+	}
+}
+
+// Evaluate the codeword at every generator root by Horner's rule; non zero if it is damaged
+static inline unsigned char rs_check_lane(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                                          const unsigned char* parity, std::size_t stride) {
+	std::size_t fec = t -> fec_length;
+	unsigned char syn[RS_MAX_FEC] = {0};
+	for (std::size_t i = 0; i < data_length; i++) {
+		unsigned char s = data[i * stride];
+		for (std::size_t r = 0; r < fec; r++) {
+			syn[r] = t -> root_mul[r][syn[r]] ^ s;
+		}
+	}
+	for (std::size_t i = 0; i < fec; i++) {
+		unsigned char s = parity[i * stride];
+		for (std::size_t r = 0; r < fec; r++) {
+			syn[r] = t -> root_mul[r][syn[r]] ^ s;
+		}
+	}
+	unsigned char dirty = 0;
+	for (std::size_t r = 0; r < fec; r++) {
+		dirty |= syn[r];
+	}
+	return dirty;
+}
+
+#ifdef RS_KERNELS_X86
+__attribute__((target("ssse3")))
+static inline __m128i rs_mul16(const unsigned char* nibble, __m128i lo, __m128i hi) {
+	__m128i tlo = _mm_loadu_si128((const __m128i*) nibble);
+	__m128i thi = _mm_loadu_si128((const __m128i*) (nibble + 16));
+	return _mm_xor_si128(_mm_shuffle_epi8(tlo, lo), _mm_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("ssse3")))
+static void rs_encode_lanes16(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                              std::size_t stride, unsigned char* parity) {
+	std::size_t fec = t -> fec_length;
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i reg[RS_MAX_FEC];
+	for (std::size_t k = 0; k < fec; k++) {
+		reg[k] = _mm_setzero_si128();
+	}
+	for (std::size_t i = 0; i < data_length; i++) {
+		__m128i fb = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (data + i * stride)), reg[fec - 1]);
+		__m128i lo = _mm_and_si128(fb, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(fb, 4), mask);
+		for (std::size_t k = fec - 1; k > 0; k--) {
+			reg[k] = _mm_xor_si128(reg[k - 1], rs_mul16(t -> gen_nibble[k], lo, hi));
+		}
+		reg[0] = rs_mul16(t -> gen_nibble[0], lo, hi);
+	}
+	for (std::size_t p = 0; p < fec; p++) {
+		_mm_storeu_si128((__m128i*) (parity + p * stride), reg[fec - 1 - p]);
+	}
+}
+
+/*
+* A codeword is clean iff its data encodes to its parity, and the encoder
+* register costs less per symbol than the syndromes: the nibbles of a symbol
+* are split once for all parity symbols instead of once per root, and the
+* parity symbols are compared rather than run through the register.
+*/
+__attribute__((target("ssse3")))
+static void rs_check_lanes16(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                             const unsigned char* parity, std::size_t stride, unsigned char* dirty) {
+	std::size_t fec = t -> fec_length;
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i reg[RS_MAX_FEC];
+	for (std::size_t k = 0; k < fec; k++) {
+		reg[k] = _mm_setzero_si128();
+	}
+	for (std::size_t i = 0; i < data_length; i++) {
+		__m128i fb = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (data + i * stride)), reg[fec - 1]);
+		__m128i lo = _mm_and_si128(fb, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(fb, 4), mask);
+		for (std::size_t k = fec - 1; k > 0; k--) {
+			reg[k] = _mm_xor_si128(reg[k - 1], rs_mul16(t -> gen_nibble[k], lo, hi));
+		}
+		reg[0] = rs_mul16(t -> gen_nibble[0], lo, hi);
+	}
+	__m128i any = _mm_setzero_si128();
+	for (std::size_t p = 0; p < fec; p++) {
+		any = _mm_or_si128(any, _mm_xor_si128(reg[fec - 1 - p], _mm_loadu_si128((const __m128i*) (parity + p * stride))));
+	}
+	_mm_storeu_si128((__m128i*) dirty, any);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rs_mul32(const unsigned char* nibble, __m256i lo, __m256i hi) {
+	__m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) nibble));
+	__m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (nibble + 16)));
+	return _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo), _mm256_shuffle_epi8(thi, hi));
+}
+
+// rs_check_lanes16 on 32 lanes, pshufb looks up each 128 bit half in the same tables
+__attribute__((target("avx2")))
+static void rs_check_lanes32(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                             const unsigned char* parity, std::size_t stride, unsigned char* dirty) {
+	std::size_t fec = t -> fec_length;
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i reg[RS_MAX_FEC];
+	for (std::size_t k = 0; k < fec; k++) {
+		reg[k] = _mm256_setzero_si256();
+	}
+	for (std::size_t i = 0; i < data_length; i++) {
+		__m256i fb = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (data + i * stride)), reg[fec - 1]);
+		__m256i lo = _mm256_and_si256(fb, mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(fb, 4), mask);
+		for (std::size_t k = fec - 1; k > 0; k--) {
+			reg[k] = _mm256_xor_si256(reg[k - 1], rs_mul32(t -> gen_nibble[k], lo, hi));
+		}
+		reg[0] = rs_mul32(t -> gen_nibble[0], lo, hi);
+	}
+	__m256i any = _mm256_setzero_si256();
+	for (std::size_t p = 0; p < fec; p++) {
+		__m256i stored = _mm256_loadu_si256((const __m256i*) (parity + p * stride));
+		any = _mm256_or_si256(any, _mm256_xor_si256(reg[fec - 1 - p], stored));
+	}
+	_mm256_storeu_si256((__m256i*) dirty, any);
+}
+
+static inline bool rs_have_ssse3() {
+	static const bool have = __builtin_cpu_supports("ssse3");
+	return rs_simd && have;
+}
+
+static inline bool rs_have_avx2() {
+	static const bool have = __builtin_cpu_supports("avx2");
+	return rs_simd && have;
+}
+#else
+static inline bool rs_have_ssse3() {
+	return false;
+}
+
+static inline bool rs_have_avx2() {
+	return false;
+}
+#endif
+
+/*
+* Encode lanes codewords whose data symbol i of lane j is data[i * stride + j],
+* storing parity symbol i of lane j at parity[i * stride + j]
+*/
+static inline void rs_encode_lanes(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                                   std::size_t lanes, std::size_t stride, unsigned char* parity) {
+	std::size_t j = 0;
+#ifdef RS_KERNELS_X86
+	if (rs_have_ssse3()) {
+		for (; j + 16 <= lanes; j += 16) {
+			rs_encode_lanes16(t, data + j, data_length, stride, parity + j);
+		}
+	}
+#endif
+	for (; j < lanes; j++) {
+		rs_encode_lane(t, data + j, data_length, stride, parity + j);
+	}
+}
+
+/*
+* Set dirty[j] non zero for every lane whose codeword has a non zero syndrome,
+* so only damaged codewords need the full decoder
+*/
+static inline void rs_check_lanes(const rs_tables* t, const unsigned char* data, std::size_t data_length,
+                                  const unsigned char* parity, std::size_t lanes, std::size_t stride,
+                                  unsigned char* dirty) {
+	std::size_t j = 0;
+#ifdef RS_KERNELS_X86
+	if (rs_have_avx2()) {
+		for (; j + 32 <= lanes; j += 32) {
+			rs_check_lanes32(t, data + j, data_length, parity + j, stride, dirty + j);
+		}
+	}
+	if (rs_have_ssse3()) {
+		for (; j + 16 <= lanes; j += 16) {
+			rs_check_lanes16(t, data + j, data_length, parity + j, stride, dirty + j);
+		}
+	}
+#endif
+	for (; j < lanes; j++) {
+		dirty[j] = rs_check_lane(t, data + j, data_length, parity + j, stride);
+	}
+}
@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+
+/*
+* Background scrub of the mounted image (--scrub). A low priority thread walks
+* the image one hash block at a time while the file system is idle. It checks
+* each block against its HMAC and the Reed Solomon codewords covering it
+* against their syndromes, running the decoder only on codewords that do not
+* vanish, and records the health of every block. A block whose HMAC fails but
+* whose codewords correct back to a matching HMAC is repaired if the operator
+* allowed it: into a sidecar file the mounter then reads the block from
+* (imageIO.cpp), or into the served file itself. Reads are paced to a byte
+* budget and only start once foreground reads have paused, so they do not add
+* to request latency. Progress is readable from the virtual file
+* SCRUB_STATUS_PATH. On an image with a Merkle tree a block is checked by
+* verifying its path to the keyed root instead. Expects parity.cpp, merkle.cpp,
+* keyedHash.cpp and imageIO.cpp to be included.
+*/
+
+#define SCRUB_STATUS_PATH "/.wofs-scrub"
+#define SCRUB_LISTED_BLOCKS 32          // failing blocks named in the status
+#define SCRUB_HASH_SIZE 32
+
+enum scrub_health {
+	SCRUB_UNCHECKED = 0,
+	SCRUB_CLEAN,                        // HMAC and syndromes match
+	SCRUB_DEGRADED,                     // HMAC matches, the parity or stored hash needed correcting
+	SCRUB_CORRECTABLE,                  // HMAC fails, the parity corrects it, repair not allowed
+	SCRUB_REPAIRED,                     // corrected and written back
+	SCRUB_FAILED,                       // HMAC fails and the parity cannot correct it
+	SCRUB_HEALTH_STATES
+};
+
+static const char* scrub_health_names[SCRUB_HEALTH_STATES] = {
+	"unchecked", "clean", "degraded", "correctable", "repaired", "failed"
+};
+
+enum scrub_repair { SCRUB_REPAIR_NONE, SCRUB_REPAIR_SIDECAR, SCRUB_REPAIR_IN_PLACE };
+enum scrub_parity { SCRUB_PARITY_NONE, SCRUB_PARITY_SEPARATE, SCRUB_PARITY_INTERLEAVED };
+
+struct scrub_config {
+	std::string served;                 // file the mounter reads
+	std::string parity_file;            // file holding the parity of the served bytes
+	scrub_parity parity;
+	parity_geometry geo;                // SCRUB_PARITY_SEPARATE
+	std::size_t fec_length;             // SCRUB_PARITY_INTERLEAVED
+	std::string key;
+	uint64_t image_size;                // bytes covered by the hashes
+	uint64_t hashes_offset;
+	uint64_t block_size;
+	int merkle;                         // the hashes section is a Merkle tree
+	uint64_t hash_algorithm;            // keyed hash of the flat hash list otherwise
+	uint64_t merkle_cache;              // verified nodes to keep
+	scrub_repair repair;
+	uint64_t rate;                      // bytes per second
+	uint64_t idle_nsec;
+	uint64_t interval_sec;
+};
+
+static scrub_config scrub_cfg;
+static int scrub_enabled = 0;
+static pthread_t scrub_thread;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake;
+static int scrub_stopping = 0;
+static uint64_t scrub_last_foreground = 0;     // CLOCK_MONOTONIC ns of the last foreground read
+static uint64_t scrub_budget_at = 0;           // earliest start of the next scrub read
+static thread_local int scrub_foreground = 0;  // set while a foreground read has a block repaired, unpaced
+
+static int scrub_served_fd = -1;
+static merkle_verifier scrub_merkle;
+static int scrub_write_fd = -1;                // sidecar, or the served file opened for writing
+static FILE* scrub_parity_fp = NULL;
+static pthread_mutex_t scrub_parity_lock = PTHREAD_MUTEX_INITIALIZER;     // parity_decode seeks scrub_parity_fp
+static uint64_t scrub_parity_size = 0;
+
+// Progress, guarded by scrub_lock
+static std::vector<unsigned char> scrub_health_map;
+static const char* scrub_state = "starting";
+static uint64_t scrub_passes = 0;
+static uint64_t scrub_block = 0;
+static uint64_t scrub_bytes = 0;
+static uint64_t scrub_corrected = 0;
+static uint64_t scrub_unrecoverable = 0;
+static time_t scrub_pass_started = 0;
+static time_t scrub_pass_finished = 0;
+
+static uint64_t scrub_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Called by every foreground read so the scrubber backs off
+static inline void scrub_note_foreground() {
+	if (scrub_enabled) {
+		scrub_last_foreground = scrub_now();
+	}
+}
+
+// Sleep until the monotonic time deadline, returns 0 if the scrubber is being stopped
+static int scrub_sleep_until(uint64_t deadline) {
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	pthread_mutex_lock(&scrub_lock);
+	while (!scrub_stopping && scrub_now() < deadline) {
+		pthread_cond_timedwait(&scrub_wake, &scrub_lock, &ts);
+	}
+	int running = !scrub_stopping;
+	pthread_mutex_unlock(&scrub_lock);
+	return running;
+}
+
+/*
+* Wait until foreground reads have paused for the idle time and the byte budget
+* allows reading bytes more. Returns 0 if the scrubber is being stopped.
+*/
+static int scrub_pace(uint64_t bytes) {
+	if (scrub_foreground) {
+		return !scrub_stopping;
+	}
+	for (;;) {
+		uint64_t quiet = scrub_last_foreground + scrub_cfg.idle_nsec;
+		uint64_t start = quiet > scrub_budget_at ? quiet : scrub_budget_at;
+		if (scrub_now() >= start) {
+			break;
+		}
+		if (!scrub_sleep_until(start)) {
+			return 0;
+		}
+	}
+	uint64_t now = scrub_now();
+	scrub_budget_at = (scrub_budget_at > now ? scrub_budget_at : now) + bytes * 1000000000ULL / scrub_cfg.rate;
+	pthread_mutex_lock(&scrub_lock);
+	scrub_bytes += bytes;
+	pthread_mutex_unlock(&scrub_lock);
+	return 1;
+}
+
+static int scrub_hash_matches(const unsigned char* data, uint64_t length, const unsigned char* hash) {
+	unsigned char digest[KEYED_HASH_SIZE];
+	keyed_hash_many(scrub_cfg.hash_algorithm, scrub_cfg.key.c_str(), scrub_cfg.key.size(), &data, 1, length, digest);
+	return memcmp(digest, hash, SCRUB_HASH_SIZE) == 0;
+}
+
+// True if a block matches its stored hash, or with a Merkle tree lies on a path to the root
+static int scrub_block_matches(uint64_t block, const unsigned char* data, uint64_t length, const unsigned char* hash) {
+	if (scrub_cfg.merkle) {
+		unsigned char leaf[MERKLE_HASH_SIZE];
+		merkle_leaf(data, length, leaf);
+		return merkle_verify_leaf(&scrub_merkle, block, leaf);
+	}
+	return scrub_hash_matches(data, length, hash);
+}
+
+/*
+* Decode the interleaved codewords holding image bytes [offset, offset + length)
+* into out. The parity file is the output of addReedSolomon: data_length image
+* bytes then fec_length parity bytes per codeword, the last one shorter.
+*/
+static int64_t scrub_decode_interleaved(uint64_t offset, uint64_t length, unsigned char* out, uint64_t* corrected) {
+	const rs_tables* tables = ecc_tables(scrub_cfg.fec_length);
+	const uint64_t fec = scrub_cfg.fec_length;
+	const uint64_t data_length = CODE_LENGTH - fec;
+	uint64_t first = offset / data_length;
+	uint64_t last = (offset + length - 1) / data_length;
+	uint64_t from = first * CODE_LENGTH;
+	uint64_t to = (last + 1) * CODE_LENGTH < scrub_parity_size ? (last + 1) * CODE_LENGTH : scrub_parity_size;
+	if (from >= to || !scrub_pace(to - from)) {
+		return -1;
+	}
+	std::vector<unsigned char> codewords(to - from);
+	if (pread_full(fileno(scrub_parity_fp), &codewords[0], to - from, from) != (ssize_t) (to - from)) {
+		return -1;
+	}
+
+	int64_t failed = 0;
+	unsigned char partial[CODE_LENGTH];
+	for (uint64_t c = first; c <= last && (c - first) * CODE_LENGTH < to - from; c++) {
+		unsigned char* codeword = &codewords[(c - first) * CODE_LENGTH];
+		uint64_t stored = to - from - (c - first) * CODE_LENGTH;
+		stored = stored < CODE_LENGTH ? stored : CODE_LENGTH;
+		if (stored <= fec) {
+			failed++;
+			continue;
+		}
+		unsigned char* data = codeword;
+		if (stored < CODE_LENGTH) {
+			memset(partial, 0, sizeof(partial));
+			memcpy(partial, codeword, stored - fec);
+			memcpy(partial + data_length, codeword + stored - fec, fec);
+			data = partial;
+		}
+		if (!rs_decode_lane(tables, rs_workspace_local(), data, data_length, data + data_length, 1, NULL, 0,
+		                    corrected)) {
+			failed++;
+		}
+		uint64_t start = c * data_length;
+		uint64_t lo = start > offset ? start : offset;
+		uint64_t hi = start + stored - fec < offset + length ? start + stored - fec : offset + length;
+		if (lo < hi) {
+			memcpy(out + (lo - offset), data + (lo - start), hi - lo);
+		}
+	}
+	return failed;
+}
+
+/*
+* Correct image bytes [offset, offset + length) against the parity into out.
+* Returns the number of codewords that could not be corrected, -1 if the parity
+* could not be read or the scrubber is being stopped.
+*/
+static int64_t scrub_correct(uint64_t offset, uint64_t length, unsigned char* out, uint64_t* corrected) {
+	if (scrub_cfg.parity == SCRUB_PARITY_INTERLEAVED) {
+		return scrub_decode_interleaved(offset, length, out, corrected);
+	}
+
+	const parity_geometry& geo = scrub_cfg.geo;
+	uint64_t group_bytes = geo.depth * geo.data_length;
+	uint64_t first = offset / group_bytes;
+	uint64_t count = (offset + length - 1) / group_bytes - first + 1;
+	uint64_t groups = parity_group_count(geo);
+	if (first >= groups) {
+		return -1;
+	}
+	count = first + count <= groups ? count : groups - first;
+	if (!scrub_pace(count * geo.depth * CODE_LENGTH)) {
+		return -1;
+	}
+	std::vector<unsigned char> data(count * group_bytes);
+	pthread_mutex_lock(&scrub_parity_lock);
+	int64_t failed = parity_decode(scrub_parity_fp, geo, first, count, &data[0], NULL, corrected);
+	pthread_mutex_unlock(&scrub_parity_lock);
+	if (failed >= 0) {
+		memcpy(out, &data[offset - first * group_bytes], length);
+	}
+	return failed;
+}
+
+static void scrub_record(uint64_t block, scrub_health health, uint64_t corrected, int64_t failed) {
+	pthread_mutex_lock(&scrub_lock);
+	scrub_health_map[block] = health;
+	scrub_corrected += corrected;
+	scrub_unrecoverable += failed > 0 ? failed : 0;
+	pthread_mutex_unlock(&scrub_lock);
+}
+
+/*
+* Write corrected bytes back. The sidecar only takes image blocks, which the
+* mounter then reads from it.
+*/
+static int scrub_write(uint64_t block, const unsigned char* data, uint64_t length, uint64_t offset) {
+	if (scrub_cfg.repair == SCRUB_REPAIR_NONE || scrub_write_fd < 0
+	    || (scrub_cfg.repair == SCRUB_REPAIR_SIDECAR && offset >= scrub_cfg.image_size)) {
+		return 0;
+	}
+	uint64_t done = 0;
+	while (done < length) {
+		ssize_t put = pwrite(scrub_write_fd, data + done, length - done, offset + done);
+		if (put < 0 && errno == EINTR) {
+			continue;
+		}
+		if (put <= 0) {
+			return 0;
+		}
+		done += put;
+	}
+	if (fdatasync(scrub_write_fd) != 0) {
+		return 0;
+	}
+	if (scrub_cfg.repair == SCRUB_REPAIR_SIDECAR) {
+		image_overlay_map[block] = 1;
+	}
+	return 1;
+}
+
+/*
+* Check one hash block and record its health. Returns 0 if the scrubber is
+* being stopped.
+*/
+static int scrub_check_block(uint64_t block) {
+	uint64_t offset = block * scrub_cfg.block_size;
+	uint64_t length = scrub_cfg.image_size - offset < scrub_cfg.block_size
+	                  ? scrub_cfg.image_size - offset : scrub_cfg.block_size;
+	uint64_t hash_offset = scrub_cfg.hashes_offset + block * SCRUB_HASH_SIZE;
+	std::vector<unsigned char> data(length);
+	std::vector<unsigned char> fixed(length);
+	unsigned char hash[SCRUB_HASH_SIZE];
+	unsigned char fixed_hash[SCRUB_HASH_SIZE];
+
+	if (!scrub_pace(length + SCRUB_HASH_SIZE)) {
+		return 0;
+	}
+	// The block is read like a foreground read would, through the sidecar if it was repaired
+	int readable = image_read(&data[0], length, offset) == (ssize_t) length
+	               && (scrub_cfg.merkle || pread_full(scrub_served_fd, hash, SCRUB_HASH_SIZE, hash_offset) == SCRUB_HASH_SIZE);
+	int matches = readable && scrub_block_matches(block, &data[0], length, hash);
+
+	if (scrub_cfg.parity == SCRUB_PARITY_NONE) {
+		scrub_record(block, matches ? SCRUB_CLEAN : SCRUB_FAILED, 0, 0);
+		return 1;
+	}
+
+	uint64_t corrected = 0;
+	int64_t failed = scrub_correct(offset, length, &fixed[0], &corrected);
+	if (failed < 0) {
+		if (scrub_stopping) {
+			return 0;
+		}
+		scrub_record(block, matches ? SCRUB_DEGRADED : SCRUB_FAILED, 0, 0);
+		return 1;
+	}
+	if (matches) {
+		scrub_record(block, corrected == 0 && failed == 0 ? SCRUB_CLEAN : SCRUB_DEGRADED, corrected, failed);
+		return 1;
+	}
+
+	// The tree has no per block entry to correct; a damaged node on the path fails the block
+	// until the mounter repairs the hashes section
+	if (scrub_cfg.merkle) {
+		scrub_health health = SCRUB_FAILED;
+		if (scrub_block_matches(block, &fixed[0], length, hash)) {
+			health = scrub_write(block, &fixed[0], length, offset) ? SCRUB_REPAIRED : SCRUB_CORRECTABLE;
+		}
+		scrub_record(block, health, corrected, failed);
+		return 1;
+	}
+
+	// The stored hash may be the damaged part, it is protected by the parity too
+	uint64_t hash_corrected = 0;
+	int64_t hash_failed = scrub_correct(hash_offset, SCRUB_HASH_SIZE, fixed_hash, &hash_corrected);
+	if (hash_failed < 0) {
+		if (scrub_stopping) {
+			return 0;
+		}
+		memcpy(fixed_hash, hash, SCRUB_HASH_SIZE);
+		hash_failed = 0;
+	}
+	corrected += hash_corrected;
+	failed += hash_failed;
+
+	scrub_health health = SCRUB_FAILED;
+	if (readable && scrub_hash_matches(&data[0], length, fixed_hash)) {
+		// Only the stored hash was damaged, the served data is intact
+		health = SCRUB_DEGRADED;
+		if (scrub_cfg.repair == SCRUB_REPAIR_IN_PLACE) {
+			scrub_write(block, fixed_hash, SCRUB_HASH_SIZE, hash_offset);
+		}
+	} else if (scrub_hash_matches(&fixed[0], length, fixed_hash)) {
+		health = scrub_write(block, &fixed[0], length, offset) ? SCRUB_REPAIRED : SCRUB_CORRECTABLE;
+		if (health == SCRUB_REPAIRED && memcmp(hash, fixed_hash, SCRUB_HASH_SIZE) != 0
+		    && scrub_cfg.repair == SCRUB_REPAIR_IN_PLACE) {
+			scrub_write(block, fixed_hash, SCRUB_HASH_SIZE, hash_offset);
+		}
+	}
+	scrub_record(block, health, corrected, failed);
+	return 1;
+}
+
+/*
+* Check and repair a block right away, for a foreground read that found it
+* damaged (the CRC check of mounter.c). Runs on the calling thread without
+* pacing. Returns 1 if the block ended up clean, degraded or repaired.
+*/
+static int scrub_repair_block(uint64_t block) {
+	if (!scrub_enabled || block >= scrub_health_map.size()) {
+		return 0;
+	}
+	scrub_foreground = 1;
+	int checked = scrub_check_block(block);
+	scrub_foreground = 0;
+	pthread_mutex_lock(&scrub_lock);
+	int health = scrub_health_map[block];
+	pthread_mutex_unlock(&scrub_lock);
+	return checked && (health == SCRUB_CLEAN || health == SCRUB_DEGRADED || health == SCRUB_REPAIRED);
+}
+
+// Idle I/O class and lowest CPU priority for the calling thread, best effort
+static void scrub_lower_priority() {
+	pid_t tid = syscall(SYS_gettid);
+	setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+	const int who_process = 1;
+	const int class_idle = 3;
+	syscall(SYS_ioprio_set, who_process, tid, class_idle << 13);
+#endif
+}
+
+static void* scrub_main(void* arg) {
+	(void) arg;
+	scrub_lower_priority();
+	uint64_t blocks = (scrub_cfg.image_size + scrub_cfg.block_size - 1) / scrub_cfg.block_size;
+	for (;;) {
+		uint64_t started = scrub_now();
+		pthread_mutex_lock(&scrub_lock);
+		scrub_state = "scrubbing";
+		scrub_pass_started = time(NULL);
+		pthread_mutex_unlock(&scrub_lock);
+
+		for (uint64_t b = 0; b < blocks; b++) {
+			pthread_mutex_lock(&scrub_lock);
+			scrub_block = b;
+			pthread_mutex_unlock(&scrub_lock);
+			if (!scrub_check_block(b)) {
+				return NULL;
+			}
+		}
+
+		pthread_mutex_lock(&scrub_lock);
+		scrub_passes++;
+		scrub_block = blocks;
+		scrub_pass_finished = time(NULL);
+		scrub_state = "waiting for the next pass";
+		pthread_mutex_unlock(&scrub_lock);
+		if (!scrub_sleep_until(started + scrub_cfg.interval_sec * 1000000000ULL)) {
+			return NULL;
+		}
+	}
+}
+
+/*
+* Open the files the scrubber needs and start it. Called from the FUSE init
+* callback, after the daemon has forked.
+*/
+static int scrub_start() {
+	scrub_served_fd = open(scrub_cfg.served.c_str(), O_RDONLY);
+	if (scrub_served_fd < 0) {
+		printf("Scrub: unable to open %s\n", scrub_cfg.served.c_str());
+		return -1;
+	}
+	uint64_t blocks = (scrub_cfg.image_size + scrub_cfg.block_size - 1) / scrub_cfg.block_size;
+	if (scrub_cfg.merkle && merkle_open(&scrub_merkle, scrub_served_fd, scrub_cfg.hashes_offset, blocks,
+	                                    scrub_cfg.key.c_str(), scrub_cfg.merkle_cache) != 0) {
+		printf("Scrub: the Merkle root does not match the keyed root\n");
+		return -1;
+	}
+	if (scrub_cfg.parity != SCRUB_PARITY_NONE) {
+		scrub_parity_fp = fopen(scrub_cfg.parity_file.c_str(), "r");
+		struct stat st;
+		if (scrub_parity_fp == NULL || fstat(fileno(scrub_parity_fp), &st) != 0) {
+			printf("Scrub: unable to open %s, checking hashes only\n", scrub_cfg.parity_file.c_str());
+			scrub_cfg.parity = SCRUB_PARITY_NONE;
+		} else {
+			scrub_parity_size = st.st_size;
+		}
+	}
+
+	scrub_health_map.assign(blocks, SCRUB_UNCHECKED);
+	if (scrub_cfg.repair == SCRUB_REPAIR_SIDECAR) {
+		// Rebuilt on every mount, the health of the blocks in it is not kept
+		std::string sidecar = scrub_cfg.served + ".scrub";
+		scrub_write_fd = open(sidecar.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (scrub_write_fd >= 0) {
+			image_overlay_map = (volatile unsigned char*) calloc(blocks, 1);
+			image_overlay_blocks = blocks;
+			image_overlay_block_size = scrub_cfg.block_size;
+			image_overlay_fd = scrub_write_fd;
+		}
+	} else if (scrub_cfg.repair == SCRUB_REPAIR_IN_PLACE) {
+		scrub_write_fd = open(scrub_cfg.served.c_str(), O_WRONLY);
+	}
+	if (scrub_cfg.repair != SCRUB_REPAIR_NONE && scrub_write_fd < 0) {
+		printf("Scrub: unable to open a file to repair into, only reporting damage\n");
+		scrub_cfg.repair = SCRUB_REPAIR_NONE;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&scrub_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0) {
+		printf("Scrub: unable to start the scrub thread\n");
+		return -1;
+	}
+	scrub_enabled = 1;
+	return 0;
+}
+
+static void scrub_stop() {
+	if (!scrub_enabled) {
+		return;
+	}
+	pthread_mutex_lock(&scrub_lock);
+	scrub_stopping = 1;
+	pthread_cond_broadcast(&scrub_wake);
+	pthread_mutex_unlock(&scrub_lock);
+	pthread_join(scrub_thread, NULL);
+	scrub_enabled = 0;
+}
+
+/*
+* Text of the status file: progress of the current pass, block health counts
+* and the first failing blocks
+*/
+static std::string scrub_status() {
+	static const char* repair_names[] = {"none", "sidecar", "in place"};
+	static const char* parity_names[] = {"none (hashes only)", "separated parity", "interleaved codewords"};
+	char line[256];
+	std::string out;
+	pthread_mutex_lock(&scrub_lock);
+	uint64_t blocks = scrub_health_map.size();
+	uint64_t counts[SCRUB_HEALTH_STATES] = {0};
+	std::string failing;
+	uint64_t listed = 0;
+	for (uint64_t b = 0; b < blocks; b++) {
+		counts[scrub_health_map[b]]++;
+		if ((scrub_health_map[b] == SCRUB_FAILED || scrub_health_map[b] == SCRUB_CORRECTABLE)
+		    && listed++ < SCRUB_LISTED_BLOCKS) {
+			snprintf(line, sizeof(line), " %llu", (unsigned long long) b);
+			failing += line;
+		}
+	}
+	snprintf(line, sizeof(line), "state: %s\npasses completed: %llu\nprogress: %llu/%llu blocks (%.1f%%)\n",
+	         scrub_state, (unsigned long long) scrub_passes, (unsigned long long) scrub_block, (unsigned long long) blocks,
+	         blocks ? 100.0 * scrub_block / blocks : 100.0);
+	out += line;
+	snprintf(line, sizeof(line), "block size: %llu\nparity: %s\nrepair: %s\n",
+	         (unsigned long long) scrub_cfg.block_size, parity_names[scrub_cfg.parity], repair_names[scrub_cfg.repair]);
+	out += line;
+	snprintf(line, sizeof(line), "budget: %.1f MB/s after %llu ms idle\nbytes read: %llu\n",
+	         scrub_cfg.rate / 1e6, (unsigned long long) (scrub_cfg.idle_nsec / 1000000),
+	         (unsigned long long) scrub_bytes);
+	out += line;
+	for (int h = 0; h < SCRUB_HEALTH_STATES; h++) {
+		snprintf(line, sizeof(line), "%s: %llu\n", scrub_health_names[h], (unsigned long long) counts[h]);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "symbols corrected: %llu\ncodewords unrecoverable: %llu\n",
+	         (unsigned long long) scrub_corrected, (unsigned long long) scrub_unrecoverable);
+	out += line;
+	if (scrub_pass_finished != 0) {
+		snprintf(line, sizeof(line), "last pass finished: %s", ctime(&scrub_pass_finished));
+		out += line;
+	}
+	if (listed > 0) {
+		out += "damaged blocks:" + failing + (listed > SCRUB_LISTED_BLOCKS ? " ...\n" : "\n");
+	}
+	pthread_mutex_unlock(&scrub_lock);
+	return out;
+}
@@ -0,0 +1,121 @@
+#include "OnDiskStructure.h"
+
+// Std lib includes
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <cstddef>
+#include <cstdlib>
+#include <endian.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "superblock.cpp"
+#include "shards.cpp"
+#include "splitImage.cpp"
+#include "replicas.cpp"
+#include "imageIO.cpp"
+#include "searchIndex.cpp"
+
+/*
+* Searches the names in an image through its search index (master
+* --search-index), reading the image directly instead of mounting it:
+*
+*   ./search.out [--path] <image> <pattern>
+*
+* Prints the full path of every entry whose name matches the glob pattern, or
+* whose full path does with --path. A pattern without *, ? or [ matches names
+* holding it.
+*/
+
+//============================== Static Globals ==============================//
+
+static s_blk sb;
+
+//=========================== Function Definitions ===========================//
+
+int main(int argc, char* argv[])
+{
+    bool whole_path = argc == 4 && std::string(argv[1]) == "--path";
+    if (argc != 3 && !whole_path) {
+        std::cout << "usage: " << argv[0] << " [--path] <image> <pattern>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string filename = argv[argc - 2];
+    const std::string pattern = argv[argc - 1];
+
+    FILE* input = fopen(filename.c_str(), "rb");
+    if (input == NULL) {
+        std::cout << "failed to open " << filename << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int sb_status = read_superblock(input, &sb);
+    if (sb_status != SB_OK) {
+        std::cout << filename << ": " << superblock_error(sb_status) << std::endl;
+        fclose(input);
+        return EXIT_FAILURE;
+    }
+    if (sb.sections[SECTION_SEARCH].length == 0) {
+        std::cout << filename << ": no search index, master the image with --search-index" << std::endl;
+        fclose(input);
+        return EXIT_FAILURE;
+    }
+
+    // A striped image is read from its shards, named as the .necc files the master writes
+    shard_set shards;
+    if (sb.features & FEATURE_STRIPED) {
+        shard_geometry geo = {sb.sections[SECTION_HASHES].offset, sb.stripe_unit, sb.shard_count};
+        int fds[SHARD_MAX_COUNT];
+        for (uint64_t k = 0; shard_count_supported(geo.count) && k < geo.count; k++) {
+            std::string name = shard_name(filename, k, "");
+            fds[k] = name.empty() ? -1 : open(name.c_str(), O_RDONLY);
+            if (fds[k] < 0) {
+                std::cout << filename << ": striped over " << geo.count << " shards, "
+                          << (name.empty() ? "name its shard 0" : name + " cannot be opened") << std::endl;
+                fclose(input);
+                return EXIT_FAILURE;
+            }
+        }
+        shard_set_open(&shards, geo, fds);
+        fclose(input);
+        input = shard_fopen(&shards);
+    }
+
+    // The index of a split image is in the image file, past where its data section was cut out
+    split_files split;
+    if (sb.features & FEATURE_SPLIT_DATA) {
+        split.geo.data_offset = sb.sections[SECTION_DATA].offset;
+        split.geo.data_length = sb.sections[SECTION_DATA].length;
+        split.geo.image_size = sb.sections[SECTION_HASHES].offset + split.geo.data_length;
+        split.image_fd = fileno(input);
+        split.data_fd = -1;
+        input = split_fopen(&split);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    search_index index;
+    if (load_search_index(input, sb.sections[SECTION_SEARCH], &index) != 0) {
+        std::cout << filename << ": malformed search index" << std::endl;
+        fclose(input);
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> matches;
+    int64_t count = search_query(input, &index, pattern, whole_path, &matches);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (count < 0) {
+        std::cout << filename << ": unable to read the search index" << std::endl;
+        fclose(input);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < matches.size(); i++) {
+        std::cout << matches[i] << "\n";
+    }
+    double msec = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    std::cerr << count << " of " << index.path_count << " entries match, " << msec << " ms" << std::endl;
+
+    fclose(input);
+    return EXIT_SUCCESS;
+} // end main
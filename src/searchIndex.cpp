@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <endian.h>
+
+/*
+* Search index section (SECTION_SEARCH)
+*
+* A trigram index over the full path of every entry ("/root/dir/file"), so
+* names are searched by substring or glob without walking the tree. Entries
+* are numbered in the order their paths are listed, and each trigram (three
+* consecutive bytes) of any path lists the entries whose path holds it. A
+* search looks up the trigrams of the literal parts of the pattern, intersects
+* their lists and matches only the paths left. Layout (big endian):
+*
+*   uint64  path count
+*   uint64  trigram count
+*   uint64  offset of the path heap in the section
+*   uint64  end of the path in the heap        [path count]
+*   uint32  trigram, first byte highest        [trigram count], ascending
+*   uint32  entries listed
+*   uint64  offset of the list in the section
+*   lists:  entry numbers ascending, each as a varint of its difference to the
+*           last (the first as itself)
+*   heap:   the paths back to back
+*/
+
+#define SEARCH_PREFIX_SIZE (3 * sizeof(uint64_t))
+#define SEARCH_TRIGRAM_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t))
+#define SEARCH_LIST_RATIO 8          // lists longer than this many times the candidates are not read
+#define SEARCH_BULK_READ 64         // more candidates than 1/64 of the paths read the whole heap at once
+
+static inline uint32_t search_trigram(const char* p) {
+	return (uint32_t) (unsigned char) p[0] << 16 | (uint32_t) (unsigned char) p[1] << 8 | (unsigned char) p[2];
+}
+
+static inline void search_put_varint(std::vector<unsigned char>& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back((unsigned char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char) v);
+}
+
+/*
+* Build the section for paths, numbered in the order given. Every trigram of a
+* path is paired with its number, and sorting the pairs groups the lists.
+*/
+std::vector<unsigned char> build_search_index(const std::vector<std::string>& paths) {
+	std::vector<uint64_t> pairs;
+	for (size_t i = 0; i < paths.size(); i++) {
+		const std::string& path = paths[i];
+		for (size_t j = 0; j + 3 <= path.size(); j++) {
+			pairs.push_back((uint64_t) search_trigram(&path[j]) << 32 | i);
+		}
+	}
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+	std::vector<uint32_t> trigrams;
+	std::vector<uint32_t> counts;
+	std::vector<unsigned char> lists;
+	std::vector<uint64_t> list_offsets;
+	for (size_t i = 0; i < pairs.size();) {
+		uint32_t trigram = pairs[i] >> 32;
+		trigrams.push_back(trigram);
+		list_offsets.push_back(lists.size());
+		uint32_t last = 0;
+		size_t start = i;
+		for (; i < pairs.size() && (pairs[i] >> 32) == trigram; i++) {
+			uint32_t entry = (uint32_t) pairs[i];
+			search_put_varint(lists, i == start ? entry : entry - last);
+			last = entry;
+		}
+		counts.push_back(i - start);
+	}
+
+	uint64_t lists_offset = SEARCH_PREFIX_SIZE + paths.size() * sizeof(uint64_t) + trigrams.size() * SEARCH_TRIGRAM_SIZE;
+	uint64_t heap_size = 0;
+	for (size_t i = 0; i < paths.size(); i++) {
+		heap_size += paths[i].size();
+	}
+	std::vector<unsigned char> section(lists_offset + lists.size() + heap_size);
+	unsigned char* p = &section[0];
+	p = put64(p, paths.size());
+	p = put64(p, trigrams.size());
+	p = put64(p, lists_offset + lists.size());
+	uint64_t end = 0;
+	for (size_t i = 0; i < paths.size(); i++) {
+		end += paths[i].size();
+		p = put64(p, end);
+	}
+	for (size_t i = 0; i < trigrams.size(); i++) {
+		p = put32(p, trigrams[i]);
+		p = put32(p, counts[i]);
+		p = put64(p, lists_offset + list_offsets[i]);
+	}
+	if (!lists.empty()) {
+		memcpy(p, &lists[0], lists.size());
+		p += lists.size();
+	}
+	for (size_t i = 0; i < paths.size(); i++) {
+		memcpy(p, paths[i].data(), paths[i].size());
+		p += paths[i].size();
+	}
+	return section;
+}
+
+/*
+* Reading side. The trigram table is kept in memory; lists, path ends and
+* paths are read from the image when a search needs them.
+*/
+struct search_trigram_entry {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t offset;
+};
+
+struct search_index {
+	uint64_t section_offset;
+	uint64_t section_length;
+	uint64_t path_count;
+	uint64_t heap_offset;
+	std::vector<search_trigram_entry> trigrams;
+};
+
+// Returns 0 on success
+static inline int load_search_index(FILE* fp, const section_entry& section, search_index* index) {
+	unsigned char prefix[SEARCH_PREFIX_SIZE];
+	fseek(fp, section.offset, SEEK_SET);
+	if (section.length < SEARCH_PREFIX_SIZE || fread(prefix, 1, sizeof(prefix), fp) != sizeof(prefix)) {
+		return -1;
+	}
+	uint64_t trigram_count;
+	const unsigned char* p = prefix;
+	p = get64(p, &index -> path_count);
+	p = get64(p, &trigram_count);
+	p = get64(p, &index -> heap_offset);
+	uint64_t table_end = SEARCH_PREFIX_SIZE + index -> path_count * sizeof(uint64_t) + trigram_count * SEARCH_TRIGRAM_SIZE;
+	if (index -> path_count == 0 || table_end > index -> heap_offset || index -> heap_offset > section.length) {
+		return -1;
+	}
+	index -> section_offset = section.offset;
+	index -> section_length = section.length;
+
+	std::vector<unsigned char> table(trigram_count * SEARCH_TRIGRAM_SIZE);
+	fseek(fp, section.offset + SEARCH_PREFIX_SIZE + index -> path_count * sizeof(uint64_t), SEEK_SET);
+	if (!table.empty() && fread(&table[0], 1, table.size(), fp) != table.size()) {
+		return -1;
+	}
+	index -> trigrams.resize(trigram_count);
+	p = table.empty() ? NULL : &table[0];
+	for (uint64_t i = 0; i < trigram_count; i++) {
+		search_trigram_entry& t = index -> trigrams[i];
+		p = get32(p, &t.trigram);
+		p = get32(p, &t.count);
+		p = get64(p, &t.offset);
+		if (t.offset > index -> heap_offset) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Path of entry i, empty if it cannot be read
+static std::string search_path(FILE* fp, const search_index* index, uint64_t i) {
+	unsigned char ends[2 * sizeof(uint64_t)];
+	uint64_t start = 0;
+	uint64_t end;
+	uint64_t at = index -> section_offset + SEARCH_PREFIX_SIZE + (i > 0 ? i - 1 : 0) * sizeof(uint64_t);
+	fseek(fp, at, SEEK_SET);
+	size_t want = i > 0 ? sizeof(ends) : sizeof(uint64_t);
+	if (fread(ends, 1, want, fp) != want) {
+		return "";
+	}
+	const unsigned char* p = ends;
+	if (i > 0) {
+		p = get64(p, &start);
+	}
+	get64(p, &end);
+	if (end < start || index -> heap_offset + end > index -> section_length) {
+		return "";
+	}
+	std::string path(end - start, '\0');
+	fseek(fp, index -> section_offset + index -> heap_offset + start, SEEK_SET);
+	if (!path.empty() && fread(&path[0], 1, path.size(), fp) != path.size()) {
+		return "";
+	}
+	return path;
+}
+
+// All path ends and the whole heap, for searches matching many of the paths
+static int search_read_paths(FILE* fp, const search_index* index, std::vector<unsigned char>* ends, std::vector<char>* heap) {
+	ends -> resize(index -> path_count * sizeof(uint64_t));
+	heap -> resize(index -> section_length - index -> heap_offset);
+	fseek(fp, index -> section_offset + SEARCH_PREFIX_SIZE, SEEK_SET);
+	if (fread(&(*ends)[0], 1, ends -> size(), fp) != ends -> size()) {
+		return -1;
+	}
+	fseek(fp, index -> section_offset + index -> heap_offset, SEEK_SET);
+	if (!heap -> empty() && fread(&(*heap)[0], 1, heap -> size(), fp) != heap -> size()) {
+		return -1;
+	}
+	return 0;
+}
+
+// Entries listed for a trigram, ascending
+static int search_list(FILE* fp, const search_index* index, const search_trigram_entry& t, std::vector<uint32_t>* out) {
+	// a varint of an entry number takes at most 5 bytes
+	uint64_t room = index -> heap_offset - t.offset;
+	std::vector<unsigned char> bytes(room < (uint64_t) t.count * 5 ? room : (uint64_t) t.count * 5);
+	fseek(fp, index -> section_offset + t.offset, SEEK_SET);
+	size_t got = bytes.empty() ? 0 : fread(&bytes[0], 1, bytes.size(), fp);
+	out -> clear();
+	uint32_t last = 0;
+	size_t at = 0;
+	for (uint32_t i = 0; i < t.count; i++) {
+		uint64_t v = 0;
+		for (int shift = 0; ; shift += 7) {
+			if (at >= got || shift > 35) {
+				return -1;
+			}
+			unsigned char b = bytes[at++];
+			v |= (uint64_t) (b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				break;
+			}
+		}
+		last = i == 0 ? v : last + v;
+		out -> push_back(last);
+	}
+	return 0;
+}
+
+/*
+* Literal runs of a glob pattern, outside of *, ? and [...] classes, with
+* backslash escapes resolved
+*/
+static std::vector<std::string> search_literals(const std::string& pattern) {
+	std::vector<std::string> runs(1);
+	for (size_t i = 0; i < pattern.size(); i++) {
+		char c = pattern[i];
+		if (c == '\\' && i + 1 < pattern.size()) {
+			runs.back() += pattern[++i];
+		} else if (c == '*' || c == '?' || c == '[') {
+			if (c == '[') {
+				size_t close = pattern.find(']', i + 2);
+				i = close == std::string::npos ? pattern.size() : close;
+			}
+			runs.push_back("");
+		} else {
+			runs.back() += c;
+		}
+	}
+	return runs;
+}
+
+static inline bool search_is_glob(const std::string& pattern) {
+	return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+/*
+* Paths of the entries matching pattern: a glob matched against the name, or
+* against the full path with whole_path, like find -name and -path. A pattern
+* without *, ? or [ matches names or paths holding it. Returns the number of
+* paths, or -1 if the index cannot be read.
+*/
+static int64_t search_query(FILE* fp, const search_index* index, const std::string& pattern, bool whole_path,
+                            std::vector<std::string>* matches) {
+	std::string glob = search_is_glob(pattern) ? pattern : "*" + pattern + "*";
+
+	// the trigrams every match holds, fewest entries first
+	std::vector<const search_trigram_entry*> needed;
+	std::vector<std::string> runs = search_literals(glob);
+	for (size_t r = 0; r < runs.size(); r++) {
+		for (size_t j = 0; j + 3 <= runs[r].size(); j++) {
+			search_trigram_entry key = {search_trigram(&runs[r][j]), 0, 0};
+			std::vector<search_trigram_entry>::const_iterator t = std::lower_bound(index -> trigrams.begin(),
+				index -> trigrams.end(), key,
+				[](const search_trigram_entry& a, const search_trigram_entry& b) { return a.trigram < b.trigram; });
+			if (t == index -> trigrams.end() || t -> trigram != key.trigram) {
+				matches -> clear();
+				return 0;
+			}
+			needed.push_back(&*t);
+		}
+	}
+	std::sort(needed.begin(), needed.end(),
+		[](const search_trigram_entry* a, const search_trigram_entry* b) { return a -> count < b -> count; });
+	needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> list;
+	std::vector<uint32_t> both;
+	for (size_t i = 0; i < needed.size(); i++) {
+		// matching a few paths is cheaper than reading a long list
+		if (i > 0 && needed[i] -> count > candidates.size() * SEARCH_LIST_RATIO) {
+			break;
+		}
+		if (search_list(fp, index, *needed[i], i == 0 ? &candidates : &list) != 0) {
+			return -1;
+		}
+		if (i > 0) {
+			both.clear();
+			std::set_intersection(candidates.begin(), candidates.end(), list.begin(), list.end(), std::back_inserter(both));
+			candidates.swap(both);
+		}
+	}
+	bool all = needed.empty();      // no literal of three bytes, every path is a candidate
+
+	matches -> clear();
+	uint64_t count = all ? index -> path_count : candidates.size();
+	std::vector<unsigned char> ends;
+	std::vector<char> heap;
+	if (count > index -> path_count / SEARCH_BULK_READ && search_read_paths(fp, index, &ends, &heap) != 0) {
+		return -1;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t entry = all ? i : candidates[i];
+		std::string path;
+		if (heap.empty()) {
+			path = search_path(fp, index, entry);
+		} else {
+			uint64_t start = 0;
+			uint64_t end;
+			if (entry > 0) {
+				get64(&ends[(entry - 1) * sizeof(uint64_t)], &start);
+			}
+			get64(&ends[entry * sizeof(uint64_t)], &end);
+			if (start <= end && end <= heap.size()) {
+				path.assign(&heap[0] + start, end - start);
+			}
+		}
+		if (path.empty()) {
+			return -1;
+		}
+		std::string name = whole_path ? path : path.substr(path.find_last_of('/') + 1);
+		if (fnmatch(glob.c_str(), name.c_str(), 0) == 0) {
+			matches -> push_back(path);
+		}
+	}
+	return matches -> size();
+}
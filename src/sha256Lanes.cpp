@@ -0,0 +1,398 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define SHA256_LANES_X86 1
+#endif
+
+/*
+* Multi-buffer HMAC-SHA256 of hash blocks (hashAndAppend, checkHash).
+*
+* The hash blocks of an image are independent messages of the same length,
+* so several of them are hashed side by side: word t of every lane's message
+* schedule sits in one register, and each round of the compression function
+* runs on all lanes at once, 8 lanes with AVX2 and 16 with AVX-512. Message
+* blocks are loaded with a transpose of 32 bit words. The ipad and opad states
+* depend on the key alone and are computed once per call.
+*
+* Hosts without either, batches of fewer messages than lanes and AVX2 hosts
+* with the SHA extensions (OpenSSL on one stream outruns eight AVX2 lanes)
+* go through OpenSSL's HMAC one message at a time. Both give the same digests.
+*/
+
+#define SHA256_MAX_LANES 16
+#define SHA256_BLOCK 64
+#define SHA256_DIGEST 32
+
+static bool sha256_lanes_simd = true;           // cleared to benchmark OpenSSL's path
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, unsigned n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t sha256_load_be(const unsigned char* p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void sha256_store_be(uint32_t x, unsigned char* p) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+// One compression of a single stream, only used for the pad blocks of the key
+static inline void sha256_compress(uint32_t* state, const unsigned char* block) {
+	uint32_t w[64];
+	for (int t = 0; t < 16; t++) {
+		w[t] = sha256_load_be(block + 4 * t);
+	}
+	for (int t = 16; t < 64; t++) {
+		uint32_t s0 = sha256_rotr(w[t - 15], 7) ^ sha256_rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+		uint32_t s1 = sha256_rotr(w[t - 2], 17) ^ sha256_rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+		w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int t = 0; t < 64; t++) {
+		uint32_t t1 = h + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) + ((e & f) ^ (~e & g))
+		              + sha256_k[t] + w[t];
+		uint32_t t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/*
+* States after the inner (key ^ ipad) and outer (key ^ opad) pad blocks. Keys
+* longer than a block are hashed first, as HMAC does.
+*/
+static inline void hmac_sha256_pads(const char* key, size_t key_length, uint32_t* inner, uint32_t* outer) {
+	unsigned char block[SHA256_BLOCK] = {0};
+	if (key_length > SHA256_BLOCK) {
+		EVP_Digest(key, key_length, block, NULL, EVP_sha256(), NULL);
+	} else {
+		memcpy(block, key, key_length);
+	}
+	unsigned char pad[SHA256_BLOCK];
+	for (int i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] = block[i] ^ 0x36;
+	}
+	memcpy(inner, sha256_initial, sizeof(sha256_initial));
+	sha256_compress(inner, pad);
+	for (int i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] = block[i] ^ 0x5c;
+	}
+	memcpy(outer, sha256_initial, sizeof(sha256_initial));
+	sha256_compress(outer, pad);
+}
+
+#ifdef SHA256_LANES_X86
+// CPUID leaf 7: EBX bit 29 is the SHA extensions
+static inline bool sha256_have_sha_extensions() {
+	unsigned int eax, ebx, ecx, edx;
+	return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx >> 29 & 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sha256_rotr8(__m256i x, int n) {
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+/*
+* Load word t of the message block of each lane into w[t]: 8 rows of 8 words
+* transposed twice, then byte swapped to big endian
+*/
+__attribute__((target("avx2")))
+static inline void sha256_load8(const unsigned char* const* blocks, __m256i* w) {
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+	                                      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (int half = 0; half < 2; half++) {
+		__m256i r[8];
+		for (int j = 0; j < 8; j++) {
+			r[j] = _mm256_loadu_si256((const __m256i*) (blocks[j] + 32 * half));
+		}
+		__m256i t[8];
+		for (int i = 0; i < 4; i++) {
+			t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+			t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+		}
+		__m256i u[8];
+		for (int i = 0; i < 2; i++) {
+			u[4 * i] = _mm256_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+			u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+			u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+			u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+		}
+		__m256i* out = w + 8 * half;
+		for (int m = 0; m < 4; m++) {
+			out[m] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[m], u[4 + m], 0x20), swap);
+			out[4 + m] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[m], u[4 + m], 0x31), swap);
+		}
+	}
+}
+
+/*
+* One compression of 8 lanes, each by the message block it points to. Word i
+* of lane j's state is state[i * 8 + j].
+*/
+__attribute__((target("avx2")))
+static void sha256_compress8(uint32_t* state, const unsigned char* const* blocks) {
+	__m256i w[16];
+	sha256_load8(blocks, w);
+	__m256i v[8];
+	for (int i = 0; i < 8; i++) {
+		v[i] = _mm256_loadu_si256((const __m256i*) (state + 8 * i));
+	}
+	__m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m256i w15 = w[(t - 15) & 15];
+			__m256i w2 = w[(t - 2) & 15];
+			__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(sha256_rotr8(w15, 7), sha256_rotr8(w15, 18)),
+			                              _mm256_srli_epi32(w15, 3));
+			__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(sha256_rotr8(w2, 17), sha256_rotr8(w2, 19)),
+			                              _mm256_srli_epi32(w2, 10));
+			w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+		}
+		__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(sha256_rotr8(e, 6), sha256_rotr8(e, 11)), sha256_rotr8(e, 25));
+		__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+		__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+		                              _mm256_add_epi32(_mm256_add_epi32(ch, w[t & 15]), _mm256_set1_epi32(sha256_k[t])));
+		__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(sha256_rotr8(a, 2), sha256_rotr8(a, 13)), sha256_rotr8(a, 22));
+		__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi32(t1, _mm256_add_epi32(s0, maj));
+	}
+	__m256i out[8] = {a, b, c, d, e, f, g, h};
+	for (int i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i*) (state + 8 * i), _mm256_add_epi32(v[i], out[i]));
+	}
+}
+
+// GCC 12 warns about the undefined source operand the unmasked AVX-512 intrinsics pass on
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/*
+* sha256_load8 for 16 lanes: one 64 byte block per register, transposed
+* within 128 bit lanes and then across them
+*/
+__attribute__((target("avx512f,avx512bw")))
+static inline void sha256_load16(const unsigned char* const* blocks, __m512i* w) {
+	const __m512i swap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+	__m512i r[16];
+	for (int j = 0; j < 16; j++) {
+		r[j] = _mm512_loadu_si512((const void*) blocks[j]);
+	}
+	__m512i t[16];
+	for (int i = 0; i < 8; i++) {
+		t[2 * i] = _mm512_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+		t[2 * i + 1] = _mm512_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+	}
+	// u[4i + m] holds word 4k + m of rows 4i..4i+3 in its 128 bit lane k
+	__m512i u[16];
+	for (int i = 0; i < 4; i++) {
+		u[4 * i] = _mm512_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 1] = _mm512_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+		u[4 * i + 2] = _mm512_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+		u[4 * i + 3] = _mm512_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+	}
+	for (int m = 0; m < 4; m++) {
+		__m512i x0 = _mm512_shuffle_i32x4(u[m], u[4 + m], 0x88);
+		__m512i x1 = _mm512_shuffle_i32x4(u[m], u[4 + m], 0xdd);
+		__m512i y0 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0x88);
+		__m512i y1 = _mm512_shuffle_i32x4(u[8 + m], u[12 + m], 0xdd);
+		w[m] = _mm512_shuffle_epi8(_mm512_shuffle_i32x4(x0, y0, 0x88), swap);
+		w[4 + m] = _mm512_shuffle_epi8(_mm512_shuffle_i32x4(x1, y1, 0x88), swap);
+		w[8 + m] = _mm512_shuffle_epi8(_mm512_shuffle_i32x4(x0, y0, 0xdd), swap);
+		w[12 + m] = _mm512_shuffle_epi8(_mm512_shuffle_i32x4(x1, y1, 0xdd), swap);
+	}
+}
+
+// sha256_compress8 on 16 lanes, with native rotates and three input logic
+__attribute__((target("avx512f,avx512bw")))
+static void sha256_compress16(uint32_t* state, const unsigned char* const* blocks) {
+	__m512i w[16];
+	sha256_load16(blocks, w);
+	__m512i v[8];
+	for (int i = 0; i < 8; i++) {
+		v[i] = _mm512_loadu_si512((const void*) (state + 16 * i));
+	}
+	__m512i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m512i w15 = w[(t - 15) & 15];
+			__m512i w2 = w[(t - 2) & 15];
+			__m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18),
+			                                       _mm512_srli_epi32(w15, 3), 0x96);
+			__m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19),
+			                                       _mm512_srli_epi32(w2, 10), 0x96);
+			w[t & 15] = _mm512_add_epi32(_mm512_add_epi32(w[t & 15], s0), _mm512_add_epi32(w[(t - 7) & 15], s1));
+		}
+		__m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11),
+		                                       _mm512_ror_epi32(e, 25), 0x96);
+		__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+		__m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, s1),
+		                              _mm512_add_epi32(_mm512_add_epi32(ch, w[t & 15]), _mm512_set1_epi32(sha256_k[t])));
+		__m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13),
+		                                       _mm512_ror_epi32(a, 22), 0x96);
+		__m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xe8);
+		h = g;
+		g = f;
+		f = e;
+		e = _mm512_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm512_add_epi32(t1, _mm512_add_epi32(s0, maj));
+	}
+	__m512i out[8] = {a, b, c, d, e, f, g, h};
+	for (int i = 0; i < 8; i++) {
+		_mm512_storeu_si512((void*) (state + 16 * i), _mm512_add_epi32(v[i], out[i]));
+	}
+}
+
+#pragma GCC diagnostic pop
+
+typedef void (*sha256_lanes_fn)(uint32_t* state, const unsigned char* const* blocks);
+
+/*
+* Finish each lane's hash with the padded final blocks of a message of total
+* bytes whose last tail bytes start at tails[j], then store its digest
+*/
+static inline void sha256_finish_lanes(sha256_lanes_fn compress, int lanes, uint32_t* state,
+                                       const unsigned char* const* tails, uint64_t tail, uint64_t total,
+                                       unsigned char* digests) {
+	unsigned char pad[SHA256_MAX_LANES][2 * SHA256_BLOCK];
+	const unsigned char* blocks[SHA256_MAX_LANES];
+	uint64_t padded = tail + 9 <= SHA256_BLOCK ? SHA256_BLOCK : 2 * SHA256_BLOCK;
+	for (int j = 0; j < lanes; j++) {
+		memset(pad[j], 0, padded);
+		memcpy(pad[j], tails[j], tail);
+		pad[j][tail] = 0x80;
+		for (int i = 0; i < 8; i++) {
+			pad[j][padded - 1 - i] = (unsigned char) (total * 8 >> 8 * i);
+		}
+		blocks[j] = pad[j];
+	}
+	compress(state, blocks);
+	if (padded > SHA256_BLOCK) {
+		for (int j = 0; j < lanes; j++) {
+			blocks[j] = pad[j] + SHA256_BLOCK;
+		}
+		compress(state, blocks);
+	}
+	for (int j = 0; j < lanes; j++) {
+		for (int i = 0; i < 8; i++) {
+			sha256_store_be(state[i * lanes + j], digests + j * SHA256_DIGEST + 4 * i);
+		}
+	}
+}
+
+// HMAC of lanes messages of length bytes each, from the pad states of the key
+static void hmac_sha256_lanes(sha256_lanes_fn compress, int lanes, const uint32_t* inner, const uint32_t* outer,
+                              const unsigned char* const* messages, uint64_t length, unsigned char* out) {
+	uint32_t state[8 * SHA256_MAX_LANES];
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < lanes; j++) {
+			state[i * lanes + j] = inner[i];
+		}
+	}
+	const unsigned char* at[SHA256_MAX_LANES];
+	uint64_t full = length / SHA256_BLOCK;
+	for (uint64_t b = 0; b < full; b++) {
+		for (int j = 0; j < lanes; j++) {
+			at[j] = messages[j] + b * SHA256_BLOCK;
+		}
+		compress(state, at);
+	}
+	for (int j = 0; j < lanes; j++) {
+		at[j] = messages[j] + full * SHA256_BLOCK;
+	}
+	unsigned char digests[SHA256_MAX_LANES * SHA256_DIGEST];
+	sha256_finish_lanes(compress, lanes, state, at, length % SHA256_BLOCK, SHA256_BLOCK + length, digests);
+
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < lanes; j++) {
+			state[i * lanes + j] = outer[i];
+		}
+	}
+	for (int j = 0; j < lanes; j++) {
+		at[j] = digests + j * SHA256_DIGEST;
+	}
+	sha256_finish_lanes(compress, lanes, state, at, SHA256_DIGEST, SHA256_BLOCK + SHA256_DIGEST, out);
+}
+
+/*
+* Lanes of the widest multi-buffer kernel worth using on this host, 0 to use
+* OpenSSL. A single stream on the SHA extensions outruns eight AVX2 lanes.
+*/
+static inline int sha256_lane_count() {
+	static const int lanes = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") ? 16
+	                         : __builtin_cpu_supports("avx2") && !sha256_have_sha_extensions() ? 8 : 0;
+	return sha256_lanes_simd ? lanes : 0;
+}
+#else
+static inline int sha256_lane_count() {
+	return 0;
+}
+#endif
+
+/*
+* HMAC-SHA256 under key of count messages of length bytes each, the digest of
+* message i stored at out + 32 * i
+*/
+static inline void hmac_sha256_many(const char* key, size_t key_length, const unsigned char* const* messages,
+                                    size_t count, uint64_t length, unsigned char* out) {
+	size_t i = 0;
+#ifdef SHA256_LANES_X86
+	int lanes = sha256_lane_count();
+	if (lanes > 0 && count >= (size_t) lanes) {
+		sha256_lanes_fn compress = lanes == 16 ? sha256_compress16 : sha256_compress8;
+		uint32_t inner[8], outer[8];
+		hmac_sha256_pads(key, key_length, inner, outer);
+		for (; i + lanes <= count; i += lanes) {
+			hmac_sha256_lanes(compress, lanes, inner, outer, messages + i, length, out + i * SHA256_DIGEST);
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		unsigned int digest_length = 0;
+		HMAC(EVP_sha256(), key, key_length, messages[i], length, out + i * SHA256_DIGEST, &digest_length);
+	}
+}
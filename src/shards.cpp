@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+/*
+* Striped images (master --shards)
+*
+* The logical image is cut into stripe units dealt round robin over the shard
+* files: unit u lives in shard u % count at offset (u / count) * unit, so the
+* units of one shard are back to back and a range of the logical image is one
+* contiguous range of each shard. Each shard is written as its own image file,
+* its part of the logical image followed by the keyed hash of each of its hash
+* blocks, with its own ECC, so a shard is verified and corrected on its own
+* and the shards can sit on different disks. Shard 0 holds the superblock.
+*
+* Shard k of an image named <image> is <image>.<k>, and <image>.<k>.necc
+* before ECC is applied.
+*/
+
+#define SHARD_MAX_COUNT 16
+#define SHARD_MIN_UNIT 4096
+#define SHARD_MAX_UNIT (64 * 1024 * 1024)
+
+struct shard_geometry {
+	uint64_t logical_size;      // bytes of the logical image
+	uint64_t unit;              // bytes per stripe unit
+	uint64_t count;             // shards
+};
+
+static inline bool shard_count_supported(uint64_t count) {
+	return count >= 2 && count <= SHARD_MAX_COUNT;
+}
+
+static inline bool shard_unit_supported(uint64_t unit) {
+	return unit >= SHARD_MIN_UNIT && unit <= SHARD_MAX_UNIT && (unit & (unit - 1)) == 0;
+}
+
+// Bytes of the logical image in shard k
+static inline uint64_t shard_length(const shard_geometry& geo, uint64_t k) {
+	uint64_t units = geo.logical_size / geo.unit;
+	uint64_t length = units / geo.count * geo.unit;
+	uint64_t left = units % geo.count;
+	if (k < left) {
+		length += geo.unit;
+	} else if (k == left) {
+		length += geo.logical_size % geo.unit;
+	}
+	return length;
+}
+
+/*
+* Name of shard k of the image whose shard 0 is named first: first ends in
+* ".0" or ".0.necc", whose 0 is replaced. With dirs, a colon separated list of
+* directories, shard k is in directory k % (number of dirs) instead of next to
+* shard 0. Empty if first is not the name of shard 0.
+*/
+static inline std::string shard_name(const std::string& first, uint64_t k, const std::string& dirs) {
+	std::string suffix = first.size() >= 5 && first.compare(first.size() - 5, 5, ".necc") == 0 ? ".necc" : "";
+	std::string stem = first.substr(0, first.size() - suffix.size());
+	if (stem.size() < 2 || stem.compare(stem.size() - 2, 2, ".0") != 0) {
+		return "";
+	}
+	std::string name = stem.substr(0, stem.size() - 1) + std::to_string(k) + suffix;
+	if (dirs.empty()) {
+		return name;
+	}
+	std::vector<std::string> dir_list;
+	size_t start = 0;
+	while (start <= dirs.size()) {
+		size_t end = dirs.find(':', start);
+		end = end == std::string::npos ? dirs.size() : end;
+		dir_list.push_back(dirs.substr(start, end - start));
+		start = end + 1;
+	}
+	size_t slash = name.find_last_of('/');
+	return dir_list[k % dir_list.size()] + "/" + (slash == std::string::npos ? name : name.substr(slash + 1));
+}
+
+/*
+* Reads of a striped image. A read touching several shards reads them side by
+* side, the calling thread taking the first shard and one worker thread per
+* shard the others.
+*/
+struct shard_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	int error;
+};
+
+// Contiguous range of one shard and the pieces of the caller's buffer it fills
+struct shard_job {
+	uint64_t shard;
+	uint64_t offset;
+	std::vector<std::pair<char*, uint64_t> > pieces;
+	shard_batch* batch;
+};
+
+struct shard_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	std::deque<shard_job*> queue;
+};
+
+struct shard_set {
+	shard_geometry geo;
+	int fds[SHARD_MAX_COUNT];
+	shard_worker workers[SHARD_MAX_COUNT];
+	int threads;                // workers started, 0 to read the shards one after another
+};
+
+static inline int shard_job_run(const shard_set* set, shard_job* job) {
+	uint64_t offset = job -> offset;
+	for (size_t i = 0; i < job -> pieces.size(); i++) {
+		char* buf = job -> pieces[i].first;
+		uint64_t len = job -> pieces[i].second;
+		uint64_t done = 0;
+		while (done < len) {
+			ssize_t got = pread(set -> fds[job -> shard], buf + done, len - done, offset + done);
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got <= 0) {
+				return -EIO;
+			}
+			done += got;
+		}
+		offset += len;
+	}
+	return 0;
+}
+
+static inline void shard_job_finish(shard_job* job, int res) {
+	pthread_mutex_lock(&job -> batch -> lock);
+	job -> batch -> error = res != 0 ? res : job -> batch -> error;
+	if (--job -> batch -> pending == 0) {
+		pthread_cond_signal(&job -> batch -> done);
+	}
+	pthread_mutex_unlock(&job -> batch -> lock);
+}
+
+struct shard_worker_arg {
+	shard_set* set;
+	uint64_t shard;
+};
+
+static void* shard_worker_main(void* arg) {
+	shard_worker_arg* a = (shard_worker_arg*) arg;
+	shard_set* set = a -> set;
+	shard_worker* worker = &set -> workers[a -> shard];
+	delete a;
+	while (true) {
+		pthread_mutex_lock(&worker -> lock);
+		while (worker -> queue.empty()) {
+			pthread_cond_wait(&worker -> ready, &worker -> lock);
+		}
+		shard_job* job = worker -> queue.front();
+		worker -> queue.pop_front();
+		pthread_mutex_unlock(&worker -> lock);
+		shard_job_finish(job, shard_job_run(set, job));
+	}
+	return NULL;
+}
+
+/*
+* Start reading the shards of geo through fds, which the set keeps, one after
+* another until shard_set_start
+*/
+static inline void shard_set_open(shard_set* set, const shard_geometry& geo, const int* fds) {
+	set -> geo = geo;
+	set -> threads = 0;
+	for (uint64_t k = 0; k < geo.count; k++) {
+		set -> fds[k] = fds[k];
+		pthread_mutex_init(&set -> workers[k].lock, NULL);
+		pthread_cond_init(&set -> workers[k].ready, NULL);
+	}
+}
+
+// Start one worker per shard, so reads spanning shards read them side by side
+static inline void shard_set_start(shard_set* set) {
+	int started = 0;
+	for (uint64_t k = 0; k < set -> geo.count; k++) {
+		shard_worker_arg* arg = new shard_worker_arg;
+		arg -> set = set;
+		arg -> shard = k;
+		if (pthread_create(&set -> workers[k].thread, NULL, shard_worker_main, arg) != 0) {
+			delete arg;
+			break;
+		}
+		pthread_detach(set -> workers[k].thread);
+		started++;
+	}
+	// if not all started, those that did wait for jobs that never come
+	set -> threads = started == (int) set -> geo.count ? started : 0;
+}
+
+/*
+* Read [offset, offset + len) of the logical image. Returns the bytes read,
+* fewer only at its end, or -EIO.
+*/
+static ssize_t shard_read(shard_set* set, void* buf, size_t len, uint64_t offset) {
+	const shard_geometry& geo = set -> geo;
+	if (offset >= geo.logical_size) {
+		return 0;
+	}
+	len = geo.logical_size - offset < len ? geo.logical_size - offset : len;
+
+	shard_job jobs[SHARD_MAX_COUNT];
+	for (uint64_t k = 0; k < geo.count; k++) {
+		jobs[k].shard = k;
+		jobs[k].pieces.clear();
+	}
+	for (uint64_t at = offset; at < offset + len;) {
+		uint64_t unit = at / geo.unit;
+		uint64_t within = at % geo.unit;
+		uint64_t part = geo.unit - within < offset + len - at ? geo.unit - within : offset + len - at;
+		shard_job* job = &jobs[unit % geo.count];
+		if (job -> pieces.empty()) {
+			job -> offset = unit / geo.count * geo.unit + within;
+		}
+		job -> pieces.push_back(std::make_pair((char*) buf + (at - offset), part));
+		at += part;
+	}
+
+	shard_batch batch;
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.done, NULL);
+	batch.pending = 0;
+	batch.error = 0;
+	shard_job* local = NULL;
+	int res = 0;
+	for (uint64_t k = 0; k < geo.count; k++) {
+		if (jobs[k].pieces.empty()) {
+			continue;
+		}
+		jobs[k].batch = &batch;
+		if (local == NULL) {
+			local = &jobs[k];
+			continue;
+		}
+		if (set -> threads == 0) {
+			int r = shard_job_run(set, &jobs[k]);
+			res = res != 0 ? res : r;
+			continue;
+		}
+		pthread_mutex_lock(&batch.lock);
+		batch.pending++;
+		pthread_mutex_unlock(&batch.lock);
+		shard_worker* worker = &set -> workers[k];
+		pthread_mutex_lock(&worker -> lock);
+		worker -> queue.push_back(&jobs[k]);
+		pthread_cond_signal(&worker -> ready);
+		pthread_mutex_unlock(&worker -> lock);
+	}
+	if (local != NULL) {
+		int r = shard_job_run(set, local);
+		res = res != 0 ? res : r;
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0) {
+		pthread_cond_wait(&batch.done, &batch.lock);
+	}
+	res = res != 0 ? res : batch.error;
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+	return res != 0 ? res : (ssize_t) len;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+
+/*
+* Split images (master --split)
+*
+* The payloads are written to a data file of their own, so the metadata can
+* sit on fast storage and the bulk of the image on slow storage. The image is
+* laid out as usual and then cut in two:
+*
+*   <image>        everything but the data section: superblock, metadata,
+*                  names, path index, followed by its hashes
+*   <image>.data   the data section, followed by its hashes
+*
+* (<image>.necc and <image>.data.necc before ECC is applied to each.) Headers
+* keep the offsets of the whole image, so an offset in the data section is
+* read from the data file and one past it from the image, moved back by the
+* length of the data section. The superblock holds the id of the data file,
+* the SHA-256 of its hashes section (baseImage.cpp), so the hashes of the
+* image cover the data file through it.
+*/
+
+struct split_geometry {
+	uint64_t data_offset;       // data section of the whole image
+	uint64_t data_length;
+	uint64_t image_size;        // bytes of the whole image before its hashes
+};
+
+// Data file of the image file name: <image>.data, or <image>.data.necc for <image>.necc
+static inline std::string split_data_name(const std::string& image) {
+	const std::string necc = ".necc";
+	if (image.size() > necc.size() && image.compare(image.size() - necc.size(), necc.size(), necc) == 0) {
+		return image.substr(0, image.size() - necc.size()) + ".data" + necc;
+	}
+	return image + ".data";
+}
+
+/*
+* Reads of a split image at offsets of the whole image, through the image and
+* data file descriptors. Returns the bytes read, fewer only at the end, or
+* -EIO.
+*/
+struct split_files {
+	split_geometry geo;
+	int image_fd;
+	int data_fd;
+};
+
+static ssize_t split_read(const split_files* files, void* buf, size_t len, uint64_t offset) {
+	const split_geometry& geo = files -> geo;
+	uint64_t data_end = geo.data_offset + geo.data_length;
+	if (offset >= geo.image_size) {
+		return 0;
+	}
+	len = geo.image_size - offset < len ? geo.image_size - offset : len;
+	size_t done = 0;
+	while (done < len) {
+		uint64_t at = offset + done;
+		int in_data = at >= geo.data_offset && at < data_end;
+		uint64_t end = at < geo.data_offset ? geo.data_offset : in_data ? data_end : geo.image_size;
+		size_t part = end - at < len - done ? end - at : len - done;
+		int fd = in_data ? files -> data_fd : files -> image_fd;
+		uint64_t physical = in_data ? at - geo.data_offset : at < geo.data_offset ? at : at - geo.data_length;
+		ssize_t got = fd < 0 ? -1 : pread(fd, (char*) buf + done, part, physical);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return -EIO;
+		}
+		done += got;
+	}
+	return len;
+}
@@ -0,0 +1,129 @@
+#include <cstring>
+#include <stdio.h>
+#include <endian.h>
+#include "OnDiskStructure.h"
+
+/*
+* Superblock serialization, shared by the master, mounter and tree programs.
+* Fields are written in the order they are declared in OnDiskStructure.h.
+*/
+
+enum superblock_status : int {SB_OK = 0, SB_SHORT = 1, SB_MAGIC = 2, SB_VERSION = 3, SB_FEATURES = 4};
+
+static inline unsigned char* put32(unsigned char* p, uint32_t v) {
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static inline unsigned char* put64(unsigned char* p, uint64_t v) {
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static inline const unsigned char* get32(const unsigned char* p, uint32_t* v) {
+	memcpy(v, p, sizeof(*v));
+	*v = be32toh(*v);
+	return p + sizeof(*v);
+}
+
+static inline const unsigned char* get64(const unsigned char* p, uint64_t* v) {
+	memcpy(v, p, sizeof(*v));
+	*v = be64toh(*v);
+	return p + sizeof(*v);
+}
+
+static inline void encode_superblock(const s_blk* sb, unsigned char* buf) {
+	memset(buf, 0, SUPERBLOCK_SIZE);
+	unsigned char* p = buf;
+	p = put32(p, sb -> magic);
+	p = put32(p, sb -> version);
+	p = put64(p, sb -> features);
+	p = put32(p, sb -> field_descriptor);
+	p = put32(p, sb -> code_length);
+	p = put32(p, sb -> fec_length);
+	p = put32(p, sb -> gen_poly_index);
+	p = put64(p, sb -> hash_block_size);
+	p = put64(p, sb -> entry_count);
+	for (int i = 0; i < MAX_SECTIONS; i++) {
+		p = put64(p, sb -> sections[i].offset);
+		p = put64(p, sb -> sections[i].length);
+	}
+	p = put64(p, sb -> data_alignment);
+	p = put64(p, sb -> align_threshold);
+	p = put64(p, sb -> parity_interleave);
+	p = put64(p, sb -> hash_algorithm);
+	p = put64(p, sb -> crc_block_size);
+	memcpy(p, sb -> base_id, BASE_ID_SIZE);
+	p += BASE_ID_SIZE;
+	p = put64(p, sb -> shard_count);
+	p = put64(p, sb -> stripe_unit);
+	memcpy(p, sb -> data_id, BASE_ID_SIZE);
+	p += BASE_ID_SIZE;
+}
+
+static inline int decode_superblock(const unsigned char* buf, s_blk* sb) {
+	const unsigned char* p = buf;
+	p = get32(p, &sb -> magic);
+	p = get32(p, &sb -> version);
+	p = get64(p, &sb -> features);
+	p = get32(p, &sb -> field_descriptor);
+	p = get32(p, &sb -> code_length);
+	p = get32(p, &sb -> fec_length);
+	p = get32(p, &sb -> gen_poly_index);
+	p = get64(p, &sb -> hash_block_size);
+	p = get64(p, &sb -> entry_count);
+	for (int i = 0; i < MAX_SECTIONS; i++) {
+		p = get64(p, &sb -> sections[i].offset);
+		p = get64(p, &sb -> sections[i].length);
+	}
+	p = get64(p, &sb -> data_alignment);
+	p = get64(p, &sb -> align_threshold);
+	p = get64(p, &sb -> parity_interleave);
+	p = get64(p, &sb -> hash_algorithm);
+	p = get64(p, &sb -> crc_block_size);
+	memcpy(sb -> base_id, p, BASE_ID_SIZE);
+	p += BASE_ID_SIZE;
+	p = get64(p, &sb -> shard_count);
+	p = get64(p, &sb -> stripe_unit);
+	memcpy(sb -> data_id, p, BASE_ID_SIZE);
+	p += BASE_ID_SIZE;
+
+	if (sb -> magic != WOFS_MAGIC) {
+		return SB_MAGIC;
+	}
+	if (sb -> version > WOFS_VERSION) {
+		return SB_VERSION;
+	}
+	if (sb -> features & ~(uint64_t) SUPPORTED_FEATURES || sb -> hash_algorithm >= HASH_ALGORITHM_COUNT) {
+		return SB_FEATURES;
+	}
+	return SB_OK;
+}
+
+static inline int write_superblock(FILE* fp, const s_blk* sb) {
+	unsigned char buf[SUPERBLOCK_SIZE];
+	encode_superblock(sb, buf);
+	fseek(fp, 0, SEEK_SET);
+	return fwrite(buf, 1, SUPERBLOCK_SIZE, fp) == SUPERBLOCK_SIZE ? SB_OK : SB_SHORT;
+}
+
+static inline int read_superblock(FILE* fp, s_blk* sb) {
+	unsigned char buf[SUPERBLOCK_SIZE];
+	fseek(fp, 0, SEEK_SET);
+	if (fread(buf, 1, SUPERBLOCK_SIZE, fp) != SUPERBLOCK_SIZE) {
+		return SB_SHORT;
+	}
+	return decode_superblock(buf, sb);
+}
+
+static inline const char* superblock_error(int status) {
+	switch (status) {
+		case SB_SHORT: return "image is too small to hold a superblock";
+		case SB_MAGIC: return "image has no WOFS superblock (not an image, or mastered by an older version)";
+		case SB_VERSION: return "image was mastered with a newer format version";
+		case SB_FEATURES: return "image uses format features this program does not support";
+		default: return "ok";
+	}
+}
@@ -6,49 +6,28 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstdlib>
 #include <endian.h>
 #include <bitset>
+#include <fcntl.h>
+
+#include "superblock.cpp"
+#include "metadata.cpp"
+#include "shards.cpp"
+#include "splitImage.cpp"
+#include "replicas.cpp"
+#include "imageIO.cpp"
 
 //========================== Function Declarations ===========================//
 
 /** 
     Prints metadata tree from root of hdr
     
-    @param input: the input stream from which to load the metadata.
+    @param input: the image file from which to load the metadata.
     @param hdr: the root metadata header from which to print down from
     @param depth: the depth for which you call the print recursion
 */
-void print_metadata(std::fstream& input, const m_hdr& hdr, unsigned int depth);
-
-/** 
-    Converts value from little endian to big endian (i.e. reverses it)
-*/
-uint64_t toBigEndian64(uint64_t value);
-
-/** 
-    Converts value from little endian to big endian (i.e. reverses it)
-*/
-uint32_t toBigEndian32(uint32_t value);
-
-/** 
-    Reads value from input file at offset
-    
-    @param input: the input stream from which to load the metadata.
-    @param offset: the offset from the beginning of the file that addresses the 
-        value
-    @return value at offset
-*/
-uint64_t readOffset(std::fstream& input, uint64_t offset);
-
-/** 
-    Reads header metadata struct from input file at offset
-
-    @param input: the input stream from which to load the metadata.
-    @param offset: the offset from the beginning of the file that addresses the 
-        value
-    @return header at offset
-*/
-m_hdr readHeader(std::fstream& input, uint64_t offset);
+void print_metadata(FILE* input, const m_hdr& hdr, unsigned int depth);
 
 /**
     Prints just the header and optionally file metadata/data
@@ -56,7 +35,7 @@ m_hdr readHeader(std::fstream& input, uint64_t offset);
     @param s: the pointer to the first character in the space padded buffer
     @return the payload string within the space padded buffer   
 */
-void printHeader(std::fstream& input, const m_hdr& hdr, const int depth);
+void printHeader(FILE* input, const m_hdr& hdr, const int depth);
 
 /**
     Trims spaces from beginning and end of a string
@@ -79,6 +58,7 @@ std::string unixTimeToHumanTime(const time_t& time);
 
 static bool disp_verbose;
 static bool disp_content;
+static s_blk sb;
 
 static const std::string empty = "    ";
 static const std::string child_line = "|___";
@@ -105,62 +85,67 @@ int main(int argc, char* argv[])
         disp_content = (flag == "-vc");
     }
 
-    // Create file stream, and open with user given filename
-    std::fstream input;
+    // Open the user given filename
     const std::string filename = (argc == 2) 
                                ? argv[1] 
                                : argv[2];
-    input.open(filename, std::ios::in | std::ios::binary);
+    FILE* input = fopen(filename.c_str(), "rb");
 
     // Check if file was properly opened
-    if (!input.is_open()) {
+    if (input == NULL) {
         std::cout << "failed to open " << filename << std::endl;
         return EXIT_FAILURE;
     }
 
-    // Set stream position to zero, and get first header 
-    input.seekg(0);
-    m_hdr root_ptr = readHeader(input, 0);
-    print_metadata(input, root_ptr, 0);
-
-    // Cleanup and return
-    return EXIT_SUCCESS;
-} // end main
-
-m_hdr readHeader(std::fstream& input, uint64_t offset) {
-
-    // Instantiate new header
-    m_hdr header;
-
-    // Read the header data starting at the offset
-    input.seekg(offset);
-    input.read(reinterpret_cast<char*>(&header), sizeof(m_hdr));
-
-    // Set data values in output header
-    header.type   = (file_type) toBigEndian32(header.type);
-    header.length = toBigEndian64(header.length);
-    header.time   = toBigEndian64(header.time);
-    header.offset = toBigEndian64(header.offset);
+    // Read the superblock to locate the root header
+    int sb_status = read_superblock(input, &sb);
+    if (sb_status != SB_OK) {
+        std::cout << filename << ": " << superblock_error(sb_status) << std::endl;
+        fclose(input);
+        return EXIT_FAILURE;
+    }
 
-    return header;
-} // end readHeader
+    // A striped image is listed from its shards, named as the .necc files the master writes
+    shard_set shards;
+    if (sb.features & FEATURE_STRIPED) {
+        shard_geometry geo = {sb.sections[SECTION_HASHES].offset, sb.stripe_unit, sb.shard_count};
+        int fds[SHARD_MAX_COUNT];
+        for (uint64_t k = 0; shard_count_supported(geo.count) && k < geo.count; k++) {
+            std::string name = shard_name(filename, k, "");
+            fds[k] = name.empty() ? -1 : open(name.c_str(), O_RDONLY);
+            if (fds[k] < 0) {
+                std::cout << filename << ": striped over " << geo.count << " shards, "
+                          << (name.empty() ? "name its shard 0" : name + " cannot be opened") << std::endl;
+                fclose(input);
+                return EXIT_FAILURE;
+            }
+        }
+        shard_set_open(&shards, geo, fds);
+        fclose(input);
+        input = shard_fopen(&shards);
+    }
 
-uint64_t readOffset(std::fstream& input, uint64_t offset) {
-    input.seekg(offset);
-    uint64_t read_offset;
-    input.read((char*)&read_offset, sizeof(uint64_t));
-    return toBigEndian64(read_offset);
-} // end readOffset
+    // A split image reads file contents from its data file, if it is next to the image
+    split_files split;
+    if (sb.features & FEATURE_SPLIT_DATA) {
+        split.geo.data_offset = sb.sections[SECTION_DATA].offset;
+        split.geo.data_length = sb.sections[SECTION_DATA].length;
+        split.geo.image_size = sb.sections[SECTION_HASHES].offset + split.geo.data_length;
+        split.image_fd = fileno(input);
+        split.data_fd = open(split_data_name(filename).c_str(), O_RDONLY);
+        input = split_fopen(&split);
+    }
 
-uint64_t toBigEndian64(uint64_t value) {
-    return htobe64(value);
-} // end toBigEndian64
+    m_hdr* root_ptr = meta_root(input, &sb);
+    print_metadata(input, *root_ptr, 0);
 
-uint32_t toBigEndian32(uint32_t value) {
-    return htobe32(value);
-} // end toBigEndian32
+    // Cleanup and return
+    free(root_ptr);
+    fclose(input);
+    return EXIT_SUCCESS;
+} // end main
 
-void print_metadata(std::fstream& input, const m_hdr& hdr, unsigned int depth){
+void print_metadata(FILE* input, const m_hdr& hdr, unsigned int depth){
 
     // Prepend line with dashes to indicate depth
     for (auto i = 1U; i < depth; i++) {
@@ -174,7 +159,7 @@ void print_metadata(std::fstream& input, const m_hdr& hdr, unsigned int depth){
     const file_type& type = hdr.type;
     
     // If the file type is a normal file, no need to recurse
-    if(type == file_type::PLAIN_FILE)
+    if(is_file(type))
     {
         return;
     }
@@ -182,19 +167,20 @@ void print_metadata(std::fstream& input, const m_hdr& hdr, unsigned int depth){
     // If the file is a directory, print the contents
     if(type == file_type::DIRECTORY)
     {
-        uint64_t init_offset = hdr.offset;
-
         for(auto i = 0U; i < hdr.length; ++i){
-            uint64_t next_offset = init_offset + i*sizeof(uint64_t);
-            uint64_t next_header_block = readOffset(input, next_offset);
-            
-            m_hdr sub = readHeader(input, next_header_block);
-            print_metadata(input, sub, depth+1);
+            m_hdr* sub = meta_child(input, &sb, &hdr, i);
+            if (sub == NULL) {
+                std::cout << "child " << i << " of " << trimSpaces(hdr.name)
+                          << " points outside the metadata section" << std::endl;
+                continue;
+            }
+            print_metadata(input, *sub, depth+1);
+            free(sub);
         }
     }
 } // end print_metadata
 
-void printHeader(std::fstream& input, const m_hdr& hdr, const int depth) {
+void printHeader(FILE* input, const m_hdr& hdr, const int depth) {
 
     std::cout << trimSpaces(hdr.name) << std::endl;
 
@@ -204,21 +190,37 @@ void printHeader(std::fstream& input, const m_hdr& hdr, const int depth) {
         }
         std::cout << " *Time: " << unixTimeToHumanTime(hdr.time) << std::endl;
 
-        if (hdr.type == PLAIN_FILE) {
+        if (is_file(hdr.type)) {
             for (auto i = 0U; i < depth; i++) {
                 std::cout << empty; 
             }
-            std::cout << " *Size: " << hdr.length << " B" << std::endl;
+            std::cout << " *Size: " << hdr.length << " B";
+            if (hdr.type == COMPRESSED_FILE) {
+                std::cout << " (compressed)";
+            } else if (hdr.type == CHUNKED_FILE) {
+                std::cout << " (in the chunk store)";
+            } else if (hdr.type == BASE_FILE) {
+                std::cout << " (in the base image)";
+            }
+            std::cout << std::endl;
+        }
+    }
+    if (disp_content && (hdr.type == COMPRESSED_FILE || hdr.type == CHUNKED_FILE || hdr.type == BASE_FILE)) {
+        for (auto i = 0U; i < depth; i++) {
+            std::cout << empty; 
         }
+        std::cout << " *Contents: (" << (hdr.type == COMPRESSED_FILE ? "compressed"
+                                         : hdr.type == CHUNKED_FILE ? "in the chunk store" : "in the base image")
+                  << ", mount the image to read)" << std::endl;
     }
     if (disp_content && (hdr.type == PLAIN_FILE)) {
         
         // Create and reserve size of file
-        char buffer[hdr.length];
+        std::string buffer(hdr.length, '\0');
 
         // Seek to beginning of file
-        input.seekg(hdr.offset);
-        input.read(reinterpret_cast<char*>(&buffer), sizeof(buffer));
+        fseek(input, hdr.offset, SEEK_SET);
+        fread(&buffer[0], 1, buffer.size(), input);
 
         for (auto i = 0U; i < depth; i++) {
             std::cout << empty; 
@@ -0,0 +1,505 @@
+#include "OnDiskStructure.h"
+
+// Std lib includes
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "ecc.cpp"
+#include "superblock.cpp"
+#include "parity.cpp"
+
+/*
+* Health check of an ECC image, without writing anything. Either layout is
+* streamed in batches of codewords laid out as lanes, their syndromes are
+* computed across lanes (rsKernels.cpp) and only the codewords whose syndromes
+* do not vanish are run through the decoder, in the read buffer, to learn how
+* many symbols they would need corrected. Unreadable sectors are zero filled
+* and counted as erasures, like the mounter's repair does.
+*
+* Exit status: 0 if every codeword is clean, 1 if some needed correcting, 2 if
+* some could not be corrected and 3 if the image could not be checked, which
+* includes files whose first codewords do not decode to a WOFS superblock.
+*/
+
+//========================== Function Declarations ===========================//
+
+struct verify_report;
+
+/**
+    Checks an image whose codewords are interleaved with their parity (addReedSolomon)
+
+    @param input: the ECC image
+    @param file_size: its size in bytes
+    @param fec_length: parity symbols per codeword
+    @param report: receives the counts
+    @return false if the image could not be read
+*/
+bool verify_interleaved(FILE* input, uint64_t file_size, std::size_t fec_length, verify_report* report);
+
+/**
+    Decodes the codewords holding the superblock of an interleaved image, so a
+    file without ECC, or not an image at all, is not reported as damaged
+
+    @param input: the ECC image
+    @param file_size: its size in bytes
+    @param fec_length: parity symbols per codeword
+    @return true if they decode to a WOFS superblock
+*/
+bool interleaved_superblock(FILE* input, uint64_t file_size, std::size_t fec_length);
+
+/**
+    Checks an image followed by its separated parity region (addParity)
+
+    @param input: the image
+    @param geo: the parity geometry recorded in its superblock
+    @param report: receives the counts
+    @return false if the image could not be read
+*/
+bool verify_separate(FILE* input, const parity_geometry& geo, verify_report* report);
+
+/**
+    Prints the report: totals, errata per codeword, damage per region and the worst margin
+
+    @param report: the counts of a finished check
+*/
+void print_report(const verify_report& report);
+
+//============================== Static Globals ==============================//
+
+#define VERIFY_BATCH_CODEWORDS 16384      // codewords read at a time
+#define VERIFY_LANES 64                   // codewords whose syndromes are computed together
+#define VERIFY_DEFAULT_REGIONS 16
+
+struct verify_region {
+	uint64_t codewords;
+	uint64_t damaged;                   // codewords with errata
+	uint64_t symbols;                   // errata they hold
+	uint64_t failed;                    // codewords beyond their parity
+};
+
+struct verify_report {
+	std::string layout;
+	std::size_t fec_length;
+	uint64_t image_size;                // image bytes the codewords protect
+	uint64_t bytes_read;
+	uint64_t codewords;
+	uint64_t damaged;
+	uint64_t failed;
+	uint64_t symbols;
+	uint64_t erasures;                  // unreadable bytes
+	uint64_t errata[RS_MAX_FEC + 1];    // codewords by errata count
+	std::vector<verify_region> regions;
+	long worst_margin;                  // parity symbols to spare in the worst correctable codeword
+	uint64_t worst_codeword;
+	uint64_t worst_offset;              // image offset of its first symbol
+};
+
+//=========================== Function Definitions ===========================//
+
+int main(int argc, char* argv[])
+{
+    unsigned long regions = VERIFY_DEFAULT_REGIONS;
+    std::size_t fec_override = 0;
+    const char* filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 10, "--regions=") == 0) {
+            regions = strtoul(arg.c_str() + 10, NULL, 10);
+        } else if (arg.compare(0, 6, "--fec=") == 0) {
+            fec_override = strtoul(arg.c_str() + 6, NULL, 10);
+        } else if (filename == NULL && arg[0] != '-') {
+            filename = argv[i];
+        } else {
+            std::cout << "usage: " << argv[0] << " [--regions=<n>] [--fec=<n>] <image>" << std::endl;
+            return 3;
+        }
+    }
+    if (filename == NULL || regions == 0) {
+        std::cout << "usage: " << argv[0] << " [--regions=<n>] [--fec=<n>] <image>" << std::endl;
+        return 3;
+    }
+
+    FILE* input = fopen(filename, "rb");
+    struct stat st;
+    if (input == NULL || fstat(fileno(input), &st) != 0) {
+        std::cout << "failed to open " << filename << std::endl;
+        return 3;
+    }
+    posix_fadvise(fileno(input), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    verify_report report;
+    memset(report.errata, 0, sizeof(report.errata));
+    report.bytes_read = report.codewords = report.damaged = report.failed = 0;
+    report.symbols = report.erasures = 0;
+    report.worst_margin = -1;
+    report.worst_codeword = report.worst_offset = 0;
+    report.regions.assign(regions, verify_region());
+
+    // A separated parity region is recognized through the superblock, corrected if need be;
+    // anything else is taken for interleaved codewords
+    s_blk sb;
+    struct timespec start, end;
+    bool read_ok;
+    if (parity_probe(input, st.st_size, &sb)) {
+        parity_geometry geo = parity_geometry_of(sb.sections[SECTION_PARITY].offset, sb.fec_length,
+                                                 sb.parity_interleave);
+        report.layout = "separated parity, interleave " + std::to_string(geo.depth);
+        report.fec_length = geo.fec_length;
+        report.image_size = geo.image_size;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        read_ok = verify_separate(input, geo, &report);
+    } else {
+        // The parity length is recorded ahead of the first codeword's parity
+        std::size_t fec_length = FEC_LENGTH;
+        unsigned char raw[SUPERBLOCK_SIZE];
+        fseek(input, 0, SEEK_SET);
+        if (fread(raw, 1, SUPERBLOCK_SIZE, input) == SUPERBLOCK_SIZE && decode_superblock(raw, &sb) == SB_OK
+            && ecc_fec_supported(sb.fec_length) && sb.code_length == CODE_LENGTH) {
+            fec_length = sb.fec_length;
+        }
+        fec_length = fec_override ? fec_override : fec_length;
+        if (!ecc_fec_supported(fec_length)) {
+            std::cout << "Unsupported Reed Solomon parity length " << fec_length << std::endl;
+            fclose(input);
+            return 3;
+        }
+        if (!interleaved_superblock(input, st.st_size, fec_length)) {
+            std::cout << filename << ": not an ECC image, its first codewords do not decode to a WOFS superblock"
+                      << std::endl;
+            fclose(input);
+            return 3;
+        }
+        uint64_t data_length = CODE_LENGTH - fec_length;
+        uint64_t whole = st.st_size / CODE_LENGTH;
+        uint64_t tail = st.st_size % CODE_LENGTH;
+        report.layout = "interleaved codewords";
+        report.fec_length = fec_length;
+        report.image_size = whole * data_length + (tail > fec_length ? tail - fec_length : 0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        read_ok = verify_interleaved(input, st.st_size, fec_length, &report);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(input);
+    if (!read_ok) {
+        std::cout << filename << ": unable to read the image" << std::endl;
+        return 3;
+    }
+
+    std::cout << "Checked " << filename << std::endl;
+    print_report(report);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Read %llu bytes in %.3f s", (unsigned long long) report.bytes_read, seconds);
+    if (seconds > 0) {
+        printf(" (%.1f MB/s)", report.bytes_read / seconds / 1e6);
+    }
+    printf("\n");
+    return report.failed > 0 ? 2 : report.damaged > 0 ? 1 : 0;
+} // end main
+
+bool interleaved_superblock(FILE* input, uint64_t file_size, std::size_t fec_length) {
+    const rs_tables* tables = ecc_tables(fec_length);
+    const std::size_t data_length = CODE_LENGTH - fec_length;
+    const std::size_t count = (SUPERBLOCK_SIZE + data_length - 1) / data_length;
+    if (file_size < count * CODE_LENGTH) {
+        return false;
+    }
+    std::vector<unsigned char> codewords(count * CODE_LENGTH);
+    std::vector<unsigned char> image(count * data_length);
+    fseek(input, 0, SEEK_SET);
+    if (fread(&codewords[0], 1, codewords.size(), input) != codewords.size()) {
+        return false;
+    }
+    for (std::size_t j = 0; j < count; j++) {
+        unsigned char* codeword = &codewords[j * CODE_LENGTH];
+        uint64_t found = 0;
+        if (!rs_decode_lane(tables, rs_workspace_local(), codeword, data_length, codeword + data_length, 1,
+                            NULL, 0, &found)) {
+            return false;
+        }
+        memcpy(&image[j * data_length], codeword, data_length);
+    }
+    s_blk sb;
+    return decode_superblock(&image[0], &sb) == SB_OK;
+}
+
+/*
+* Account for one codeword. Codewords that are dirty or hold erasures are
+* decoded in place, lane j of the lane buffers with the given stride.
+*/
+static void verify_codeword(const rs_tables* tables, unsigned char* data, unsigned char* parity, std::size_t stride,
+                            bool dirty, const std::vector<std::size_t>& erasures, uint64_t codeword,
+                            uint64_t offset, verify_report* report) {
+    uint64_t r = offset * report -> regions.size() / report -> image_size;
+    verify_region& region = report -> regions[std::min<uint64_t>(r, report -> regions.size() - 1)];
+    const long fec = tables -> fec_length;
+    report -> codewords++;
+    region.codewords++;
+    if (!dirty && erasures.empty()) {
+        report -> errata[0]++;
+        return;
+    }
+
+    uint64_t found = 0;
+    bool corrected = rs_decode_lane(tables, rs_workspace_local(), data, CODE_LENGTH - fec, parity, stride,
+                                    erasures.empty() ? NULL : &erasures[0], erasures.size(), &found);
+    if (!corrected) {
+        report -> damaged++;
+        report -> failed++;
+        region.damaged++;
+        region.failed++;
+        return;
+    }
+    if (found == 0) {
+        report -> errata[0]++;
+        return;
+    }
+
+    // An erasure costs one parity symbol, an error at an unknown position two
+    long errors = found > erasures.size() ? found - erasures.size() : 0;
+    long margin = fec - 2 * errors - (long) erasures.size();
+    report -> damaged++;
+    report -> symbols += found;
+    report -> errata[found <= RS_MAX_FEC ? found : RS_MAX_FEC]++;
+    region.damaged++;
+    region.symbols += found;
+    if (report -> worst_margin < 0 || margin < report -> worst_margin) {
+        report -> worst_margin = margin;
+        report -> worst_codeword = codeword;
+        report -> worst_offset = offset;
+    }
+}
+
+/*
+* Codewords checked together. Their symbols are gathered into lanes that fit
+* the L1 cache: checking lanes with a stride of a whole batch would walk 255
+* rows of a power of two stride, all mapping to the same cache sets.
+*/
+struct verify_chunk {
+    std::size_t count;
+    const unsigned char* data[VERIFY_LANES];    // symbol i of codeword k at data[k][i * stride[k]]
+    const unsigned char* parity[VERIFY_LANES];
+    std::size_t stride[VERIFY_LANES];
+    const std::vector<std::size_t>* erasures[VERIFY_LANES];
+    uint64_t codeword[VERIFY_LANES];
+    uint64_t offset[VERIFY_LANES];              // image offset of the first symbol
+    unsigned char lanes[CODE_LENGTH * VERIFY_LANES];
+    unsigned char dirty[VERIFY_LANES];
+};
+
+// Gather the chunk into lanes, check their syndromes and account for every codeword
+static void verify_chunk_check(const rs_tables* tables, verify_chunk* chunk, verify_report* report) {
+    const std::size_t data_length = CODE_LENGTH - tables -> fec_length;
+    const std::size_t count = chunk -> count;
+    unsigned char* parity = &chunk -> lanes[data_length * VERIFY_LANES];
+    for (std::size_t k = 0; k < count; k++) {
+        const unsigned char* data = chunk -> data[k];
+        const unsigned char* fec = chunk -> parity[k];
+        const std::size_t stride = chunk -> stride[k];
+        for (std::size_t i = 0; i < data_length; i++) {
+            chunk -> lanes[i * VERIFY_LANES + k] = data[i * stride];
+        }
+        for (std::size_t i = 0; i < tables -> fec_length; i++) {
+            parity[i * VERIFY_LANES + k] = fec[i * stride];
+        }
+    }
+    rs_check_lanes(tables, chunk -> lanes, data_length, parity, count, VERIFY_LANES, chunk -> dirty);
+    for (std::size_t k = 0; k < count; k++) {
+        verify_codeword(tables, &chunk -> lanes[k], parity + k, VERIFY_LANES, chunk -> dirty[k],
+                        *chunk -> erasures[k], chunk -> codeword[k], chunk -> offset[k], report);
+    }
+    chunk -> count = 0;
+}
+
+bool verify_interleaved(FILE* input, uint64_t file_size, std::size_t fec_length, verify_report* report) {
+    const rs_tables* tables = ecc_tables(fec_length);
+    const std::size_t data_length = CODE_LENGTH - fec_length;
+    std::vector<unsigned char> buffer(VERIFY_BATCH_CODEWORDS * CODE_LENGTH);
+    std::vector<std::vector<std::size_t> > erasures(VERIFY_BATCH_CODEWORDS);
+    unsigned char partial[CODE_LENGTH];
+    verify_chunk chunk;
+    chunk.count = 0;
+    byte_ranges unreadable;
+
+    for (uint64_t offset = 0; offset < file_size; offset += buffer.size()) {
+        uint64_t length = std::min<uint64_t>(buffer.size(), file_size - offset);
+        unreadable.clear();
+        if (!parity_read(input, offset, length, &buffer[0], &unreadable)) {
+            return false;
+        }
+        report -> bytes_read += length;
+        // The kernel reads the next batch while this one is checked
+        posix_fadvise(fileno(input), offset + length, buffer.size(), POSIX_FADV_WILLNEED);
+
+        // The last codeword of the file may be short: its data is zero padded, its parity whole
+        uint64_t count = (length + CODE_LENGTH - 1) / CODE_LENGTH;
+        uint64_t whole = length / CODE_LENGTH;
+        std::size_t stored = length - whole * CODE_LENGTH;
+        if (stored > 0) {
+            if (stored <= fec_length) {
+                return false;
+            }
+            memset(partial, 0, sizeof(partial));
+            memcpy(partial, &buffer[whole * CODE_LENGTH], stored - fec_length);
+            memcpy(partial + data_length, &buffer[whole * CODE_LENGTH + stored - fec_length], fec_length);
+        }
+
+        for (uint64_t j = 0; j < count; j++) {
+            erasures[j].clear();
+        }
+        for (size_t r = 0; r < unreadable.size(); r++) {
+            for (uint64_t p = unreadable[r].first; p < unreadable[r].first + unreadable[r].second; p++) {
+                uint64_t j = (p - offset) / CODE_LENGTH;
+                std::size_t i = (p - offset) % CODE_LENGTH;
+                if (j == whole && i >= stored - fec_length) {
+                    i += data_length - (stored - fec_length);
+                }
+                erasures[j].push_back(i);
+                report -> erasures++;
+            }
+        }
+
+        uint64_t first = offset / CODE_LENGTH;
+        for (uint64_t j = 0; j < count; j++) {
+            const unsigned char* codeword = j < whole ? &buffer[j * CODE_LENGTH] : partial;
+            std::size_t k = chunk.count++;
+            chunk.data[k] = codeword;
+            chunk.parity[k] = codeword + data_length;
+            chunk.stride[k] = 1;
+            chunk.erasures[k] = &erasures[j];
+            chunk.codeword[k] = first + j;
+            chunk.offset[k] = (first + j) * data_length;
+            if (chunk.count == VERIFY_LANES || j + 1 == count) {
+                verify_chunk_check(tables, &chunk, report);
+            }
+        }
+    }
+    return true;
+}
+
+bool verify_separate(FILE* input, const parity_geometry& geo, verify_report* report) {
+    const rs_tables* tables = ecc_tables(geo.fec_length);
+    uint64_t groups = parity_group_count(geo);
+    uint64_t batch = parity_batch_groups(geo);
+    uint64_t group_bytes = geo.depth * geo.data_length;
+    std::vector<unsigned char> data(batch * group_bytes);
+    std::vector<unsigned char> fec(batch * geo.depth * geo.fec_length);
+    std::vector<std::vector<std::size_t> > erasures(batch * geo.depth);
+    std::vector<std::vector<std::size_t> > lane_erasures(geo.depth);
+    verify_chunk chunk;
+    chunk.count = 0;
+    byte_ranges unreadable;
+
+    for (uint64_t first = 0; first < groups; first += batch) {
+        uint64_t count = std::min<uint64_t>(groups - first, batch);
+        uint64_t stripes = (count - 1) * geo.depth + parity_group_lanes(geo, first + count - 1);
+        uint64_t data_off = first * group_bytes;
+        uint64_t data_len = std::min<uint64_t>(geo.image_size - data_off, stripes * geo.data_length);
+        uint64_t fec_off = geo.image_size + first * geo.depth * geo.fec_length;
+        unreadable.clear();
+        memset(&data[0], 0, stripes * geo.data_length);
+        if (!parity_read(input, data_off, data_len, &data[0], &unreadable)
+            || !parity_read(input, fec_off, stripes * geo.fec_length, &fec[0], &unreadable)) {
+            return false;
+        }
+        report -> bytes_read += data_len + stripes * geo.fec_length;
+        posix_fadvise(fileno(input), data_off + data.size(), data.size(), POSIX_FADV_WILLNEED);
+        posix_fadvise(fileno(input), fec_off + fec.size(), fec.size(), POSIX_FADV_WILLNEED);
+
+        // Symbol i of lane j of a group is byte i * lanes + j of its data and of its parity
+        for (uint64_t g = first; g < first + count; g++) {
+            uint64_t lanes = parity_group_lanes(geo, g);
+            uint64_t start = g * group_bytes;
+            const unsigned char* group_data = &data[(g - first) * group_bytes];
+            const unsigned char* group_fec = &fec[(g - first) * geo.depth * geo.fec_length];
+            std::vector<std::size_t>* group_erasures = &erasures[(g - first) * geo.depth];
+            for (uint64_t j = 0; j < lanes; j++) {
+                group_erasures[j].clear();
+            }
+            if (!unreadable.empty()) {
+                for (uint64_t j = 0; j < lanes; j++) {
+                    lane_erasures[j].clear();
+                }
+                parity_erasures(unreadable, start, lanes * geo.data_length, lanes, 0, lane_erasures);
+                parity_erasures(unreadable, geo.image_size + g * geo.depth * geo.fec_length,
+                                lanes * geo.fec_length, lanes, geo.data_length, lane_erasures);
+                for (uint64_t j = 0; j < lanes; j++) {
+                    group_erasures[j].swap(lane_erasures[j]);
+                    report -> erasures += group_erasures[j].size();
+                }
+            }
+
+            for (uint64_t j = 0; j < lanes; j++) {
+                std::size_t k = chunk.count++;
+                chunk.data[k] = group_data + j;
+                chunk.parity[k] = group_fec + j;
+                chunk.stride[k] = lanes;
+                chunk.erasures[k] = &group_erasures[j];
+                chunk.codeword[k] = g * geo.depth + j;
+                chunk.offset[k] = start + j;
+                if (chunk.count == VERIFY_LANES) {
+                    verify_chunk_check(tables, &chunk, report);
+                }
+            }
+        }
+        // The chunk points into this batch's buffers
+        if (chunk.count > 0) {
+            verify_chunk_check(tables, &chunk, report);
+        }
+    }
+    return true;
+}
+
+void print_report(const verify_report& report) {
+    printf("Layout: %s, %zu parity symbols per codeword\n", report.layout.c_str(), report.fec_length);
+    printf("Codewords: %llu, clean %llu, correctable %llu, uncorrectable %llu\n",
+           (unsigned long long) report.codewords, (unsigned long long) (report.codewords - report.damaged),
+           (unsigned long long) (report.damaged - report.failed), (unsigned long long) report.failed);
+    printf("Symbols in error: %llu in correctable codewords, %llu unreadable bytes\n",
+           (unsigned long long) report.symbols, (unsigned long long) report.erasures);
+
+    if (report.damaged > report.failed) {
+        printf("\nErrata per correctable codeword:\n");
+        for (std::size_t e = 1; e <= RS_MAX_FEC; e++) {
+            if (report.errata[e] > 0) {
+                printf("  %3zu: %llu\n", e, (unsigned long long) report.errata[e]);
+            }
+        }
+    }
+
+    printf("\nDamage by region of the image:\n");
+    printf("  %-27s %10s %10s %10s %10s\n", "bytes", "codewords", "damaged", "symbols", "failed");
+    uint64_t regions = report.regions.size();
+    for (uint64_t r = 0; r < regions; r++) {
+        const verify_region& region = report.regions[r];
+        char range[64];
+        snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long) (report.image_size * r / regions),
+                 (unsigned long long) (report.image_size * (r + 1) / regions));
+        printf("  %-27s %10llu %10llu %10llu %10llu\n", range, (unsigned long long) region.codewords,
+               (unsigned long long) region.damaged, (unsigned long long) region.symbols,
+               (unsigned long long) region.failed);
+    }
+
+    printf("\n");
+    if (report.failed > 0) {
+        printf("\033[0;31mUnhealthy\033[0m: %llu codewords cannot be corrected\n", (unsigned long long) report.failed);
+        if (report.worst_margin >= 0) {
+            printf("Worst correctable codeword: margin %ld of %zu parity symbols, codeword %llu at image byte %llu\n",
+                   report.worst_margin, report.fec_length, (unsigned long long) report.worst_codeword,
+                   (unsigned long long) report.worst_offset);
+        }
+    } else if (report.damaged > 0) {
+        printf("\033[0;33mDegraded\033[0m: worst margin %ld of %zu parity symbols, codeword %llu at image byte %llu\n",
+               report.worst_margin, report.fec_length, (unsigned long long) report.worst_codeword,
+               (unsigned long long) report.worst_offset);
+    } else {
+        printf("\033[0;32mHealthy\033[0m: every codeword has all %zu parity symbols to spare\n", report.fec_length);
+    }
+}